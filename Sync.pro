@@ -2,7 +2,7 @@ QT -= gui
 QT += sql
 QT += network
 
-CONFIG += c++11 console
+CONFIG += c++17 console
 CONFIG -= app_bundle
 
 # You can make your code fail to compile if it uses deprecated APIs.
@@ -11,8 +11,33 @@ CONFIG -= app_bundle
 
 SOURCES += \
         main.cpp \
+        tanswerparser.cpp \
+        tbackoff.cpp \
+        tcompactor.cpp \
+        tcompressdevice.cpp \
+        tdeltacodec.cpp \
+        tdirscanner.cpp \
+        tdownloadqueue.cpp \
+        tfilesnapshot.cpp \
+        tfilewriter.cpp \
         thttpquery.cpp \
-        tsync.cpp
+        tingestpipeline.cpp \
+        tlogwriter.cpp \
+        tmetrics.cpp \
+        tmetricsexporter.cpp \
+        toldfiles.cpp \
+        tratelimiter.cpp \
+        trequestbody.cpp \
+        tscheduler.cpp \
+        tsync.cpp \
+        tsyncdb.cpp
+
+# Сжатие тела запроса: gzip/deflate через zlib, zstd - при сборке с CONFIG+=zstd
+LIBS += -lz
+zstd {
+    DEFINES += SYNC_ZSTD
+    LIBS += -lzstd
+}
 
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin
@@ -20,5 +45,23 @@ else: unix:!android: target.path = /opt/$${TARGET}/bin
 !isEmpty(target.path): INSTALLS += target
 
 HEADERS += \
+    tanswerparser.h \
+    tbackoff.h \
+    tcompactor.h \
+    tcompressdevice.h \
+    tdeltacodec.h \
+    tdirscanner.h \
+    tdownloadqueue.h \
+    tfilesnapshot.h \
+    tfilewriter.h \
     thttpquery.h \
-    tsync.h
+    tingestpipeline.h \
+    tlogwriter.h \
+    tmetrics.h \
+    tmetricsexporter.h \
+    toldfiles.h \
+    tratelimiter.h \
+    trequestbody.h \
+    tscheduler.h \
+    tsync.h \
+    tsyncdb.h
@@ -0,0 +1,25 @@
+QT -= gui
+QT += sql
+QT += network
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+TARGET = SyncBench
+
+# Нагрузочный тест: локальный сервер синхронизации и запуск Sync с разными сценариями
+# Sync собирается отдельно из ../Sync.pro, путь к нему задается параметром --Sync
+SOURCES += \
+        main.cpp \
+        tbenchmark.cpp \
+        tmockserver.cpp \
+        ../tdeltacodec.cpp
+
+HEADERS += \
+    tbenchmark.h \
+    tmockserver.h \
+    ../tdeltacodec.h
+
+# Сервер распаковывает сжатые запросы через zlib
+LIBS += -lz
+win32: LIBS += -lpsapi
@@ -0,0 +1,89 @@
+#include <QCoreApplication>
+#include <QTimer>
+#include <QCommandLineParser>
+#include "tbenchmark.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("SyncBench");
+    QCoreApplication::setOrganizationName("OOO 'SA'");
+    QCoreApplication::setApplicationVersion("0.1a");
+
+    setlocale(LC_CTYPE, ""); //настраиваем локаль
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Benchmark of Sync against a local mock sync server.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    TBenchmark::TOptions Options;
+    QCommandLineOption Sync("Sync", "Sync executable", "FileName", a.applicationDirPath() + "/Sync");
+    QCommandLineOption WorkDir("WorkDir", "Work directory. Temporary by default", "Path");
+    QCommandLineOption Workloads("Workloads", "Comma separated workloads: tiny, large, storm, download", "List", "tiny,large,storm,download");
+    QCommandLineOption Driver("Driver", "Client DB driver. QSQLITE - embedded DB in the work directory", "Driver", "QSQLITE");
+    QCommandLineOption DataBase("DataBase", "Client DB name", "Name");
+    QCommandLineOption DBHost("DBHost", "Client DB host", "Host");
+    QCommandLineOption DBPort("DBPort", "Client DB port", "Port", "0");
+    QCommandLineOption DBUser("DBUser", "Client DB user", "User");
+    QCommandLineOption DBPassword("DBPassword", "Client DB password", "Password");
+    QCommandLineOption BinaryBody("BinaryBody", "Store file bodies without encoding (0/1)", "Value", "1");
+    QCommandLineOption ContentHash("ContentHash", "Hash file contents (0/1)", "Value", "0");
+    QCommandLineOption Compression("Compression", "Request compression: none, gzip, deflate", "Method", "gzip");
+    QCommandLineOption Latency("Latency", "Server answer delay, ms", "ms", "0");
+    QCommandLineOption Loss("Loss", "Lost exchanges, %", "Percent", "0");
+    QCommandLineOption TinyFiles("TinyFiles", "Files in the tiny workload", "Count", "10000");
+    QCommandLineOption TinySize("TinySize", "Size of tiny and storm files, bytes", "Bytes", "512");
+    QCommandLineOption LargeFiles("LargeFiles", "Files in the large workload", "Count", "3");
+    QCommandLineOption LargeSize("LargeSize", "Size of large files, bytes", "Bytes", "524288000");
+    QCommandLineOption StormFiles("StormFiles", "Files rewritten in the storm workload", "Count", "500");
+    QCommandLineOption StormRounds("StormRounds", "Rewrites of each storm file", "Count", "20");
+    QCommandLineOption StormInterval("StormInterval", "Pause between storm rewrites, ms", "ms", "50");
+    QCommandLineOption DownloadFiles("DownloadFiles", "Files in the download workload", "Count", "1000");
+    QCommandLineOption DownloadSize("DownloadSize", "Size of downloaded files, bytes", "Bytes", "65536");
+    QCommandLineOption Timeout("Timeout", "Workload timeout, ms", "ms", "600000");
+    QCommandLineOption Report("Report", "Write results to JSON file", "FileName");
+    QCommandLineOption Baseline("Baseline", "Compare results with JSON report of a previous run", "FileName");
+    QCommandLineOption Tolerance("Tolerance", "Allowed degradation against the baseline, %", "Percent", "10");
+    parser.addOptions({Sync, WorkDir, Workloads, Driver, DataBase, DBHost, DBPort, DBUser, DBPassword, BinaryBody, ContentHash,
+                       Compression, Latency, Loss, TinyFiles, TinySize, LargeFiles, LargeSize, StormFiles, StormRounds,
+                       StormInterval, DownloadFiles, DownloadSize, Timeout, Report, Baseline, Tolerance});
+    parser.process(a);
+
+    Options.SyncPath = parser.value(Sync);
+    Options.WorkDir = parser.value(WorkDir);
+    Options.Workloads = parser.value(Workloads).split(",", Qt::SkipEmptyParts);
+    Options.Driver = parser.value(Driver);
+    Options.DataBase = parser.value(DataBase);
+    Options.DBHost = parser.value(DBHost);
+    Options.DBPort = parser.value(DBPort).toInt();
+    Options.DBUser = parser.value(DBUser);
+    Options.DBPassword = parser.value(DBPassword);
+    Options.BinaryBody = parser.value(BinaryBody).toInt() != 0;
+    Options.ContentHash = parser.value(ContentHash).toInt() != 0;
+    Options.Compression = parser.value(Compression);
+    Options.Latency = parser.value(Latency).toInt();
+    Options.Loss = parser.value(Loss).toDouble();
+    Options.TinyFiles = parser.value(TinyFiles).toInt();
+    Options.TinySize = parser.value(TinySize).toLongLong();
+    Options.LargeFiles = parser.value(LargeFiles).toInt();
+    Options.LargeSize = parser.value(LargeSize).toLongLong();
+    Options.StormFiles = parser.value(StormFiles).toInt();
+    Options.StormRounds = parser.value(StormRounds).toInt();
+    Options.StormInterval = parser.value(StormInterval).toInt();
+    Options.DownloadFiles = parser.value(DownloadFiles).toInt();
+    Options.DownloadSize = parser.value(DownloadSize).toLongLong();
+    Options.Timeout = parser.value(Timeout).toInt();
+    Options.ReportFile = parser.value(Report);
+    Options.BaselineFile = parser.value(Baseline);
+    Options.Tolerance = parser.value(Tolerance).toDouble();
+
+    TBenchmark Benchmark(Options);
+
+    //При запуске выполняем слот onStart, по сигналу Finished завершаемся с кодом результата
+    QTimer::singleShot(0, &Benchmark, SLOT(onStart()));
+    QObject::connect(&Benchmark, &TBenchmark::Finished, &a, &QCoreApplication::exit, Qt::QueuedConnection);
+
+    //запускаем цикл обработчика событий
+    return a.exec();
+}
@@ -0,0 +1,518 @@
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSettings>
+#include <QDateTime>
+#include <QTextStream>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QRandomGenerator>
+#include <QCryptographicHash>
+#include <algorithm>
+#include <cmath>
+#include "tbenchmark.h"
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <psapi.h>
+#endif
+
+static const QString OutCategory = "BENCH_OUT"; //категория файлов, отправляемых клиентом
+static const QString InCategory = "BENCH_IN";   //категория файлов, скачиваемых клиентом
+
+TBenchmark::TBenchmark(const TOptions &Options, QObject *parent)
+    : QObject(parent)
+    , Options(Options)
+{
+    PollTimer.setInterval(200);
+    QObject::connect(&PollTimer, SIGNAL(timeout()), this, SLOT(onPoll()));
+    StormTimer.setInterval(qMax(1, Options.StormInterval));
+    QObject::connect(&StormTimer, SIGNAL(timeout()), this, SLOT(onStormTimer()));
+}
+
+TBenchmark::~TBenchmark()
+{
+    StopClient();
+}
+
+void TBenchmark::onStart()
+{
+    if (!Prepare()) {
+        emit Finished(1);
+        return;
+    }
+    qInfo().noquote() << "Work directory:" << WorkDir << "Server port:" << Server->Port();
+    onNextWorkload();
+}
+
+bool TBenchmark::Prepare()
+{
+    WorkDir = Options.WorkDir.isEmpty() ? QDir::tempPath() + "/SyncBench_" + QDateTime::currentDateTime().toString("yyyyMMdd_hhmmss") : Options.WorkDir;
+    OutDir = WorkDir + "/out";
+    InDir = WorkDir + "/in";
+    PrepareDir = WorkDir + "/prepare";
+    ConfigFile = WorkDir + "/Sync.ini";
+    for (const auto &Path : {OutDir, InDir, PrepareDir, WorkDir + "/client"}) {
+        if (!QDir().mkpath(Path)) {
+            qCritical().noquote() << "Cannot create directory" << Path;
+            return false;
+        }
+    }
+
+    Server = new TMockServer(WorkDir + "/server.sqlite", this);
+    if (!Server->Start()) {
+        qCritical().noquote() << Server->ErrorString();
+        return false;
+    }
+    Server->SetLatency(Options.Latency);
+    Server->SetLoss(Options.Loss);
+    QObject::connect(Server, SIGNAL(Exchanged()), this, SLOT(onExchanged()));
+    QObject::connect(Server, SIGNAL(FileReceived(const QString &, const QString &, qint64, const QByteArray &)),
+                     this, SLOT(onFileReceived(const QString &, const QString &, qint64, const QByteArray &)));
+
+    WriteConfig();
+    return true;
+}
+
+QString TBenchmark::ClientDataBase() const
+{
+    if (!Options.DataBase.isEmpty() || (Options.Driver != "QSQLITE")) return Options.DataBase;
+    return WorkDir + "/client.sqlite";
+}
+
+void TBenchmark::WriteConfig()
+{
+    QSettings Config(ConfigFile, QSettings::IniFormat);
+    Config.clear();
+
+    Config.beginGroup("DATABASE");
+    Config.setValue("Driver", Options.Driver);
+    if (!ClientDataBase().isEmpty()) Config.setValue("DataBase", ClientDataBase());
+    if (!Options.DBHost.isEmpty()) Config.setValue("Host", Options.DBHost);
+    if (Options.DBPort > 0) Config.setValue("Port", Options.DBPort);
+    if (!Options.DBUser.isEmpty()) Config.setValue("UID", Options.DBUser);
+    if (!Options.DBPassword.isEmpty()) Config.setValue("PWD", Options.DBPassword);
+    Config.setValue("BinaryBody", Options.BinaryBody);
+    Config.setValue("ContentHash", Options.ContentHash);
+    Config.endGroup();
+
+    //отладочный вывод сам по себе заметно замедляет Sync, поэтому он выключен
+    Config.beginGroup("SYSTEM");
+    Config.setValue("Debug", false);
+    Config.setValue("Interval", 1000);
+    Config.setValue("EventDriven", true);
+    Config.setValue("StatCacheDir", WorkDir + "/client/StatCache");
+    Config.setValue("SnapshotFile", WorkDir + "/client/OldFiles.snapshot");
+    Config.setValue("DownloadQueueFile", WorkDir + "/client/DownloadQueue.dat");
+    Config.setValue("DeltaDir", WorkDir + "/client/Delta");
+    Config.endGroup();
+
+    Config.beginGroup("SERVER");
+    Config.setValue("UID", "BENCH");
+    Config.setValue("PWD", "123456");
+    Config.setValue("Host", "127.0.0.1");
+    Config.setValue("Port", Server->Port());
+    if (!Options.Compression.isEmpty()) Config.setValue("Compression", Options.Compression);
+    //при потере обменов повторяем быстро, иначе тест будет измерять паузы, а не обмен
+    Config.setValue("RetryMinDelay", 100);
+    Config.setValue("RetryMaxDelay", 2000);
+    Config.endGroup();
+
+    Config.beginGroup("SYNCTARGETS");
+    Config.setValue("Count", 2);
+    Config.endGroup();
+    Config.beginGroup("TARGET0");
+    Config.setValue("Target", OutDir + "/");
+    Config.setValue("Category", OutCategory);
+    Config.setValue("LoadingFromServer", false);
+    Config.endGroup();
+    Config.beginGroup("TARGET1");
+    Config.setValue("Target", InDir + "/");
+    Config.setValue("Category", InCategory);
+    Config.setValue("LoadingFromServer", true);
+    Config.endGroup();
+    Config.sync();
+}
+
+void TBenchmark::onNextWorkload()
+{
+    ++WorkloadIndex;
+    if (WorkloadIndex >= Options.Workloads.size()) {
+        Report();
+        int ExitCode = 0;
+        for (const auto &Result : Results) {
+            if (!Result.Completed) ExitCode = 1;
+        }
+        if ((ExitCode == 0) && (Compare() > 0)) ExitCode = 2;
+        emit Finished(ExitCode);
+        return;
+    }
+
+    Workload = Options.Workloads[WorkloadIndex];
+    Expected.clear();
+    DoneCount = 0;
+    Latencies.clear();
+    StormRound = 0;
+    PeakRSS = -1;
+    ClientReady = false;
+    qInfo().noquote() << "Workload" << Workload << "- preparing";
+
+    //файлы готовятся до запуска клиента, чтобы их запись не попала в измерения
+    bool Ok = true;
+    if ((Workload == "tiny") || (Workload == "large")) {
+        const int Count = (Workload == "tiny") ? Options.TinyFiles : Options.LargeFiles;
+        const qint64 Size = (Workload == "tiny") ? Options.TinySize : Options.LargeSize;
+        for (int i = 0; Ok && (i < Count); ++i) {
+            const QString Name = QString("%1_%2.dat").arg(Workload).arg(i, 6, 10, QChar('0'));
+            TExpected Item;
+            Item.Size = Size;
+            Ok = WriteFile(PrepareDir + "/" + Name, Size, Item.Md5);
+            Expected.insert(Name, Item);
+        }
+    }
+    else if (Workload == "download") {
+        for (int i = 0; Ok && (i < Options.DownloadFiles); ++i) {
+            const QString Name = QString("download_%1_%2.dat").arg(QDateTime::currentMSecsSinceEpoch()).arg(i, 6, 10, QChar('0'));
+            QByteArray Body(Options.DownloadSize, '\0');
+            QRandomGenerator::global()->fillRange(reinterpret_cast<quint32 *>(Body.data()), Body.size() / sizeof(quint32));
+            TExpected Item;
+            Item.Size = Body.size();
+            Item.Md5 = QCryptographicHash::hash(Body, QCryptographicHash::Md5);
+            Ok = !Server->Publish(InCategory, Name, Body).isEmpty();
+            if (!Ok) qCritical().noquote() << Server->ErrorString();
+            Expected.insert(Name, Item);
+        }
+    }
+    else if (Workload != "storm") {
+        qWarning().noquote() << "Unknown workload" << Workload << "- skipped";
+        onNextWorkload();
+        return;
+    }
+
+    Clock.start();
+    if (!Ok) {
+        FinishWorkload(false);
+        return;
+    }
+    StartClient();
+}
+
+void TBenchmark::StartClient()
+{
+    Client = new QProcess(this);
+    Client->setProgram(Options.SyncPath);
+    Client->setArguments(QStringList() << "--Config" << ConfigFile);
+    Client->setProcessChannelMode(QProcess::MergedChannels);
+    Client->setStandardOutputFile(WorkDir + "/client.log", QIODevice::Append);
+    QObject::connect(Client, SIGNAL(finished(int, QProcess::ExitStatus)), this, SLOT(onClientFinished(int, QProcess::ExitStatus)));
+    Client->start();
+    if (!Client->waitForStarted(10000)) {
+        qCritical().noquote() << "Cannot start" << Options.SyncPath << "Error:" << Client->errorString();
+        FinishWorkload(false);
+        return;
+    }
+    PollTimer.start();
+}
+
+void TBenchmark::StopClient()
+{
+    if (Client == nullptr) return;
+    QObject::disconnect(Client, nullptr, this, nullptr);
+    //Sync не обрабатывает сигналы завершения - все его состояние и так сохраняется по ходу работы
+    Client->kill();
+    Client->waitForFinished(10000);
+    delete Client;
+    Client = nullptr;
+}
+
+void TBenchmark::onExchanged()
+{
+    if ((Client == nullptr) || ClientReady) return;
+    //первый запрос клиента - он запустился и прочитал БД
+    ClientReady = true;
+    StartGeneration();
+}
+
+void TBenchmark::StartGeneration()
+{
+    qInfo().noquote() << "Workload" << Workload << "- running. Client start:" << Clock.elapsed() << "ms";
+    Clock.start();
+    const bool Download = (Workload == "download");
+    StartFiles = Download ? Server->SentFileCount() : Server->ReceivedFileCount();
+    StartBytes = Download ? Server->SentByteCount() : Server->ReceivedByteCount();
+    StartExchanges = Server->ExchangeCount();
+    StartDropped = Server->DroppedCount();
+    Server->TakeExchangeTimes();
+
+    if ((Workload == "tiny") || (Workload == "large")) {
+        //файлы появляются в отслеживаемой директории целиком
+        for (auto it = Expected.constBegin(); it != Expected.constEnd(); ++it) MoveToOut(it.key());
+    }
+    else if (Workload == "storm") {
+        StormWrite();
+        StormTimer.start();
+    }
+}
+
+bool TBenchmark::WriteFile(const QString &FileName, qint64 Size, QByteArray &Md5)
+{
+    QFile File(FileName);
+    if (!File.open(QIODevice::WriteOnly)) {
+        qCritical().noquote() << "Cannot write file" << FileName << "Error:" << File.errorString();
+        return false;
+    }
+    QCryptographicHash Hash(QCryptographicHash::Md5);
+    //случайные данные генерируются словами по 4 байта, последний блок записывается не целиком
+    QByteArray Block((qMin<qint64>(Size, 1048576) + 3) / 4 * 4, '\0');
+    for (qint64 Written = 0; Written < Size; ) {
+        QRandomGenerator::global()->fillRange(reinterpret_cast<quint32 *>(Block.data()), Block.size() / sizeof(quint32));
+        const qint64 Count = qMin<qint64>(Block.size(), Size - Written);
+        if (File.write(Block.constData(), Count) != Count) {
+            qCritical().noquote() << "Cannot write file" << FileName << "Error:" << File.errorString();
+            return false;
+        }
+        Hash.addData(QByteArrayView(Block.constData(), Count));
+        Written += Count;
+    }
+    Md5 = Hash.result();
+    return true;
+}
+
+void TBenchmark::MoveToOut(const QString &FileName)
+{
+    //QFile::rename не заменяет существующий файл
+    QFile::remove(OutDir + "/" + FileName);
+    if (!QFile::rename(PrepareDir + "/" + FileName, OutDir + "/" + FileName)) {
+        qWarning().noquote() << "Cannot move file" << FileName << "to the watched directory";
+    }
+}
+
+void TBenchmark::StormWrite()
+{
+    //каждый раунд перезаписывает все файлы - клиент должен в итоге отправить последние версии
+    for (int i = 0; i < Options.StormFiles; ++i) {
+        const QString Name = QString("storm_%1.dat").arg(i, 6, 10, QChar('0'));
+        TExpected &Item = Expected[Name];
+        if (Item.Done) --DoneCount;
+        Item.Done = false;
+        Item.Size = Options.TinySize;
+        Item.WriteTime = Clock.elapsed();
+        if (WriteFile(PrepareDir + "/" + Name, Item.Size, Item.Md5)) MoveToOut(Name);
+    }
+    ++StormRound;
+}
+
+void TBenchmark::onStormTimer()
+{
+    if (StormRound >= Options.StormRounds) {
+        StormTimer.stop();
+        return;
+    }
+    StormWrite();
+}
+
+void TBenchmark::onFileReceived(const QString &Category, const QString &FileName, qint64 Size, const QByteArray &Md5)
+{
+    Q_UNUSED(Size);
+    if ((Category != OutCategory) || !ClientReady) return;
+    auto it = Expected.find(FileName);
+    //промежуточные версии файлов storm не считаются
+    if ((it == Expected.end()) || it->Done || (it->Md5 != Md5)) return;
+    it->Done = true;
+    ++DoneCount;
+    Latencies.push_back(Clock.elapsed() - it->WriteTime);
+    if ((DoneCount == Expected.size()) && ((Workload != "storm") || (StormRound >= Options.StormRounds))) FinishWorkload(true);
+}
+
+void TBenchmark::onPoll()
+{
+    if (Client != nullptr) PeakRSS = qMax(PeakRSS, ProcessPeakRSS(Client->processId()));
+
+    if ((Workload == "download") && ClientReady) {
+        //Sync заменяет файл атомарно, поэтому файл нужного размера уже записан целиком
+        for (auto it = Expected.begin(); it != Expected.end(); ++it) {
+            if (it->Done) continue;
+            QFile File(InDir + "/" + it.key());
+            if (!File.exists() || (File.size() != it->Size) || !File.open(QIODevice::ReadOnly)) continue;
+            QCryptographicHash Hash(QCryptographicHash::Md5);
+            Hash.addData(&File);
+            if (Hash.result() != it->Md5) continue;
+            it->Done = true;
+            ++DoneCount;
+            Latencies.push_back(Clock.elapsed() - it->WriteTime);
+        }
+        if (DoneCount == Expected.size()) {
+            FinishWorkload(true);
+            return;
+        }
+    }
+
+    if (Clock.elapsed() > Options.Timeout) {
+        qWarning().noquote() << "Workload" << Workload << "timed out. Files done:" << DoneCount << "of" << Expected.size();
+        FinishWorkload(false);
+    }
+}
+
+void TBenchmark::onClientFinished(int ExitCode, QProcess::ExitStatus ExitStatus)
+{
+    Q_UNUSED(ExitStatus);
+    qWarning().noquote() << "Sync exited unexpectedly. Exit code:" << ExitCode << "See" << WorkDir + "/client.log";
+    FinishWorkload(false);
+}
+
+void TBenchmark::FinishWorkload(bool Completed)
+{
+    if (Workload.isEmpty()) return; //сценарий уже завершен
+    PollTimer.stop();
+    StormTimer.stop();
+    if ((Client != nullptr) && (Client->state() == QProcess::Running)) PeakRSS = qMax(PeakRSS, ProcessPeakRSS(Client->processId()));
+
+    const bool Download = (Workload == "download");
+    TResult Result;
+    Result.Name = Workload;
+    Result.Completed = Completed;
+    Result.Elapsed = qMax<qint64>(1, Clock.elapsed());
+    Result.Files = (Download ? qint64(Server->SentFileCount()) : qint64(Server->ReceivedFileCount())) - StartFiles;
+    Result.Bytes = (Download ? Server->SentByteCount() : Server->ReceivedByteCount()) - StartBytes;
+    Result.Exchanges = Server->ExchangeCount() - StartExchanges;
+    Result.Dropped = Server->DroppedCount() - StartDropped;
+    const QList<qint64> Times = Server->TakeExchangeTimes();
+    Result.CycleP50 = Percentile(Times, 50);
+    Result.CycleP99 = Percentile(Times, 99);
+    Result.LatencyP50 = Percentile(Latencies, 50);
+    Result.LatencyP99 = Percentile(Latencies, 99);
+    Result.PeakRSS = PeakRSS;
+    Results.push_back(Result);
+    qInfo().noquote() << "Workload" << Workload << (Completed ? "- done." : "- FAILED.") << "Time:" << Result.Elapsed << "ms";
+
+    Workload.clear();
+    StopClient();
+    //следующий сценарий запускаем после выхода из обработчика сигнала сервера
+    QTimer::singleShot(0, this, SLOT(onNextWorkload()));
+}
+
+void TBenchmark::Report()
+{
+    QTextStream Out(stdout);
+    Out << Qt::endl << QString("%1 %2 %3 %4 %5 %6 %7 %8 %9 %10")
+                      .arg("Workload", -10).arg("Result", -8).arg("Files/s", 10).arg("MB/s", 9)
+                      .arg("Cycle p50", 10).arg("Cycle p99", 10).arg("Lat p50", 9).arg("Lat p99", 9)
+                      .arg("RSS MB", 8).arg("Lost", 6) << Qt::endl;
+    for (const auto &Result : Results) {
+        Out << QString("%1 %2 %3 %4 %5 %6 %7 %8 %9 %10")
+               .arg(Result.Name, -10).arg(Result.Completed ? "ok" : "FAILED", -8)
+               .arg(Result.Files * 1000.0 / Result.Elapsed, 10, 'f', 1)
+               .arg(Result.Bytes * 1000.0 / Result.Elapsed / 1048576.0, 9, 'f', 2)
+               .arg(Result.CycleP50, 10).arg(Result.CycleP99, 10)
+               .arg(Result.LatencyP50, 9).arg(Result.LatencyP99, 9)
+               .arg(Result.PeakRSS < 0 ? QString("n/a") : QString::number(Result.PeakRSS / 1048576.0, 'f', 1), 8)
+               .arg(Result.Dropped, 6) << Qt::endl;
+    }
+
+    if (Options.ReportFile.isEmpty()) return;
+    QJsonObject Settings;
+    Settings["Latency"] = Options.Latency;
+    Settings["Loss"] = Options.Loss;
+    Settings["Driver"] = Options.Driver;
+    Settings["BinaryBody"] = Options.BinaryBody;
+    Settings["ContentHash"] = Options.ContentHash;
+    Settings["Compression"] = Options.Compression;
+    QJsonArray Workloads;
+    for (const auto &Result : Results) Workloads.append(ToJson(Result));
+    QJsonObject Root;
+    Root["Date"] = QDateTime::currentDateTime().toString(Qt::ISODate);
+    Root["Settings"] = Settings;
+    Root["Workloads"] = Workloads;
+    QFile File(Options.ReportFile);
+    if (!File.open(QIODevice::WriteOnly) || (File.write(QJsonDocument(Root).toJson()) < 0)) {
+        qWarning().noquote() << "Cannot write report" << Options.ReportFile << "Error:" << File.errorString();
+    }
+}
+
+int TBenchmark::Compare() const
+{
+    if (Options.BaselineFile.isEmpty()) return 0;
+    QFile File(Options.BaselineFile);
+    if (!File.open(QIODevice::ReadOnly)) {
+        qWarning().noquote() << "Cannot read baseline" << Options.BaselineFile << "Error:" << File.errorString();
+        return 0;
+    }
+    QHash<QString, QJsonObject> Baseline;
+    for (const auto &Item : QJsonDocument::fromJson(File.readAll()).object().value("Workloads").toArray()) {
+        Baseline.insert(Item.toObject().value("Name").toString(), Item.toObject());
+    }
+
+    //скорость не должна падать, а задержки и память - расти больше чем на Tolerance процентов
+    const double Margin = Options.Tolerance / 100.0;
+    int Regressions = 0;
+    for (const auto &Result : Results) {
+        if (!Baseline.contains(Result.Name)) continue;
+        const QJsonObject Current = ToJson(Result);
+        const QJsonObject &Base = Baseline[Result.Name];
+        for (const QString &Key : {QString("FilesPerSec"), QString("BytesPerSec")}) {
+            if (Current[Key].toDouble() < Base[Key].toDouble() * (1 - Margin)) {
+                qWarning().noquote() << "REGRESSION" << Result.Name << Key << Current[Key].toDouble() << "baseline" << Base[Key].toDouble();
+                ++Regressions;
+            }
+        }
+        for (const QString &Key : {QString("CycleP99"), QString("LatencyP99"), QString("PeakRSS")}) {
+            if ((Base[Key].toDouble() > 0) && (Current[Key].toDouble() > Base[Key].toDouble() * (1 + Margin))) {
+                qWarning().noquote() << "REGRESSION" << Result.Name << Key << Current[Key].toDouble() << "baseline" << Base[Key].toDouble();
+                ++Regressions;
+            }
+        }
+    }
+    return Regressions;
+}
+
+QJsonObject TBenchmark::ToJson(const TResult &Result)
+{
+    QJsonObject Object;
+    Object["Name"] = Result.Name;
+    Object["Completed"] = Result.Completed;
+    Object["Files"] = Result.Files;
+    Object["Bytes"] = Result.Bytes;
+    Object["ElapsedMs"] = Result.Elapsed;
+    Object["FilesPerSec"] = Result.Files * 1000.0 / Result.Elapsed;
+    Object["BytesPerSec"] = Result.Bytes * 1000.0 / Result.Elapsed;
+    Object["CycleP50"] = Result.CycleP50;
+    Object["CycleP99"] = Result.CycleP99;
+    Object["LatencyP50"] = Result.LatencyP50;
+    Object["LatencyP99"] = Result.LatencyP99;
+    Object["PeakRSS"] = Result.PeakRSS;
+    Object["Exchanges"] = static_cast<qint64>(Result.Exchanges);
+    Object["Dropped"] = static_cast<qint64>(Result.Dropped);
+    return Object;
+}
+
+qint64 TBenchmark::Percentile(QList<qint64> Values, double Percent)
+{
+    if (Values.isEmpty()) return 0;
+    std::sort(Values.begin(), Values.end());
+    const qsizetype Index = qBound<qsizetype>(0, static_cast<qsizetype>(std::ceil(Percent / 100.0 * Values.size())) - 1, Values.size() - 1);
+    return Values[Index];
+}
+
+qint64 TBenchmark::ProcessPeakRSS(qint64 PID)
+{
+#if defined(Q_OS_LINUX)
+    QFile File("/proc/" + QString::number(PID) + "/status");
+    if (!File.open(QIODevice::ReadOnly | QIODevice::Text)) return -1;
+    for (const QByteArray &Line : File.readAll().split('\n')) {
+        //VmHWM: 12345 kB
+        if (Line.startsWith("VmHWM:")) return Line.mid(6).trimmed().split(' ').first().toLongLong() * 1024;
+    }
+    return -1;
+#elif defined(Q_OS_WIN)
+    HANDLE Process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, static_cast<DWORD>(PID));
+    if (Process == nullptr) return -1;
+    PROCESS_MEMORY_COUNTERS Counters;
+    const bool Ok = GetProcessMemoryInfo(Process, &Counters, sizeof(Counters));
+    CloseHandle(Process);
+    return Ok ? static_cast<qint64>(Counters.PeakWorkingSetSize) : -1;
+#else
+    Q_UNUSED(PID);
+    return -1;
+#endif
+}
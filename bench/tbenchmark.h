@@ -0,0 +1,145 @@
+/* Нагрузочный тест Sync
+ * Запускает локальный TMockServer и настоящий Sync отдельным процессом с конфигурацией, указывающей
+ * на этот сервер. Сценарии выполняются по очереди, для каждого Sync запускается заново:
+ *  tiny     - много маленьких файлов в отслеживаемой директории
+ *  large    - несколько больших файлов (передаются частями)
+ *  storm    - серии быстрых перезаписей одних и тех же файлов
+ *  download - файлы, опубликованные сервером для скачивания клиентом
+ * Сценарий завершен, когда сервер получил последние версии всех файлов (или клиент сохранил все
+ * скачиваемые файлы). Для каждого сценария считаются файлы/с, байты/с, p50/p99 времени обмена,
+ * p50/p99 задержки доставки файла и пиковый объем памяти процесса Sync. Результаты можно сохранить
+ * в JSON и сравнить с базовыми, чтобы найти регрессии до выпуска
+*/
+#ifndef TBENCHMARK_H
+#define TBENCHMARK_H
+
+#include <QObject>
+#include <QProcess>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QStringList>
+#include <QJsonObject>
+#include "tmockserver.h"
+
+class TBenchmark : public QObject
+{
+    Q_OBJECT
+public:
+    typedef struct {
+        QString SyncPath;       //исполняемый файл Sync
+        QString WorkDir;        //рабочая директория теста. Пустая - временная
+        QStringList Workloads;  //выполняемые сценарии по порядку
+        //БД клиента. Встроенную БД (QSQLITE) Sync создает сам
+        QString Driver;
+        QString DataBase;
+        QString DBHost;
+        int DBPort = 0;
+        QString DBUser;
+        QString DBPassword;
+        bool BinaryBody = true;
+        bool ContentHash = false;
+        QString Compression;
+        int Latency = 0;        //задержка ответа сервера, мс
+        double Loss = 0;        //потеря обменов, %
+        int TinyFiles = 10000;
+        qint64 TinySize = 512;
+        int LargeFiles = 3;
+        qint64 LargeSize = 524288000;
+        int StormFiles = 500;
+        int StormRounds = 20;
+        int StormInterval = 50; //пауза между перезаписями, мс
+        int DownloadFiles = 1000;
+        qint64 DownloadSize = 65536;
+        int Timeout = 600000;   //максимальное время сценария, мс
+        QString ReportFile;     //JSON с результатами
+        QString BaselineFile;   //JSON с базовыми результатами для сравнения
+        double Tolerance = 10;  //допустимое ухудшение относительно базовых результатов, %
+    } TOptions;
+
+private:
+    typedef struct {
+        QString Name;
+        bool Completed = false;
+        qint64 Files = 0;        //передано тел файлов
+        qint64 Bytes = 0;        //передано байт тел
+        qint64 Elapsed = 0;      //мс
+        qint64 CycleP50 = 0;     //время обмена с сервером, мс
+        qint64 CycleP99 = 0;
+        qint64 LatencyP50 = 0;   //от появления файла до его доставки, мс
+        qint64 LatencyP99 = 0;
+        qint64 PeakRSS = -1;     //пиковый объем памяти Sync, байт. -1 - неизвестно
+        quint64 Exchanges = 0;
+        quint64 Dropped = 0;
+    } TResult;
+
+    typedef struct {
+        QByteArray Md5;     //хеш последней версии
+        qint64 Size = 0;
+        qint64 WriteTime = 0; //время записи последней версии от начала сценария, мс
+        bool Done = false;    //последняя версия доставлена
+    } TExpected;
+
+    const TOptions Options;
+    QString WorkDir;
+    QString OutDir;      //отслеживаемая директория клиента
+    QString InDir;       //директория для файлов с сервера
+    QString PrepareDir;  //файлы готовятся здесь и переносятся в OutDir целиком
+    QString ConfigFile;
+    TMockServer *Server = nullptr;
+    QProcess *Client = nullptr;
+    QTimer PollTimer;    //проверка завершения сценария
+    QTimer StormTimer;   //очередная перезапись в сценарии storm
+    QElapsedTimer Clock; //время от начала сценария
+
+    qsizetype WorkloadIndex = -1;
+    QString Workload;
+    bool ClientReady = false;
+    int StormRound = 0;
+    QHash<QString, TExpected> Expected; //ожидаемые файлы. Ключ - имя файла
+    qsizetype DoneCount = 0;            //доставлено файлов из Expected
+    QList<qint64> Latencies;
+    qint64 StartFiles = 0;
+    qint64 StartBytes = 0;
+    quint64 StartExchanges = 0;
+    quint64 StartDropped = 0;
+    qint64 PeakRSS = -1;
+    QList<TResult> Results;
+
+    bool Prepare();          //создает директории и конфигурацию клиента
+    QString ClientDataBase() const; //БД клиента. Для QSQLITE по умолчанию - файл в рабочей директории
+    void WriteConfig();
+    void StartClient();
+    void StopClient();
+    void StartGeneration(); //клиент ответил серверу - начинаем сценарий
+    bool WriteFile(const QString &FileName, qint64 Size, QByteArray &Md5); //пишет файл со случайным содержимым
+    void MoveToOut(const QString &FileName);
+    void StormWrite();
+    void FinishWorkload(bool Completed);
+    void Report();
+    int Compare() const; //сравнение с базовыми результатами. Количество регрессий
+    static QJsonObject ToJson(const TResult &Result);
+    static qint64 Percentile(QList<qint64> Values, double Percent);
+    static qint64 ProcessPeakRSS(qint64 PID);
+
+public:
+    explicit TBenchmark(const TOptions &Options, QObject *parent = nullptr);
+    ~TBenchmark();
+
+signals:
+    void Finished(int ExitCode);
+
+public slots:
+    void onStart();
+
+private slots:
+    void onNextWorkload();
+    void onExchanged();
+    void onFileReceived(const QString &Category, const QString &FileName, qint64 Size, const QByteArray &Md5);
+    void onPoll();
+    void onStormTimer();
+    void onClientFinished(int ExitCode, QProcess::ExitStatus ExitStatus);
+};
+
+#endif // TBENCHMARK_H
@@ -0,0 +1,622 @@
+#include <QDebug>
+#include <QBuffer>
+#include <QTimer>
+#include <QDateTime>
+#include <QStringList>
+#include <QXmlStreamReader>
+#include <QXmlStreamWriter>
+#include <QCryptographicHash>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QtEndian>
+#include <cstring>
+#include <zlib.h>
+#include "tmockserver.h"
+#include "../tdeltacodec.h"
+
+const QString TMockServer::ProtocolVersion = "0.5";
+const QString TMockServer::BinaryContentType = "application/x-sync-frames";
+
+TMockServer::TMockServer(const QString &DBFileName, QObject *parent)
+    : QObject(parent)
+    , Random(QRandomGenerator::securelySeeded())
+{
+    DB = QSqlDatabase::addDatabase("QSQLITE", "MockServer");
+    DB.setDatabaseName(DBFileName);
+    QObject::connect(&Server, SIGNAL(newConnection()), this, SLOT(onNewConnection()));
+}
+
+TMockServer::~TMockServer()
+{
+    Server.close();
+    DB.close();
+}
+
+bool TMockServer::Start(quint16 Port)
+{
+    if (!DB.open()) {
+        LastError = "Cannot open server DB. Error: " + DB.lastError().text();
+        return false;
+    }
+
+    //сервер - только стенд для клиента, поэтому надежность записи не важна
+    const QStringList Schema = {
+        "PRAGMA journal_mode = WAL",
+        "PRAGMA synchronous = NORMAL",
+        "CREATE TABLE IF NOT EXISTS SYNCFILE (ID INTEGER PRIMARY KEY AUTOINCREMENT, AZS_CODE VARCHAR(20), DIRECTION INTEGER NOT NULL, "
+        "CATEGORY VARCHAR(50), FILE_NAME VARCHAR(250), CREATE_DATE_TIME TIMESTAMP, CHANGE_DATE_TIME TIMESTAMP, HASH VARCHAR(128), BODY BLOB)",
+        "CREATE INDEX IF NOT EXISTS SYNCFILE_HASH ON SYNCFILE (HASH)",
+        "CREATE INDEX IF NOT EXISTS SYNCFILE_NAME ON SYNCFILE (AZS_CODE, CATEGORY, FILE_NAME)",
+        "CREATE TABLE IF NOT EXISTS LOG (ID INTEGER PRIMARY KEY AUTOINCREMENT, DATE_TIME TIMESTAMP DEFAULT CURRENT_TIMESTAMP, "
+        "AZS_CODE VARCHAR(20), CATEGORY INTEGER, MSG TEXT)"
+    };
+    QSqlQuery Query(DB);
+    for (const auto &Text : Schema) {
+        if (!Query.exec(Text)) {
+            LastError = "Cannot create server DB. Error: " + Query.lastError().text() + " Query: " + Text;
+            return false;
+        }
+    }
+
+    if (!Server.listen(QHostAddress::LocalHost, Port)) {
+        LastError = "Cannot listen port " + QString::number(Port) + ". Error: " + Server.errorString();
+        return false;
+    }
+    return true;
+}
+
+QString TMockServer::Publish(const QString &Category, const QString &FileName, const QByteArray &Body)
+{
+    const QString HASH = QCryptographicHash::hash(Body, QCryptographicHash::Md5).toHex();
+    const QDateTime Now = QDateTime::currentDateTime();
+    QSqlQuery Query(DB);
+    Query.prepare("INSERT INTO SYNCFILE (AZS_CODE, DIRECTION, CATEGORY, FILE_NAME, CREATE_DATE_TIME, CHANGE_DATE_TIME, HASH, BODY) "
+                  "VALUES ('', 1, ?, ?, ?, ?, ?, ?)");
+    Query.addBindValue(Category);
+    Query.addBindValue(FileName);
+    Query.addBindValue(Now);
+    Query.addBindValue(Now);
+    Query.addBindValue(HASH);
+    Query.addBindValue(Body);
+    if (!Query.exec()) {
+        LastError = "Cannot publish file. Error: " + Query.lastError().text();
+        return QString();
+    }
+    return HASH;
+}
+
+QList<qint64> TMockServer::TakeExchangeTimes()
+{
+    QList<qint64> Result;
+    Result.swap(ExchangeTimes);
+    return Result;
+}
+
+void TMockServer::onNewConnection()
+{
+    while (QTcpSocket *Socket = Server.nextPendingConnection()) {
+        Connections.insert(Socket, TConnection());
+        QObject::connect(Socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+        QObject::connect(Socket, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+    }
+}
+
+void TMockServer::onDisconnected()
+{
+    QTcpSocket *Socket = qobject_cast<QTcpSocket *>(sender());
+    Connections.remove(Socket);
+    Socket->deleteLater();
+}
+
+void TMockServer::onReadyRead()
+{
+    QTcpSocket *Socket = qobject_cast<QTcpSocket *>(sender());
+    auto it = Connections.find(Socket);
+    if (it == Connections.end()) return;
+    if (!it->HeadDone && it->Buffer.isEmpty()) it->Timer.start(); //первый байт очередного запроса
+    it->Buffer += Socket->readAll();
+
+    while (ParseRequest(*it)) {
+        //запрос получен целиком. Остаток буфера - начало следующего запроса на этом же соединении
+        TConnection Request = *it;
+        *it = TConnection();
+        it->Buffer = Request.Buffer;
+        if (!it->Buffer.isEmpty()) it->Timer.start();
+        Process(Socket, Request);
+        //при потере обмена соединение разрывается
+        it = Connections.find(Socket);
+        if (it == Connections.end()) return;
+    }
+}
+
+bool TMockServer::ParseRequest(TConnection &Connection)
+{
+    if (!Connection.HeadDone) {
+        const qsizetype End = Connection.Buffer.indexOf("\r\n\r\n");
+        if (End < 0) return false;
+        const QList<QByteArray> Lines = Connection.Buffer.left(End).split('\n');
+        Connection.Buffer.remove(0, End + 4);
+        Connection.HeadDone = true;
+        //первая строка - строка запроса. Путь не важен: код АЗС берется из XML
+        for (qsizetype i = 1; i < Lines.size(); ++i) {
+            const qsizetype Colon = Lines[i].indexOf(':');
+            if (Colon < 0) continue;
+            const QByteArray Name = Lines[i].left(Colon).trimmed().toLower();
+            const QString Value = QString::fromLatin1(Lines[i].mid(Colon + 1).trimmed());
+            if (Name == "content-type") Connection.ContentType = Value;
+            else if (Name == "content-encoding") Connection.ContentEncoding = Value.toLower();
+            else if (Name == "content-length") Connection.ContentLength = Value.toLongLong();
+            else if (Name == "transfer-encoding") Connection.Chunked = Value.toLower().contains("chunked");
+        }
+    }
+
+    if (!Connection.Chunked) {
+        if (Connection.Buffer.size() < Connection.ContentLength) return false;
+        Connection.Body = Connection.Buffer.left(Connection.ContentLength);
+        Connection.Buffer.remove(0, Connection.ContentLength);
+        return true;
+    }
+
+    //chunked: размер куска в шестнадцатеричном виде, данные, перевод строки. Кусок нулевого размера - конец тела
+    while (true) {
+        if (Connection.ChunkRemain < 0) {
+            const qsizetype End = Connection.Buffer.indexOf("\r\n");
+            if (End < 0) return false;
+            bool Ok = false;
+            const qint64 Size = Connection.Buffer.left(End).split(';').first().trimmed().toLongLong(&Ok, 16);
+            if (!Ok || (Size < 0)) {
+                //разобрать тело невозможно - отвечаем ошибкой по пустому телу
+                Connection.Body.clear();
+                Connection.Buffer.clear();
+                return true;
+            }
+            if (Size == 0) {
+                const qsizetype TrailerEnd = Connection.Buffer.indexOf("\r\n\r\n", End);
+                if (TrailerEnd < 0) return false;
+                Connection.Buffer.remove(0, TrailerEnd + 4);
+                return true;
+            }
+            Connection.Buffer.remove(0, End + 2);
+            Connection.ChunkRemain = Size;
+        }
+        else if (Connection.ChunkRemain > 0) {
+            const qsizetype Count = qMin<qint64>(Connection.ChunkRemain, Connection.Buffer.size());
+            Connection.Body += Connection.Buffer.left(Count);
+            Connection.Buffer.remove(0, Count);
+            Connection.ChunkRemain -= Count;
+            if (Connection.ChunkRemain > 0) return false;
+        }
+        else {
+            //перевод строки после данных куска
+            if (Connection.Buffer.size() < 2) return false;
+            Connection.Buffer.remove(0, 2);
+            Connection.ChunkRemain = -1;
+        }
+    }
+}
+
+void TMockServer::Process(QTcpSocket *Socket, TConnection &Connection)
+{
+    QByteArray Data;
+    if (!Decompress(Connection.Body, Connection.ContentEncoding, Data)) {
+        SendError(Socket, 415, "Cannot decode request body. Content encoding: " + Connection.ContentEncoding);
+        return;
+    }
+    Connection.Body.clear();
+
+    //в двоичном протоколе первый кадр - XML документ, остальные - тела файлов
+    const bool Framed = Connection.ContentType.startsWith(BinaryContentType);
+    QList<QByteArray> BodyFrames;
+    if (Framed) {
+        if (!SplitFrames(Data, BodyFrames) || BodyFrames.isEmpty()) {
+            SendError(Socket, 400, "Invalid request frames");
+            return;
+        }
+        Data = BodyFrames.takeFirst();
+    }
+
+    QList<QByteArray> AnswerFrames;
+    QString Error;
+    const QByteArray XML = HandleRequest(Data, BodyFrames, Framed, AnswerFrames, Error);
+    if (!Error.isEmpty()) {
+        SendError(Socket, 400, Error);
+        return;
+    }
+    ++Exchanges;
+    emit Exchanged();
+
+    //обмен потерян: запрос обработан, но ответ до клиента не доходит
+    if ((Loss > 0) && (Random.generateDouble() < Loss)) {
+        ++Dropped;
+        Socket->abort();
+        return;
+    }
+
+    QByteArray Body = Framed ? Frame(XML) : XML;
+    for (const auto &Item : AnswerFrames) Body += Frame(Item);
+    const QByteArray ContentType = Framed ? BinaryContentType.toLatin1() : QByteArray("application/xml");
+    const QElapsedTimer Timer = Connection.Timer;
+    if (Latency == 0) {
+        SendAnswer(Socket, ContentType, Body, Timer.elapsed());
+        return;
+    }
+    //если соединение закроется раньше, таймер будет удален вместе с сокетом
+    QTimer::singleShot(Latency, Socket, [this, Socket, ContentType, Body, Timer]() {
+        SendAnswer(Socket, ContentType, Body, Timer.elapsed());
+    });
+}
+
+QByteArray TMockServer::HandleRequest(const QByteArray &XML, const QList<QByteArray> &BodyFrames, bool Framed, QList<QByteArray> &AnswerFrames, QString &Error)
+{
+    QString AZSCode;
+    quint64 LastID = 0;
+    quint64 LastListedID = 0;
+    QStringList Categories;
+    qint64 MaxSize = 0;
+    qint64 ChunkSize = 0;
+    QList<QPair<QString, qint64>> Requested; //запрошенные клиентом файлы: HASH и позиция, с которой его нужно отдать
+    QList<TClientFile> Files;
+    TClientFile File;
+    qsizetype FrameIndex = 0;
+
+    QXmlStreamReader Reader(XML);
+    QStringList Stack;
+    QString Text;
+    while (!Reader.atEnd()) {
+        const QXmlStreamReader::TokenType Token = Reader.readNext();
+        if (Token == QXmlStreamReader::StartElement) {
+            const QString Name = Reader.name().toString();
+            const QString Parent = Stack.isEmpty() ? QString() : Stack.last();
+            if ((Name == "File") && (Parent == "FilesFromClient")) {
+                File = TClientFile();
+            }
+            else if ((Name == "Body") && (Parent == "File")) {
+                const QXmlStreamAttributes Attributes = Reader.attributes();
+                File.Encoding = Attributes.value("Encoding").toString();
+                File.Delta = (Attributes.value("Format") == QLatin1String("delta"));
+                if (Attributes.hasAttribute("Offset")) File.Offset = Attributes.value("Offset").toLongLong();
+                if (Attributes.hasAttribute("TotalSize")) File.TotalSize = Attributes.value("TotalSize").toLongLong();
+                if (Framed && Attributes.hasAttribute("Size")) {
+                    //тело пришло отдельным кадром после XML документа
+                    if ((FrameIndex >= BodyFrames.size()) || (BodyFrames[FrameIndex].size() != Attributes.value("Size").toLongLong())) {
+                        Error = "Body frame does not match the file. File name: " + File.FileName;
+                        return QByteArray();
+                    }
+                    File.Body = BodyFrames[FrameIndex++];
+                    File.Framed = true;
+                    Reader.skipCurrentElement();
+                }
+                else {
+                    File.Body = Reader.readElementText().toLatin1();
+                }
+                continue;
+            }
+            else if ((Name == "HASH") && (Parent == "FilesForLoad")) {
+                const qint64 Offset = Reader.attributes().value("Offset").toLongLong();
+                Requested.push_back({Reader.readElementText().trimmed(), Offset});
+                continue;
+            }
+            Stack.push_back(Name);
+            Text.clear();
+        }
+        else if (Token == QXmlStreamReader::Characters) {
+            Text += Reader.text();
+        }
+        else if (Token == QXmlStreamReader::EndElement) {
+            const QString Name = Stack.isEmpty() ? QString() : Stack.takeLast();
+            const QString Parent = Stack.isEmpty() ? QString() : Stack.last();
+            if (Stack.size() == 1) {
+                if (Name == "AZSCode") AZSCode = Text;
+                else if (Name == "LastID") LastID = Text.toULongLong();
+                else if (Name == "LastListedID") LastListedID = Text.toULongLong();
+            }
+            if ((Parent == "QueryCategory") && (Name == "Category")) Categories << Text;
+            else if ((Parent == "FilesForLoad") && (Name == "MaxSize")) MaxSize = Text.toLongLong();
+            else if ((Parent == "FilesForLoad") && (Name == "ChunkSize")) ChunkSize = Text.toLongLong();
+            else if ((Parent == "File") && (Name == "ID")) File.ID = Text.toULongLong();
+            else if ((Parent == "File") && (Name == "Category")) File.Category = Text;
+            else if ((Parent == "File") && (Name == "FileName")) File.FileName = Text;
+            else if ((Parent == "File") && (Name == "CreateDateTime")) File.CreateDateTime = Text;
+            else if ((Parent == "File") && (Name == "ChangeDateTime")) File.ChangeDateTime = Text;
+            else if ((Parent == "File") && (Name == "Hash")) File.Hash = Text;
+            else if ((Parent == "File") && (Name == "BodyRef")) File.BodyRef = Text;
+            else if ((Parent == "FilesFromClient") && (Name == "File")) Files.push_back(File);
+            Text.clear();
+        }
+    }
+    if (Reader.hasError()) {
+        Error = "Invalid request XML. Error: " + Reader.errorString();
+        return QByteArray();
+    }
+
+    QBuffer Buffer;
+    Buffer.open(QIODevice::WriteOnly);
+    QXmlStreamWriter Writer(&Buffer);
+    Writer.writeStartDocument("1.0");
+    Writer.writeStartElement("Root");
+    Writer.writeTextElement("ProtocolVersion", ProtocolVersion);
+
+    DB.transaction();
+
+    //файлы от клиента. Части больших файлов накапливаются, пока не придет последняя
+    quint64 FilesFromClient = 0;
+    for (const auto &Item : Files) {
+        bool DeltaRejected = false;
+        if (Item.TotalSize < 0) {
+            if (!StoreFile(AZSCode, Item, Error, DeltaRejected)) {
+                DB.rollback();
+                return QByteArray();
+            }
+            if (DeltaRejected) Writer.writeTextElement("DeltaRejected", QString::number(Item.ID));
+            else ++FilesFromClient;
+            continue;
+        }
+
+        const QString Key = AZSCode + "/" + QString::number(Item.ID);
+        QByteArray &Data = Uploads[Key];
+        if (Item.Offset == 0) Data.clear();
+        //часть тела храним в том виде, как оно хранится у клиента. Двоичная часть в XML закодирована в Base64
+        const QByteArray Chunk = (!Item.Framed && (Item.Encoding == "binary")) ? QByteArray::fromBase64(Item.Body) : Item.Body;
+        if (Item.Offset == Data.size()) Data += Chunk;
+        Writer.writeStartElement("ChunkAck");
+        Writer.writeTextElement("ID", QString::number(Item.ID));
+        Writer.writeTextElement("Offset", QString::number(Data.size()));
+        Writer.writeEndElement(); //ChunkAck
+        if (Data.size() < Item.TotalSize) continue;
+
+        TClientFile Whole = Item;
+        Whole.Body = Data;
+        Whole.Framed = true;
+        Whole.Offset = 0;
+        Whole.TotalSize = -1;
+        Uploads.remove(Key);
+        if (!StoreFile(AZSCode, Whole, Error, DeltaRejected)) {
+            DB.rollback();
+            return QByteArray();
+        }
+        if (DeltaRejected) Writer.writeTextElement("DeltaRejected", QString::number(Item.ID));
+        else ++FilesFromClient;
+    }
+
+    //файлы запрошенных категорий, которых еще нет в очереди клиента
+    if (!Categories.isEmpty()) {
+        QStringList Marks;
+        for (qsizetype i = 0; i < Categories.size(); ++i) Marks << "?";
+        QSqlQuery Query(DB);
+        Query.prepare("SELECT ID, HASH FROM SYNCFILE WHERE DIRECTION = 1 AND ID > ? AND CATEGORY IN (" + Marks.join(", ") + ") ORDER BY ID LIMIT ?");
+        Query.addBindValue(static_cast<qint64>(qMax(LastID, LastListedID)));
+        for (const auto &Category : Categories) Query.addBindValue(Category);
+        Query.addBindValue(ListLimit);
+        if (!Query.exec()) {
+            Error = "Cannot select files for client. Error: " + Query.lastError().text();
+            DB.rollback();
+            return QByteArray();
+        }
+        bool Started = false;
+        while (Query.next()) {
+            if (!Started) Writer.writeStartElement("UndownloadedFileList");
+            Started = true;
+            Writer.writeStartElement("File");
+            Writer.writeTextElement("ID", Query.value(0).toString());
+            Writer.writeTextElement("HASH", Query.value(1).toString());
+            Writer.writeEndElement(); //File
+        }
+        if (Started) Writer.writeEndElement(); //UndownloadedFileList
+    }
+
+    //запрошенные файлы. Первый отдается всегда, остальные - пока ответ не превысит MaxSize
+    qint64 AnswerSize = 0;
+    quint64 FilesToClient = 0;
+    bool ListStarted = false;
+    QSqlQuery FileQuery(DB);
+    FileQuery.prepare("SELECT ID, CATEGORY, FILE_NAME, LENGTH(BODY) FROM SYNCFILE WHERE DIRECTION = 1 AND HASH = ? ORDER BY ID LIMIT 1");
+    QSqlQuery BodyQuery(DB);
+    BodyQuery.prepare("SELECT SUBSTR(BODY, ?, ?) FROM SYNCFILE WHERE ID = ?");
+    for (const auto &Item : Requested) {
+        FileQuery.addBindValue(Item.first);
+        if (!FileQuery.exec() || !FileQuery.next()) continue;
+        const qint64 ID = FileQuery.value(0).toLongLong();
+        const QString Category = FileQuery.value(1).toString();
+        const QString FileName = FileQuery.value(2).toString();
+        const qint64 Size = FileQuery.value(3).toLongLong();
+        FileQuery.finish();
+
+        const qint64 Offset = qBound<qint64>(0, Item.second, Size);
+        const bool Chunked = (ChunkSize > 0) && ((Size > ChunkSize) || (Offset > 0));
+        const qint64 Length = Chunked ? qMin(ChunkSize, Size - Offset) : Size - Offset;
+        if ((AnswerSize > 0) && (MaxSize > 0) && (AnswerSize + Length > MaxSize)) break;
+
+        //позиция в SUBSTR начинается с 1
+        BodyQuery.addBindValue(Offset + 1);
+        BodyQuery.addBindValue(Length);
+        BodyQuery.addBindValue(ID);
+        if (!BodyQuery.exec() || !BodyQuery.next()) {
+            Error = "Cannot read file body. Error: " + BodyQuery.lastError().text();
+            DB.rollback();
+            return QByteArray();
+        }
+        const QByteArray Part = BodyQuery.value(0).toByteArray();
+        BodyQuery.finish();
+
+        if (!ListStarted) Writer.writeStartElement("NewFileList");
+        ListStarted = true;
+        Writer.writeStartElement("File");
+        Writer.writeTextElement("Category", Category);
+        Writer.writeTextElement("FileName", FileName);
+        Writer.writeTextElement("HASH", Item.first);
+        if (Chunked) {
+            Writer.writeTextElement("Offset", QString::number(Offset));
+            Writer.writeTextElement("TotalSize", QString::number(Size));
+        }
+        if (Framed) {
+            Writer.writeEmptyElement("Body");
+            Writer.writeAttribute("Size", QString::number(Part.size()));
+            AnswerFrames.push_back(Part);
+        }
+        else {
+            Writer.writeTextElement("Body", QString::fromLatin1(Part.toBase64()));
+        }
+        Writer.writeEndElement(); //File
+        AnswerSize += Part.size();
+        if (!Chunked || (Offset + Part.size() >= Size)) ++FilesToClient;
+    }
+    if (ListStarted) Writer.writeEndElement(); //NewFileList
+    SentFiles += FilesToClient;
+    SentBytes += AnswerSize;
+
+    Writer.writeEndElement(); //Root
+    Writer.writeEndDocument();
+
+    if (!DB.commit()) {
+        Error = "Cannot commit transaction. Error: " + DB.lastError().text();
+        DB.rollback();
+        return QByteArray();
+    }
+    WriteLog(AZSCode, 0, "Exchange. Files from client: " + QString::number(FilesFromClient) +
+                         " Files to client: " + QString::number(FilesToClient) +
+                         " Answer size: " + QString::number(AnswerSize));
+    return Buffer.data();
+}
+
+bool TMockServer::StoreFile(const QString &AZSCode, const TClientFile &File, QString &Error, bool &DeltaRejected)
+{
+    DeltaRejected = false;
+    QByteArray Content;
+    if (!File.BodyRef.isEmpty()) {
+        //тело уже было получено с другим файлом
+        QSqlQuery Query(DB);
+        Query.prepare("SELECT BODY FROM SYNCFILE WHERE DIRECTION = 0 AND HASH = ? ORDER BY ID DESC LIMIT 1");
+        Query.addBindValue(File.BodyRef);
+        if (!Query.exec() || !Query.next()) {
+            Error = "Unknown body reference. File name: " + File.FileName + " Hash: " + File.BodyRef;
+            return false;
+        }
+        Content = Query.value(0).toByteArray();
+    }
+    else {
+        //в кадре тело идет так, как хранится у клиента. В XML - всегда в Base64
+        Content = (File.Framed && (File.Encoding == "binary")) ? File.Body : QByteArray::fromBase64(File.Body);
+    }
+
+    if (File.Delta) {
+        //разность собирается по прошлой версии файла, полученной от этого клиента
+        QSqlQuery Query(DB);
+        Query.prepare("SELECT BODY FROM SYNCFILE WHERE DIRECTION = 0 AND AZS_CODE = ? AND CATEGORY = ? AND FILE_NAME = ? ORDER BY ID DESC LIMIT 1");
+        Query.addBindValue(AZSCode);
+        Query.addBindValue(File.Category);
+        Query.addBindValue(File.FileName);
+        const QByteArray Base = (Query.exec() && Query.next()) ? Query.value(0).toByteArray() : QByteArray();
+        QByteArray Data;
+        QString DeltaError;
+        if (!TDeltaCodec::Apply(Base, Content, Data, &DeltaError)) {
+            //клиент отправит файл целиком
+            qDebug() << "Cannot apply delta. File name:" << File.FileName << "Error:" << DeltaError;
+            DeltaRejected = true;
+            return true;
+        }
+        Content = Data;
+    }
+
+    const QByteArray Md5 = QCryptographicHash::hash(Content, QCryptographicHash::Md5);
+    QSqlQuery Query(DB);
+    Query.prepare("INSERT INTO SYNCFILE (AZS_CODE, DIRECTION, CATEGORY, FILE_NAME, CREATE_DATE_TIME, CHANGE_DATE_TIME, HASH, BODY) "
+                  "VALUES (?, 0, ?, ?, ?, ?, ?, ?)");
+    Query.addBindValue(AZSCode);
+    Query.addBindValue(File.Category);
+    Query.addBindValue(File.FileName);
+    Query.addBindValue(File.CreateDateTime);
+    Query.addBindValue(File.ChangeDateTime);
+    Query.addBindValue(File.Hash.isEmpty() ? QString::fromLatin1(Md5.toHex()) : File.Hash);
+    Query.addBindValue(Content);
+    if (!Query.exec()) {
+        Error = "Cannot store file. Error: " + Query.lastError().text();
+        return false;
+    }
+
+    ++ReceivedFiles;
+    ReceivedBytes += Content.size();
+    emit FileReceived(File.Category, File.FileName, Content.size(), Md5);
+    return true;
+}
+
+void TMockServer::SendAnswer(QTcpSocket *Socket, const QByteArray &ContentType, const QByteArray &Body, qint64 Time)
+{
+    QByteArray Head = "HTTP/1.1 200 OK\r\n"
+                      "Content-Type: " + ContentType + "\r\n"
+                      "Content-Length: " + QByteArray::number(Body.size()) + "\r\n"
+                      "Accept-Encoding: gzip, deflate\r\n" //сжатые запросы клиент отправляет только после этого заголовка
+                      "Connection: keep-alive\r\n\r\n";
+    Socket->write(Head);
+    Socket->write(Body);
+    ExchangeTimes.push_back(Time);
+}
+
+void TMockServer::SendError(QTcpSocket *Socket, int Code, const QString &Msg)
+{
+    qDebug() << "Mock server:" << Msg;
+    WriteLog(QString(), 1, Msg);
+    const QByteArray Body = Msg.toUtf8();
+    Socket->write("HTTP/1.1 " + QByteArray::number(Code) + " Error\r\n"
+                  "Content-Type: text/plain\r\n"
+                  "Content-Length: " + QByteArray::number(Body.size()) + "\r\n"
+                  "Connection: close\r\n\r\n" + Body);
+    Socket->disconnectFromHost();
+}
+
+void TMockServer::WriteLog(const QString &AZSCode, int Category, const QString &Msg)
+{
+    QSqlQuery Query(DB);
+    Query.prepare("INSERT INTO LOG (AZS_CODE, CATEGORY, MSG) VALUES (?, ?, ?)");
+    Query.addBindValue(AZSCode);
+    Query.addBindValue(Category);
+    Query.addBindValue(Msg);
+    if (!Query.exec()) qDebug() << "Mock server: cannot write log. Error:" << Query.lastError().text();
+}
+
+bool TMockServer::Decompress(const QByteArray &Data, const QString &Encoding, QByteArray &Result)
+{
+    if (Encoding.isEmpty() || (Encoding == "identity")) {
+        Result = Data;
+        return true;
+    }
+    if ((Encoding != "gzip") && (Encoding != "deflate")) return false;
+
+    z_stream Stream;
+    std::memset(&Stream, 0, sizeof(Stream));
+    //15 + 32 - формат (gzip или zlib) определяется по заголовку
+    if (inflateInit2(&Stream, 15 + 32) != Z_OK) return false;
+    Stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(Data.constData()));
+    Stream.avail_in = static_cast<uInt>(Data.size());
+    Result.clear();
+    QByteArray Buffer(65536, '\0');
+    int Code = Z_OK;
+    while (Code == Z_OK) {
+        Stream.next_out = reinterpret_cast<Bytef *>(Buffer.data());
+        Stream.avail_out = static_cast<uInt>(Buffer.size());
+        Code = inflate(&Stream, Z_NO_FLUSH);
+        if ((Code == Z_OK) || (Code == Z_STREAM_END)) Result.append(Buffer.constData(), Buffer.size() - Stream.avail_out);
+    }
+    inflateEnd(&Stream);
+    return Code == Z_STREAM_END;
+}
+
+bool TMockServer::SplitFrames(const QByteArray &Data, QList<QByteArray> &Frames)
+{
+    qsizetype Pos = 0;
+    while (Pos < Data.size()) {
+        if (Data.size() - Pos < 8) return false;
+        const qint64 Size = qFromBigEndian<qint64>(Data.constData() + Pos);
+        Pos += 8;
+        if ((Size < 0) || (Size > Data.size() - Pos)) return false;
+        Frames.push_back(Data.mid(Pos, Size));
+        Pos += Size;
+    }
+    return true;
+}
+
+QByteArray TMockServer::Frame(const QByteArray &Data)
+{
+    QByteArray Header(8, '\0');
+    qToBigEndian<qint64>(Data.size(), Header.data());
+    return Header + Data;
+}
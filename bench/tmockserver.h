@@ -0,0 +1,123 @@
+/* Локальная замена сервера синхронизации для нагрузочного тестирования
+ * Принимает запросы Sync по HTTP/1.1 (Content-Length или chunked, тело может быть сжато gzip/deflate),
+ * разбирает FilesFromClient и FilesForLoad и отвечает UndownloadedFileList, NewFileList и ChunkAck
+ * в XML или в двоичном протоколе - так же, как пришел запрос. Поддерживается протокол до 0.5:
+ * ссылки на уже полученные тела, разности и передача больших файлов частями
+ * Файлы хранятся в SQLite в таблице SYNCFILE (DIRECTION: 0 - получен от клиента, 1 - для отправки клиенту),
+ * каждый обмен записывается в LOG
+ * Для имитации плохой сети ответ задерживается на Latency мс, а часть обменов теряется - соединение
+ * разрывается после обработки запроса, и клиент отправляет его повторно
+*/
+#ifndef TMOCKSERVER_H
+#define TMOCKSERVER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QHash>
+#include <QList>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+#include <QtSql/QSqlDatabase>
+
+class TMockServer : public QObject
+{
+    Q_OBJECT
+public:
+    static const QString ProtocolVersion; //версия протокола, о которой сервер сообщает клиенту
+    static const QString BinaryContentType;
+
+private:
+    typedef struct {
+        QByteArray Buffer;         //полученные, но еще не разобранные данные
+        bool HeadDone = false;     //заголовок запроса разобран
+        QString ContentType;
+        QString ContentEncoding;
+        bool Chunked = false;      //тело передается в chunked transfer encoding
+        qint64 ContentLength = 0;
+        qint64 ChunkRemain = -1;   //сколько байт текущего куска chunked осталось получить. -1 - ожидается размер куска
+        QByteArray Body;
+        QElapsedTimer Timer;       //время с первого байта запроса
+    } TConnection;
+
+    typedef struct {
+        quint64 ID = 0;
+        QString Category;
+        QString FileName;
+        QString CreateDateTime;
+        QString ChangeDateTime;
+        QString Hash;
+        QString BodyRef;
+        QByteArray Body;          //тело в том виде, как оно хранится у клиента
+        QString Encoding;         //base64 или binary
+        bool Framed = false;      //тело пришло отдельным кадром
+        bool Delta = false;       //тело - разность с прошлой версией файла
+        qint64 Offset = 0;
+        qint64 TotalSize = -1;    //полный размер файла, если пришла только его часть
+    } TClientFile;
+
+    QTcpServer Server;
+    QSqlDatabase DB;
+    QHash<QTcpSocket *, TConnection> Connections;
+    QHash<QString, QByteArray> Uploads; //файлы, полученные частично. Ключ - AZSCode/ID
+    QRandomGenerator Random;
+    QString LastError;
+    int Latency = 0;  //задержка ответа, мс
+    double Loss = 0;  //доля потерянных обменов
+    int ListLimit = 1000; //максимальная длина списка незагруженных файлов в одном ответе
+
+    quint64 Exchanges = 0; //обработано запросов
+    quint64 Dropped = 0;   //потеряно обменов
+    quint64 ReceivedFiles = 0;
+    qint64 ReceivedBytes = 0; //размер полученных от клиента файлов
+    quint64 SentFiles = 0;
+    qint64 SentBytes = 0;     //размер отправленных клиенту тел
+    QList<qint64> ExchangeTimes; //время обменов с первого байта запроса до отправки ответа, мс
+
+    bool ParseRequest(TConnection &Connection); //true - запрос получен полностью
+    void Process(QTcpSocket *Socket, TConnection &Connection);
+    QByteArray HandleRequest(const QByteArray &XML, const QList<QByteArray> &BodyFrames, bool Framed, QList<QByteArray> &AnswerFrames, QString &Error);
+    //сохраняет файл, полученный целиком. DeltaRejected - разность не подходит к прошлой версии, файл не сохранен
+    bool StoreFile(const QString &AZSCode, const TClientFile &File, QString &Error, bool &DeltaRejected);
+    void SendAnswer(QTcpSocket *Socket, const QByteArray &ContentType, const QByteArray &Body, qint64 Time); //Time - время обмена для статистики, мс
+    void SendError(QTcpSocket *Socket, int Code, const QString &Msg);
+    void WriteLog(const QString &AZSCode, int Category, const QString &Msg);
+
+    static bool Decompress(const QByteArray &Data, const QString &Encoding, QByteArray &Result);
+    static bool SplitFrames(const QByteArray &Data, QList<QByteArray> &Frames);
+    static QByteArray Frame(const QByteArray &Data);
+
+public:
+    explicit TMockServer(const QString &DBFileName, QObject *parent = nullptr);
+    ~TMockServer();
+
+    bool Start(quint16 Port = 0); //0 - любой свободный порт
+    quint16 Port() const { return Server.serverPort(); }
+    QString ErrorString() const { return LastError; }
+
+    void SetLatency(int Latency) { this->Latency = qMax(0, Latency); }
+    void SetLoss(double Percent) { Loss = qBound(0.0, Percent / 100.0, 1.0); }
+
+    //добавляет файл для отправки клиенту. Возвращает HASH файла, пустая строка - ошибка
+    QString Publish(const QString &Category, const QString &FileName, const QByteArray &Body);
+
+    quint64 ExchangeCount() const { return Exchanges; }
+    quint64 DroppedCount() const { return Dropped; }
+    quint64 ReceivedFileCount() const { return ReceivedFiles; }
+    qint64 ReceivedByteCount() const { return ReceivedBytes; }
+    quint64 SentFileCount() const { return SentFiles; }
+    qint64 SentByteCount() const { return SentBytes; }
+    QList<qint64> TakeExchangeTimes(); //время обменов с прошлого вызова
+
+signals:
+    void FileReceived(const QString &Category, const QString &FileName, qint64 Size, const QByteArray &Md5); //получен файл от клиента
+    void Exchanged(); //обработан очередной запрос
+
+private slots:
+    void onNewConnection();
+    void onReadyRead();
+    void onDisconnected();
+};
+
+#endif // TMOCKSERVER_H
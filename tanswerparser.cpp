@@ -0,0 +1,314 @@
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QTemporaryFile>
+#include <QtEndian>
+#include "tanswerparser.h"
+#include "tsync.h"
+
+TAnswerParser::TAnswerParser(const QMap<QString, QString> &CategoryToTarget, QObject *parent)
+    : QObject(parent)
+    , CategoryToTarget(CategoryToTarget)
+{
+}
+
+TAnswerParser::~TAnswerParser()
+{
+    DiscardBody();
+}
+
+void TAnswerParser::AddData(const QByteArray &Data)
+{
+    if (!Error.isEmpty()) return;
+    if (Head.size() < 200) Head += Data.left(200 - Head.size());
+    if (Framed) {
+        AddFramedData(Data);
+        return;
+    }
+    XMLReader.addData(Data);
+    ParseTokens();
+}
+
+void TAnswerParser::AddFramedData(const QByteArray &Data)
+{
+    qsizetype Pos = 0;
+    while ((Pos < Data.size()) && Error.isEmpty()) {
+        if (FrameRemain < 0) { //читаем заголовок кадра
+            const qsizetype Count = qMin<qsizetype>(8 - FrameHeader.size(), Data.size() - Pos);
+            FrameHeader += Data.mid(Pos, Count);
+            Pos += Count;
+            if (FrameHeader.size() < 8) return;
+            FrameRemain = qFromBigEndian<qint64>(FrameHeader.constData());
+            FrameHeader.clear();
+            StartFrame();
+            if (Error.isEmpty() && (FrameRemain == 0)) FinishFrame();
+            continue;
+        }
+
+        const qsizetype Count = qMin<qint64>(FrameRemain, Data.size() - Pos);
+        const QByteArray Part = Data.mid(Pos, Count);
+        Pos += Count;
+        FrameRemain -= Count;
+        if (FrameIndex == 0) {
+            XMLReader.addData(Part);
+            ParseTokens();
+        }
+        else if ((BodyFile != nullptr) && !CurrentFile.BodyError) {
+            if (CurrentFile.Base64Frame) {
+                AddBase64(Part);
+            }
+            else {
+                if (BodyFile->write(Part) != Part.size()) CurrentFile.BodyError = true;
+                CurrentFile.Size += Part.size();
+            }
+        }
+        if (Error.isEmpty() && (FrameRemain == 0)) FinishFrame();
+    }
+}
+
+void TAnswerParser::StartFrame()
+{
+    if (FrameRemain < 0) {
+        Error = "Invalid frame size";
+        return;
+    }
+    if (FrameIndex == 0) return; //XML документ
+
+    //кадр с телом очередного файла из NewFileList
+    if (PendingIndex >= PendingFiles.size()) {
+        Error = "Unexpected body frame " + QString::number(FrameIndex);
+        return;
+    }
+    CurrentFile = PendingFiles[PendingIndex];
+    if (CurrentFile.FrameSize != FrameRemain) {
+        Error = "Body frame size mismatch. File name: " + CurrentFile.FileName;
+        return;
+    }
+    StartBody();
+}
+
+void TAnswerParser::FinishFrame()
+{
+    if (FrameIndex == 0) {
+        //XML документ должен закончиться вместе с кадром
+        if (!ElementStack.isEmpty() || (XMLReader.hasError() && (XMLReader.error() != QXmlStreamReader::PrematureEndOfDocumentError))) {
+            Error = "Incomplete XML frame";
+        }
+    }
+    else {
+        FinishBody();
+        EmitFile();
+        ++PendingIndex;
+    }
+    ++FrameIndex;
+    FrameRemain = -1;
+}
+
+void TAnswerParser::EmitFile()
+{
+    if (!CurrentFile.BodyError && !CurrentFile.TmpFileName.isEmpty() && !MoveToTarget()) CurrentFile.BodyError = true;
+    if (CurrentFile.BodyError || CurrentFile.TmpFileName.isEmpty()) {
+        if (!CurrentFile.TmpFileName.isEmpty()) QFile::remove(CurrentFile.TmpFileName);
+        emit SendLogMsg(TSync::CODE_INFORMATION, "Cannot decode file body. Category: " + CurrentFile.Category +
+                                                 " File name: " + CurrentFile.FileName +
+                                                 " HASH:" + CurrentFile.HASH);
+    }
+    else if (CurrentFile.TotalSize >= 0) {
+        emit GetFileChunk(CurrentFile.Category, CurrentFile.FileName, CurrentFile.HASH, CurrentFile.TmpFileName, CurrentFile.Offset, CurrentFile.TotalSize);
+    }
+    else {
+        emit GetFile(CurrentFile.Category, CurrentFile.FileName, CurrentFile.HASH, CurrentFile.TmpFileName);
+    }
+    CurrentFile = TFileInfo();
+}
+
+bool TAnswerParser::Finish()
+{
+    if (Error.isEmpty() && XMLReader.hasError()) {
+        //ответ закончился раньше чем документ
+        Error = XMLReader.errorString();
+    }
+    if (Error.isEmpty() && !ElementStack.isEmpty()) {
+        Error = "Unexpected end of answer";
+    }
+    if (Error.isEmpty() && Framed && ((FrameIndex == 0) || (FrameRemain >= 0) || (PendingIndex < PendingFiles.size()))) {
+        Error = "Unexpected end of answer. Not all frames received";
+    }
+    DiscardBody();
+    return Error.isEmpty();
+}
+
+void TAnswerParser::ParseTokens()
+{
+    while (!XMLReader.atEnd()) {
+        QXmlStreamReader::TokenType Token = XMLReader.readNext();
+        if (Token == QXmlStreamReader::Invalid) {
+            //данные кончились - ждем следующий кусок
+            if (XMLReader.error() == QXmlStreamReader::PrematureEndOfDocumentError) return;
+            Error = XMLReader.errorString();
+            DiscardBody();
+            return;
+        }
+        else if (Token == QXmlStreamReader::StartElement) {
+            const QString Name = XMLReader.name().toString();
+            const QString Parent = ElementStack.isEmpty() ? QString() : ElementStack.last();
+            ElementStack.push_back(Name);
+            Text.clear();
+            if ((Name == "File") || (Name == "ChunkAck") || (Name == "DeltaRejected")) {
+                CurrentFile = TFileInfo();
+            }
+            else if ((Name == "Body") && (Parent == "File")) {
+                //в XML тело всегда в Base64. Encoding описывает хранение тела и важен для отдельного кадра
+                const QString Encoding = XMLReader.attributes().value("Encoding").toString();
+                if (!Encoding.isEmpty() && (Encoding != "binary") && (Encoding != "base64")) {
+                    emit SendLogMsg(TSync::CODE_INFORMATION, "Unsupported body encoding: " + Encoding);
+                    CurrentFile.BodyError = true;
+                }
+                if (Framed && XMLReader.attributes().hasAttribute("Size")) {
+                    //тело придет отдельным кадром после XML документа
+                    CurrentFile.BodyFrame = true;
+                    CurrentFile.FrameSize = XMLReader.attributes().value("Size").toLongLong();
+                    CurrentFile.Base64Frame = (Encoding == "base64");
+                }
+                else {
+                    InBody = true;
+                    StartBody();
+                }
+            }
+        }
+        else if (Token == QXmlStreamReader::Characters) {
+            if (InBody) AddBody(XMLReader.text());
+            else Text += XMLReader.text();
+        }
+        else if (Token == QXmlStreamReader::EndElement) {
+            const QString Name = ElementStack.isEmpty() ? QString() : ElementStack.takeLast();
+            const QString Parent = ElementStack.isEmpty() ? QString() : ElementStack.last();
+            if (Name == "ProtocolVersion") emit GetProtocolVersion(Text);
+            else if (Name == "ID") CurrentFile.ID = Text.toULongLong();
+            else if (Name == "HASH") CurrentFile.HASH = Text;
+            else if (Name == "FileName") CurrentFile.FileName = Text;
+            else if (Name == "Category") CurrentFile.Category = Text;
+            else if (Name == "Offset") CurrentFile.Offset = Text.toLongLong();
+            else if (Name == "TotalSize") CurrentFile.TotalSize = Text.toLongLong();
+            else if (Name == "ChunkAck") emit GetChunkAck(CurrentFile.ID, CurrentFile.Offset);
+            else if (Name == "DeltaRejected") emit GetDeltaRejected(CurrentFile.ID);
+            else if (InBody && (Name == "Body")) {
+                InBody = false;
+                FinishBody();
+            }
+            else if ((Name == "File") && (Parent == "UndownloadedFileList")) { //пришел список незагруженных файлов
+                if ((CurrentFile.ID != 0) && (CurrentFile.HASH != "")) {
+                    emit GetUndownloadedFile(CurrentFile.ID, CurrentFile.HASH);
+                }
+            }
+            else if ((Name == "File") && (Parent == "NewFileList")) { //Пришел новый файл
+                if (CurrentFile.BodyFrame) PendingFiles.push_back(CurrentFile);
+                else EmitFile();
+                CurrentFile = TFileInfo();
+            }
+            Text.clear();
+        }
+    }
+}
+
+void TAnswerParser::StartBody()
+{
+    DiscardBody();
+    Base64Tail.clear();
+
+    //временный файл создаем рядом с целевым, чтобы потом его можно было просто переименовать
+    //если Category и FileName еще не пришли или директории пока нет, пишем во временную директорию,
+    //а к целевому файл переносится в EmitFile
+    QString Dir = TargetDir();
+    if (Dir.isEmpty() || !QFileInfo(Dir).isDir()) Dir = QDir::tempPath();
+
+    QTemporaryFile *File = new QTemporaryFile(Dir + "/.sync_XXXXXX.tmp", this);
+    File->setAutoRemove(false);
+    if (!File->open()) {
+        emit SendLogMsg(TSync::CODE_ERROR, "Cannot create temporary file in " + Dir + ". Error: " + File->errorString());
+        delete File;
+        CurrentFile.BodyError = true;
+        return;
+    }
+    BodyFile = File;
+    CurrentFile.TmpFileName = File->fileName();
+    CurrentFile.Size = 0;
+}
+
+QString TAnswerParser::TargetDir() const
+{
+    if (CurrentFile.FileName.isEmpty() || !CategoryToTarget.contains(CurrentFile.Category)) return QString();
+    return QFileInfo(CategoryToTarget[CurrentFile.Category] + CurrentFile.FileName).absolutePath();
+}
+
+bool TAnswerParser::MoveToTarget()
+{
+    //файл, который не запрашивали, получатель сигнала отбросит - директорию для него не создаем
+    const QString Dir = TargetDir();
+    if (Dir.isEmpty() || !Requested.contains(CurrentFile.HASH)) return true;
+    QFileInfo TmpFile(CurrentFile.TmpFileName);
+    if (TmpFile.absolutePath() == QFileInfo(Dir).absoluteFilePath()) return true;
+
+    if (!QDir().mkpath(Dir)) {
+        emit SendLogMsg(TSync::CODE_ERROR, "Cannot create directory " + Dir);
+        return false;
+    }
+    //между файловыми системами QFile::rename копирует файл
+    const QString FileName = Dir + "/" + TmpFile.fileName();
+    if (!QFile::rename(CurrentFile.TmpFileName, FileName)) {
+        emit SendLogMsg(TSync::CODE_ERROR, "Cannot move temporary file to " + Dir);
+        return false;
+    }
+    CurrentFile.TmpFileName = FileName;
+    return true;
+}
+
+void TAnswerParser::AddBody(QStringView Data)
+{
+    if ((BodyFile == nullptr) || CurrentFile.BodyError) return;
+
+    AddBase64(Data.toLatin1());
+}
+
+void TAnswerParser::AddBase64(const QByteArray &Data)
+{
+    if ((BodyFile == nullptr) || CurrentFile.BodyError) return;
+
+    //пробелы и переводы строк внутри Base64 пропускаем
+    Base64Tail.reserve(Base64Tail.size() + Data.size());
+    for (const char Char : Data) {
+        if (!QChar::isSpace(static_cast<uchar>(Char))) Base64Tail.append(Char);
+    }
+
+    //декодируем только целые четверки символов, остаток ждет следующего куска
+    const qsizetype DecodeSize = Base64Tail.size() - Base64Tail.size() % 4;
+    if (DecodeSize == 0) return;
+
+    auto Result = QByteArray::fromBase64Encoding(Base64Tail.left(DecodeSize), QByteArray::AbortOnBase64DecodingErrors);
+    Base64Tail.remove(0, DecodeSize);
+    if ((Result.decodingStatus != QByteArray::Base64DecodingStatus::Ok) || (BodyFile->write(Result.decoded) != Result.decoded.size())) {
+        CurrentFile.BodyError = true;
+        return;
+    }
+    CurrentFile.Size += Result.decoded.size();
+}
+
+void TAnswerParser::FinishBody()
+{
+    if (BodyFile == nullptr) return;
+    if (!Base64Tail.isEmpty()) CurrentFile.BodyError = true; //длина Base64 не кратна 4
+    if (!BodyFile->flush()) CurrentFile.BodyError = true;
+    BodyFile->close();
+    delete BodyFile;
+    BodyFile = nullptr;
+}
+
+void TAnswerParser::DiscardBody()
+{
+    if (BodyFile == nullptr) return;
+    BodyFile->close();
+    BodyFile->remove();
+    delete BodyFile;
+    BodyFile = nullptr;
+    CurrentFile.TmpFileName.clear();
+}
@@ -0,0 +1,102 @@
+/* Разбирает ответ HTTP сервера по мере его получения
+ * Данные подаются кусками через AddData(), тела файлов (<Body>) декодируются из Base64
+ * на лету и пишутся во временный файл рядом с целевым. Таким образом объем занимаемой
+ * памяти не зависит от размера получаемых файлов
+ * После получения файла полностью генерируется сигнал GetFile. С этого момента за временный
+ * файл отвечает получатель сигнала
+ *
+ * Двоичный протокол (SetFramed(true)): ответ состоит из кадров. Каждый кадр - 8 байт длины
+ * (big-endian) и данные. Первый кадр - XML документ, в котором тела файлов заменены на
+ * <Body Size="N"/>, далее в том же порядке идут кадры с телами файлов. Атрибут Encoding сообщает, как тело
+ * хранится на сервере: binary (по умолчанию) - кадр содержит сам файл, base64 - кадр содержит его Base64
+ *
+ * Передача частями (протокол 0.5): элемент File с TotalSize содержит часть файла с позиции Offset -
+ * о ней сообщает сигнал GetFileChunk. ChunkAck подтверждает, сколько байт отправляемого файла сервер уже получил
+ *
+ * DeltaRejected - сервер не смог собрать файл ID из разности (у него другая прошлая версия). Файл нужно отправить целиком
+*/
+#ifndef TANSWERPARSER_H
+#define TANSWERPARSER_H
+
+#include <QObject>
+#include <QXmlStreamReader>
+#include <QStringList>
+#include <QByteArray>
+#include <QMap>
+#include <QSet>
+#include <QFile>
+
+class TAnswerParser : public QObject
+{
+    Q_OBJECT
+private:
+    typedef struct {
+        quint64 ID = 0;
+        QString HASH;
+        QString FileName;
+        QString Category;
+        QString TmpFileName; //временный файл с телом
+        qint64 Size = 0;     //размер декодированного тела
+        bool BodyError = false;
+        bool BodyFrame = false; //тело передается отдельным кадром
+        qint64 FrameSize = 0;   //размер кадра с телом
+        bool Base64Frame = false; //кадр с телом содержит Base64
+        qint64 Offset = 0;      //позиция части файла или подтвержденный сервером размер (ChunkAck)
+        qint64 TotalSize = -1;  //полный размер файла, если передается только его часть. -1 - файл целиком
+    } TFileInfo;
+
+    QXmlStreamReader XMLReader;
+    const QMap<QString, QString> CategoryToTarget; //категория -> путь к цели
+    QSet<QString> Requested; //HASH запрошенных файлов. Только для них создаются директории целей
+    QStringList ElementStack; //стек открытых элементов
+    QString Text;             //текст текущего простого элемента
+    TFileInfo CurrentFile;    //текущий разбираемый элемент File
+    QFile *BodyFile = nullptr; //файл в который пишется текущее тело
+    bool InBody = false;       //разбирается элемент Body
+    QByteArray Base64Tail;    //остаток Base64 который еще нельзя декодировать (длина не кратна 4)
+    QByteArray Head;          //начало ответа для диагностики ошибок
+    QString Error;
+
+    bool Framed = false;      //ответ в двоичном протоколе
+    QByteArray FrameHeader;   //накопленный заголовок кадра
+    qint64 FrameRemain = -1;  //сколько байт текущего кадра осталось получить. -1 - ожидается заголовок
+    qsizetype FrameIndex = 0; //номер текущего кадра. 0 - XML документ
+    QList<TFileInfo> PendingFiles; //файлы, тела которых придут в следующих кадрах
+    qsizetype PendingIndex = 0;    //файл, тело которого ожидается следующим
+
+    void ParseTokens();
+    void AddFramedData(const QByteArray &Data);
+    void StartFrame();
+    void FinishFrame();
+    void EmitFile();
+    void StartBody();
+    QString TargetDir() const; //директория целевого файла. Пусто - файл не относится к известной цели
+    bool MoveToTarget(); //переносит временный файл к целевому, если тело пришло раньше Category и FileName
+    void AddBody(QStringView Data);
+    void AddBase64(const QByteArray &Data); //декодирует очередной кусок Base64 в файл тела
+    void FinishBody();
+    void DiscardBody();
+
+public:
+    explicit TAnswerParser(const QMap<QString, QString> &CategoryToTarget, QObject *parent = nullptr);
+    ~TAnswerParser();
+
+    void SetFramed(bool Framed) { this->Framed = Framed; } //ответ в двоичном протоколе. Вызывается до первого AddData
+    void SetRequested(const QSet<QString> &Hashes) { Requested = Hashes; } //запрошенные файлы. Вызывается до первого AddData
+    void AddData(const QByteArray &Data); //добавляет очередной кусок ответа и разбирает его
+    bool Finish(); //вызывается после получения ответа целиком. false - ответ некорректный
+    QString ErrorString() const { return Error; }
+    QByteArray AnswerHead() const { return Head; }
+
+signals:
+    void GetProtocolVersion(const QString &Version); //версия протокола сервера
+    void GetUndownloadedFile(quint64 ID, const QString &HASH); //пришел элемент списка незагруженных файлов
+    void GetFile(const QString &Category, const QString &FileName, const QString &HASH, const QString &TmpFileName); //пришел файл
+    //пришла часть файла с позиции Offset. TmpFileName содержит только эту часть
+    void GetFileChunk(const QString &Category, const QString &FileName, const QString &HASH, const QString &TmpFileName, qint64 Offset, qint64 TotalSize);
+    void GetChunkAck(quint64 ID, qint64 Offset); //сервер получил первые Offset байт файла ID
+    void GetDeltaRejected(quint64 ID); //сервер не принял разность файла ID
+    void SendLogMsg(uint16_t Category, const QString &Msg);
+};
+
+#endif // TANSWERPARSER_H
@@ -0,0 +1,70 @@
+#include <QRandomGenerator>
+#include <QTimer>
+#include "tbackoff.h"
+#include "tsync.h"
+
+TBackoff::TBackoff(qint64 MinDelay, qint64 MaxDelay, int MaxFailures, QObject *parent)
+    : QObject(parent)
+    , MinDelay(qMax<qint64>(1, MinDelay))
+    , MaxDelay(qMax(MinDelay, MaxDelay))
+    , MaxFailures(qMax(1, MaxFailures))
+{
+    Clock.start();
+}
+
+int TBackoff::Allowed()
+{
+    if (Clock.elapsed() < RetryAt) return 0;
+    //пауза закончилась - пропускаем один пробный запрос
+    if (State == OPEN) State = HALF_OPEN;
+    if (State == HALF_OPEN) return 1;
+    return Window;
+}
+
+qint64 TBackoff::Delay() const
+{
+    return qMax<qint64>(0, RetryAt - Clock.elapsed());
+}
+
+void TBackoff::Success()
+{
+    if (State != CLOSED) {
+        emit SendLogMsg(TSync::CODE_INFORMATION, "Connection to the server has been restored after " + QString::number(Failures) + " failures");
+    }
+    State = CLOSED;
+    Failures = 0;
+    RetryAt = 0;
+    //быстро возвращаемся к полному окну: удваиваем его с каждым успешным ответом
+    Window = qMin(MaxWindow, Window * 2);
+}
+
+void TBackoff::Failure()
+{
+    //ошибки запросов, которые выполнялись одновременно, считаем одной ошибкой
+    if (Clock.elapsed() < RetryAt) return;
+
+    ++Failures;
+    Window = 1;
+
+    //экспоненциальная пауза со случайным разбросом в пределах [Delay/2, Delay]
+    qint64 Delay = MinDelay;
+    for (int i = 1; (i < Failures) && (Delay < MaxDelay); ++i) Delay *= 2;
+    Delay = qMin(Delay, MaxDelay);
+    Delay = Delay / 2 + static_cast<qint64>(QRandomGenerator::global()->bounded(static_cast<double>(Delay / 2 + 1)));
+    RetryAt = Clock.elapsed() + Delay;
+
+    if ((State == HALF_OPEN) || ((State == CLOSED) && (Failures >= MaxFailures))) {
+        if (State == CLOSED) {
+            emit SendLogMsg(TSync::CODE_ERROR, "Server is unavailable. Failures: " + QString::number(Failures) + ". Requests are suspended");
+        }
+        State = OPEN;
+    }
+
+    QTimer::singleShot(static_cast<int>(Delay), this, SLOT(onRetryTimeout()));
+}
+
+void TBackoff::onRetryTimeout()
+{
+    if (Clock.elapsed() < RetryAt) return; //таймер от более ранней паузы
+    emit RetryAllowed();
+}
@@ -0,0 +1,50 @@
+/* Планировщик повторных попыток обмена с сервером
+ * После ошибки следующая попытка откладывается на экспоненциально растущее время со случайным разбросом,
+ * чтобы множество клиентов не обращались к восстановившемуся серверу одновременно.
+ * После MaxFailures ошибок подряд цепь размыкается (OPEN): до истечения паузы запросы не отправляются,
+ * затем отправляется один пробный запрос (HALF_OPEN). После успешного ответа окно одновременных запросов
+ * удваивается с каждым успешным ответом до полного размера
+*/
+#ifndef TBACKOFF_H
+#define TBACKOFF_H
+
+#include <QObject>
+#include <QElapsedTimer>
+
+class TBackoff : public QObject
+{
+    Q_OBJECT
+public:
+    typedef enum {CLOSED, OPEN, HALF_OPEN} TState; //состояние цепи
+
+private:
+    const qint64 MinDelay;  //пауза после первой ошибки, мс
+    const qint64 MaxDelay;  //максимальная пауза, мс
+    const int MaxFailures;  //количество ошибок подряд, после которого цепь размыкается
+    int MaxWindow = 1;      //полный размер окна одновременных запросов
+    int Window = 1;         //текущий размер окна
+    int Failures = 0;       //количество ошибок подряд
+    TState State = CLOSED;
+    QElapsedTimer Clock;
+    qint64 RetryAt = 0;     //время, до которого запросы не отправляются, мс от запуска Clock
+
+public:
+    explicit TBackoff(qint64 MinDelay, qint64 MaxDelay, int MaxFailures, QObject *parent = nullptr);
+
+    void SetMaxWindow(int Size) { MaxWindow = qMax(1, Size); Window = MaxWindow; }
+    int Allowed();  //количество запросов, которые могут выполняться одновременно прямо сейчас. 0 - идет пауза
+    qint64 Delay() const; //сколько осталось до конца паузы, мс
+    TState GetState() const { return State; }
+
+    void Success(); //сервер успешно ответил
+    void Failure(); //запрос завершился ошибкой
+
+signals:
+    void RetryAllowed(); //пауза закончилась, можно повторить обмен
+    void SendLogMsg(uint16_t Category, const QString &Msg);
+
+private slots:
+    void onRetryTimeout();
+};
+
+#endif // TBACKOFF_H
@@ -0,0 +1,147 @@
+#include <QDebug>
+#include <QtSql/QSqlDatabase>
+#include "tcompactor.h"
+
+TCompactor::TCompactor(const QString &SourceConnectionName, int Interval, int RetentionDays, int SliceSize, int SlicePause, int FullPassEvery)
+    : QObject(nullptr) //объект живет в потоке очистки, поэтому родителя у него нет
+    , SourceConnectionName(SourceConnectionName)
+    , Interval(qMax(0, Interval))
+    , RetentionDays(qMax(0, RetentionDays))
+    , SliceSize(qMax(1, SliceSize))
+    , SlicePause(qMax(0, SlicePause))
+    , FullPassEvery(qMax(1, FullPassEvery))
+{
+    moveToThread(&Thread);
+    QObject::connect(&Thread, SIGNAL(started()), this, SLOT(onStarted()));
+}
+
+TCompactor::~TCompactor()
+{
+    Stop();
+}
+
+void TCompactor::Start()
+{
+    if ((Interval > 0) && !Thread.isRunning()) Thread.start();
+}
+
+void TCompactor::Stop()
+{
+    if (!Thread.isRunning()) return;
+    QMetaObject::invokeMethod(this, "onStop", Qt::BlockingQueuedConnection);
+    Thread.quit();
+    Thread.wait();
+}
+
+void TCompactor::onStarted()
+{
+    //соединение создается в потоке очистки и используется только в нем
+    SyncDB = new TSyncDB(QSqlDatabase::cloneDatabase(SourceConnectionName, SourceConnectionName + "Compact"), false, false);
+    if (!SyncDB->Open()) {
+        emit ErrorOccurred(SyncDB->ErrorString());
+    }
+
+    PassTimer = new QTimer(this);
+    PassTimer->setInterval(Interval);
+    QObject::connect(PassTimer, SIGNAL(timeout()), this, SLOT(onPass()));
+    PassTimer->start();
+    SliceTimer = new QTimer(this);
+    SliceTimer->setSingleShot(true);
+    QObject::connect(SliceTimer, SIGNAL(timeout()), this, SLOT(onSlice()));
+
+    //первый проход - вскоре после запуска, когда схлынет загрузка накопившихся файлов
+    QTimer::singleShot(qMin(Interval, 60000), this, SLOT(onPass()));
+}
+
+void TCompactor::onPass()
+{
+    if (Phase != IDLE) return; //предыдущий проход еще не закончен
+    if (!SyncDB->Connection().isOpen() && !SyncDB->Open()) {
+        emit ErrorOccurred(SyncDB->ErrorString());
+        return;
+    }
+    if (!IndexChecked) {
+        //без индекса каждый шаг просматривает всю таблицу - такая очистка мешала бы обмену больше, чем помогала
+        const TSyncDB::TIndexState State = SyncDB->FileIndex();
+        if (State == TSyncDB::INDEX_FAILED) {
+            //индекс попробуем создать еще раз при следующем проходе
+            emit ErrorOccurred("Compaction of SYNCFILE skipped. " + SyncDB->ErrorString());
+            return;
+        }
+        //индекс в БД неизвестного типа не проверить - за ним следит администратор БД
+        if (State == TSyncDB::INDEX_UNKNOWN) qDebug() << SyncDB->ErrorString();
+        IndexChecked = true;
+    }
+    Phase = REMOVE;
+    //прерванный проход продолжаем, новый начинаем с границы прошлого или, когда пора, с начала таблицы
+    if (Cursor == 0) Cursor = ((Passes + 1) % FullPassEvery == 0) ? 0 : LowWaterMark;
+    PassAckedID = AckedID.loadRelaxed();
+    Before = QDateTime::currentDateTime().addDays(-RetentionDays);
+    Deleted = 0;
+    SliceTimer->start(0);
+}
+
+void TCompactor::onSlice()
+{
+    if (Phase == REMOVE) {
+        if (Cursor >= PassAckedID) {
+            //удаление закончено - следующий проход начнется отсюда
+            LowWaterMark = qMax(LowWaterMark, PassAckedID);
+            Cursor = 0;
+            ++Passes;
+            emit Progress(LowWaterMark, Cursor, Passes);
+            if (Deleted == 0) {
+                FinishPass();
+                return;
+            }
+            Phase = RECLAIM;
+        }
+        else {
+            const quint64 ToID = qMin(Cursor + SliceSize, PassAckedID);
+            qint64 Count = 0;
+            bool Ok = SyncDB->Transaction() && SyncDB->Compact(Cursor, ToID, Before, Count);
+            if (Ok) Ok = SyncDB->Commit();
+            else SyncDB->Rollback();
+            if (!Ok) {
+                //следующий проход продолжится с этого же места
+                emit ErrorOccurred("Compaction of SYNCFILE interrupted. " + SyncDB->ErrorString());
+                Phase = IDLE;
+                return;
+            }
+            Cursor = ToID;
+            Deleted += Count;
+            if ((Metrics != nullptr) && (Count > 0)) Metrics->Add(TMetrics::COMPACTED_FILES, Count);
+            emit Progress(LowWaterMark, Cursor, Passes);
+        }
+        SliceTimer->start(SlicePause);
+        return;
+    }
+
+    if (Phase == RECLAIM) {
+        bool Done = true;
+        if (!SyncDB->ReclaimSpace(ReclaimPages, Done)) {
+            //удаленные записи уже зафиксированы, неосвобожденные страницы будут использованы под новые
+            qDebug() << SyncDB->ErrorString();
+        }
+        if (Done) FinishPass();
+        else SliceTimer->start(SlicePause);
+    }
+}
+
+void TCompactor::FinishPass()
+{
+    Phase = IDLE;
+    emit Compacted(Deleted);
+}
+
+void TCompactor::onStop()
+{
+    if (PassTimer != nullptr) PassTimer->stop();
+    if (SliceTimer != nullptr) SliceTimer->stop();
+    Phase = IDLE;
+
+    const QString ConnectionName = SyncDB->Connection().connectionName();
+    delete SyncDB;
+    SyncDB = nullptr;
+    QSqlDatabase::removeDatabase(ConnectionName);
+}
@@ -0,0 +1,81 @@
+/* Очистка SYNCFILE от устаревших версий файлов
+ * Работает в отдельном потоке через собственное соединение с БД. Раз в Interval мс проходит по подтвержденным
+ * сервером записям (ID <= AckedID) диапазонами по SliceSize ID, каждый диапазон - отдельная короткая транзакция,
+ * между диапазонами - пауза SlicePause мс, чтобы не мешать загрузке новых файлов и обмену с сервером.
+ * Удаляются версии, измененные раньше чем RetentionDays дней назад, если у файла есть более новая версия
+ * (срок считается от времени изменения файла CHANGE_DATE_TIME, а не от подтверждения сервером):
+ * последняя версия каждого файла остается, по ней определяется, изменился ли файл. После прохода
+ * освободившееся место во встроенной БД возвращается системе такими же частями
+ * Проход начинается с LowWaterMark - границы предыдущего завершенного прохода. Раз в FullPassEvery проходов
+ * таблица просматривается с начала: за это время старые версии могли выйти за срок хранения или получить более новую версию.
+ * Состояние прохода сообщается через Progress и восстанавливается SetState, поэтому прерванный проход
+ * продолжается после перезапуска с того же места. Без индекса по (CATEGORY, FILE_NAME) очистка не выполняется,
+ * пока индекс не удастся создать. В БД, индексы которой проверить нельзя, очистка выполняется без проверки
+*/
+#ifndef TCOMPACTOR_H
+#define TCOMPACTOR_H
+
+#include <QObject>
+#include <QThread>
+#include <QTimer>
+#include <QDateTime>
+#include <QAtomicInteger>
+#include "tsyncdb.h"
+#include "tmetrics.h"
+
+class TCompactor : public QObject
+{
+    Q_OBJECT
+private:
+    typedef enum {IDLE, REMOVE, RECLAIM} TPhase;
+
+    static const int ReclaimPages = 256; //страниц, освобождаемых за один шаг
+
+    QThread Thread;              //поток очистки
+    const QString SourceConnectionName;
+    const int Interval;
+    const int RetentionDays;
+    const quint64 SliceSize;
+    const int SlicePause;
+    const int FullPassEvery;
+    TSyncDB *SyncDB = nullptr;   //собственное соединение потока очистки
+    QTimer *PassTimer = nullptr;  //запуск очередного прохода
+    QTimer *SliceTimer = nullptr; //очередной шаг прохода
+    QAtomicInteger<quint64> AckedID = 0; //записи до этого ID подтверждены сервером
+    TMetrics *Metrics = nullptr;
+
+    TPhase Phase = IDLE;
+    bool IndexChecked = false; //индекс, нужный для очистки, есть в БД или его нельзя проверить
+    quint64 LowWaterMark = 0; //записи до этого ID обработаны последним завершенным проходом
+    int Passes = 0;       //завершенные проходы. По ним определяется, когда нужен полный проход
+    quint64 Cursor = 0;   //записи до этого ID в текущем проходе уже обработаны
+    quint64 PassAckedID = 0; //граница текущего прохода
+    QDateTime Before;     //удаляются версии, измененные раньше (по CHANGE_DATE_TIME)
+    qint64 Deleted = 0;   //удалено в текущем проходе
+
+    void FinishPass();
+
+public:
+    explicit TCompactor(const QString &SourceConnectionName, int Interval, int RetentionDays, int SliceSize, int SlicePause, int FullPassEvery);
+    ~TCompactor();
+
+    void SetMetrics(TMetrics *Metrics) { this->Metrics = Metrics; } //только до Start
+    void SetAckedID(quint64 ID) { AckedID.storeRelaxed(ID); } //может вызываться из любого потока
+    //состояние с прошлого запуска. Cursor > 0 - прерванный проход, который продолжится с этого ID. Только до Start
+    void SetState(quint64 LowWaterMark, quint64 Cursor, int Passes) { this->LowWaterMark = LowWaterMark; this->Cursor = Cursor; this->Passes = Passes; }
+    void Start();
+    void Stop(); //прерывает проход и останавливает поток
+
+signals:
+    void Compacted(qint64 Deleted); //проход завершен
+    void Progress(quint64 LowWaterMark, quint64 Cursor, int Passes); //состояние для SetState при следующем запуске
+    void ErrorOccurred(const QString &Msg); //проход прерван, следующий будет выполнен по расписанию
+
+private slots:
+    void onStarted();
+    void onPass();
+    void onSlice();
+    void onStop();
+};
+
+#endif // TCOMPACTOR_H
@@ -0,0 +1,188 @@
+#include <QDebug>
+#include <cstring>
+#include <zlib.h>
+#ifdef SYNC_ZSTD
+#include <zstd.h>
+#endif
+#include "tcompressdevice.h"
+
+static const qint64 ChunkSize = 65536; //размер куска исходных данных сжимаемого за один раз
+
+TCompressDevice::TCompressDevice(QIODevice *Source, TMethod Method, int Level, QObject *parent)
+    : QIODevice(parent)
+    , Source(Source)
+    , Method(Method)
+    , Level(Level)
+{
+    Source->setParent(this); //исходное устройство живет пока идет сжатие
+}
+
+TCompressDevice::~TCompressDevice()
+{
+    close();
+}
+
+TCompressDevice::TMethod TCompressDevice::MethodFromString(const QString &Name)
+{
+    const QString tmp = Name.trimmed().toLower();
+    if (tmp == "gzip") return GZIP;
+    if (tmp == "deflate") return DEFLATE;
+#ifdef SYNC_ZSTD
+    if (tmp == "zstd") return ZSTD;
+#endif
+    return NONE;
+}
+
+QString TCompressDevice::ContentEncoding(TMethod Method)
+{
+    switch (Method) {
+    case GZIP: return "gzip";
+    case DEFLATE: return "deflate";
+    case ZSTD: return "zstd";
+    case NONE: return "identity";
+    }
+    return "identity";
+}
+
+bool TCompressDevice::open(OpenMode mode)
+{
+    if ((mode & QIODevice::WriteOnly) || (Method == NONE)) return false;
+    if (!Source->isOpen() && !Source->open(QIODevice::ReadOnly)) {
+        setErrorString("Cannot open source device. Error: " + Source->errorString());
+        return false;
+    }
+
+    if ((Method == GZIP) || (Method == DEFLATE)) {
+        z_stream *ZStream = new z_stream;
+        std::memset(ZStream, 0, sizeof(z_stream));
+        //15 - размер окна по умолчанию, +16 - формат gzip вместо zlib
+        if (deflateInit2(ZStream, Level, Z_DEFLATED, Method == GZIP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            delete ZStream;
+            setErrorString("Cannot initialize zlib compressor");
+            return false;
+        }
+        Stream = ZStream;
+    }
+#ifdef SYNC_ZSTD
+    else if (Method == ZSTD) {
+        ZSTD_CCtx *Ctx = ZSTD_createCCtx();
+        ZSTD_CCtx_setParameter(Ctx, ZSTD_c_compressionLevel, Level);
+        Stream = Ctx;
+    }
+#endif
+
+    OutBuffer.clear();
+    OutPos = 0;
+    Finished = false;
+    Failed = false;
+    if (!QIODevice::open(mode | QIODevice::Unbuffered)) return false;
+    //первый кусок сжимаем сразу, чтобы bytesAvailable сообщал о реальных данных
+    Fill();
+    return true;
+}
+
+void TCompressDevice::close()
+{
+    if (Stream != nullptr) {
+        if ((Method == GZIP) || (Method == DEFLATE)) {
+            deflateEnd(static_cast<z_stream *>(Stream));
+            delete static_cast<z_stream *>(Stream);
+        }
+#ifdef SYNC_ZSTD
+        else if (Method == ZSTD) {
+            ZSTD_freeCCtx(static_cast<ZSTD_CCtx *>(Stream));
+        }
+#endif
+        Stream = nullptr;
+    }
+    if (isOpen()) QIODevice::close();
+}
+
+qint64 TCompressDevice::bytesAvailable() const
+{
+    //только уже сжатые данные. Следующий кусок сжимается после их чтения
+    return (OutBuffer.size() - OutPos) + QIODevice::bytesAvailable();
+}
+
+bool TCompressDevice::atEnd() const
+{
+    return (Finished || Failed) && (OutPos >= OutBuffer.size()) && QIODevice::atEnd();
+}
+
+bool TCompressDevice::Compress()
+{
+    OutBuffer.clear();
+    OutPos = 0;
+
+    const QByteArray In = Source->read(ChunkSize);
+    if (In.isEmpty() && !Source->atEnd()) {
+        setErrorString("Cannot read source device. Error: " + Source->errorString());
+        return false;
+    }
+    const bool Last = Source->atEnd();
+
+    if ((Method == GZIP) || (Method == DEFLATE)) {
+        z_stream *ZStream = static_cast<z_stream *>(Stream);
+        ZStream->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(In.constData()));
+        ZStream->avail_in = static_cast<uInt>(In.size());
+        char Out[ChunkSize];
+        int Result = Z_OK;
+        do {
+            ZStream->next_out = reinterpret_cast<Bytef *>(Out);
+            ZStream->avail_out = ChunkSize;
+            Result = deflate(ZStream, Last ? Z_FINISH : Z_NO_FLUSH);
+            if (Result == Z_STREAM_ERROR) {
+                setErrorString("zlib compression error");
+                return false;
+            }
+            OutBuffer.append(Out, ChunkSize - ZStream->avail_out);
+        } while (ZStream->avail_out == 0);
+        Finished = (Result == Z_STREAM_END);
+    }
+#ifdef SYNC_ZSTD
+    else if (Method == ZSTD) {
+        ZSTD_CCtx *Ctx = static_cast<ZSTD_CCtx *>(Stream);
+        ZSTD_inBuffer Input = {In.constData(), static_cast<size_t>(In.size()), 0};
+        char Out[ChunkSize];
+        size_t Remaining = 0;
+        do {
+            ZSTD_outBuffer Output = {Out, ChunkSize, 0};
+            Remaining = ZSTD_compressStream2(Ctx, &Output, &Input, Last ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(Remaining)) {
+                setErrorString(QString("zstd compression error: ") + ZSTD_getErrorName(Remaining));
+                return false;
+            }
+            OutBuffer.append(Out, Output.pos);
+        } while (Last ? (Remaining != 0) : (Input.pos < Input.size));
+        Finished = Last;
+    }
+#endif
+    return true;
+}
+
+void TCompressDevice::Fill()
+{
+    //компрессор может долго копить данные без вывода
+    while ((OutPos >= OutBuffer.size()) && !Finished && !Failed) {
+        if (!Compress()) Failed = true;
+    }
+}
+
+qint64 TCompressDevice::readData(char *data, qint64 maxSize)
+{
+    Fill();
+    if (Failed && (OutPos >= OutBuffer.size())) return -1;
+    const qint64 Count = qMin(maxSize, OutBuffer.size() - OutPos);
+    std::memcpy(data, OutBuffer.constData() + OutPos, Count);
+    OutPos += Count;
+    //готовим следующий кусок, чтобы bytesAvailable не обнулялся посреди потока
+    Fill();
+    return Count;
+}
+
+qint64 TCompressDevice::writeData(const char *data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+    return -1;
+}
@@ -0,0 +1,50 @@
+/* Сжимает данные другого устройства по мере их чтения
+ * Используется для сжатия тела HTTP запроса (Content-Encoding) без загрузки его в память целиком
+ * Поддерживаются gzip и deflate (zlib), zstd - если программа собрана с CONFIG+=zstd
+*/
+#ifndef TCOMPRESSDEVICE_H
+#define TCOMPRESSDEVICE_H
+
+#include <QObject>
+#include <QIODevice>
+#include <QByteArray>
+#include <QString>
+
+class TCompressDevice : public QIODevice
+{
+    Q_OBJECT
+public:
+    typedef enum {NONE, GZIP, DEFLATE, ZSTD} TMethod; //методы сжатия
+
+private:
+    QIODevice *Source; //устройство с исходными данными
+    const TMethod Method;
+    const int Level;
+    void *Stream = nullptr;  //состояние компрессора (z_stream или ZSTD_CCtx)
+    QByteArray OutBuffer;    //сжатые данные ожидающие чтения
+    qint64 OutPos = 0;
+    bool Finished = false;   //все данные сжаты
+    bool Failed = false;     //ошибка чтения или сжатия
+
+    bool Compress(); //сжимает очередной кусок исходных данных в OutBuffer
+    void Fill();     //сжимает, пока в OutBuffer не появятся данные или они не кончатся
+
+public:
+    explicit TCompressDevice(QIODevice *Source, TMethod Method, int Level, QObject *parent = nullptr);
+    ~TCompressDevice();
+
+    static TMethod MethodFromString(const QString &Name); //метод по названию из файла конфигурации
+    static QString ContentEncoding(TMethod Method);       //значение заголовка Content-Encoding
+
+    bool open(OpenMode mode) override;
+    void close() override;
+    bool isSequential() const override { return true; }
+    qint64 bytesAvailable() const override;
+    bool atEnd() const override;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 maxSize) override;
+};
+
+#endif // TCOMPRESSDEVICE_H
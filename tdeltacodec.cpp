@@ -0,0 +1,208 @@
+#include <QDataStream>
+#include <QHash>
+#include <QCryptographicHash>
+#include <cstring>
+#include "tdeltacodec.h"
+
+namespace {
+
+//слабая контрольная сумма блока (как в rsync): A - сумма байт, B - сумма с весами по позиции
+class TRollingSum
+{
+private:
+    quint32 A = 0;
+    quint32 B = 0;
+    quint32 Size;
+
+public:
+    TRollingSum(const char *Data, int Size)
+        : Size(Size)
+    {
+        for (int i = 0; i < Size; ++i) {
+            A += static_cast<quint8>(Data[i]);
+            B += (Size - i) * static_cast<quint8>(Data[i]);
+        }
+    }
+    //сдвигает окно на один байт: Out выходит из блока, In - входит
+    void Roll(char Out, char In)
+    {
+        A += static_cast<quint8>(In) - static_cast<quint8>(Out);
+        B += A - Size * static_cast<quint8>(Out);
+    }
+    quint32 Value() const { return (A & 0xFFFF) | (B << 16); }
+};
+
+//записывает команды разности, объединяя соседние копирования
+class TDeltaWriter
+{
+private:
+    QDataStream &Stream;
+    qint64 CopyOffset = 0;
+    qint64 CopyLength = 0; //копирование, которое еще можно продолжить
+
+    void FlushCopy()
+    {
+        if (CopyLength == 0) return;
+        Stream << quint8(TDeltaCodec::OP_COPY) << quint64(CopyOffset) << quint64(CopyLength);
+        CopyLength = 0;
+    }
+
+public:
+    explicit TDeltaWriter(QDataStream &Stream) : Stream(Stream) {}
+
+    void Copy(qint64 Offset, qint64 Length)
+    {
+        if ((CopyLength > 0) && (CopyOffset + CopyLength == Offset)) {
+            CopyLength += Length;
+            return;
+        }
+        FlushCopy();
+        CopyOffset = Offset;
+        CopyLength = Length;
+    }
+    void Data(const char *Data, qint64 Length)
+    {
+        if (Length == 0) return;
+        FlushCopy();
+        Stream << quint8(TDeltaCodec::OP_DATA) << quint64(Length);
+        Stream.writeRawData(Data, Length);
+    }
+    void Finish() { FlushCopy(); }
+};
+
+QByteArray ContentHash(const QByteArray &Data)
+{
+    return QCryptographicHash::hash(Data, QCryptographicHash::Blake2b_256);
+}
+
+} //namespace
+
+QByteArray TDeltaCodec::Make(const QByteArray &Base, const QByteArray &Data, int BlockSize)
+{
+    if (BlockSize <= 0) BlockSize = DefaultBlockSize;
+
+    QByteArray Delta;
+    QDataStream Stream(&Delta, QIODevice::WriteOnly);
+    Stream << Magic << Version << quint64(Base.size()) << quint64(Data.size());
+    const QByteArray BaseHash = ContentHash(Base);
+    const QByteArray DataHash = ContentHash(Data);
+    Stream.writeRawData(BaseHash.constData(), BaseHash.size());
+    Stream.writeRawData(DataHash.constData(), DataHash.size());
+
+    TDeltaWriter Writer(Stream);
+    //файл только дописывался - копируем предыдущую версию целиком и добавляем хвост
+    if (!Base.isEmpty() && Data.startsWith(Base)) {
+        Writer.Copy(0, Base.size());
+        Writer.Data(Data.constData() + Base.size(), Data.size() - Base.size());
+        Writer.Finish();
+        return Stream.status() == QDataStream::Ok ? Delta : QByteArray();
+    }
+
+    //блоки предыдущей версии по слабой контрольной сумме
+    QMultiHash<quint32, qint64> Blocks;
+    if ((Base.size() >= BlockSize) && (Data.size() >= BlockSize)) {
+        Blocks.reserve(Base.size() / BlockSize);
+        for (qint64 Offset = 0; Offset + BlockSize <= Base.size(); Offset += BlockSize) {
+            Blocks.insert(TRollingSum(Base.constData() + Offset, BlockSize).Value(), Offset);
+        }
+    }
+
+    const char *Src = Data.constData();
+    qint64 Pos = 0;
+    qint64 LiteralStart = 0; //начало еще не записанных новых данных
+    if (!Blocks.isEmpty()) {
+        TRollingSum Sum(Src, BlockSize);
+        while (Pos + BlockSize <= Data.size()) {
+            qint64 MatchOffset = -1;
+            for (auto it = Blocks.constFind(Sum.Value()); (it != Blocks.constEnd()) && (it.key() == Sum.Value()); ++it) {
+                if (std::memcmp(Base.constData() + it.value(), Src + Pos, BlockSize) == 0) {
+                    MatchOffset = it.value();
+                    break;
+                }
+            }
+            if (MatchOffset < 0) {
+                if (Pos + BlockSize < Data.size()) Sum.Roll(Src[Pos], Src[Pos + BlockSize]);
+                ++Pos;
+                continue;
+            }
+
+            //совпадение продолжаем за пределы блока, пока байты совпадают
+            qint64 Length = BlockSize;
+            while ((Pos + Length < Data.size()) && (MatchOffset + Length < Base.size()) && (Src[Pos + Length] == Base[MatchOffset + Length])) {
+                ++Length;
+            }
+            Writer.Data(Src + LiteralStart, Pos - LiteralStart);
+            Writer.Copy(MatchOffset, Length);
+            Pos += Length;
+            LiteralStart = Pos;
+            if (Pos + BlockSize <= Data.size()) Sum = TRollingSum(Src + Pos, BlockSize);
+        }
+    }
+    Writer.Data(Src + LiteralStart, Data.size() - LiteralStart);
+    Writer.Finish();
+
+    return Stream.status() == QDataStream::Ok ? Delta : QByteArray();
+}
+
+bool TDeltaCodec::Apply(const QByteArray &Base, const QByteArray &Delta, QByteArray &Data, QString *ErrorString)
+{
+    auto Error = [ErrorString](const QString &Msg) {
+        if (ErrorString != nullptr) *ErrorString = Msg;
+        return false;
+    };
+
+    QDataStream Stream(Delta);
+    quint32 DeltaMagic = 0;
+    quint8 DeltaVersion = 0;
+    quint64 BaseSize = 0;
+    quint64 DataSize = 0;
+    Stream >> DeltaMagic >> DeltaVersion >> BaseSize >> DataSize;
+    if ((Stream.status() != QDataStream::Ok) || (DeltaMagic != Magic) || (DeltaVersion != Version)) {
+        return Error("Invalid delta header");
+    }
+    QByteArray BaseHash(32, '\0');
+    QByteArray DataHash(32, '\0');
+    if ((Stream.readRawData(BaseHash.data(), BaseHash.size()) != BaseHash.size()) ||
+        (Stream.readRawData(DataHash.data(), DataHash.size()) != DataHash.size())) {
+        return Error("Invalid delta header");
+    }
+    if ((quint64(Base.size()) != BaseSize) || (ContentHash(Base) != BaseHash)) {
+        return Error("Delta was made from another version of the file");
+    }
+
+    QByteArray Result;
+    Result.reserve(DataSize);
+    while (!Stream.atEnd()) {
+        quint8 Operation = 0;
+        quint64 Value = 0;
+        Stream >> Operation >> Value;
+        if (Operation == OP_COPY) {
+            quint64 Length = 0;
+            Stream >> Length;
+            if ((Stream.status() != QDataStream::Ok) || (Value > BaseSize) || (Length > BaseSize - Value)) {
+                return Error("Invalid delta copy command");
+            }
+            Result.append(Base.constData() + Value, Length);
+        }
+        else if (Operation == OP_DATA) {
+            if ((Stream.status() != QDataStream::Ok) || (Value > DataSize - qMin<quint64>(DataSize, Result.size()))) {
+                return Error("Invalid delta data command");
+            }
+            const qsizetype Pos = Result.size();
+            Result.resize(Pos + Value);
+            if (Stream.readRawData(Result.data() + Pos, Value) != qint64(Value)) {
+                return Error("Truncated delta data");
+            }
+        }
+        else {
+            return Error("Unknown delta command");
+        }
+        if (quint64(Result.size()) > DataSize) return Error("Delta result is too large");
+    }
+    if ((quint64(Result.size()) != DataSize) || (ContentHash(Result) != DataHash)) {
+        return Error("Delta result does not match the file");
+    }
+
+    Data = Result;
+    return true;
+}
@@ -0,0 +1,33 @@
+/* Разностное кодирование новой версии файла относительно предыдущей
+ * Разность - последовательность команд: скопировать кусок предыдущей версии или вставить новые данные.
+ * Если новая версия начинается с предыдущей (файл только дописывается), разность - одно копирование и новый хвост.
+ * Иначе совпадающие блоки BlockSize байт ищутся по скользящей контрольной сумме (как в rsync)
+ * и сверяются побайтно - предыдущая версия есть у клиента целиком, поэтому сильный хеш блоков не нужен.
+ * В заголовке разности - размеры и хеши обеих версий, по ним получатель проверяет, что собирает файл из нужной версии.
+ * Apply собирает файл обратно - так же, как это делает сервер
+*/
+#ifndef TDELTACODEC_H
+#define TDELTACODEC_H
+
+#include <QByteArray>
+#include <QString>
+
+class TDeltaCodec
+{
+public:
+    typedef enum {OP_COPY = 1, OP_DATA = 2} TOperation; //команды разности
+
+private:
+    static const quint32 Magic = 0x53444C54; //"SDLT"
+    static const quint8 Version = 1;
+
+public:
+    static const int DefaultBlockSize = 4096;
+
+    //разность Data относительно Base. Пустой результат - данные не удалось закодировать
+    static QByteArray Make(const QByteArray &Base, const QByteArray &Data, int BlockSize = DefaultBlockSize);
+    //собирает новую версию из Base и разности Delta. false - разность повреждена или построена не от Base
+    static bool Apply(const QByteArray &Base, const QByteArray &Delta, QByteArray &Data, QString *ErrorString = nullptr);
+};
+
+#endif // TDELTACODEC_H
@@ -0,0 +1,230 @@
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QDateTime>
+#include <algorithm>
+#ifdef Q_OS_UNIX
+#include <sys/stat.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+#include "tdirscanner.h"
+
+static const quint32 CacheMagic = 0x53594E43; //"SYNC"
+static const quint32 CacheVersion = 1;
+
+TDirScanner::TDirScanner(const QString &Path, QObject *parent)
+    : QObject(parent)
+    , Path(Path)
+{
+    RewatchTimer.setInterval(RewatchInterval);
+    QObject::connect(&RewatchTimer, SIGNAL(timeout()), this, SLOT(onRewatch()));
+}
+
+TDirScanner::~TDirScanner()
+{
+    StopWatching();
+}
+
+void TDirScanner::StopWatching()
+{
+    //StopWatching может вызываться из слота самого Notifier
+    if (Notifier != nullptr) Notifier->deleteLater();
+    Notifier = nullptr;
+#ifdef Q_OS_LINUX
+    if (Fd != -1) ::close(Fd);
+#endif
+    Fd = -1;
+}
+
+bool TDirScanner::StartWatching()
+{
+#ifdef Q_OS_LINUX
+    if (Fd != -1) return true;
+    Fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (Fd == -1) return false;
+    if (inotify_add_watch(Fd, QFile::encodeName(Path).constData(),
+                          IN_CREATE | IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM |
+                          IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF) == -1) {
+        ::close(Fd);
+        Fd = -1;
+        return false;
+    }
+    Notifier = new QSocketNotifier(Fd, QSocketNotifier::Read, this);
+    QObject::connect(Notifier, SIGNAL(activated(QSocketDescriptor, QSocketNotifier::Type)), this, SLOT(onActivated()));
+    return true;
+#else
+    return false;
+#endif
+}
+
+void TDirScanner::onActivated()
+{
+#ifdef Q_OS_LINUX
+    alignas(struct inotify_event) char Buffer[16384];
+    bool Lost = false;
+    for (;;) {
+        const ssize_t Size = ::read(Fd, Buffer, sizeof(Buffer));
+        if (Size <= 0) break;
+        for (ssize_t Pos = 0; Pos < Size; ) {
+            const struct inotify_event *Event = reinterpret_cast<const struct inotify_event *>(Buffer + Pos);
+            //очередь событий переполнилась или сама директория пропала - нужен полный обход
+            if (Event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) FullScan = true;
+            else if (Event->len > 0) Dirty.insert(QFile::decodeName(Event->name));
+            //наблюдение снято - новых событий по этому дескриптору не будет
+            if (Event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) Lost = true;
+            Pos += sizeof(struct inotify_event) + Event->len;
+        }
+    }
+    if (Lost) {
+        StopWatching();
+        if (!QFileInfo(Path).isDir() || !StartWatching()) {
+            qDebug() << "Watched directory is gone. Waiting for it to appear again:" << Path;
+            RewatchTimer.start();
+        }
+    }
+    emit Changed(Path);
+#endif
+}
+
+void TDirScanner::onRewatch()
+{
+    //директория на прежнем месте - снова ставим наблюдение и просим просканировать ее целиком
+    if (!QFileInfo(Path).isDir() || !StartWatching()) return;
+    RewatchTimer.stop();
+    FullScan = true;
+    emit Changed(Path);
+}
+
+TDirScanner::TStat TDirScanner::GetStat(const QFileInfo &FileInfo)
+{
+    TStat Stat;
+    Stat.Size = FileInfo.size();
+    Stat.MTime = FileInfo.fileTime(QFileDevice::FileModificationTime).toMSecsSinceEpoch();
+    Stat.CTime = FileInfo.fileTime(QFileDevice::FileMetadataChangeTime).toMSecsSinceEpoch();
+#ifdef Q_OS_UNIX
+    struct stat Buf;
+    if (::stat(QFile::encodeName(FileInfo.absoluteFilePath()).constData(), &Buf) == 0) Stat.Inode = Buf.st_ino;
+#endif
+    return Stat;
+}
+
+bool TDirScanner::Check(const QFileInfo &FileInfo)
+{
+    const TStat Stat = GetStat(FileInfo);
+    auto it = Cache.find(FileInfo.fileName());
+    if (it == Cache.end()) {
+        Cache.insert(FileInfo.fileName(), Stat);
+        Modified = true;
+        return true;
+    }
+    if ((it->Size == Stat.Size) && (it->MTime == Stat.MTime) && (it->CTime == Stat.CTime) && (it->Inode == Stat.Inode)) return false;
+    *it = Stat;
+    Modified = true;
+    return true;
+}
+
+QFileInfoList TDirScanner::Scan()
+{
+    QFileInfoList Result;
+
+    if (FullScan || (Notifier == nullptr)) {
+        //полный обход: атрибуты берутся из результатов чтения директории, удаленные файлы убираем из кеша
+        QSet<QString> Seen;
+        Seen.reserve(Cache.size());
+        QDirIterator it(Path, QDir::Files | QDir::Hidden | QDir::NoSymLinks);
+        while (it.hasNext()) {
+            it.next();
+            const QFileInfo FileInfo = it.fileInfo();
+            Seen.insert(FileInfo.fileName());
+            if (Check(FileInfo)) Result.push_back(FileInfo);
+        }
+        for (auto CacheIt = Cache.begin(); CacheIt != Cache.end(); ) {
+            if (!Seen.contains(CacheIt.key())) {
+                CacheIt = Cache.erase(CacheIt);
+                Modified = true;
+            }
+            else ++CacheIt;
+        }
+        FullScan = false;
+    }
+    else {
+        //проверяем только файлы, о которых сообщил inotify
+        const QDir Dir(Path);
+        for (const auto &Name : Dirty) {
+            const QFileInfo FileInfo(Dir, Name);
+            if (!FileInfo.exists() || !FileInfo.isFile() || FileInfo.isSymLink()) {
+                if (Cache.remove(Name)) Modified = true;
+                continue;
+            }
+            if (Check(FileInfo)) Result.push_back(FileInfo);
+        }
+    }
+    Dirty.clear();
+
+    //файлы отдаем в порядке изменения, как и при сортировке директории по времени
+    std::sort(Result.begin(), Result.end(), [](const QFileInfo &a, const QFileInfo &b) {
+        return a.fileTime(QFileDevice::FileModificationTime) < b.fileTime(QFileDevice::FileModificationTime);
+    });
+    return Result;
+}
+
+void TDirScanner::Forget(const QString &FileName)
+{
+    if (Cache.remove(QFileInfo(FileName).fileName())) Modified = true;
+}
+
+bool TDirScanner::Load(const QString &FileName)
+{
+    QFile File(FileName);
+    if (!File.open(QIODevice::ReadOnly)) return false;
+    QDataStream Stream(&File);
+    Stream.setVersion(QDataStream::Qt_6_0);
+    quint32 Magic = 0;
+    quint32 Version = 0;
+    QString CachePath;
+    quint32 Count = 0;
+    Stream >> Magic >> Version >> CachePath >> Count;
+    //кеш другой директории или другого формата не используем
+    if ((Stream.status() != QDataStream::Ok) || (Magic != CacheMagic) || (Version != CacheVersion) || (CachePath != Path)) return false;
+
+    QHash<QString, TStat> tmp;
+    tmp.reserve(Count);
+    for (quint32 i = 0; i < Count; ++i) {
+        QString Name;
+        TStat Stat;
+        Stream >> Name >> Stat.Size >> Stat.MTime >> Stat.CTime >> Stat.Inode;
+        tmp.insert(Name, Stat);
+    }
+    if (Stream.status() != QDataStream::Ok) return false;
+    Cache.swap(tmp);
+    return true;
+}
+
+bool TDirScanner::Save(const QString &FileName, const QSet<QString> &Pending)
+{
+    QSaveFile File(FileName);
+    if (!File.open(QIODevice::WriteOnly)) return false;
+    QDataStream Stream(&File);
+    Stream.setVersion(QDataStream::Qt_6_0);
+    const QDir Dir(Path);
+    QList<QString> Names;
+    Names.reserve(Cache.size());
+    for (auto it = Cache.constBegin(); it != Cache.constEnd(); ++it) {
+        if (Pending.isEmpty() || !Pending.contains(Dir.absoluteFilePath(it.key()))) Names.push_back(it.key());
+    }
+    Stream << CacheMagic << CacheVersion << Path << quint32(Names.size());
+    for (const auto &Name : Names) {
+        const TStat &Stat = Cache[Name];
+        Stream << Name << Stat.Size << Stat.MTime << Stat.CTime << Stat.Inode;
+    }
+    if ((Stream.status() != QDataStream::Ok) || !File.commit()) return false;
+    //незаписанные файлы остаются в кеше, поэтому он сохранен не полностью
+    Modified = (Names.size() != Cache.size());
+    return true;
+}
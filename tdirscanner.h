@@ -0,0 +1,68 @@
+/* Инкрементальное сканирование отслеживаемой директории
+ * Хранит кеш атрибутов файлов (размер, время изменения содержимого и метаданных, inode) и при сканировании
+ * возвращает только новые и изменившиеся файлы. В Linux директория отслеживается через inotify, который сообщает
+ * имена изменившихся файлов, поэтому сканирование проверяет только их. В остальных системах выполняется полный
+ * обход директории, но без повторного получения атрибутов и построения множества всех файлов.
+ * Если отслеживаемая директория удалена или перемещена, inotify снимает наблюдение - тогда сканер раз в
+ * RewatchInterval мс проверяет, не появилась ли директория снова, и возобновляет наблюдение.
+ * Кеш сохраняется между запусками программы
+*/
+#ifndef TDIRSCANNER_H
+#define TDIRSCANNER_H
+
+#include <QObject>
+#include <QString>
+#include <QHash>
+#include <QSet>
+#include <QFileInfo>
+#include <QSocketNotifier>
+#include <QTimer>
+
+class TDirScanner : public QObject
+{
+    Q_OBJECT
+private:
+    typedef struct {
+        qint64 Size = 0;
+        qint64 MTime = 0; //время изменения содержимого, мс от начала эпохи
+        qint64 CTime = 0; //время изменения метаданных, мс от начала эпохи
+        quint64 Inode = 0;
+    } TStat;
+
+    const QString Path;          //отслеживаемая директория
+    QHash<QString, TStat> Cache; //атрибуты файлов. Ключ - имя файла в директории
+    QSet<QString> Dirty;         //имена файлов, о изменении которых сообщил inotify
+    bool FullScan = true;        //требуется полный обход директории
+    int Fd = -1;                 //дескриптор inotify
+    QSocketNotifier *Notifier = nullptr;
+    QTimer RewatchTimer;         //ожидание появления директории после потери наблюдения
+    bool Modified = false;       //кеш изменился с последнего сохранения
+    static const int RewatchInterval = 1000;
+
+    void StopWatching();
+
+    static TStat GetStat(const QFileInfo &FileInfo);
+    bool Check(const QFileInfo &FileInfo); //обновляет кеш. true - файл новый или изменился
+
+public:
+    explicit TDirScanner(const QString &Path, QObject *parent = nullptr);
+    ~TDirScanner();
+
+    bool StartWatching(); //включает отслеживание через inotify. false - не поддерживается, нужен QFileSystemWatcher
+    QFileInfoList Scan(); //новые и изменившиеся с прошлого сканирования файлы, от старых к новым
+    void Forget(const QString &FileName); //удаляет файл из кеша, при следующем сканировании он будет считаться новым
+
+    bool Load(const QString &FileName);       //загружает кеш, сохраненный при прошлом запуске
+    //сохраняет кеш. Pending - полные пути файлов, которые еще не записаны в БД: после сбоя они должны считаться новыми
+    bool Save(const QString &FileName, const QSet<QString> &Pending = QSet<QString>());
+    bool IsModified() const { return Modified; }
+
+signals:
+    void Changed(const QString &Path); //в директории произошли изменения
+
+private slots:
+    void onActivated();
+    void onRewatch(); //директория появилась снова - возобновляем наблюдение
+};
+
+#endif // TDIRSCANNER_H
@@ -0,0 +1,170 @@
+#include <QDebug>
+#include <QFile>
+#include <QSaveFile>
+#include <QDataStream>
+#include <iterator>
+#include "tdownloadqueue.h"
+
+static const quint32 QueueMagic = 0x444C5155; //"DLQU"
+static const quint32 QueueVersion = 1;
+//первый байт упакованного HASH
+static const char HASH_LOWER_HEX = 0;
+static const char HASH_UPPER_HEX = 1;
+static const char HASH_TEXT = 2;
+
+TDownloadQueue::TDownloadQueue(qsizetype MaxSize)
+    : MaxSize(MaxSize)
+{
+}
+
+QByteArray TDownloadQueue::PackHash(const QString &HASH)
+{
+    bool Lower = true;
+    bool Upper = true;
+    for (const QChar &Char : HASH) {
+        const char c = Char.toLatin1();
+        const bool Digit = (c >= '0') && (c <= '9');
+        Lower = Lower && (Digit || ((c >= 'a') && (c <= 'f')));
+        Upper = Upper && (Digit || ((c >= 'A') && (c <= 'F')));
+    }
+    //шестнадцатеричную строку храним в двоичном виде, регистр запоминаем, чтобы вернуть HASH как есть
+    if ((Lower || Upper) && !HASH.isEmpty() && (HASH.size() % 2 == 0)) {
+        return QByteArray(1, Lower ? HASH_LOWER_HEX : HASH_UPPER_HEX) + QByteArray::fromHex(HASH.toLatin1());
+    }
+    return QByteArray(1, HASH_TEXT) + HASH.toUtf8();
+}
+
+QString TDownloadQueue::UnpackHash(const QByteArray &Packed)
+{
+    if (Packed.isEmpty()) return QString();
+    const QByteArray Data = Packed.mid(1);
+    if (Packed[0] == HASH_LOWER_HEX) return QString::fromLatin1(Data.toHex());
+    if (Packed[0] == HASH_UPPER_HEX) return QString::fromLatin1(Data.toHex().toUpper());
+    return QString::fromUtf8(Data);
+}
+
+bool TDownloadQueue::Add(quint64 ID, const QString &HASH)
+{
+    if (Items.contains(ID)) return false;
+    if ((MaxSize > 0) && (Items.size() >= MaxSize)) {
+        //очередь заполнена - оставляем файлы с меньшими ID, остальные сервер пришлет позже
+        if (ID > Items.lastKey()) return false;
+        auto Last = std::prev(Items.end());
+        HashIndex.remove(Last->Hash, Last.key());
+        Items.erase(Last);
+    }
+
+    TItem Item;
+    Item.Hash = PackHash(HASH);
+    Items.insert(ID, Item);
+    HashIndex.insert(Item.Hash, ID);
+    return true;
+}
+
+quint64 TDownloadQueue::Find(const QString &HASH) const
+{
+    //один и тот же файл может быть в очереди несколько раз - берем первый несохраненный
+    const QByteArray Packed = PackHash(HASH);
+    quint64 Result = 0;
+    for (auto it = HashIndex.constFind(Packed); (it != HashIndex.constEnd()) && (it.key() == Packed); ++it) {
+        if (((Result == 0) || (it.value() < Result)) && !Items.value(it.value()).Downloaded) Result = it.value();
+    }
+    return Result;
+}
+
+QString TDownloadQueue::Hash(quint64 ID) const
+{
+    auto it = Items.constFind(ID);
+    return it == Items.constEnd() ? QString() : UnpackHash(it->Hash);
+}
+
+void TDownloadQueue::SetDownloaded(quint64 ID)
+{
+    auto it = Items.find(ID);
+    if (it != Items.end()) it->Downloaded = true;
+}
+
+quint64 TDownloadQueue::TakeDownloaded()
+{
+    quint64 LastID = 0;
+    while (!Items.isEmpty() && Items.first().Downloaded) {
+        auto First = Items.begin();
+        LastID = First.key();
+        HashIndex.remove(First->Hash, LastID);
+        Items.erase(First);
+    }
+    return LastID;
+}
+
+QList<quint64> TDownloadQueue::Pending(qsizetype Count, const QSet<quint64> &Exclude) const
+{
+    QList<quint64> Result;
+    for (auto it = Items.constBegin(); (it != Items.constEnd()) && (Result.size() < Count); ++it) {
+        if (!it->Downloaded && !Exclude.contains(it.key())) Result.push_back(it.key());
+    }
+    return Result;
+}
+
+qsizetype TDownloadQueue::RemoveUnlisted(const QSet<quint64> &Listed, quint64 UpToID, const QSet<quint64> &Exclude)
+{
+    qsizetype Removed = 0;
+    for (auto it = Items.begin(); (it != Items.end()) && (it.key() <= UpToID); ) {
+        if (it->Downloaded || Listed.contains(it.key()) || Exclude.contains(it.key())) {
+            ++it;
+            continue;
+        }
+        HashIndex.remove(it->Hash, it.key());
+        it = Items.erase(it);
+        ++Removed;
+    }
+    return Removed;
+}
+
+bool TDownloadQueue::Load(const QString &FileName, const QString &Key, quint64 LastDownloadID)
+{
+    Items.clear();
+    HashIndex.clear();
+
+    QFile File(FileName);
+    if (!File.open(QIODevice::ReadOnly)) return false;
+    QDataStream Stream(&File);
+    Stream.setVersion(QDataStream::Qt_6_0);
+
+    quint32 Magic = 0;
+    quint32 Version = 0;
+    QString QueueKey;
+    quint32 Count = 0;
+    Stream >> Magic >> Version >> QueueKey >> Count;
+    if ((Stream.status() != QDataStream::Ok) || (Magic != QueueMagic) || (Version != QueueVersion) || (QueueKey != Key)) return false;
+
+    for (quint32 i = 0; i < Count; ++i) {
+        quint64 ID = 0;
+        TItem Item;
+        Stream >> ID >> Item.Hash >> Item.Downloaded;
+        if (Stream.status() != QDataStream::Ok) {
+            qDebug() << "Download queue is damaged. File:" << FileName;
+            Items.clear();
+            HashIndex.clear();
+            return false;
+        }
+        //очередь могла быть сохранена раньше, чем сдвинулся LastDownloadID
+        if (ID <= LastDownloadID) continue;
+        if ((MaxSize > 0) && (Items.size() >= MaxSize)) break;
+        Items.insert(ID, Item);
+        HashIndex.insert(Item.Hash, ID);
+    }
+    return true;
+}
+
+bool TDownloadQueue::Save(const QString &FileName, const QString &Key) const
+{
+    QSaveFile File(FileName);
+    if (!File.open(QIODevice::WriteOnly)) return false;
+    QDataStream Stream(&File);
+    Stream.setVersion(QDataStream::Qt_6_0);
+    Stream << QueueMagic << QueueVersion << Key << quint32(Items.size());
+    for (auto it = Items.constBegin(); it != Items.constEnd(); ++it) {
+        Stream << it.key() << it->Hash << it->Downloaded;
+    }
+    return (Stream.status() == QDataStream::Ok) && File.commit();
+}
@@ -0,0 +1,52 @@
+/* Очередь файлов для скачивания с сервера (UndownloadedFileList)
+ * Файлы упорядочены по ID, HASH ищется по индексу за O(1). HASH в шестнадцатеричном виде хранится
+ * в двоичном - вдвое компактнее. Размер очереди ограничен MaxSize: файлы с большими ID, не поместившиеся
+ * в очередь, сервер пришлет в списке снова. Очередь сохраняется на диск, чтобы после перезапуска
+ * не получать весь список заново. Файлы, которые сервер перестал отдавать в полном списке, удаляются RemoveUnlisted -
+ * иначе они навсегда задержат LastDownloadID
+*/
+#ifndef TDOWNLOADQUEUE_H
+#define TDOWNLOADQUEUE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QMap>
+#include <QHash>
+#include <QSet>
+#include <QList>
+
+class TDownloadQueue
+{
+private:
+    typedef struct {
+        QByteArray Hash;         //упакованный HASH
+        bool Downloaded = false; //файл сохранен, но перед ним в очереди есть несохраненные
+    } TItem;
+
+    QMap<quint64, TItem> Items;                //очередь. Ключ - ID файла на сервере
+    QMultiHash<QByteArray, quint64> HashIndex; //ID по упакованному HASH
+    const qsizetype MaxSize;
+
+    static QByteArray PackHash(const QString &HASH);
+    static QString UnpackHash(const QByteArray &Packed);
+
+public:
+    explicit TDownloadQueue(qsizetype MaxSize = 0); //0 - без ограничения
+
+    bool Add(quint64 ID, const QString &HASH); //false - файл уже в очереди или очередь заполнена
+    quint64 Find(const QString &HASH) const;   //первый несохраненный файл с таким HASH. 0 - нет
+    QString Hash(quint64 ID) const;            //пустая строка - файла нет в очереди
+    void SetDownloaded(quint64 ID);
+    quint64 TakeDownloaded(); //удаляет сохраненные файлы с начала очереди. Возвращает последний удаленный ID, 0 - ничего не удалено
+    QList<quint64> Pending(qsizetype Count, const QSet<quint64> &Exclude) const; //первые Count несохраненных файлов кроме Exclude
+    //удаляет несохраненные файлы с ID не больше UpToID, которых нет в Listed, кроме Exclude. Возвращает количество удаленных
+    qsizetype RemoveUnlisted(const QSet<quint64> &Listed, quint64 UpToID, const QSet<quint64> &Exclude);
+    qsizetype Size() const { return Items.size(); }
+    quint64 LastID() const { return Items.isEmpty() ? 0 : Items.lastKey(); } //максимальный ID в очереди
+
+    //очередь относится к серверу Key. Файлы с ID не больше LastDownloadID уже сохранены и не загружаются
+    bool Load(const QString &FileName, const QString &Key, quint64 LastDownloadID);
+    bool Save(const QString &FileName, const QString &Key) const;
+};
+
+#endif // TDOWNLOADQUEUE_H
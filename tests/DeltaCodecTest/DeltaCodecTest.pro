@@ -0,0 +1,15 @@
+QT -= gui
+QT += testlib
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+TARGET = DeltaCodecTest
+
+# Проверка разностного кодирования: Make и Apply должны возвращать исходную версию файла
+SOURCES += \
+        tdeltacodectest.cpp \
+        ../../tdeltacodec.cpp
+
+HEADERS += \
+    ../../tdeltacodec.h
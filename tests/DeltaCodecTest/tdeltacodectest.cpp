@@ -0,0 +1,83 @@
+#include <QtTest>
+#include <QRandomGenerator>
+#include "../../tdeltacodec.h"
+
+class TDeltaCodecTest : public QObject
+{
+    Q_OBJECT
+private:
+    static QByteArray Random(QRandomGenerator &Generator, qsizetype Size)
+    {
+        QByteArray Data(Size, Qt::Uninitialized);
+        for (auto &Byte : Data) Byte = static_cast<char>(Generator.bounded(256));
+        return Data;
+    }
+
+private slots:
+    void RoundTrip_data();
+    void RoundTrip();
+    void WrongBase();
+};
+
+void TDeltaCodecTest::RoundTrip_data()
+{
+    QTest::addColumn<QByteArray>("Base");
+    QTest::addColumn<QByteArray>("Data");
+    QTest::addColumn<int>("BlockSize");
+
+    //фиксированное начальное значение - тест повторяем
+    QRandomGenerator Generator(20240101);
+    const QByteArray Base = Random(Generator, 64 * 1024);
+    const QByteArray Block = Random(Generator, 1000);
+
+    QTest::newRow("empty") << QByteArray() << QByteArray() << 16;
+    QTest::newRow("empty base") << QByteArray() << Base << 16;
+    QTest::newRow("empty data") << Base << QByteArray() << 16;
+    QTest::newRow("same") << Base << Base << 4096;
+    QTest::newRow("append") << Base << Base + Block << 4096;
+    QTest::newRow("shifted") << Base << Block + Base << 4096;
+    QTest::newRow("shifted by one") << Base << "x" + Base << 4096;
+    QTest::newRow("inserted") << Base << Base.left(10000) + Block + Base.mid(10000) << 4096;
+    QTest::newRow("removed") << Base << Base.left(10000) + Base.mid(20000) << 4096;
+    QTest::newRow("truncated") << Base << Base.left(30000) << 4096;
+    QTest::newRow("small blocks") << Base << Block + Base.mid(333) + Block << 16;
+    QTest::newRow("random") << Base << Random(Generator, 70 * 1024) << 4096;
+    //случайные правки: куски прошлой версии вперемешку с новыми данными
+    QByteArray Edited;
+    for (int i = 0; i < 50; ++i) {
+        if (Generator.bounded(2) == 0) Edited += Base.mid(Generator.bounded(Base.size()), Generator.bounded(8192));
+        else Edited += Random(Generator, Generator.bounded(512));
+    }
+    QTest::newRow("random edits") << Base << Edited << 512;
+}
+
+void TDeltaCodecTest::RoundTrip()
+{
+    QFETCH(QByteArray, Base);
+    QFETCH(QByteArray, Data);
+    QFETCH(int, BlockSize);
+
+    const QByteArray Delta = TDeltaCodec::Make(Base, Data, BlockSize);
+    QVERIFY(!Delta.isEmpty());
+    QByteArray Result;
+    QString Error;
+    QVERIFY2(TDeltaCodec::Apply(Base, Delta, Result, &Error), qPrintable(Error));
+    QCOMPARE(Result, Data);
+}
+
+void TDeltaCodecTest::WrongBase()
+{
+    //разность, построенная от другой версии, не применяется
+    QRandomGenerator Generator(42);
+    const QByteArray Base = Random(Generator, 16 * 1024);
+    const QByteArray Delta = TDeltaCodec::Make(Base, Base + "tail");
+    QByteArray OtherBase = Base;
+    OtherBase[100] = static_cast<char>(OtherBase[100] ^ 1);
+    QByteArray Result;
+    QVERIFY(!TDeltaCodec::Apply(OtherBase, Delta, Result));
+    QVERIFY(!TDeltaCodec::Apply(Base, Delta.left(Delta.size() - 1), Result));
+}
+
+QTEST_APPLESS_MAIN(TDeltaCodecTest)
+
+#include "tdeltacodectest.moc"
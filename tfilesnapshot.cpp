@@ -0,0 +1,197 @@
+#include <QDebug>
+#include <QHash>
+#include <QSaveFile>
+#include <QFileInfo>
+#include "tfilesnapshot.h"
+
+static const quint32 SnapshotMagic = 0x534E4150; //"SNAP"
+static const quint32 SnapshotVersion = 3;
+static const quint8 RECORD_FILE = 1;
+static const quint8 RECORD_CHECKPOINT = 2;
+static const quint8 RECORD_REMOVE = 3;
+
+TFileSnapshot::TFileSnapshot(const QString &FileName, const QString &DBName, QObject *parent)
+    : QObject(parent)
+    , FileName(FileName)
+    , DBName(DBName)
+    , File(FileName)
+{
+}
+
+TFileSnapshot::~TFileSnapshot()
+{
+    Close();
+}
+
+static QString EntryKey(const QString &Category, const QString &FileName, qint64 ChangeTime)
+{
+    return Category + QChar(0) + FileName + QChar(0) + QString::number(ChangeTime);
+}
+
+bool TFileSnapshot::Load(QList<TEntry> &Entries, quint64 &HighWaterMark)
+{
+    Entries.clear();
+    HighWaterMark = 0;
+    ValidSize = 0;
+    Live = 0;
+    Garbage = 0;
+    Mark = 0;
+
+    QFile tmp(FileName);
+    if (!tmp.open(QIODevice::ReadOnly)) return false;
+    QDataStream In(&tmp);
+    In.setVersion(QDataStream::Qt_6_0);
+
+    quint32 Magic = 0;
+    quint32 Version = 0;
+    QString SnapshotDBName;
+    In >> Magic >> Version >> SnapshotDBName;
+    if ((In.status() != QDataStream::Ok) || (Magic != SnapshotMagic) || (Version != SnapshotVersion) || (SnapshotDBName != DBName)) return false;
+    ValidSize = tmp.pos();
+
+    //номер действующей записи по файлу. Отмененные записи помечаются пустым именем и отбрасываются в конце
+    QHash<QString, qsizetype> Index;
+    //читаем записи до конца файла или до первой недописанной записи
+    while (!In.atEnd()) {
+        quint8 Type = 0;
+        In >> Type;
+        if (Type == RECORD_FILE) {
+            TEntry Entry;
+            In >> Entry.Category >> Entry.FileName >> Entry.ChangeTime >> Entry.Size >> Entry.Hash;
+            if (In.status() != QDataStream::Ok) break;
+            //повторная запись о том же файле заменяет прежнюю
+            qsizetype &Pos = Index[EntryKey(Entry.Category, Entry.FileName, Entry.ChangeTime)];
+            if (Pos > 0) {
+                Entries[Pos - 1].FileName.clear();
+                ++Garbage;
+            }
+            Entries.push_back(Entry);
+            Pos = Entries.size();
+        }
+        else if (Type == RECORD_REMOVE) {
+            QString Category;
+            QString EntryFileName;
+            qint64 ChangeTime = 0;
+            In >> Category >> EntryFileName >> ChangeTime;
+            if (In.status() != QDataStream::Ok) break;
+            const qsizetype Pos = Index.take(EntryKey(Category, EntryFileName, ChangeTime));
+            if (Pos > 0) {
+                Entries[Pos - 1].FileName.clear();
+                ++Garbage;
+            }
+            ++Garbage;
+        }
+        else if (Type == RECORD_CHECKPOINT) {
+            quint64 tmpMark = 0;
+            In >> tmpMark;
+            if (In.status() != QDataStream::Ok) break;
+            HighWaterMark = tmpMark;
+            Mark = tmpMark;
+        }
+        else {
+            break;
+        }
+        ValidSize = tmp.pos();
+    }
+    if (ValidSize < tmp.size()) {
+        qDebug() << "Snapshot is damaged. Records after position" << ValidSize << "are ignored";
+    }
+    Entries.removeIf([](const TEntry &Entry) { return Entry.FileName.isEmpty(); });
+    Live = Entries.size();
+    return true;
+}
+
+bool TFileSnapshot::Open(bool Reset)
+{
+    Close();
+    if (Reset) {
+        if (!File.open(QIODevice::WriteOnly | QIODevice::Truncate)) return false;
+        Stream.setDevice(&File);
+        Stream.setVersion(QDataStream::Qt_6_0);
+        Stream << SnapshotMagic << SnapshotVersion << DBName;
+        Live = 0;
+        Garbage = 0;
+        Mark = 0;
+    }
+    else {
+        //отрезаем недописанную запись, чтобы новые записи читались правильно
+        if (!File.open(QIODevice::ReadWrite) || !File.resize(ValidSize) || !File.seek(ValidSize)) {
+            File.close();
+            return false;
+        }
+        Stream.setDevice(&File);
+        Stream.setVersion(QDataStream::Qt_6_0);
+    }
+    return Stream.status() == QDataStream::Ok;
+}
+
+void TFileSnapshot::Add(const TEntry &Entry)
+{
+    if (!File.isOpen()) return;
+    Stream << RECORD_FILE << Entry.Category << Entry.FileName << Entry.ChangeTime << Entry.Size << Entry.Hash;
+    ++Live;
+}
+
+void TFileSnapshot::Remove(const QString &Category, const QString &FileName, qint64 ChangeTime)
+{
+    if (!File.isOpen()) return;
+    Stream << RECORD_REMOVE << Category << FileName << ChangeTime;
+    //надгробие и отмененная им запись
+    if (Live > 0) --Live;
+    Garbage += 2;
+}
+
+void TFileSnapshot::Checkpoint(quint64 HighWaterMark)
+{
+    if (!File.isOpen()) return;
+    Stream << RECORD_CHECKPOINT << HighWaterMark;
+    Mark = HighWaterMark;
+    File.flush();
+    if ((Garbage >= MinGarbage) && (Garbage > Live) && !Rewrite(HighWaterMark)) {
+        qDebug() << "Cannot compact snapshot of processed files:" << FileName;
+    }
+}
+
+bool TFileSnapshot::Rewrite(quint64 HighWaterMark)
+{
+    //снимок перечитывается с диска - в памяти программы хранятся не все поля записей
+    Close();
+    QList<TEntry> Entries;
+    quint64 tmpMark = 0;
+    if (!Load(Entries, tmpMark)) {
+        //снимок не прочитан - заново начатый снимок с отметкой скрыл бы все прежние файлы. Удаляем его,
+        //чтобы при следующем запуске файлы были прочитаны из БД. До конца работы снимок не пополняется
+        QFile::remove(FileName);
+        Live = 0;
+        Garbage = 0;
+        Mark = 0;
+        return false;
+    }
+    QSaveFile NewFile(FileName);
+    bool Ok = NewFile.open(QIODevice::WriteOnly);
+    if (Ok) {
+        QDataStream Out(&NewFile);
+        Out.setVersion(QDataStream::Qt_6_0);
+        Out << SnapshotMagic << SnapshotVersion << DBName;
+        for (const auto &Entry : Entries) {
+            Out << RECORD_FILE << Entry.Category << Entry.FileName << Entry.ChangeTime << Entry.Size << Entry.Hash;
+        }
+        Out << RECORD_CHECKPOINT << HighWaterMark;
+        Ok = (Out.status() == QDataStream::Ok) && NewFile.commit();
+    }
+    if (Ok) {
+        ValidSize = QFileInfo(FileName).size();
+        Live = Entries.size();
+        Garbage = 0;
+        Mark = HighWaterMark;
+    }
+    //при ошибке записи продолжаем дописывать прежний снимок
+    return Open(false) && Ok;
+}
+
+void TFileSnapshot::Close()
+{
+    if (!File.isOpen()) return;
+    Stream.setDevice(nullptr);
+    File.close();
+}
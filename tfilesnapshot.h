@@ -0,0 +1,59 @@
+/* Снимок множества уже обработанных файлов (OldFiles) на диске
+ * Позволяет при запуске не читать из SYNCFILE всю историю файлов, а загрузить снимок и запросить из БД
+ * только записи с ID больше отметки снимка. Файл снимка пополняется по мере записи новых файлов в БД:
+ * записи о файлах и отметки (максимальный ID SYNCFILE, все файлы до которого уже есть в снимке).
+ * Файлы, которые больше не считаются обработанными (удалены в БД или вытеснены из OldFiles), отмечаются
+ * записями-надгробиями. Когда отмененных записей становится больше, чем действующих, снимок переписывается заново.
+ * Недописанная при аварийном завершении запись отбрасывается при загрузке
+*/
+#ifndef TFILESNAPSHOT_H
+#define TFILESNAPSHOT_H
+
+#include <QObject>
+#include <QString>
+#include <QList>
+#include <QFile>
+#include <QDataStream>
+
+class TFileSnapshot : public QObject
+{
+    Q_OBJECT
+public:
+    typedef struct {
+        QString Category;
+        QString FileName;     //полный путь к файлу
+        qint64 ChangeTime = 0; //время изменения, мс от начала эпохи
+        qint64 Size = -1;     //размер файла. -1 - неизвестен (файл загружен из БД)
+        QByteArray Hash;      //хеш содержимого. Пустой - неизвестен
+    } TEntry;
+
+private:
+    const QString FileName;
+    const QString DBName;  //снимок относится только к этой БД
+    QFile File;
+    QDataStream Stream;
+    qint64 ValidSize = 0;  //размер файла до первой поврежденной записи
+    qsizetype Live = 0;    //действующие записи о файлах
+    qsizetype Garbage = 0; //отмененные записи о файлах и надгробия
+    quint64 Mark = 0;      //последняя записанная отметка
+    static const qsizetype MinGarbage = 10000; //меньше этого снимок не переписывается
+
+    bool Rewrite(quint64 HighWaterMark); //переписывает снимок только с действующими записями
+
+public:
+    explicit TFileSnapshot(const QString &FileName, const QString &DBName, QObject *parent = nullptr);
+    ~TFileSnapshot();
+
+    //загружает снимок. HighWaterMark - ID, до которого включительно все файлы SYNCFILE есть в снимке
+    //записи, отмененные надгробиями, не возвращаются. false - снимка нет, он поврежден или сделан для другой БД
+    bool Load(QList<TEntry> &Entries, quint64 &HighWaterMark);
+    bool Open(bool Reset); //открывает снимок для дописывания. Reset - начать снимок заново
+    void Add(const TEntry &Entry);
+    void Remove(const QString &Category, const QString &FileName, qint64 ChangeTime); //записывает надгробие
+    //записывает отметку и сбрасывает данные на диск. Если отмененных записей много - переписывает снимок
+    void Checkpoint(quint64 HighWaterMark);
+    void Close();
+    quint64 HighWaterMark() const { return Mark; }
+};
+
+#endif // TFILESNAPSHOT_H
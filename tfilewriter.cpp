@@ -0,0 +1,189 @@
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QSet>
+#include "tfilewriter.h"
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <io.h>
+#endif
+#ifdef Q_OS_UNIX
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+TFileWriter::TFileWriter(TDurability Durability, int BatchSize, int BatchDelay)
+    : QObject(nullptr) //объект живет в потоке записи, поэтому родителя у него нет
+    , Durability(Durability)
+    , BatchSize(qMax(1, BatchSize))
+    , BatchDelay(qMax(1, BatchDelay))
+{
+    moveToThread(&Thread);
+    QObject::connect(&Thread, SIGNAL(started()), this, SLOT(onStarted()));
+}
+
+TFileWriter::~TFileWriter()
+{
+    Stop();
+}
+
+TFileWriter::TDurability TFileWriter::DurabilityFromString(const QString &Name)
+{
+    const QString Value = Name.trimmed().toLower();
+    if (Value == "none") return NONE;
+    if (Value == "file") return EACH_FILE;
+    return BATCH;
+}
+
+void TFileWriter::Start()
+{
+    if (!Thread.isRunning()) Thread.start();
+}
+
+void TFileWriter::Stop()
+{
+    if (!Thread.isRunning()) return;
+    //дожидаемся сохранения всех поставленных файлов
+    QMetaObject::invokeMethod(this, "onStop", Qt::BlockingQueuedConnection);
+    Thread.quit();
+    Thread.wait();
+}
+
+void TFileWriter::Add(quint64 ID, const QString &TmpFileName, const QString &FileName)
+{
+    QMutexLocker Locker(&Mutex);
+    Queue.enqueue({ID, TmpFileName, FileName});
+    //набралась пачка - сохраняем не дожидаясь таймера
+    if (Queue.size() == BatchSize) {
+        QMetaObject::invokeMethod(this, "onFlush", Qt::QueuedConnection);
+    }
+    //первый файл пачки - через BatchDelay пачка сохранится, даже если не наберется. Таймер запускается в потоке записи
+    else if (Queue.size() == 1) {
+        QMetaObject::invokeMethod(this, "onQueued", Qt::QueuedConnection);
+    }
+}
+
+void TFileWriter::onStarted()
+{
+    //таймер взводится только когда есть что сохранять, чтобы поток не просыпался впустую
+    BatchTimer = new QTimer(this);
+    BatchTimer->setInterval(BatchDelay);
+    BatchTimer->setSingleShot(true);
+    QObject::connect(BatchTimer, SIGNAL(timeout()), this, SLOT(onFlush()));
+}
+
+void TFileWriter::onQueued()
+{
+    if ((BatchTimer != nullptr) && !BatchTimer->isActive()) BatchTimer->start();
+}
+
+void TFileWriter::onFlush()
+{
+    //сохраняем пачками, пока в очереди остаются полные пачки. Остаток сохранится по таймеру
+    while (WriteBatch()) {
+        QMutexLocker Locker(&Mutex);
+        if (Queue.size() < BatchSize) break;
+    }
+    QMutexLocker Locker(&Mutex);
+    if (Queue.isEmpty()) BatchTimer->stop();
+    else if (!BatchTimer->isActive()) BatchTimer->start();
+}
+
+void TFileWriter::onStop()
+{
+    if (BatchTimer != nullptr) BatchTimer->stop();
+    while (WriteBatch()) {}
+}
+
+bool TFileWriter::WriteBatch()
+{
+    QList<TJob> Jobs;
+    {
+        QMutexLocker Locker(&Mutex);
+        while (!Queue.isEmpty() && (Jobs.size() < BatchSize)) Jobs.push_back(Queue.dequeue());
+    }
+    if (Jobs.isEmpty()) return false;
+
+    QElapsedTimer Timer;
+    Timer.start();
+    QList<QString> Errors(Jobs.size());
+    //сначала сбрасываем данные всех файлов пачки, чтобы после переименования на диске не оказался пустой файл
+    if (Durability == BATCH) {
+        for (qsizetype i = 0; i < Jobs.size(); ++i) {
+            if (!SyncFile(Jobs[i].TmpFileName)) Errors[i] = "Cannot flush file to disk";
+        }
+    }
+
+    QSet<QString> Dirs;
+    for (qsizetype i = 0; i < Jobs.size(); ++i) {
+        const TJob &Job = Jobs[i];
+        if (Errors[i].isEmpty() && (Durability == EACH_FILE) && !SyncFile(Job.TmpFileName)) Errors[i] = "Cannot flush file to disk";
+        const QString Path = QFileInfo(Job.FileName).absolutePath();
+        if (Errors[i].isEmpty() && !QDir().mkpath(Path)) Errors[i] = "Cannot create directory " + Path;
+        if (Errors[i].isEmpty() && !Replace(Job.TmpFileName, Job.FileName)) Errors[i] = "Cannot replace file";
+        if (!Errors[i].isEmpty()) {
+            QFile::remove(Job.TmpFileName);
+            continue;
+        }
+        if (Durability == EACH_FILE) {
+            if (!SyncDir(Path)) qDebug() << "Cannot flush directory to disk:" << Path;
+        }
+        else if (Durability == BATCH) {
+            Dirs.insert(Path);
+        }
+    }
+    //переименования пачки фиксируются одним сбросом каждой директории
+    for (const QString &Path : Dirs) {
+        if (!SyncDir(Path)) qDebug() << "Cannot flush directory to disk:" << Path;
+    }
+    if (Metrics != nullptr) Metrics->AddTime(TMetrics::SAVE_FILE, Timer.nsecsElapsed());
+
+    for (qsizetype i = 0; i < Jobs.size(); ++i) {
+        if (Errors[i].isEmpty()) emit FileSaved(Jobs[i].ID, Jobs[i].FileName);
+        else emit FileFailed(Jobs[i].ID, Jobs[i].FileName, Errors[i]);
+    }
+    emit BatchSaved();
+    return true;
+}
+
+bool TFileWriter::SyncFile(const QString &FileName)
+{
+    QFile File(FileName);
+    if (!File.open(QIODevice::ReadWrite)) return false;
+#ifdef Q_OS_WIN
+    return FlushFileBuffers(reinterpret_cast<HANDLE>(_get_osfhandle(File.handle()))) != 0;
+#else
+    return ::fsync(File.handle()) == 0;
+#endif
+}
+
+bool TFileWriter::SyncDir(const QString &Path)
+{
+#ifdef Q_OS_UNIX
+    const int Handle = ::open(QFile::encodeName(Path).constData(), O_RDONLY);
+    if (Handle < 0) return false;
+    const bool Result = ::fsync(Handle) == 0;
+    ::close(Handle);
+    return Result;
+#else
+    //в Windows переименование с MOVEFILE_WRITE_THROUGH завершается после записи на диск
+    Q_UNUSED(Path);
+    return true;
+#endif
+}
+
+bool TFileWriter::Replace(const QString &TmpFileName, const QString &FileName)
+{
+    //QFile::rename не заменяет существующий файл, а удаление перед переименованием оставляет окно без файла
+#ifdef Q_OS_WIN
+    return MoveFileExW(reinterpret_cast<LPCWSTR>(QDir::toNativeSeparators(TmpFileName).utf16()),
+                       reinterpret_cast<LPCWSTR>(QDir::toNativeSeparators(FileName).utf16()),
+                       MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return ::rename(QFile::encodeName(TmpFileName).constData(), QFile::encodeName(FileName).constData()) == 0;
+#endif
+}
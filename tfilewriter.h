@@ -0,0 +1,71 @@
+/* Сохранение полученных с сервера файлов в отдельном потоке
+ * Тело файла уже записано во временный файл рядом с целевым. Поток записи сбрасывает его на диск
+ * и атомарно заменяет им целевой файл, поэтому после сбоя на месте целевого файла остается
+ * либо старая, либо полностью записанная новая версия. Файлы обрабатываются пачками:
+ *  NONE      - файлы не сбрасываются на диск, только переименовываются
+ *  BATCH     - сбрасываются все файлы пачки, затем они переименовываются и один раз сбрасываются их директории
+ *  EACH_FILE - каждый файл сбрасывается и переименовывается отдельно вместе со своей директорией
+ * FileSaved генерируется только после сброса на диск, поэтому по нему можно сдвигать LastDownloadID
+*/
+#ifndef TFILEWRITER_H
+#define TFILEWRITER_H
+
+#include <QObject>
+#include <QThread>
+#include <QMutex>
+#include <QQueue>
+#include <QTimer>
+#include <QString>
+#include "tmetrics.h"
+
+class TFileWriter : public QObject
+{
+    Q_OBJECT
+public:
+    typedef enum {NONE, BATCH, EACH_FILE} TDurability; //когда данные сбрасываются на диск
+
+private:
+    typedef struct {
+        quint64 ID;          //ID файла на сервере
+        QString TmpFileName; //временный файл с телом
+        QString FileName;    //целевой файл
+    } TJob;
+
+    QThread Thread;              //поток записи
+    const TDurability Durability;
+    const int BatchSize;
+    const int BatchDelay;
+    QTimer *BatchTimer = nullptr;
+    QMutex Mutex;                //защищает Queue
+    QQueue<TJob> Queue;          //файлы ожидающие сохранения
+    TMetrics *Metrics = nullptr; //время сохранения пачек
+
+    static bool SyncFile(const QString &FileName); //сбрасывает данные файла на диск
+    static bool SyncDir(const QString &Path);      //сбрасывает на диск записи директории (переименования)
+    static bool Replace(const QString &TmpFileName, const QString &FileName); //атомарно заменяет FileName файлом TmpFileName
+    bool WriteBatch(); //сохраняет одну пачку. false - очередь пуста
+
+public:
+    explicit TFileWriter(TDurability Durability, int BatchSize, int BatchDelay);
+    ~TFileWriter();
+
+    static TDurability DurabilityFromString(const QString &Name); //уровень по названию из файла конфигурации
+
+    void SetMetrics(TMetrics *Metrics) { this->Metrics = Metrics; } //только до Start
+    void Start();
+    void Stop(); //сохраняет все поставленные файлы и останавливает поток
+    void Add(quint64 ID, const QString &TmpFileName, const QString &FileName); //ставит файл в очередь. Может вызываться из любого потока
+
+signals:
+    void FileSaved(quint64 ID, const QString &FileName); //файл сохранен и сброшен на диск
+    void FileFailed(quint64 ID, const QString &FileName, const QString &Msg); //файл сохранить не удалось, временный файл удален
+    void BatchSaved(); //обработана очередная пачка
+
+private slots:
+    void onStarted();
+    void onQueued(); //в пустую очередь поставлен файл - запускает таймер пачки
+    void onFlush();
+    void onStop();
+};
+
+#endif // TFILEWRITER_H
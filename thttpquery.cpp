@@ -1,4 +1,5 @@
 #include <QCoreApplication>
+#include <QTimer>
 #include "thttpquery.h"
 #include "tsync.h"
 
@@ -7,7 +8,6 @@ THTTPQuery::THTTPQuery(const QString &Url, QObject *parent)
     , manager(parent)
     , Url(Url)
 {
-    manager.setTransferTimeout(300000);
     QObject::connect(&manager, SIGNAL(finished(QNetworkReply *)), this, SLOT(onReplyFinished(QNetworkReply *))); //событие конца обмена данными
 }
 
@@ -16,7 +16,7 @@ THTTPQuery::~THTTPQuery()
 
 }
 
-bool THTTPQuery::Run(const QByteArray &data)
+quint64 THTTPQuery::Run(const QByteArray &data)
 {
   //  qDebug() << "Connect: " << Url;
   //  qDebug() << data.size();
@@ -25,37 +25,159 @@ bool THTTPQuery::Run(const QByteArray &data)
     Request.setHeader(QNetworkRequest::ContentTypeHeader, "application/xml");
     Request.setHeader(QNetworkRequest::UserAgentHeader, QCoreApplication::applicationName());
     Request.setHeader(QNetworkRequest::ContentLengthHeader, QString::number(data.size()));
-    Request.setTransferTimeout(300000);
+    //если заголовок Accept-Encoding не задан, QNetworkAccessManager сам запрашивает сжатие ответа и распаковывает его
+    if (!AcceptEncoding) Request.setRawHeader("Accept-Encoding", "identity");
+    Request.setTransferTimeout(TransferTimeout);
 
-    resp = manager.post(Request, data);
-    if (resp == nullptr) {
+    QNetworkReply *Reply = manager.post(Request, data);
+    if (Reply == nullptr) {
         emit SendLogMsg(TSync::CODE_ERROR, "Send HTTP request fail.");
-        emit ErrorOccurred();
-        return false;
+        return 0;
     }
-    QObject::connect(resp, SIGNAL(errorOccurred(QNetworkReply::NetworkError)), this, SLOT(onErrorOccurred(QNetworkReply::NetworkError))); //событие ошибки
-    return true; //true - если запрос отправлен
+    return AddReply(Reply); //ID - если запрос отправлен
+}
+
+quint64 THTTPQuery::Run(QIODevice *Body, const QString &ContentType, bool Compress, qint64 Size)
+{
+    QNetworkRequest Request(Url);
+    Request.setHeader(QNetworkRequest::ContentTypeHeader, ContentType);
+    Request.setHeader(QNetworkRequest::UserAgentHeader, QCoreApplication::applicationName());
+    //запрещаем буферизацию - тело читается по мере отправки. Если размер неизвестен, оно уходит частями (chunked transfer encoding)
+    Request.setAttribute(QNetworkRequest::DoNotBufferUploadDataAttribute, true);
+    if (!AcceptEncoding) Request.setRawHeader("Accept-Encoding", "identity");
+    Request.setTransferTimeout(TransferTimeout);
+
+    //тело сжимается на лету по мере отправки, если сервер сообщил, что принимает сжатые запросы
+    if (Compress && CompressionAllowed()) {
+        Body = new TCompressDevice(Body, Compression, CompressionLevel);
+        Request.setRawHeader("Content-Encoding", TCompressDevice::ContentEncoding(Compression).toLatin1());
+    }
+    else if (Size >= 0) {
+        Request.setHeader(QNetworkRequest::ContentLengthHeader, Size);
+    }
+
+    if (!Body->isOpen() && !Body->open(QIODevice::ReadOnly)) {
+        emit SendLogMsg(TSync::CODE_ERROR, "Cannot open HTTP request body. Error: " + Body->errorString());
+        Body->deleteLater();
+        return 0;
+    }
+
+    QNetworkReply *Reply = manager.post(Request, Body);
+    if (Reply == nullptr) {
+        emit SendLogMsg(TSync::CODE_ERROR, "Send HTTP request fail.");
+        Body->deleteLater();
+        return 0;
+    }
+    Body->setParent(Reply); //тело запроса должно жить пока идет отправка
+    return AddReply(Reply); //ID - если запрос отправлен
+}
+
+quint64 THTTPQuery::AddReply(QNetworkReply *Reply)
+{
+    const quint64 ID = ++LastRequestID;
+    Replies.insert(Reply, ID);
+    QObject::connect(Reply, SIGNAL(errorOccurred(QNetworkReply::NetworkError)), this, SLOT(onErrorOccurred(QNetworkReply::NetworkError))); //событие ошибки
+    QObject::connect(Reply, SIGNAL(metaDataChanged()), this, SLOT(onMetaDataChanged()));
+    QObject::connect(Reply, SIGNAL(readyRead()), this, SLOT(onReadyRead())); //ответ разбираем по мере получения
+
+    //QNetworkAccessManager не ограничивает время установки соединения отдельно от передачи
+    //соединение считается установленным, когда началась отправка тела или пришли заголовки ответа
+    if (ConnectTimeout > 0) {
+        QTimer *ConnectTimer = new QTimer(Reply);
+        ConnectTimer->setObjectName("ConnectTimer");
+        ConnectTimer->setSingleShot(true);
+        QObject::connect(ConnectTimer, SIGNAL(timeout()), this, SLOT(onConnectTimeout()));
+        QObject::connect(Reply, SIGNAL(uploadProgress(qint64, qint64)), this, SLOT(onConnected()));
+        QObject::connect(Reply, SIGNAL(metaDataChanged()), this, SLOT(onConnected()));
+        ConnectTimer->start(ConnectTimeout);
+    }
+    return ID;
 }
 
 void THTTPQuery::onReplyFinished(QNetworkReply *resp)
 {
    // qDebug() << "HTTP Finished";
-    if (resp->isOpen()) {
-        emit GetAnswer(resp->readAll());
+    const quint64 ID = Replies.take(resp);
+    if (ID == 0) {
+        //запрос уже не отслеживается
+    }
+    else if (resp->error() != QNetworkReply::NoError) {
+        //ошибка уже обработана в onErrorOccurred
+    }
+    else if (resp->isOpen()) {
+        //отдаем то, что еще не было прочитано в onReadyRead
+        if (resp->bytesAvailable() > 0) {
+            emit GetAnswerData(ID, resp->readAll());
+        }
+        emit GetAnswerFinished(ID);
     }
     else {
         emit SendLogMsg(TSync::CODE_ERROR, "Response from HTTP server not received. Error: " + resp->errorString());
-        emit ErrorOccurred();
+        emit ErrorOccurred(ID);
     }
 
     resp->deleteLater();
 }
 
+void THTTPQuery::onReadyRead()
+{
+    QNetworkReply *Reply = qobject_cast<QNetworkReply *>(sender());
+    if ((Reply == nullptr) || (Reply->error() != QNetworkReply::NoError) || !Replies.contains(Reply)) return;
+    emit GetAnswerData(Replies[Reply], Reply->readAll());
+}
+
+void THTTPQuery::RejectCompression()
+{
+    if (CompressionRejected || !CompressionAccepted) return;
+    CompressionRejected = true;
+    emit SendLogMsg(TSync::CODE_INFORMATION, "Compressed request failed. Requests will be sent uncompressed");
+}
+
+void THTTPQuery::onMetaDataChanged()
+{
+    QNetworkReply *Reply = qobject_cast<QNetworkReply *>(sender());
+    if ((Reply == nullptr) || !Replies.contains(Reply)) return;
+    //Accept-Encoding в ответе - список методов, которыми сервер умеет распаковывать запросы
+    if ((Compression != TCompressDevice::NONE) && Reply->hasRawHeader("Accept-Encoding")) {
+        const QString Method = TCompressDevice::ContentEncoding(Compression);
+        bool Accepted = false;
+        for (const auto &Item : QString::fromLatin1(Reply->rawHeader("Accept-Encoding")).split(",", Qt::SkipEmptyParts)) {
+            if (Item.section(";", 0, 0).trimmed().compare(Method, Qt::CaseInsensitive) == 0) Accepted = true;
+        }
+        if (Accepted != CompressionAccepted) {
+            CompressionAccepted = Accepted;
+            if (Accepted && !CompressionRejected) emit SendLogMsg(TSync::CODE_INFORMATION, "Server accepts compressed requests: " + Method);
+        }
+    }
+    emit GetAnswerContentType(Replies[Reply], Reply->header(QNetworkRequest::ContentTypeHeader).toString());
+}
+
 void THTTPQuery::onErrorOccurred(QNetworkReply::NetworkError ErrCode)
 {
+    QNetworkReply *Reply = qobject_cast<QNetworkReply *>(sender());
+    if ((Reply == nullptr) || !Replies.contains(Reply)) return;
+    //запрос прерван по таймауту соединения
+    if (Reply->property("ConnectTimeout").toBool()) ErrCode = QNetworkReply::TimeoutError;
     emit SendLogMsg(TSync::CODE_ERROR, "HTTP request fail. Msg: " + NetworkError2Str(ErrCode));
-    resp->deleteLater();
-    emit ErrorOccurred();
+    emit ErrorOccurred(Replies[Reply]);
+}
+
+void THTTPQuery::onConnected()
+{
+    QNetworkReply *Reply = qobject_cast<QNetworkReply *>(sender());
+    if (Reply == nullptr) return;
+    QTimer *ConnectTimer = Reply->findChild<QTimer *>("ConnectTimer", Qt::FindDirectChildrenOnly);
+    if (ConnectTimer != nullptr) ConnectTimer->stop();
+}
+
+void THTTPQuery::onConnectTimeout()
+{
+    QTimer *ConnectTimer = qobject_cast<QTimer *>(sender());
+    if (ConnectTimer == nullptr) return;
+    QNetworkReply *Reply = qobject_cast<QNetworkReply *>(ConnectTimer->parent());
+    if ((Reply == nullptr) || !Replies.contains(Reply)) return;
+    Reply->setProperty("ConnectTimeout", true);
+    Reply->abort();
 }
 
 QString THTTPQuery::NetworkError2Str(QNetworkReply::NetworkError ErrCode) {
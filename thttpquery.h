@@ -6,6 +6,8 @@
 #include <QNetworkReply>
 #include <QString>
 #include <QSettings>
+#include <QHash>
+#include "tcompressdevice.h"
 
 class THTTPQuery : public QObject
 {
@@ -13,23 +15,49 @@ class THTTPQuery : public QObject
 private:
     QNetworkAccessManager manager; //менеджер обработки соединий
     QString NetworkError2Str(QNetworkReply::NetworkError ErrCode); //переводиит код ошибки в текстовое описание
+    quint64 AddReply(QNetworkReply *Reply); //начинает отслеживание ответа
     const QString Url;
-    QNetworkReply *resp;
+    QHash<QNetworkReply *, quint64> Replies; //выполняющиеся запросы. Значение - ID запроса
+    quint64 LastRequestID = 0;
+    TCompressDevice::TMethod Compression = TCompressDevice::NONE; //метод сжатия тела запроса
+    bool CompressionAccepted = false; //сервер сообщил заголовком Accept-Encoding в ответе, что принимает этот метод (RFC 7694)
+    bool CompressionRejected = false; //сжатый запрос не прошел - до перезапуска запросы не сжимаются
+    int CompressionLevel = 6; //уровень сжатия
+    bool AcceptEncoding = true; //разрешить серверу сжимать ответ
+    int ConnectTimeout = 10000;  //время на установку соединения, мс
+    int TransferTimeout = 60000; //максимальная пауза в передаче данных, мс
 
 public:
     explicit THTTPQuery(const QString &Url, QObject *parent = nullptr);
     ~THTTPQuery();
 
 
-    bool Run(const QByteArray &data); //запускает отправку запроса
+    //Запускают отправку запроса. Возвращают ID запроса, который передается во всех сигналах по этому запросу, или 0 если запрос отправить не удалось
+    //Одновременно может выполняться несколько запросов
+    quint64 Run(const QByteArray &data);
+    //тело передается частями по мере чтения из Body. Запрос становиться владельцем Body
+    //Size - размер тела, если он известен заранее. Сжатое тело отправляется без размера
+    quint64 Run(QIODevice *Body, const QString &ContentType = "application/xml", bool Compress = false, qint64 Size = -1);
+    int ActiveCount() const { return Replies.size(); } //количество выполняющихся запросов
+    void SetCompression(TCompressDevice::TMethod Method, int Level) { Compression = Method; CompressionLevel = Level; } //настройка сжатия тела запроса
+    bool CompressionAllowed() const { return (Compression != TCompressDevice::NONE) && CompressionAccepted && !CompressionRejected; } //запрос можно сжать
+    void RejectCompression(); //сервер не смог разобрать сжатый запрос - дальше отправляем без сжатия
+    void SetAcceptEncoding(bool Accept) { AcceptEncoding = Accept; } //разрешить сжатие ответа
+    void SetTimeouts(int Connect, int Transfer) { ConnectTimeout = Connect; TransferTimeout = Transfer; } //таймауты соединения и передачи, мс
 
 public slots:
     void onReplyFinished(QNetworkReply * resp); //конец приема ответа
+    void onReadyRead(); //пришла очередная часть ответа
+    void onMetaDataChanged(); //пришли заголовки ответа
     void onErrorOccurred(QNetworkReply::NetworkError ErrCode); //возникла ошибка
+    void onConnected(); //соединение установлено - таймаут соединения больше не нужен
+    void onConnectTimeout(); //соединение не установлено за ConnectTimeout
 
 signals:
-    void GetAnswer(const QByteArray &Answer);
-    void ErrorOccurred();
+    void GetAnswerContentType(quint64 ID, const QString &ContentType); //тип содержимого ответа. Генерируется до первой части ответа
+    void GetAnswerData(quint64 ID, const QByteArray &Data); //очередная часть ответа сервера
+    void GetAnswerFinished(quint64 ID); //ответ сервера получен полностью
+    void ErrorOccurred(quint64 ID);
     void SendLogMsg(uint16_t Category, const QString &Msg);
 };
 
@@ -0,0 +1,394 @@
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QtSql/QSqlDatabase>
+#include <algorithm>
+#include <limits>
+#include "tingestpipeline.h"
+
+TIngestPipeline::TIngestPipeline(const QString &SourceConnectionName, bool BinaryBody, bool ContentHash, int Threads, int BatchSize, int BatchDelay,
+                                 int MaxQueueSize, qint64 MaxQueueBytes)
+    : QObject(nullptr) //объект живет в потоке записи, поэтому родителя у него нет
+    , SourceConnectionName(SourceConnectionName)
+    , BinaryBody(BinaryBody)
+    , ContentHash(ContentHash)
+    , BatchSize(qMax(1, BatchSize))
+    , BatchDelay(qMax(0, BatchDelay))
+    , QueueSlots(qMax(1, MaxQueueSize))
+    , MaxQueueKB(static_cast<int>(qBound<qint64>(1, MaxQueueBytes / 1024, std::numeric_limits<int>::max())))
+    , QueueBytes(MaxQueueKB)
+{
+    //по умолчанию читаем файлы в столько потоков, сколько ядер у процессора
+    Pool.setMaxThreadCount(Threads > 0 ? Threads : QThread::idealThreadCount());
+    moveToThread(&Thread);
+    QObject::connect(&Thread, SIGNAL(started()), this, SLOT(onStarted()));
+}
+
+TIngestPipeline::~TIngestPipeline()
+{
+    Stop();
+}
+
+QByteArray TIngestPipeline::Hash(const QByteArray &Data)
+{
+    return QCryptographicHash::hash(Data, QCryptographicHash::Blake2b_256);
+}
+
+void TIngestPipeline::Start()
+{
+    if (!Thread.isRunning()) Thread.start();
+}
+
+void TIngestPipeline::Stop()
+{
+    if (!Thread.isRunning()) return;
+    //дочитываем поставленные файлы и дожидаемся их записи
+    Pool.waitForDone();
+    QMetaObject::invokeMethod(this, "onStop", Qt::BlockingQueuedConnection);
+    Thread.quit();
+    Thread.wait();
+}
+
+void TIngestPipeline::Add(const QString &Target, const QString &Category, const QString &FileName, const QDateTime &CreateDateTime, const QDateTime &ChangeDateTime,
+                          const QByteArray &PrevHash, bool AllowRef, bool KeepBase, bool AllowDelta)
+{
+    TIngestFile File;
+    File.Target = Target;
+    File.Category = Category;
+    File.FileName = FileName;
+    File.CreateDateTime = CreateDateTime;
+    File.ChangeDateTime = ChangeDateTime;
+    File.PrevHash = PrevHash;
+    File.AllowRef = AllowRef;
+    File.KeepBase = KeepBase;
+    File.AllowDelta = AllowDelta;
+
+    Pending.ref();
+    Pool.start([this, File]() { ReadFile(File); });
+}
+
+void TIngestPipeline::Resend(const QString &Target, const QString &Category, const QString &FileName, const QDateTime &CreateDateTime, const QDateTime &ChangeDateTime)
+{
+    TIngestFile File;
+    File.Target = Target;
+    File.Category = Category;
+    File.FileName = FileName;
+    File.CreateDateTime = CreateDateTime;
+    File.ChangeDateTime = ChangeDateTime;
+    File.KeepBase = true;
+    File.Full = true;
+    //та же версия, пока она хранится. Иначе - текущее содержимое файла
+    const QString Version = VersionFileName(BaseKey(FileName), ChangeDateTime.toMSecsSinceEpoch());
+    if (QFile::exists(Version)) File.SourceFileName = Version;
+
+    Pending.ref();
+    Pool.start([this, File]() { ReadFile(File); });
+}
+
+void TIngestPipeline::AckVersion(const QString &FileName, const QDateTime &ChangeDateTime)
+{
+    QMetaObject::invokeMethod(this, "onVersionAcked", Qt::QueuedConnection, Q_ARG(QString, FileName), Q_ARG(qint64, ChangeDateTime.toMSecsSinceEpoch()));
+}
+
+int TIngestPipeline::MemoryKB(qint64 Bytes) const
+{
+    //файл больше всего объема занимает его целиком
+    return static_cast<int>(qBound<qint64>(0, (Bytes + 1023) / 1024, MaxQueueKB));
+}
+
+void TIngestPipeline::ReadFile(TIngestFile File)
+{
+    //ждем, пока поток записи освободит место, чтобы не держать в памяти слишком много тел
+    QueueSlots.acquire();
+
+    QElapsedTimer Timer;
+    Timer.start();
+    QFile tmp(File.SourceFileName.isEmpty() ? File.FileName : File.SourceFileName);
+    //память резервируем по размеру файла до чтения: на время кодирования в памяти и файл, и его Base64
+    const qint64 FileSize = QFileInfo(tmp).size();
+    const qint64 Encoded = BinaryBody ? FileSize : (FileSize + 2) / 3 * 4;
+    const int Peak = MemoryKB(BinaryBody ? FileSize : FileSize + Encoded);
+    QueueBytes.acquire(Peak);
+    File.Reserved = Peak;
+    if (tmp.open(QIODevice::ReadOnly)) {
+        File.Body = tmp.readAll();
+        File.Size = File.Body.size();
+        if (ContentHash) {
+            File.Hash = Hash(File.Body);
+            //файл только "потрогали" - содержимое то же, что и при прошлой загрузке
+            File.Unchanged = (File.Hash == File.PrevHash);
+        }
+        if (File.Unchanged) File.Body.clear();
+        else if (!BinaryBody && !File.KeepBase) File.Body = File.Body.toBase64(QByteArray::Base64Encoding);
+        tmp.close();
+    }
+    else {
+        File.Error = tmp.errorString();
+    }
+    //до записи остается только кодированное тело. Файлы с KeepBase кодируются в потоке записи и держат весь резерв
+    if (File.Unchanged || !File.Error.isEmpty()) File.Reserved = 0;
+    else if (!File.KeepBase) File.Reserved = qMin(Peak, MemoryKB(Encoded));
+    if (File.Reserved < Peak) QueueBytes.release(Peak - File.Reserved);
+    if (Metrics != nullptr) Metrics->AddTime(TMetrics::READ, Timer.nsecsElapsed());
+
+    {
+        QMutexLocker Locker(&Mutex);
+        ReadyFiles.enqueue(File);
+    }
+    Pending.deref(); //уменьшаем только после постановки в очередь - поток записи видит Pending == 0, когда все файлы уже в очереди
+    QMetaObject::invokeMethod(this, "onFileRead", Qt::QueuedConnection);
+}
+
+void TIngestPipeline::onStarted()
+{
+    //соединение создается в потоке записи и используется только в нем
+    SyncDB = new TSyncDB(QSqlDatabase::cloneDatabase(SourceConnectionName, SourceConnectionName + "Ingest"), BinaryBody, ContentHash);
+    if (!SyncDB->Open()) {
+        emit ErrorOccurred(SyncDB->ErrorString());
+    }
+
+    //незавершенная запись версий: неизвестно, попала ли версия в БД. При подтверждении такой версии база
+    //будет удалена, и следующая версия уйдет целиком. Остальные версии ждут подтверждения сервером
+    if (!DeltaDir.isEmpty()) {
+        QDir Dir(DeltaDir);
+        Dir.mkpath(".");
+        for (const auto &FileName : Dir.entryList(QStringList() << "*.new", QDir::Files)) Dir.remove(FileName);
+        for (const auto &FileName : Dir.entryList(QStringList() << "*.version", QDir::Files)) {
+            const QStringList Parts = FileName.split('.'); //ключ.время.version
+            if (Parts.size() == 3) Unacked[Parts[0]].push_back(Parts[1].toLongLong());
+        }
+        for (auto &Versions : Unacked) std::sort(Versions.begin(), Versions.end());
+    }
+
+    BatchTimer = new QTimer(this);
+    BatchTimer->setSingleShot(true);
+    BatchTimer->setInterval(BatchDelay);
+    QObject::connect(BatchTimer, SIGNAL(timeout()), this, SLOT(onBatchTimeout()));
+}
+
+void TIngestPipeline::onFileRead()
+{
+    QQueue<TIngestFile> Files;
+    {
+        QMutexLocker Locker(&Mutex);
+        Files.swap(ReadyFiles);
+    }
+
+    for (auto &File : Files) {
+        if (!File.Error.isEmpty()) {
+            QueueSlots.release();
+            QueueBytes.release(File.Reserved);
+            emit FileFailed(File.Target, File.FileName, File.ChangeDateTime, "Cannot open file for sync. File name: " + File.FileName + " Error: " + File.Error);
+            continue;
+        }
+        if (File.Unchanged || (File.KeepBase && !PrepareDelta(File))) {
+            QueueSlots.release();
+            QueueBytes.release(File.Reserved);
+            emit FileAdded(File.Target, File.FileName, File.ChangeDateTime, File.Size, File.Hash);
+            continue;
+        }
+        Batch.push_back(File);
+        BatchReserved += File.Reserved;
+        //большие тела пишем сразу - пока они в памяти, остальные файлы не читаются
+        if ((Batch.size() >= BatchSize) || (BatchReserved >= MaxQueueKB / 2)) WriteBatch();
+    }
+
+    if (Batch.isEmpty()) return;
+    //все поставленные файлы прочитаны - пишем не дожидаясь заполнения пачки
+    if (Pending.loadAcquire() == 0) WriteBatch();
+    else if (!BatchTimer->isActive()) BatchTimer->start();
+}
+
+void TIngestPipeline::onBatchTimeout()
+{
+    WriteBatch();
+}
+
+void TIngestPipeline::WriteBatch()
+{
+    BatchTimer->stop();
+    if (Batch.isEmpty()) return;
+
+    QElapsedTimer Timer;
+    Timer.start();
+    bool Ok = SyncDB->Transaction();
+    QSet<QByteArray> BatchHashes; //хеши тел записанных в этой пачке
+    for (const auto &File : Batch) {
+        if (!Ok) break;
+        if (!ContentHash) {
+            Ok = SyncDB->AddFile(File.Category, File.FileName, File.CreateDateTime, File.ChangeDateTime, File.Body, File.Encoding);
+            continue;
+        }
+        //такое тело уже есть в SYNCFILE - вместо него записываем ссылку по хешу
+        const bool Ref = File.Encoding.isEmpty() && File.AllowRef && (KnownHashes.contains(File.Hash) || BatchHashes.contains(File.Hash));
+        Ok = SyncDB->AddFile(File.Category, File.FileName, File.CreateDateTime, File.ChangeDateTime, Ref ? QByteArray("") : File.Body,
+                             Ref ? "ref" : File.Encoding, File.Hash.toHex());
+        BatchHashes.insert(File.Hash);
+    }
+    if (Ok && !SaveVersions()) {
+        //версии не сохранены - при их подтверждении база будет удалена и следующие версии уйдут целиком
+        qDebug() << "Cannot save file versions for deltas. Dir:" << DeltaDir;
+    }
+    if (Ok) {
+        Ok = SyncDB->Commit();
+    }
+    else {
+        SyncDB->Rollback();
+    }
+    CommitVersions(Ok);
+    if (Metrics != nullptr) Metrics->AddTime(TMetrics::DB_INSERT, Timer.nsecsElapsed());
+
+    QueueSlots.release(Batch.size());
+    QueueBytes.release(BatchReserved);
+    BatchReserved = 0;
+    if (!Ok) {
+        Batch.clear();
+        emit ErrorOccurred(SyncDB->ErrorString());
+        return;
+    }
+
+    //файлы в SYNCFILE добавляет только этот поток, поэтому максимальный ID сразу после записи - последний ID пачки
+    quint64 LastID = 0;
+    if (!SyncDB->MaxID(LastID)) {
+        qDebug() << SyncDB->ErrorString();
+    }
+
+    KnownHashes.unite(BatchHashes);
+    if (Metrics != nullptr) {
+        Metrics->Add(TMetrics::INGESTED_FILES, Batch.size());
+        for (const auto &File : Batch) Metrics->Add(TMetrics::INGESTED_BYTES, File.Size);
+    }
+    for (const auto &File : Batch) emit FileAdded(File.Target, File.FileName, File.ChangeDateTime, File.Size, File.Hash);
+    emit BatchWritten(Batch.size(), LastID);
+    Batch.clear();
+}
+
+QString TIngestPipeline::BaseKey(const QString &FileName)
+{
+    return QCryptographicHash::hash(FileName.toUtf8(), QCryptographicHash::Md5).toHex();
+}
+
+QString TIngestPipeline::BaseFileName(const QString &Key) const
+{
+    return DeltaDir + "/" + Key + ".base";
+}
+
+QString TIngestPipeline::VersionFileName(const QString &Key, qint64 ChangeTime) const
+{
+    return DeltaDir + "/" + Key + "." + QString::number(ChangeTime) + ".version";
+}
+
+static bool ReadAll(const QString &FileName, QByteArray &Data)
+{
+    QFile File(FileName);
+    if (!File.open(QIODevice::ReadOnly)) return false;
+    Data = File.readAll();
+    return File.error() == QFileDevice::NoError;
+}
+
+bool TIngestPipeline::PrepareDelta(TIngestFile &File)
+{
+    const QString Key = BaseKey(File.FileName);
+    const QList<qint64> Versions = Unacked.value(Key);
+    bool InFlight = !Versions.isEmpty(); //есть версии, которые сервер еще не подтвердил
+
+    //сравниваем с версией, записанной в БД последней: из текущей пачки, еще не подтвержденной или базой
+    QByteArray Last;
+    bool HaveLast = false;
+    for (auto it = BatchVersions.crbegin(); it != BatchVersions.crend(); ++it) {
+        if (it->Key != Key) continue;
+        Last = it->Body;
+        HaveLast = true;
+        InFlight = true;
+        break;
+    }
+    if (!HaveLast && !Versions.isEmpty()) HaveLast = ReadAll(VersionFileName(Key, Versions.last()), Last);
+    QByteArray Base;
+    const bool HaveBase = ReadAll(BaseFileName(Key), Base);
+    if (!HaveLast && HaveBase) {
+        Last = Base;
+        HaveLast = true;
+    }
+    if (HaveLast && !File.Full && (Last == File.Body)) return false;
+
+    BatchVersions.push_back({Key, File.ChangeDateTime.toMSecsSinceEpoch(), File.Body});
+    //разность строится только от версии, которую сервер подтвердил, и только пока она у сервера последняя
+    if (HaveBase && !InFlight && File.AllowDelta) {
+        //разность записываем, только если она заметно меньше самого файла
+        const QByteArray Delta = TDeltaCodec::Make(Base, File.Body, DeltaBlockSize);
+        if (!Delta.isEmpty() && (Delta.size() < File.Body.size() / 4 * 3)) {
+            File.Body = Delta;
+            File.Encoding = "delta";
+            return true;
+        }
+    }
+    if (!BinaryBody) File.Body = File.Body.toBase64(QByteArray::Base64Encoding);
+    return true;
+}
+
+bool TIngestPipeline::SaveVersions()
+{
+    bool Ok = true;
+    for (const auto &Version : BatchVersions) {
+        QFile VersionFile(VersionFileName(Version.Key, Version.ChangeTime) + ".new");
+        if (VersionFile.open(QIODevice::WriteOnly | QIODevice::Truncate) && (VersionFile.write(Version.Body) == Version.Body.size()) && VersionFile.flush()) {
+            continue;
+        }
+        VersionFile.remove();
+        Ok = false;
+    }
+    return Ok;
+}
+
+void TIngestPipeline::CommitVersions(bool Ok)
+{
+    for (const auto &Version : BatchVersions) {
+        const QString VersionName = VersionFileName(Version.Key, Version.ChangeTime);
+        if (!QFile::exists(VersionName + ".new")) continue;
+        if (Ok) {
+            QFile::remove(VersionName);
+            if (QFile::rename(VersionName + ".new", VersionName)) {
+                QList<qint64> &Versions = Unacked[Version.Key];
+                if (!Versions.contains(Version.ChangeTime)) {
+                    Versions.insert(std::lower_bound(Versions.begin(), Versions.end(), Version.ChangeTime), Version.ChangeTime);
+                }
+                continue;
+            }
+        }
+        QFile::remove(VersionName + ".new");
+    }
+    BatchVersions.clear();
+}
+
+void TIngestPipeline::onVersionAcked(const QString &FileName, qint64 ChangeTime)
+{
+    const QString Key = BaseKey(FileName);
+    const QString BaseName = BaseFileName(Key);
+    auto it = Unacked.find(Key);
+    QFile::remove(BaseName);
+    //версии нет - сервер получил содержимое, которого у нас нет. Базы не будет, следующая версия уйдет целиком
+    if ((it == Unacked.end()) || !it->contains(ChangeTime)) return;
+    if (!QFile::rename(VersionFileName(Key, ChangeTime), BaseName)) {
+        qDebug() << "Cannot save delta base. File name:" << FileName;
+    }
+    //более ранние версии сервер уже получил или получит позже подтвержденной - базой они не станут
+    while (!it->isEmpty() && (it->first() <= ChangeTime)) {
+        const qint64 Time = it->takeFirst();
+        if (Time != ChangeTime) QFile::remove(VersionFileName(Key, Time));
+    }
+    if (it->isEmpty()) Unacked.erase(it);
+}
+
+void TIngestPipeline::onStop()
+{
+    onFileRead();
+    WriteBatch();
+
+    const QString ConnectionName = SyncDB->Connection().connectionName();
+    delete SyncDB;
+    SyncDB = nullptr;
+    QSqlDatabase::removeDatabase(ConnectionName);
+}
@@ -0,0 +1,135 @@
+/* Загрузка новых файлов в SYNCFILE
+ * Файлы читаются, хешируются и кодируются в Base64 в пуле потоков, а записываются в БД одним потоком записи
+ * через собственное соединение: одна транзакция на пачку из BatchSize файлов. Пачка записывается,
+ * когда она заполнена, когда все поставленные файлы прочитаны или через BatchDelay мс после первого файла пачки.
+ * Один поток записи гарантирует, что ID новых файлов становятся видимы другим соединениям строго по порядку.
+ * Прочитанные, но еще не записанные файлы ограничены MaxQueueSize по количеству и MaxQueueBytes по размеру тел.
+ * Файл больше MaxQueueBytes читается, только когда остальные тела записаны, и пишется в БД без ожидания пачки.
+ * При ContentHash файл, содержимое которого не изменилось с прошлой загрузки, в БД не записывается,
+ * а тело, уже записанное в SYNCFILE для другого файла, заменяется ссылкой на него (ENCODING = 'ref')
+ * Для файлов с KeepBase записанные версии хранятся в DeltaDir, пока сервер не подтвердит их прием (AckVersion).
+ * Подтвержденная версия становится базой. Если сервер принимает разности, а других версий файла в пути нет,
+ * в БД записывается разность с базой (ENCODING = 'delta') - только эта версия точно есть на сервере.
+ * Разность считается в потоке записи - только там известен порядок, в котором версии одного файла попадают в SYNCFILE.
+ * Если сервер не смог применить разность, Resend записывает ту же версию целиком
+*/
+#ifndef TINGESTPIPELINE_H
+#define TINGESTPIPELINE_H
+
+#include <QObject>
+#include <QThread>
+#include <QThreadPool>
+#include <QMutex>
+#include <QSemaphore>
+#include <QQueue>
+#include <QTimer>
+#include <QDateTime>
+#include <QAtomicInt>
+#include <QSet>
+#include <QHash>
+#include "tsyncdb.h"
+#include "tdeltacodec.h"
+#include "tmetrics.h"
+
+class TIngestPipeline : public QObject
+{
+    Q_OBJECT
+private:
+    typedef struct {
+        QString Target;     //цель отслеживания, к которой относится файл
+        QString Category;
+        QString FileName;   //полный путь к файлу
+        QDateTime CreateDateTime;
+        QDateTime ChangeDateTime;
+        QByteArray Body;    //тело файла, в Base64 если BinaryBody = false
+        qint64 Size = 0;    //размер файла
+        QByteArray Hash;    //хеш содержимого
+        QByteArray PrevHash; //хеш содержимого при прошлой загрузке этого файла
+        bool AllowRef = false; //можно заменить тело ссылкой на такое же тело
+        bool KeepBase = false; //хранить копию файла для разностей. Тело остается некодированным до записи
+        bool AllowDelta = false; //можно записать разность с прошлой версией вместо тела
+        bool Full = false;  //записать тело целиком, даже если содержимое не изменилось (повтор отклоненной разности)
+        QString SourceFileName; //откуда читать тело, если не из самого файла
+        QString Encoding;   //кодирование тела в SYNCFILE, если отличается от обычного
+        bool Unchanged = false; //содержимое не изменилось - файл не записывается
+        QString Error;      //файл не удалось прочитать
+        int Reserved = 0;   //место в QueueBytes, занятое телом, КБ
+    } TIngestFile;
+
+    typedef struct {
+        QString Key;        //ключ файла в DeltaDir
+        qint64 ChangeTime;  //время изменения версии, мс от начала эпохи
+        QByteArray Body;
+    } TVersion;
+
+    QThread Thread;              //поток записи в БД
+    QThreadPool Pool;            //потоки чтения файлов
+    const QString SourceConnectionName;
+    const bool BinaryBody;
+    const bool ContentHash;
+    const int BatchSize;
+    const int BatchDelay;
+    TSyncDB *SyncDB = nullptr;   //собственное соединение потока записи
+    QTimer *BatchTimer = nullptr;
+    QSemaphore QueueSlots;       //свободные места для прочитанных файлов
+    const int MaxQueueKB;        //память под тела прочитанных и еще не записанных файлов, КБ
+    QSemaphore QueueBytes;       //свободная память под тела, КБ
+    int BatchReserved = 0;       //память, занятая телами текущей пачки, КБ
+    QMutex Mutex;                //защищает ReadyFiles
+    QQueue<TIngestFile> ReadyFiles; //прочитанные файлы ожидающие записи
+    QList<TIngestFile> Batch;    //текущая пачка
+    QAtomicInt Pending = 0;      //файлы поставленные, но еще не переданные в поток записи
+    QSet<QByteArray> KnownHashes; //хеши тел, уже записанных в SYNCFILE
+    QString DeltaDir;            //базы и неподтвержденные версии файлов с KeepBase
+    int DeltaBlockSize = TDeltaCodec::DefaultBlockSize;
+    QList<TVersion> BatchVersions; //версии файлов из текущей пачки, которые сохраняются после записи
+    QHash<QString, QList<qint64>> Unacked; //записанные, но еще не подтвержденные сервером версии по ключу файла
+    TMetrics *Metrics = nullptr; //время чтения и записи в БД, записанные файлы
+
+    void ReadFile(TIngestFile File); //выполняется в пуле потоков
+    int MemoryKB(qint64 Bytes) const; //сколько КБ QueueBytes занимает тело такого размера
+    void WriteBatch();
+    static QString BaseKey(const QString &FileName); //ключ файла в DeltaDir
+    QString BaseFileName(const QString &Key) const;  //подтвержденная сервером версия
+    QString VersionFileName(const QString &Key, qint64 ChangeTime) const; //неподтвержденная версия
+    bool PrepareDelta(TIngestFile &File); //false - содержимое не изменилось с прошлой записанной версии
+    bool SaveVersions();   //записывает версии пачки во временные файлы до фиксации пачки
+    void CommitVersions(bool Ok); //после фиксации пачки делает версии постоянными или удаляет временные файлы
+
+public:
+    explicit TIngestPipeline(const QString &SourceConnectionName, bool BinaryBody, bool ContentHash, int Threads, int BatchSize, int BatchDelay,
+                             int MaxQueueSize, qint64 MaxQueueBytes);
+
+    static QByteArray Hash(const QByteArray &Data); //хеш содержимого файла (BLAKE2b-256)
+    ~TIngestPipeline();
+
+    void Start();
+    void AddKnownHashes(const QSet<QByteArray> &Hashes) { KnownHashes.unite(Hashes); } //только до Start
+    void SetDelta(const QString &Dir, int BlockSize) { DeltaDir = Dir; DeltaBlockSize = BlockSize; } //только до Start
+    void SetMetrics(TMetrics *Metrics) { this->Metrics = Metrics; } //только до Start
+    void Stop(); //дожидается записи всех поставленных файлов и останавливает потоки
+    //ставит файл в очередь на загрузку в БД. Может вызываться только из потока, в котором создан объект
+    //PrevHash - хеш содержимого при прошлой загрузке файла, AllowRef - сервер принимает ссылки на уже отправленные тела
+    //KeepBase - хранить последнюю версию файла для разностей, AllowDelta - сервер принимает разности
+    void Add(const QString &Target, const QString &Category, const QString &FileName, const QDateTime &CreateDateTime, const QDateTime &ChangeDateTime,
+             const QByteArray &PrevHash = QByteArray(), bool AllowRef = false, bool KeepBase = false, bool AllowDelta = false);
+    //записывает версию файла с KeepBase целиком - сервер не смог применить ее разность
+    void Resend(const QString &Target, const QString &Category, const QString &FileName, const QDateTime &CreateDateTime, const QDateTime &ChangeDateTime);
+    //сервер получил версию файла с KeepBase - она становится базой для следующих разностей. Может вызываться из любого потока
+    void AckVersion(const QString &FileName, const QDateTime &ChangeDateTime);
+
+signals:
+    void FileAdded(const QString &Target, const QString &FileName, const QDateTime &ChangeDateTime, qint64 Size, const QByteArray &Hash); //файл записан в БД или не изменился
+    void FileFailed(const QString &Target, const QString &FileName, const QDateTime &ChangeDateTime, const QString &Msg); //файл не удалось прочитать
+    void BatchWritten(int Count, quint64 LastID);  //записана очередная пачка файлов. LastID - максимальный ID в SYNCFILE после записи
+    void ErrorOccurred(const QString &Msg); //ошибка БД, дальнейшая работа невозможна
+
+private slots:
+    void onStarted();
+    void onFileRead(); //в очереди появились прочитанные файлы
+    void onBatchTimeout();
+    void onVersionAcked(const QString &FileName, qint64 ChangeTime);
+    void onStop();
+};
+
+#endif // TINGESTPIPELINE_H
@@ -0,0 +1,171 @@
+#include <QDebug>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QVariantList>
+#include "tlogwriter.h"
+#include "tsync.h"
+#include "tsyncdb.h"
+
+TLogWriter::TLogWriter(const QString &SourceConnectionName, int BatchSize, int FlushInterval, int MaxQueueSize)
+    : QObject(nullptr) //объект живет в потоке записи, поэтому родителя у него нет
+    , SourceConnectionName(SourceConnectionName)
+    , BatchSize(qMax(1, BatchSize))
+    , FlushInterval(qMax(1, FlushInterval))
+    , MaxQueueSize(qMax(BatchSize, MaxQueueSize))
+{
+    moveToThread(&Thread);
+    QObject::connect(&Thread, SIGNAL(started()), this, SLOT(onStarted()));
+}
+
+TLogWriter::~TLogWriter()
+{
+    Stop();
+}
+
+void TLogWriter::Start()
+{
+    if (!Thread.isRunning()) Thread.start();
+}
+
+void TLogWriter::Stop()
+{
+    if (!Thread.isRunning()) return;
+    //дожидаемся записи всех накопленных сообщений
+    QMetaObject::invokeMethod(this, "onStop", Qt::BlockingQueuedConnection);
+    Thread.quit();
+    Thread.wait();
+}
+
+void TLogWriter::Add(uint16_t Category, const QString &Msg)
+{
+    QMutexLocker Locker(&Mutex);
+    if (Queue.size() >= MaxQueueSize) {
+        ++Dropped;
+        return;
+    }
+    Queue.enqueue({Category, Msg});
+    //набралась пачка - записываем не дожидаясь таймера
+    if (Queue.size() == BatchSize) {
+        QMetaObject::invokeMethod(this, "onFlush", Qt::QueuedConnection);
+    }
+}
+
+void TLogWriter::onStarted()
+{
+    //соединение создается в потоке записи и используется только в нем
+    DB = QSqlDatabase::cloneDatabase(SourceConnectionName, SourceConnectionName + "Log");
+    QString Error;
+    if (!DB.open()) {
+        qCritical() << "Cannot connect to database for writing log. Error: " << DB.lastError().text();
+    }
+    else if (!TSyncDB::Tune(DB, Error)) {
+        qCritical() << Error;
+    }
+    else if (!Prepare()) {
+        qCritical() << "Cannot prepare query for writing log. Error: " << InsertQuery.lastError().text();
+    }
+
+    FlushTimer = new QTimer(this);
+    FlushTimer->setInterval(FlushInterval);
+    QObject::connect(FlushTimer, SIGNAL(timeout()), this, SLOT(onFlush()));
+    FlushTimer->start();
+}
+
+void TLogWriter::onFlush()
+{
+    //записываем пачками, пока в очереди остаются полные пачки. Остаток запишется по таймеру
+    while (WriteBatch()) {
+        QMutexLocker Locker(&Mutex);
+        if (Queue.size() < BatchSize) break;
+    }
+}
+
+void TLogWriter::AddDropped(quint64 Count)
+{
+    QMutexLocker Locker(&Mutex);
+    Dropped += Count;
+}
+
+bool TLogWriter::Prepare()
+{
+    InsertQuery = QSqlQuery(DB);
+    Prepared = InsertQuery.prepare("INSERT INTO LOG (CATEGORY, SENDER, MSG) VALUES (?, ?, ?)");
+    return Prepared;
+}
+
+bool TLogWriter::WriteBatch()
+{
+    QVariantList Categories;
+    QVariantList Senders;
+    QVariantList Msgs;
+    quint64 Lost = 0; //потерянные сообщения, о которых сообщает эта пачка
+    {
+        QMutexLocker Locker(&Mutex);
+        if (Dropped > 0) {
+            Categories << TSync::CODE_ERROR;
+            Senders << "Sync";
+            Msgs << "Log messages dropped (queue overflow or write error): " + QString::number(Dropped);
+            Lost = Dropped;
+            Dropped = 0;
+        }
+        while (!Queue.isEmpty() && (Msgs.size() < BatchSize)) {
+            const TLogMsg LogMsg = Queue.dequeue();
+            Categories << LogMsg.Category;
+            Senders << "Sync";
+            Msgs << LogMsg.Msg;
+        }
+    }
+    if (Msgs.isEmpty()) return false;
+    //если пачку записать не удастся, ее сообщения учитываются как потерянные вместе с уже потерянными
+    const quint64 BatchLost = Lost + Msgs.size() - (Lost > 0 ? 1 : 0);
+
+    if (!DB.isOpen()) {
+        Prepared = false;
+        if (!DB.open()) {
+            qDebug() << "FAIL Cannot connect to database for writing log. Error: " << DB.lastError().text() << " Messages lost:" << Msgs.size();
+            AddDropped(BatchLost);
+            return false;
+        }
+    }
+    //запрос подготавливается заново только после переподключения или ошибки
+    if (!Prepared && !Prepare()) {
+        qDebug() << "FAIL Cannot prepare query. Error: " << InsertQuery.lastError().text();
+        AddDropped(BatchLost);
+        return false;
+    }
+
+    //одна транзакция на пачку. Firebird не поддерживает многострочный VALUES, поэтому пачка передается через execBatch
+    DB.transaction();
+    InsertQuery.bindValue(0, Categories);
+    InsertQuery.bindValue(1, Senders);
+    InsertQuery.bindValue(2, Msgs);
+    if (!InsertQuery.execBatch()) {
+        qDebug() << "FAIL Cannot execute query. Error: " << InsertQuery.lastError().text() << " Query: "<< InsertQuery.lastQuery();
+        DB.rollback();
+        Prepared = false;
+        AddDropped(BatchLost);
+        return false;
+    }
+    if (!DB.commit()) {
+        qDebug() << "FAIL Cannot commit transation. Error: " << DB.lastError().text();
+        DB.rollback();
+        AddDropped(BatchLost);
+        return false;
+    };
+    return true;
+}
+
+void TLogWriter::onStop()
+{
+    if (FlushTimer != nullptr) FlushTimer->stop();
+    //дописываем всю очередь
+    while (WriteBatch()) {}
+
+    //подготовленный запрос освобождается до закрытия соединения
+    InsertQuery = QSqlQuery();
+    Prepared = false;
+    const QString ConnectionName = DB.connectionName();
+    DB.close();
+    DB = QSqlDatabase();
+    QSqlDatabase::removeDatabase(ConnectionName);
+}
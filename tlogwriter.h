@@ -0,0 +1,60 @@
+/* Асинхронная запись сообщений в таблицу LOG
+ * Сообщения накапливаются в очереди и записываются пачками в отдельном потоке через собственное соединение с БД:
+ * одна транзакция и один подготовленный INSERT на пачку. Пачка записывается, когда в очереди набралось BatchSize
+ * сообщений или прошло FlushInterval мс. Если БД не успевает, очередь ограничивается MaxQueueSize сообщениями,
+ * лишние сообщения отбрасываются, а их количество записывается в LOG отдельным сообщением. Туда же попадают
+ * сообщения пачек, которые записать не удалось
+*/
+#ifndef TLOGWRITER_H
+#define TLOGWRITER_H
+
+#include <QObject>
+#include <QThread>
+#include <QMutex>
+#include <QQueue>
+#include <QTimer>
+#include <QString>
+#include <QtSql/QSqlDatabase>
+#include <QtSql/QSqlQuery>
+
+class TLogWriter : public QObject
+{
+    Q_OBJECT
+private:
+    typedef struct {
+        uint16_t Category;
+        QString Msg;
+    } TLogMsg;
+
+    QThread Thread;            //поток записи в БД
+    const QString SourceConnectionName; //соединение, параметры которого используются для своего соединения
+    QSqlDatabase DB;           //собственное соединение потока записи
+    QSqlQuery InsertQuery;     //INSERT в LOG, подготовленный один раз для соединения
+    bool Prepared = false;     //InsertQuery подготовлен для текущего соединения
+    QTimer *FlushTimer = nullptr;
+    QMutex Mutex;              //защищает Queue и Dropped
+    QQueue<TLogMsg> Queue;     //сообщения ожидающие записи
+    quint64 Dropped = 0;       //количество отброшенных и не записанных сообщений с последней записи
+    const int BatchSize;
+    const int FlushInterval;
+    const int MaxQueueSize;
+
+    bool Prepare(); //подготавливает InsertQuery
+    bool WriteBatch(); //записывает одну пачку сообщений. false - очередь пуста или запись не удалась
+    void AddDropped(quint64 Count); //сообщения потеряны - о них будет сообщено в следующей пачке
+
+public:
+    explicit TLogWriter(const QString &SourceConnectionName, int BatchSize, int FlushInterval, int MaxQueueSize);
+    ~TLogWriter();
+
+    void Start(); //запускает поток записи
+    void Stop();  //записывает все накопленные сообщения и останавливает поток
+    void Add(uint16_t Category, const QString &Msg); //ставит сообщение в очередь. Может вызываться из любого потока
+
+private slots:
+    void onStarted(); //открывает соединение с БД в потоке записи
+    void onFlush();   //записывает накопленные сообщения
+    void onStop();
+};
+
+#endif // TLOGWRITER_H
@@ -0,0 +1,86 @@
+#include "tmetrics.h"
+
+//от 1 мс до 2 мин: быстрые этапы (разбор, сканирование) и медленные (обмен по плохой сети) в одной шкале
+const qint64 TMetrics::Buckets[TMetrics::BucketCount] = {1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+                                                         1000000, 5000000, 30000000, 120000000};
+
+static const char *PhaseNames[TMetrics::PHASE_COUNT] = {"scan", "read", "db_insert", "xml_build", "http_rtt", "parse", "save_file"};
+
+typedef struct {
+    const char *Name;
+    const char *Label; //значение метки, если несколько счетчиков выводятся под одним именем
+    const char *Help;
+} TMetricInfo;
+
+static const TMetricInfo CounterInfo[TMetrics::COUNTER_COUNT] = {
+    {"sync_sent_bytes_total", nullptr, "Size of requests sent to the server before compression"},
+    {"sync_received_bytes_total", nullptr, "Size of answers received from the server"},
+    {"sync_ingested_files_total", nullptr, "Files written to SYNCFILE"},
+    {"sync_ingested_bytes_total", nullptr, "Size of files written to SYNCFILE"},
+    {"sync_saved_files_total", nullptr, "Files received from the server and saved to disk"},
+    {"sync_saved_bytes_total", nullptr, "Size of files received from the server and saved to disk"},
+    {"sync_exchanges_total", nullptr, "Successful exchanges with the server"},
+    {"sync_compacted_files_total", nullptr, "Outdated file versions deleted from SYNCFILE"},
+    {"sync_errors_total", "http", "Errors by type"},
+    {"sync_errors_total", "answer", nullptr},
+    {"sync_errors_total", "read", nullptr},
+    {"sync_errors_total", "save", nullptr}
+};
+
+static const TMetricInfo GaugeInfo[TMetrics::GAUGE_COUNT] = {
+    {"sync_pending_files", nullptr, "Files in SYNCFILE not yet confirmed by the server"},
+    {"sync_download_queue_files", nullptr, "Files listed by the server and not yet saved"},
+    {"sync_requests_in_flight", nullptr, "Requests to the server in progress"},
+    {"sync_ingesting_files", nullptr, "Files queued for writing to SYNCFILE"},
+    {"sync_saving_files", nullptr, "Received files queued for saving to disk"}
+};
+
+void TMetrics::AddTime(TPhase Phase, qint64 Nsecs)
+{
+    const qint64 Usecs = qMax<qint64>(0, Nsecs / 1000);
+    int Bucket = 0;
+    while ((Bucket < BucketCount) && (Usecs > Buckets[Bucket])) ++Bucket;
+    Phases[Phase].Count[Bucket].fetchAndAddRelaxed(1);
+    Phases[Phase].Sum.fetchAndAddRelaxed(Usecs);
+}
+
+static void AddHeader(QByteArray &Text, const char *Name, const char *Help, const char *Type)
+{
+    Text += QByteArray("# HELP ") + Name + " " + Help + "\n";
+    Text += QByteArray("# TYPE ") + Name + " " + Type + "\n";
+}
+
+QByteArray TMetrics::Text() const
+{
+    QByteArray Text;
+    Text.reserve(8192);
+
+    AddHeader(Text, "sync_phase_seconds", "Time spent in phases of the exchange cycle", "histogram");
+    for (int Phase = 0; Phase < PHASE_COUNT; ++Phase) {
+        //в формате Prometheus корзина включает все меньшие значения
+        const QByteArray Label = QByteArray("phase=\"") + PhaseNames[Phase] + "\"";
+        quint64 Total = 0;
+        for (int Bucket = 0; Bucket <= BucketCount; ++Bucket) {
+            Total += Phases[Phase].Count[Bucket].loadRelaxed();
+            const QByteArray Bound = (Bucket < BucketCount) ? QByteArray::number(Buckets[Bucket] / 1000000.0, 'g', 6) : QByteArray("+Inf");
+            Text += "sync_phase_seconds_bucket{" + Label + ",le=\"" + Bound + "\"} " + QByteArray::number(Total) + "\n";
+        }
+        Text += "sync_phase_seconds_sum{" + Label + "} " + QByteArray::number(Phases[Phase].Sum.loadRelaxed() / 1000000.0, 'f', 6) + "\n";
+        Text += "sync_phase_seconds_count{" + Label + "} " + QByteArray::number(Total) + "\n";
+    }
+
+    for (int Counter = 0; Counter < COUNTER_COUNT; ++Counter) {
+        const TMetricInfo &Info = CounterInfo[Counter];
+        if (Info.Help != nullptr) AddHeader(Text, Info.Name, Info.Help, "counter");
+        Text += Info.Name;
+        if (Info.Label != nullptr) Text += QByteArray("{type=\"") + Info.Label + "\"}";
+        Text += " " + QByteArray::number(Counters[Counter].loadRelaxed()) + "\n";
+    }
+
+    for (int Gauge = 0; Gauge < GAUGE_COUNT; ++Gauge) {
+        const TMetricInfo &Info = GaugeInfo[Gauge];
+        AddHeader(Text, Info.Name, Info.Help, "gauge");
+        Text += QByteArray(Info.Name) + " " + QByteArray::number(Gauges[Gauge].loadRelaxed()) + "\n";
+    }
+    return Text;
+}
@@ -0,0 +1,41 @@
+/* Счетчики и время выполнения этапов цикла обмена
+ * Обновляются из любого потока без блокировок: каждое значение - атомарное целое. Время этапа
+ * накапливается гистограммой с фиксированными границами, поэтому по ней можно получить как среднее,
+ * так и долю медленных выполнений. Значения выводятся в текстовом формате Prometheus
+*/
+#ifndef TMETRICS_H
+#define TMETRICS_H
+
+#include <QByteArray>
+#include <QAtomicInteger>
+
+class TMetrics
+{
+public:
+    typedef enum {SCAN, READ, DB_INSERT, XML_BUILD, HTTP_RTT, PARSE, SAVE_FILE, PHASE_COUNT} TPhase; //этапы цикла
+    typedef enum {SENT_BYTES, RECEIVED_BYTES, INGESTED_FILES, INGESTED_BYTES, SAVED_FILES, SAVED_BYTES, EXCHANGES, COMPACTED_FILES,
+                  HTTP_ERRORS, ANSWER_ERRORS, READ_ERRORS, SAVE_ERRORS, COUNTER_COUNT} TCounter; //накопительные счетчики
+    typedef enum {PENDING_FILES, DOWNLOAD_QUEUE, REQUESTS, INGESTING_FILES, SAVING_FILES, GAUGE_COUNT} TGauge; //текущие значения
+
+private:
+    static const int BucketCount = 12;
+    static const qint64 Buckets[BucketCount]; //верхние границы корзин гистограмм, мкс
+
+    typedef struct {
+        QAtomicInteger<quint64> Count[BucketCount + 1]; //последняя корзина - больше всех границ
+        QAtomicInteger<quint64> Sum; //суммарное время, мкс
+    } THistogram;
+
+    THistogram Phases[PHASE_COUNT];
+    QAtomicInteger<quint64> Counters[COUNTER_COUNT];
+    QAtomicInteger<qint64> Gauges[GAUGE_COUNT];
+
+public:
+    void AddTime(TPhase Phase, qint64 Nsecs); //время одного выполнения этапа, нс (QElapsedTimer::nsecsElapsed)
+    void Add(TCounter Counter, quint64 Value = 1) { Counters[Counter].fetchAndAddRelaxed(Value); }
+    void Set(TGauge Gauge, qint64 Value) { Gauges[Gauge].storeRelaxed(Value); }
+
+    QByteArray Text() const; //все значения в текстовом формате Prometheus
+};
+
+#endif // TMETRICS_H
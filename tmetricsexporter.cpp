@@ -0,0 +1,89 @@
+#include <QDebug>
+#include <QSaveFile>
+#include "tmetricsexporter.h"
+
+TMetricsExporter::TMetricsExporter(TMetrics *Metrics, QObject *parent)
+    : QObject(parent)
+    , Metrics(Metrics)
+{
+    QObject::connect(&Server, SIGNAL(newConnection()), this, SLOT(onNewConnection()));
+    QObject::connect(&SnapshotTimer, SIGNAL(timeout()), this, SLOT(onSnapshotTimeout()));
+}
+
+QByteArray TMetricsExporter::Collected()
+{
+    emit Collect();
+    return Metrics->Text();
+}
+
+bool TMetricsExporter::Listen(const QHostAddress &Address, quint16 Port)
+{
+    return Server.listen(Address, Port);
+}
+
+void TMetricsExporter::StartSnapshots(const QString &FileName, int Interval)
+{
+    SnapshotFileName = FileName;
+    SnapshotTimer.start(qMax(1000, Interval));
+}
+
+bool TMetricsExporter::WriteSnapshot()
+{
+    if (SnapshotFileName.isEmpty()) return true;
+    //файл заменяется целиком, поэтому читатель никогда не увидит его частично записанным
+    QSaveFile File(SnapshotFileName);
+    if (!File.open(QIODevice::WriteOnly)) return false;
+    File.write(Collected());
+    return File.commit();
+}
+
+void TMetricsExporter::onSnapshotTimeout()
+{
+    if (!WriteSnapshot()) qDebug() << "Cannot write metrics file:" << SnapshotFileName;
+}
+
+void TMetricsExporter::onNewConnection()
+{
+    while (QTcpSocket *Socket = Server.nextPendingConnection()) {
+        QObject::connect(Socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+        QObject::connect(Socket, SIGNAL(disconnected()), Socket, SLOT(deleteLater()));
+    }
+}
+
+void TMetricsExporter::onReadyRead()
+{
+    QTcpSocket *Socket = qobject_cast<QTcpSocket *>(sender());
+    if (Socket == nullptr) return;
+
+    //ждем заголовок запроса целиком. Тело у GET не бывает
+    const QByteArray Head = Socket->peek(MaxRequestSize);
+    if (!Head.contains("\r\n\r\n")) {
+        if (Head.size() >= MaxRequestSize) Socket->abort();
+        return;
+    }
+    Socket->readAll();
+    QObject::disconnect(Socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+
+    const QList<QByteArray> RequestLine = Head.left(Head.indexOf("\r\n")).split(' ');
+    QByteArray Status = "200 OK";
+    QByteArray ContentType = "text/plain; version=0.0.4; charset=utf-8";
+    QByteArray Body;
+    if ((RequestLine.size() < 2) || (RequestLine[0] != "GET")) {
+        Status = "405 Method Not Allowed";
+        ContentType = "text/plain";
+    }
+    else if ((RequestLine[1] != "/metrics") && (RequestLine[1] != "/")) {
+        Status = "404 Not Found";
+        ContentType = "text/plain";
+    }
+    else {
+        Body = Collected();
+    }
+
+    Socket->write("HTTP/1.1 " + Status + "\r\n"
+                  "Content-Type: " + ContentType + "\r\n"
+                  "Content-Length: " + QByteArray::number(Body.size()) + "\r\n"
+                  "Connection: close\r\n\r\n");
+    Socket->write(Body);
+    Socket->disconnectFromHost();
+}
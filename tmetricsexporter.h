@@ -0,0 +1,47 @@
+/* Вывод значений TMetrics для внешнего мониторинга
+ * HTTP: на GET /metrics отвечает текстом в формате Prometheus. По умолчанию слушает только локальный адрес
+ * Файл: каждые Interval мс записывает тот же текст в файл целиком через временный файл, чтобы его можно было
+ * забирать агентом сбора, не открывая порт
+ * Перед каждым выводом генерируется Collect, чтобы владелец успел обновить текущие значения (очереди, запросы)
+*/
+#ifndef TMETRICSEXPORTER_H
+#define TMETRICSEXPORTER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QHostAddress>
+#include <QTimer>
+#include "tmetrics.h"
+
+class TMetricsExporter : public QObject
+{
+    Q_OBJECT
+private:
+    static const int MaxRequestSize = 8192; //запросы с большим заголовком отклоняются
+
+    TMetrics *Metrics;
+    QTcpServer Server;
+    QTimer SnapshotTimer;
+    QString SnapshotFileName;
+
+    QByteArray Collected(); //текущие значения всех метрик
+
+public:
+    explicit TMetricsExporter(TMetrics *Metrics, QObject *parent = nullptr);
+
+    bool Listen(const QHostAddress &Address, quint16 Port); //запускает HTTP сервер
+    QString ErrorString() const { return Server.errorString(); }
+    void StartSnapshots(const QString &FileName, int Interval); //запускает периодическую запись в файл
+    bool WriteSnapshot(); //записывает файл немедленно
+
+signals:
+    void Collect(); //значения будут выведены - их нужно обновить
+
+private slots:
+    void onNewConnection();
+    void onReadyRead();
+    void onSnapshotTimeout();
+};
+
+#endif // TMETRICSEXPORTER_H
@@ -0,0 +1,180 @@
+#include <QFileInfo>
+#include <QDateTime>
+#include <cstring>
+#include "toldfiles.h"
+
+TOldFiles::TOldFiles()
+{
+    Slots.fill(EmptySlot, 16);
+}
+
+void TOldFiles::SplitPath(const QString &FileName, QString &Dir, QString &Name)
+{
+    const qsizetype Pos = FileName.lastIndexOf('/');
+    Dir = FileName.left(Pos + 1);
+    Name = FileName.mid(Pos + 1);
+}
+
+size_t TOldFiles::Hash(quint32 Dir, const QByteArray &Name, qint64 MTime)
+{
+    return qHashMulti(0, Dir, Name, MTime);
+}
+
+qsizetype TOldFiles::FindSlot(quint32 Dir, const QByteArray &Name, qint64 MTime) const
+{
+    const qsizetype Mask = Slots.size() - 1;
+    for (qsizetype i = Hash(Dir, Name, MTime) & Mask; ; i = (i + 1) & Mask) {
+        const quint32 Slot = Slots[i];
+        if (Slot == EmptySlot) return -1;
+        if (Slot == DeletedSlot) continue;
+        const TEntry &Entry = Entries[Slot - 1];
+        if ((Entry.Dir == Dir) && (Entry.MTime == MTime) && (Entry.NameSize == quint32(Name.size())) &&
+            (std::memcmp(Names.constData() + Entry.NameOffset, Name.constData(), Name.size()) == 0)) {
+            return i;
+        }
+    }
+}
+
+void TOldFiles::Rehash(qsizetype NewSize)
+{
+    Slots.fill(EmptySlot, NewSize);
+    UsedSlots = 0;
+    const qsizetype Mask = NewSize - 1;
+    for (qsizetype Index = 0; Index < Entries.size(); ++Index) {
+        const TEntry &Entry = Entries[Index];
+        if (Entry.Dir == DeletedDir) continue;
+        const QByteArray Name = QByteArray::fromRawData(Names.constData() + Entry.NameOffset, Entry.NameSize);
+        qsizetype i = Hash(Entry.Dir, Name, Entry.MTime) & Mask;
+        while (Slots[i] != EmptySlot) i = (i + 1) & Mask;
+        Slots[i] = quint32(Index + 1);
+        ++UsedSlots;
+    }
+}
+
+void TOldFiles::Compact()
+{
+    QByteArray NewNames;
+    NewNames.reserve(Names.size());
+    QList<TEntry> NewEntries;
+    NewEntries.reserve(Count);
+    qsizetype NewCursor = -1;
+    for (qsizetype Index = 0; Index < Entries.size(); ++Index) {
+        //незаконченная проверка Evict продолжится с той же записи
+        if ((NewCursor == -1) && (Index >= EvictCursor)) NewCursor = NewEntries.size();
+        const TEntry &Entry = Entries[Index];
+        if (Entry.Dir == DeletedDir) continue;
+        TEntry tmp = Entry;
+        tmp.NameOffset = quint32(NewNames.size());
+        NewNames.append(Names.constData() + Entry.NameOffset, Entry.NameSize);
+        NewEntries.push_back(tmp);
+    }
+    EvictCursor = (NewCursor == -1) ? NewEntries.size() : NewCursor;
+    Names.swap(NewNames);
+    Entries.swap(NewEntries);
+    Names.squeeze();
+    Entries.squeeze();
+
+    //размер таблицы - степень двойки с заполнением не более половины
+    qsizetype NewSize = 16;
+    while (NewSize < Count * 2) NewSize *= 2;
+    Rehash(NewSize);
+}
+
+void TOldFiles::Insert(const QString &FileName, qint64 MTime)
+{
+    QString DirName;
+    QString FileNameOnly;
+    SplitPath(FileName, DirName, FileNameOnly);
+    auto DirIt = DirIndex.constFind(DirName);
+    quint32 Dir = 0;
+    if (DirIt == DirIndex.constEnd()) {
+        Dir = quint32(Dirs.size());
+        Dirs.push_back(DirName);
+        DirIndex.insert(DirName, Dir);
+    }
+    else {
+        Dir = DirIt.value();
+    }
+
+    const QByteArray Name = FileNameOnly.toUtf8();
+    if (FindSlot(Dir, Name, MTime) != -1) return;
+
+    //заполнение таблицы не более 3/4, считая удаленные слоты
+    if ((UsedSlots + 1) * 4 > Slots.size() * 3) {
+        qsizetype NewSize = Slots.size();
+        while ((Count + 1) * 2 > NewSize) NewSize *= 2;
+        Rehash(NewSize);
+    }
+
+    TEntry Entry;
+    Entry.Dir = Dir;
+    Entry.NameOffset = quint32(Names.size());
+    Entry.NameSize = quint32(Name.size());
+    Entry.MTime = MTime;
+    Names.append(Name);
+    Entries.push_back(Entry);
+
+    const qsizetype Mask = Slots.size() - 1;
+    qsizetype i = Hash(Dir, Name, MTime) & Mask;
+    while ((Slots[i] != EmptySlot) && (Slots[i] != DeletedSlot)) i = (i + 1) & Mask;
+    if (Slots[i] == EmptySlot) ++UsedSlots;
+    Slots[i] = quint32(Entries.size());
+    ++Count;
+}
+
+bool TOldFiles::Contains(const QString &FileName, qint64 MTime) const
+{
+    QString DirName;
+    QString FileNameOnly;
+    SplitPath(FileName, DirName, FileNameOnly);
+    auto DirIt = DirIndex.constFind(DirName);
+    if (DirIt == DirIndex.constEnd()) return false;
+    return FindSlot(DirIt.value(), FileNameOnly.toUtf8(), MTime) != -1;
+}
+
+void TOldFiles::Remove(const QString &FileName, qint64 MTime)
+{
+    QString DirName;
+    QString FileNameOnly;
+    SplitPath(FileName, DirName, FileNameOnly);
+    auto DirIt = DirIndex.constFind(DirName);
+    if (DirIt == DirIndex.constEnd()) return;
+    const qsizetype i = FindSlot(DirIt.value(), FileNameOnly.toUtf8(), MTime);
+    if (i == -1) return;
+
+    RemoveSlot(i);
+    //удаленных записей больше, чем действующих - освобождаем память
+    if ((Entries.size() > 1024) && (Count * 2 < Entries.size())) Compact();
+}
+
+void TOldFiles::RemoveSlot(qsizetype i)
+{
+    Entries[Slots[i] - 1].Dir = DeletedDir;
+    Slots[i] = DeletedSlot;
+    --Count;
+}
+
+qsizetype TOldFiles::Evict(qsizetype Limit, bool &Done, QList<QPair<QString, qint64>> *Evicted)
+{
+    //оставляем только записи, совпадающие с текущим временем изменения существующего файла
+    qsizetype EvictedCount = 0;
+    const qsizetype End = qMin(Entries.size(), EvictCursor + qMax<qsizetype>(1, Limit));
+    for (; EvictCursor < End; ++EvictCursor) {
+        const TEntry &Entry = Entries[EvictCursor];
+        if (Entry.Dir == DeletedDir) continue;
+        const QByteArray Name(Names.constData() + Entry.NameOffset, Entry.NameSize);
+        const QString FileName = Dirs[Entry.Dir] + QString::fromUtf8(Name);
+        const QFileInfo FileInfo(FileName);
+        if (FileInfo.exists() && (FileInfo.fileTime(QFileDevice::FileModificationTime).toMSecsSinceEpoch() == Entry.MTime)) continue;
+        if (Evicted != nullptr) Evicted->push_back(qMakePair(FileName, Entry.MTime));
+        RemoveSlot(FindSlot(Entry.Dir, Name, Entry.MTime));
+        ++EvictedCount;
+    }
+    Done = (EvictCursor >= Entries.size());
+    if (Done) {
+        EvictCursor = 0;
+        //память освобождается один раз за проход
+        if (Count * 2 < Entries.size()) Compact();
+    }
+    return EvictedCount;
+}
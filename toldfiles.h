@@ -0,0 +1,60 @@
+/* Компактное множество уже обработанных файлов цели (путь, время изменения)
+ * Директории хранятся один раз и на них ссылаются по номеру, имена файлов лежат подряд в одном буфере в UTF-8,
+ * время изменения хранится в мс от начала эпохи. Поиск идет по собственной хеш-таблице с открытой адресацией,
+ * в которой хранятся только номера записей. Записи о файлах, которых больше нет на диске, удаляются методом Evict
+ * по частям: каждый вызов проверяет ограниченное число записей и продолжает с места, где остановился прошлый
+*/
+#ifndef TOLDFILES_H
+#define TOLDFILES_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QPair>
+
+class TOldFiles
+{
+private:
+    typedef struct {
+        quint32 Dir;        //номер директории в Dirs. DeletedDir - запись удалена
+        quint32 NameOffset; //смещение имени в Names
+        quint32 NameSize;   //длина имени в байтах
+        qint64 MTime;       //время изменения, мс от начала эпохи
+    } TEntry;
+
+    static const quint32 DeletedDir = 0xFFFFFFFF;
+    static const quint32 EmptySlot = 0;
+    static const quint32 DeletedSlot = 0xFFFFFFFF;
+
+    QStringList Dirs;               //директории
+    QHash<QString, quint32> DirIndex; //номер директории по пути
+    QByteArray Names;               //имена файлов
+    QList<TEntry> Entries;
+    QList<quint32> Slots;           //хеш-таблица: номер записи + 1, EmptySlot или DeletedSlot
+    qsizetype Count = 0;            //количество действующих записей
+    qsizetype UsedSlots = 0;        //занятые слоты, включая удаленные
+    qsizetype EvictCursor = 0;      //номер записи, с которой продолжится проверка Evict
+
+    static void SplitPath(const QString &FileName, QString &Dir, QString &Name);
+    static size_t Hash(quint32 Dir, const QByteArray &Name, qint64 MTime);
+    qsizetype FindSlot(quint32 Dir, const QByteArray &Name, qint64 MTime) const; //-1 - не найден
+    void Rehash(qsizetype NewSize);
+    void Compact(); //убирает удаленные записи из Entries и Names
+    void RemoveSlot(qsizetype i); //удаляет запись, на которую указывает слот i
+
+public:
+    TOldFiles();
+
+    void Insert(const QString &FileName, qint64 MTime);
+    bool Contains(const QString &FileName, qint64 MTime) const;
+    void Remove(const QString &FileName, qint64 MTime);
+    qsizetype Size() const { return Count; }
+    //удаляет записи о файлах, которых нет на диске или которые с тех пор изменились. Проверяет не более Limit записей
+    //Возвращает количество удаленных. Done - проход по всем записям завершен, следующий вызов начнет новый
+    //Evicted - удаленные записи (путь, время изменения), если нужны
+    qsizetype Evict(qsizetype Limit, bool &Done, QList<QPair<QString, qint64>> *Evicted = nullptr);
+};
+
+#endif // TOLDFILES_H
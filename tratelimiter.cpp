@@ -0,0 +1,41 @@
+#include <cmath>
+#include "tratelimiter.h"
+
+TRateLimiter::TRateLimiter(qint64 Rate)
+    : Rate(qMax<qint64>(0, Rate))
+    , Burst(qMax<qint64>(0, Rate))
+    , Tokens(qMax<qint64>(0, Rate))
+{
+    Clock.start();
+}
+
+void TRateLimiter::Refill()
+{
+    //считаем в наносекундах, иначе при частых вызовах доли миллисекунд терялись бы
+    const qint64 Now = Clock.nsecsElapsed();
+    Tokens = qMin<double>(Burst, Tokens + static_cast<double>(Rate) * (Now - LastRefill) / 1000000000.0);
+    LastRefill = Now;
+}
+
+bool TRateLimiter::Allowed()
+{
+    if (Unlimited()) return true;
+    Refill();
+    return Tokens > 0;
+}
+
+qint64 TRateLimiter::Delay()
+{
+    if (Unlimited()) return 0;
+    Refill();
+    if (Tokens > 0) return 0;
+    //время на погашение долга и еще один байт
+    return static_cast<qint64>(std::ceil((1.0 - Tokens) * 1000.0 / Rate));
+}
+
+void TRateLimiter::Consume(qint64 Bytes)
+{
+    if (Unlimited()) return;
+    Refill();
+    Tokens -= Bytes;
+}
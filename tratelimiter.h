@@ -0,0 +1,32 @@
+/* Ограничение скорости передачи (маркерная корзина)
+ * Корзина пополняется на Rate байт в секунду и вмещает не больше Burst байт. Передача разрешена, пока
+ * в корзине что-то есть, и списывает переданный размер целиком - корзина может уйти в минус, тогда
+ * следующая передача ждет, пока долг не будет погашен. Так файл любого размера проходит без разбиения,
+ * а средняя скорость не превышает Rate
+*/
+#ifndef TRATELIMITER_H
+#define TRATELIMITER_H
+
+#include <QElapsedTimer>
+
+class TRateLimiter
+{
+private:
+    qint64 Rate = 0;   //байт в секунду. 0 - без ограничения
+    qint64 Burst = 0;  //вместимость корзины, байт
+    double Tokens = 0; //байт в корзине
+    QElapsedTimer Clock;
+    qint64 LastRefill = 0; //время последнего пополнения от запуска Clock, нс
+
+    void Refill();
+
+public:
+    explicit TRateLimiter(qint64 Rate = 0); //Burst - одна секунда передачи
+
+    bool Unlimited() const { return Rate <= 0; }
+    bool Allowed();    //можно передавать прямо сейчас
+    qint64 Delay();    //сколько ждать до разрешения передачи, мс. 0 - можно сейчас
+    void Consume(qint64 Bytes);
+};
+
+#endif // TRATELIMITER_H
@@ -0,0 +1,112 @@
+#include <QDebug>
+#include <QtEndian>
+#include <cstring>
+#include "trequestbody.h"
+
+TRequestBody::TRequestBody(TSyncDB *SyncDB, qint64 ChunkSize, QObject *parent)
+    : QIODevice(parent)
+    , SyncDB(SyncDB)
+    , ChunkSize(qMax<qint64>(ChunkSize, 1024))
+{
+}
+
+void TRequestBody::AddData(const QByteArray &Data)
+{
+    if (Data.isEmpty()) return;
+    TPart tmp;
+    tmp.Data = Data;
+    tmp.Size = Data.size();
+    Parts.push_back(tmp);
+    TotalSize += tmp.Size;
+}
+
+void TRequestBody::AddBody(quint64 ID, qint64 Size, bool ToBase64, qint64 Offset)
+{
+    if (Size <= 0) return;
+    TPart tmp;
+    tmp.ID = ID;
+    tmp.Size = Size;
+    tmp.Offset = Offset;
+    tmp.ToBase64 = ToBase64;
+    Parts.push_back(tmp);
+    TotalSize += ToBase64 ? Base64Size(Size) : Size;
+}
+
+void TRequestBody::AddFrameHeader(qint64 Size)
+{
+    QByteArray Header(8, '\0');
+    qToBigEndian<qint64>(Size, Header.data());
+    AddData(Header);
+}
+
+qint64 TRequestBody::bytesAvailable() const
+{
+    return TotalSize - ReadSize + QIODevice::bytesAvailable();
+}
+
+bool TRequestBody::atEnd() const
+{
+    return (ReadSize >= TotalSize) && QIODevice::atEnd();
+}
+
+bool TRequestBody::NextChunk()
+{
+    Buffer.clear();
+    BufferPos = 0;
+    while (CurrentPart < Parts.size()) {
+        const TPart &Part = Parts[CurrentPart];
+        if (PartPos >= Part.Size) { //часть полностью считана - переходим к следующей
+            ++CurrentPart;
+            PartPos = 0;
+            continue;
+        }
+        if (Part.ID == 0) { //готовые данные отдаем целиком
+            Buffer = Part.Data;
+        }
+        else { //тело файла читаем из БД очередным куском
+            //при кодировании в Base64 читаем кратно 3 байтам, чтобы куски можно было кодировать независимо
+            const qint64 ReadSize = Part.ToBase64 ? ChunkSize - ChunkSize % 3 : ChunkSize;
+            if (!SyncDB->ReadBodyChunk(Part.ID, Part.Offset + PartPos, qMin(ReadSize, Part.Size - PartPos), Buffer)) {
+                setErrorString("Cannot read file body from DB. ID: " + QString::number(Part.ID) + " Error: " + SyncDB->ErrorString());
+                qDebug() << errorString();
+                return false;
+            }
+            if (Buffer.isEmpty()) {
+                setErrorString("File body in DB is shorter than expected. ID: " + QString::number(Part.ID));
+                qDebug() << errorString();
+                return false;
+            }
+        }
+        PartPos += Buffer.size();
+        if (Part.ToBase64) Buffer = Buffer.toBase64(QByteArray::Base64Encoding);
+        return true;
+    }
+    return false;
+}
+
+qint64 TRequestBody::readData(char *data, qint64 maxSize)
+{
+    qint64 Result = 0;
+    while (Result < maxSize) {
+        if (BufferPos >= Buffer.size()) {
+            if (!NextChunk()) {
+                //данные закончились раньше, чем ожидалось - это ошибка чтения
+                if ((Result == 0) && (ReadSize < TotalSize)) return -1;
+                break;
+            }
+        }
+        const qint64 Count = qMin(maxSize - Result, Buffer.size() - BufferPos);
+        std::memcpy(data + Result, Buffer.constData() + BufferPos, Count);
+        BufferPos += Count;
+        Result += Count;
+    }
+    ReadSize += Result;
+    return Result;
+}
+
+qint64 TRequestBody::writeData(const char *data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+    return -1;
+}
@@ -0,0 +1,59 @@
+/* Тело HTTP запроса, которое формируется по мере отправки
+ * Состоит из частей: готовые блоки данных (разметка XML) и тела файлов из таблицы SYNCFILE
+ * Тела файлов считываются из БД кусками по ChunkSize байт, поэтому объем занимаемой
+ * памяти не зависит от размера передаваемых файлов
+ * Тело хранящееся в БД в двоичном виде при необходимости кодируется в Base64 на лету
+*/
+#ifndef TREQUESTBODY_H
+#define TREQUESTBODY_H
+
+#include <QObject>
+#include <QIODevice>
+#include <QList>
+#include <QByteArray>
+#include "tsyncdb.h"
+
+class TRequestBody : public QIODevice
+{
+    Q_OBJECT
+private:
+    typedef struct {
+        QByteArray Data; //готовые данные
+        quint64 ID = 0;  //ID записи в SYNCFILE. 0 - часть содержит готовые данные
+        qint64 Size = 0; //размер тела файла в БД
+        qint64 Offset = 0; //позиция в теле файла, с которой начинается часть
+        bool ToBase64 = false; //кодировать тело в Base64 при отправке
+    } TPart;
+
+    QList<TPart> Parts;
+    TSyncDB *SyncDB; //БД, из которой читаются тела файлов
+    const qint64 ChunkSize;
+
+    qsizetype CurrentPart = 0; //текущая отправляемая часть
+    qint64 PartPos = 0;        //сколько байт текущей части уже считано
+    QByteArray Buffer;         //текущий кусок данных
+    qint64 BufferPos = 0;      //позиция в текущем куске
+    qint64 TotalSize = 0;      //общий размер тела запроса
+    qint64 ReadSize = 0;       //сколько байт уже отдано
+
+    bool NextChunk(); //загружает в Buffer следующий кусок. false - данных больше нет или произошла ошибка
+
+public:
+    explicit TRequestBody(TSyncDB *SyncDB, qint64 ChunkSize = 65536, QObject *parent = nullptr);
+
+    void AddData(const QByteArray &Data);   //добавляет готовый блок данных
+    void AddBody(quint64 ID, qint64 Size, bool ToBase64 = false, qint64 Offset = 0); //добавляет Size байт тела файла из SYNCFILE начиная с Offset
+    void AddFrameHeader(qint64 Size); //добавляет заголовок кадра двоичного протокола - 8 байт длины (big-endian)
+    static qint64 Base64Size(qint64 Size) { return (Size + 2) / 3 * 4; } //размер данных после кодирования в Base64
+    qint64 Size() const { return TotalSize; } //общий размер тела запроса
+
+    bool isSequential() const override { return true; }
+    qint64 bytesAvailable() const override;
+    bool atEnd() const override;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 maxSize) override;
+};
+
+#endif // TREQUESTBODY_H
@@ -0,0 +1,123 @@
+#include <QMap>
+#include <QStringList>
+#include <algorithm>
+#include "tscheduler.h"
+
+TScheduler::TCategoryInfo &TScheduler::Info(const QString &Category)
+{
+    //категория без настроек создается с приоритетом 0, весом 1 и без ограничения скорости
+    return Categories[Category];
+}
+
+void TScheduler::AddCategory(const QString &Category, int Priority, int Weight, qint64 Rate)
+{
+    TCategoryInfo &Item = Info(Category);
+    Item.Priority = Priority;
+    Item.Weight = qMax(1, Weight);
+    Item.Limiter = TRateLimiter(Rate);
+}
+
+bool TScheduler::Allowed(const QString &Category)
+{
+    return Info(Category).Limiter.Allowed();
+}
+
+qint64 TScheduler::Delay(const QString &Category)
+{
+    return Info(Category).Limiter.Delay();
+}
+
+void TScheduler::Consume(const QString &Category, qint64 Bytes)
+{
+    TCategoryInfo &Item = Info(Category);
+    Item.Limiter.Consume(Bytes);
+    //файл, выбранный в обход доли (Urgent или часть большого файла), не уводит долю в минус
+    Item.Deficit = qMax<qint64>(0, Item.Deficit - Bytes);
+}
+
+QList<qsizetype> TScheduler::Pick(const QList<TCandidate> &Candidates, int MaxFiles, qint64 MaxSize, qint64 &Wait)
+{
+    Wait = 0;
+    //выбор ведется на копиях состояния категорий: файлы, которые в итоге не уйдут, не должны расходовать предел и долю
+    QHash<QString, TCategoryInfo> Work;
+    QHash<QString, qint64> PickedSize; //выбрано по доле, байт. Возвращается в долю, чтобы Consume списал только отправленное
+    QList<qsizetype> Picked;
+    qint64 Size = 0;
+    qint64 MinWait = 0; //ближайшее восстановление предела скорости среди пропущенных категорий
+    auto Limited = [&MinWait](TCategoryInfo &Category) {
+        if (Category.Limiter.Allowed()) return false;
+        const qint64 Delay = Category.Limiter.Delay();
+        if ((MinWait == 0) || (Delay < MinWait)) MinWait = Delay;
+        return true;
+    };
+
+    //файлы, ждущие дольше допустимого, идут первыми по порядку ID. Остальные - в очереди своих категорий
+    QHash<QString, QList<qsizetype>> Queues;
+    QStringList Order;
+    for (qsizetype i = 0; i < Candidates.size(); ++i) {
+        const TCandidate &File = Candidates[i];
+        auto Category = Work.find(File.Category);
+        if (Category == Work.end()) Category = Work.insert(File.Category, Info(File.Category));
+        if (File.Urgent && (Picked.size() < MaxFiles) && (Picked.isEmpty() || (Size + File.Size <= MaxSize)) && !Limited(*Category)) {
+            Category->Limiter.Consume(File.Size);
+            Size += File.Size;
+            Picked.push_back(i);
+            continue;
+        }
+        QList<qsizetype> &Queue = Queues[File.Category];
+        if (Queue.isEmpty()) Order.push_back(File.Category);
+        Queue.push_back(i);
+    }
+
+    if (!Order.isEmpty()) {
+        const qsizetype Start = Round % Order.size();
+        Round = static_cast<int>(Start) + 1;
+        std::rotate(Order.begin(), Order.begin() + Start, Order.end());
+    }
+    QMap<int, QStringList> Levels; //категории по приоритетам
+    for (const auto &Category : Order) Levels[Work[Category].Priority].push_back(Category);
+
+    //уровни - от большего приоритета к меньшему. Следующий уровень получает только оставшееся место
+    for (auto Level = Levels.end(); (Level != Levels.begin()) && (Picked.size() < MaxFiles); ) {
+        --Level;
+        QStringList Active = Level.value();
+        //каждый обход добавляет категории Quantum * Weight байт. Категория отправляет файлы, пока хватает накопленного
+        while (!Active.isEmpty() && (Picked.size() < MaxFiles)) {
+            for (auto it = Active.begin(); (it != Active.end()) && (Picked.size() < MaxFiles); ) {
+                TCategoryInfo &Category = Work[*it];
+                QList<qsizetype> &Queue = Queues[*it];
+                Category.Deficit += Quantum * Category.Weight;
+                bool Skip = false; //в этом пакете категория больше ничего не отправит
+                while (!Queue.isEmpty() && (Picked.size() < MaxFiles)) {
+                    const TCandidate &File = Candidates[Queue.first()];
+                    if (!Picked.isEmpty() && (Size + File.Size > MaxSize)) {
+                        Skip = true;
+                        break;
+                    }
+                    if (Limited(Category)) {
+                        Skip = true;
+                        break;
+                    }
+                    if (File.Size > Category.Deficit) break;
+                    Category.Deficit -= File.Size;
+                    Category.Limiter.Consume(File.Size);
+                    PickedSize[*it] += File.Size;
+                    Size += File.Size;
+                    Picked.push_back(Queue.takeFirst());
+                }
+                //опустевшая очередь не копит дефицит - иначе категория потом надолго захватит пакет
+                if (Queue.isEmpty()) Category.Deficit = 0;
+                it = (Skip || Queue.isEmpty()) ? Active.erase(it) : it + 1;
+            }
+        }
+    }
+
+    //из состояния категорий сохраняется только накопленная доля. Пределы скорости не трогаем
+    for (auto it = Work.constBegin(); it != Work.constEnd(); ++it) {
+        Info(it.key()).Deficit = it->Deficit + PickedSize.value(it.key());
+    }
+
+    std::sort(Picked.begin(), Picked.end());
+    if (Picked.isEmpty()) Wait = MinWait;
+    return Picked;
+}
@@ -0,0 +1,62 @@
+/* Выбор файлов для очередного пакета по категориям
+ * Категории с большим Priority обслуживаются раньше: файлы категории с меньшим приоритетом попадают в пакет,
+ * только если место осталось. Категории одного приоритета делят пакет пропорционально Weight по байтам
+ * (взвешенный циклический обход с накоплением дефицита), поэтому объемные файлы одной категории не задерживают
+ * мелкие файлы другой. Для каждой категории и для всего обмена можно ограничить скорость в байтах в секунду:
+ * категория, исчерпавшая свой предел, пропускается до его восстановления.
+ * Категории, для которых ничего не задано, получают приоритет 0, вес 1 и не ограничиваются.
+ * Файлы, которые ждут дольше допустимого (Urgent), выбираются первыми по порядку ID - так файлы категорий
+ * с низким приоритетом не откладываются бесконечно. Pick только намечает файлы: предел скорости и доля категории
+ * списываются через Consume за файлы, которые действительно ушли на сервер
+*/
+#ifndef TSCHEDULER_H
+#define TSCHEDULER_H
+
+#include <QString>
+#include <QHash>
+#include <QList>
+#include "tratelimiter.h"
+
+class TScheduler
+{
+public:
+    typedef struct {
+        QString Category;
+        qint64 Size = 0; //сколько байт файла уйдет в пакете
+        bool Urgent = false; //файл ждет дольше допустимого - выбирается раньше остальных независимо от приоритета
+    } TCandidate;
+
+private:
+    typedef struct {
+        int Priority = 0;
+        int Weight = 1;
+        qint64 Deficit = 0; //сколько байт категория может отправить, не нарушая доли
+        TRateLimiter Limiter;
+    } TCategoryInfo;
+
+    static const qint64 Quantum = 65536; //байт на единицу веса за один обход
+
+    QHash<QString, TCategoryInfo> Categories;
+    TRateLimiter Global; //общий предел скорости обмена
+    int Round = 0;       //с какой категории начинается обход, чтобы ни одна не была всегда первой
+
+    TCategoryInfo &Info(const QString &Category);
+
+public:
+    void AddCategory(const QString &Category, int Priority, int Weight, qint64 Rate); //Rate - байт в секунду, 0 - без ограничения
+    void SetGlobalRate(qint64 Rate) { Global = TRateLimiter(Rate); }
+
+    int Priority(const QString &Category) const { return Categories.value(Category).Priority; }
+    bool Allowed(const QString &Category); //предел скорости категории не исчерпан
+    qint64 Delay(const QString &Category); //сколько ждать до восстановления предела категории, мс
+    void Consume(const QString &Category, qint64 Bytes); //файл категории отправлен: списывает предел скорости и долю категории
+    qint64 GlobalDelay() { return Global.Delay(); } //сколько ждать до восстановления общего предела, мс
+    void ConsumeGlobal(qint64 Bytes) { Global.Consume(Bytes); } //передано по сети в любую сторону
+
+    //выбирает файлы в пакет из не более MaxFiles файлов общим размером не более MaxSize (первый файл - любого размера)
+    //Candidates - по порядку ID. Возвращает номера выбранных файлов по возрастанию. Если ничего не выбрано из-за
+    //пределов скорости, Wait - сколько ждать до восстановления первого из них, мс
+    QList<qsizetype> Pick(const QList<TCandidate> &Candidates, int MaxFiles, qint64 MaxSize, qint64 &Wait);
+};
+
+#endif // TSCHEDULER_H
@@ -1,13 +1,19 @@
 #include <QDebug>
 #include <QSqlQuery>
-#include <QSqlError>
 #include <QXmlStreamWriter>
 #include <QCoreApplication>
 #include <QFileInfo>
 #include <QDir>
 #include <QProcess>
+#include <QBuffer>
+#include <QVersionNumber>
+#include <QCryptographicHash>
+#include <limits>
+#include <algorithm>
 #include "tsync.h"
 
+const QString TSync::BinaryContentType = "application/x-sync-frames";
+
 TSync::TSync(const QString &ConfigFileName, QObject *parent)
     : QObject(parent)
 {
@@ -18,11 +24,15 @@ TSync::TSync(const QString &ConfigFileName, QObject *parent)
     }
 
     Config->beginGroup("DATABASE");
-    DB = QSqlDatabase::addDatabase(Config->value("Driver", "QODBC").toString(), "MainDB");
-    DB.setDatabaseName(Config->value("DataBase", "SystemMonitorDB").toString());
+    BinaryBody = Config->value("BinaryBody", false).toBool();
+    ContentHash = Config->value("ContentHash", false).toBool();
+    SyncDB = new TSyncDB(QSqlDatabase::addDatabase(Config->value("Driver", "QODBC").toString(), "MainDB"), BinaryBody, ContentHash, this);
+    QSqlDatabase &DB = SyncDB->Connection();
+    //встроенная БД по умолчанию лежит рядом с программой. Соединения потоков записи ждут друг друга, а не получают ошибку
+    DB.setDatabaseName(Config->value("DataBase", SyncDB->Embedded() ? QCoreApplication::applicationDirPath() + "/Sync.sqlite" : "SystemMonitorDB").toString());
     DB.setUserName(Config->value("UID", "SYSDBA").toString());
     DB.setPassword(Config->value("PWD", "MASTERKEY").toString());
-    DB.setConnectOptions(Config->value("ConnectionOprions", "").toString());
+    DB.setConnectOptions(Config->value("ConnectionOprions", SyncDB->Embedded() ? "QSQLITE_BUSY_TIMEOUT=5000" : "").toString());
     DB.setPort(Config->value("Port", "3051").toUInt());
     DB.setHostName(Config->value("Host", "localhost").toString());
     Config->endGroup();
@@ -31,23 +41,134 @@ TSync::TSync(const QString &ConfigFileName, QObject *parent)
     UpdateTimer.setInterval(Config->value("Interval", "60000").toInt());
     UpdateTimer.setSingleShot(false);
     DebugMode = Config->value("Debug", "1").toBool();
+    EventDriven = Config->value("EventDriven", true).toBool();
+    ScanDelay = Config->value("ScanDelay", "200").toInt();
+    MaxScanDelay = qMax(ScanDelay, Config->value("MaxScanDelay", "1000").toInt());
+    StatCacheDir = Config->value("StatCacheDir", QCoreApplication::applicationDirPath() + "/StatCache").toString();
+    EvictTimer.setInterval(Config->value("EvictInterval", "86400000").toInt());
+    EvictSliceSize = qMax(1, Config->value("EvictSliceSize", "1000").toInt());
+    StatCacheTimer.setInterval(Config->value("StatCacheInterval", "300000").toInt());
+    DownloadQueueFile = Config->value("DownloadQueueFile", QCoreApplication::applicationDirPath() + "/DownloadQueue.dat").toString();
+    DownloadQueue = new TDownloadQueue(Config->value("DownloadQueueSize", "100000").toLongLong());
+    FileWriter = new TFileWriter(TFileWriter::DurabilityFromString(Config->value("WriteDurability", "batch").toString()),
+                                 Config->value("WriteBatchSize", "50").toInt(),
+                                 Config->value("WriteBatchDelay", "100").toInt());
+    QObject::connect(FileWriter, SIGNAL(FileSaved(quint64, const QString &)), this, SLOT(onFileSaved(quint64, const QString &)));
+    QObject::connect(FileWriter, SIGNAL(FileFailed(quint64, const QString &, const QString &)),
+                     this, SLOT(onFileSaveFailed(quint64, const QString &, const QString &)));
+    QObject::connect(FileWriter, SIGNAL(BatchSaved()), this, SLOT(onFileBatchSaved()));
+    FileWriter->SetMetrics(&Metrics);
+    const QString SnapshotFileName = Config->value("SnapshotFile", QCoreApplication::applicationDirPath() + "/OldFiles.snapshot").toString();
+    Snapshot = new TFileSnapshot(SnapshotFileName, DB.databaseName() + "@" + DB.hostName(), this);
+    LogWriter = new TLogWriter(SyncDB->Connection().connectionName(),
+                               Config->value("LogBatchSize", "100").toInt(),
+                               Config->value("LogFlushInterval", "1000").toInt(),
+                               Config->value("LogQueueSize", "10000").toInt());
+    Ingest = new TIngestPipeline(SyncDB->Connection().connectionName(), BinaryBody, ContentHash,
+                                 Config->value("IngestThreads", "0").toInt(),
+                                 Config->value("IngestBatchSize", "50").toInt(),
+                                 Config->value("IngestBatchDelay", "100").toInt(),
+                                 Config->value("IngestQueueSize", "100").toInt(),
+                                 Config->value("IngestQueueBytes", "67108864").toLongLong());
+    Ingest->SetDelta(Config->value("DeltaDir", QCoreApplication::applicationDirPath() + "/Delta").toString(),
+                     Config->value("DeltaBlockSize", "4096").toInt());
+    QObject::connect(Ingest, SIGNAL(FileAdded(const QString &, const QString &, const QDateTime &, qint64, const QByteArray &)),
+                     this, SLOT(onFileAdded(const QString &, const QString &, const QDateTime &, qint64, const QByteArray &)));
+    QObject::connect(Ingest, SIGNAL(FileFailed(const QString &, const QString &, const QDateTime &, const QString &)),
+                     this, SLOT(onFileFailed(const QString &, const QString &, const QDateTime &, const QString &)));
+    QObject::connect(Ingest, SIGNAL(BatchWritten(int, quint64)), this, SLOT(onBatchWritten(int, quint64)));
+    QObject::connect(Ingest, SIGNAL(ErrorOccurred(const QString &)), this, SLOT(onIngestError(const QString &)));
+    Ingest->SetMetrics(&Metrics);
+    //RetentionDays отсчитывается от времени изменения файла (CHANGE_DATE_TIME), а не от подтверждения сервером
+    Compactor = new TCompactor(SyncDB->Connection().connectionName(),
+                               Config->value("CompactionInterval", "3600000").toInt(),
+                               Config->value("RetentionDays", "30").toInt(),
+                               Config->value("CompactionSliceSize", "5000").toInt(),
+                               Config->value("CompactionSlicePause", "50").toInt(),
+                               Config->value("CompactionFullPass", "24").toInt());
+    Compactor->SetMetrics(&Metrics);
+    //очистка продолжается с места, на котором остановилась в прошлый раз
+    Compactor->SetState(Config->value("CompactionMark", "0").toULongLong(), Config->value("CompactionCursor", "0").toULongLong(),
+                        Config->value("CompactionPasses", "0").toInt());
+    QObject::connect(Compactor, SIGNAL(Compacted(qint64)), this, SLOT(onCompacted(qint64)));
+    QObject::connect(Compactor, SIGNAL(Progress(quint64, quint64, int)), this, SLOT(onCompactionProgress(quint64, quint64, int)));
+    QObject::connect(Compactor, SIGNAL(ErrorOccurred(const QString &)), this, SLOT(onCompactionError(const QString &)));
+    MetricsExporter = new TMetricsExporter(&Metrics, this);
+    QObject::connect(MetricsExporter, SIGNAL(Collect()), this, SLOT(onCollectMetrics()));
 
     Config->endGroup();
     QObject::connect(&UpdateTimer, SIGNAL(timeout()), this, SLOT(onStartGetData()));
+    ScanTimer.setSingleShot(true);
+    QObject::connect(&ScanTimer, SIGNAL(timeout()), this, SLOT(onStartGetData()));
+    QObject::connect(&EvictTimer, SIGNAL(timeout()), this, SLOT(onEvictOldFiles()));
+    EvictSliceTimer.setInterval(0);
+    QObject::connect(&EvictSliceTimer, SIGNAL(timeout()), this, SLOT(onEvictSlice()));
+    QObject::connect(&StatCacheTimer, SIGNAL(timeout()), this, SLOT(onSaveStatCache()));
+    ShapingTimer.setSingleShot(true);
+    QObject::connect(&ShapingTimer, SIGNAL(timeout()), this, SLOT(onShapingTimeout()));
 
     Config->beginGroup("SERVER");
     HTTPServerInfo.AZSCode = Config->value("UID", "000").toString();
     HTTPServerInfo.Url = "http://" + Config->value("Host", "localhost").toString() + ":" + Config->value("Port", "80").toString() +
                   "/CGI/SYNC&" + HTTPServerInfo.AZSCode +"&" + Config->value("PWD", "123456").toString();
     HTTPServerInfo.LastFileID = Config->value("LastFileID", "0").toULongLong();
-    HTTPServerInfo.DeleteFileID = HTTPServerInfo.LastFileID;
+    //тела файлов до LastFileID очищаются после сохранения LastFileID. Если очистка не успела - она повторяется при запуске
+    ClearedFileID = qMin(HTTPServerInfo.LastFileID, Config->value("ClearedFileID", HTTPServerInfo.LastFileID).toULongLong());
+    //файлы, подтвержденные не по порядку, после перезапуска повторно не отправляются. Подряд идущие ID хранятся диапазоном "A-B"
+    for (const auto &Item : Config->value("AckedFiles", "").toString().split(",", Qt::SkipEmptyParts)) {
+        const qsizetype Pos = Item.indexOf('-');
+        const quint64 From = qMax(Item.left(Pos).toULongLong(), HTTPServerInfo.LastFileID + 1);
+        const quint64 To = (Pos < 0) ? From : Item.mid(Pos + 1).toULongLong();
+        for (quint64 ID = From; ID <= To; ++ID) AckedIDs.insert(ID);
+    }
+    MaxAckedFiles = qMax(1, Config->value("MaxAckedFiles", "10000").toInt());
+    AckSaveTimer.setInterval(Config->value("AckSaveInterval", "1000").toInt());
+    AckSaveTimer.setSingleShot(true);
+    QObject::connect(&AckSaveTimer, SIGNAL(timeout()), this, SLOT(onSaveAcks()));
     HTTPServerInfo.LastDownloadID = Config->value("LastDownloadID", "0").toULongLong();
+    DownloadQueueKey = HTTPServerInfo.AZSCode + "@" + Config->value("Host", "localhost").toString() + ":" + Config->value("Port", "80").toString();
+    ListRefreshInterval = Config->value("ListRefreshInterval", "3600000").toInt();
+    HTTPServerInfo.UploadFileID = Config->value("UploadFileID", "0").toULongLong();
+    HTTPServerInfo.UploadOffset = Config->value("UploadOffset", "0").toLongLong();
+    //части тела в Base64 должны декодироваться независимо, поэтому размер части кратен 12 (3 байта и 4 символа)
+    HTTPServerInfo.TransferChunkSize = qMax<qint64>(0, Config->value("TransferChunkSize", "1048576").toLongLong()) / 12 * 12;
+    HTTPServerInfo.MaxRequests = qMax(1, Config->value("MaxRequests", "4").toInt());
+    HTTPServerInfo.MaxFilesPerPacket = qMax(1u, Config->value("MaxFilesPerPacket", "100").toUInt());
+    HTTPServerInfo.MaxPacketSize = Config->value("MaxPacketSize", "5242880").toLongLong();
+    HTTPServerInfo.MaxDownloadFiles = qMax(1u, Config->value("MaxDownloadFiles", "100").toUInt());
+    HTTPServerInfo.MaxDownloadSize = Config->value("MaxDownloadSize", "5242880").toLongLong();
+    HTTPServerInfo.BodyChunkSize = Config->value("BodyChunkSize", "65536").toLongLong();
+    ScheduleWindow = qMax(1, Config->value("ScheduleWindow", "10000").toInt());
+    MaxScheduleDelay = Config->value("MaxScheduleDelay", "60000").toInt();
+    ScheduleClock.start();
+    //общий предел скорости обмена в обе стороны, байт в секунду. 0 - без ограничения
+    Scheduler.SetGlobalRate(Config->value("MaxRate", "0").toLongLong());
+    HTTPServerInfo.BinaryAllowed = Config->value("BinaryProtocol", true).toBool();
+    HTTPServerInfo.CompressionMinSize = Config->value("CompressionMinSize", "1024").toLongLong();
+    HTTPServerInfo.NoCompressExt = Config->value("NoCompressExt", "zip,gz,tgz,bz2,xz,7z,rar,zst,cab,jpg,jpeg,png,gif,mp3,mp4,avi").toString().toLower().split(",", Qt::SkipEmptyParts);
+    const TCompressDevice::TMethod Compression = TCompressDevice::MethodFromString(Config->value("Compression", "none").toString());
+    const int CompressionLevel = Config->value("CompressionLevel", "6").toInt();
+    const bool AcceptEncoding = Config->value("AcceptEncoding", true).toBool();
+    const int ConnectTimeout = Config->value("ConnectTimeout", "10000").toInt();
+    const int TransferTimeout = Config->value("TransferTimeout", "60000").toInt();
+    Backoff = new TBackoff(Config->value("RetryMinDelay", "1000").toLongLong(),
+                           Config->value("RetryMaxDelay", "300000").toLongLong(),
+                           Config->value("MaxFailures", "5").toInt(), this);
     Config->endGroup();
+    Backoff->SetMaxWindow(HTTPServerInfo.MaxRequests);
+    LoadPartialDownloads();
+    QObject::connect(Backoff, SIGNAL(RetryAllowed()), this, SLOT(onStartGetData()));
+    QObject::connect(Backoff, SIGNAL(SendLogMsg(uint16_t, const QString &)), this, SLOT(onSendLogMsg(uint16_t, const QString &)));
 
     HTTPQuery = new THTTPQuery(HTTPServerInfo.Url, this);
-    QObject::connect(HTTPQuery, SIGNAL(GetAnswer(const QByteArray &)), this, SLOT(onHTTPGetAnswer(const QByteArray &)));
+    HTTPQuery->SetCompression(Compression, CompressionLevel);
+    HTTPQuery->SetAcceptEncoding(AcceptEncoding);
+    HTTPQuery->SetTimeouts(ConnectTimeout, TransferTimeout);
+    QObject::connect(HTTPQuery, SIGNAL(GetAnswerContentType(quint64, const QString &)), this, SLOT(onHTTPGetAnswerContentType(quint64, const QString &)));
+    QObject::connect(HTTPQuery, SIGNAL(GetAnswerData(quint64, const QByteArray &)), this, SLOT(onHTTPGetAnswerData(quint64, const QByteArray &)));
+    QObject::connect(HTTPQuery, SIGNAL(GetAnswerFinished(quint64)), this, SLOT(onHTTPGetAnswerFinished(quint64)));
     QObject::connect(HTTPQuery, SIGNAL(SendLogMsg(uint16_t, const QString &)), this, SLOT(onSendLogMsg(uint16_t, const QString &)));
-    QObject::connect(HTTPQuery, SIGNAL(ErrorOccurred()), this, SLOT(onHTTPError()));
+    QObject::connect(HTTPQuery, SIGNAL(ErrorOccurred(quint64)), this, SLOT(onHTTPError(quint64)));
 
     FileSystemWatcher = new QFileSystemWatcher(this);
     QObject::connect(FileSystemWatcher, SIGNAL(directoryChanged(const QString &)), this, SLOT(onDirectoryChanged(const QString &)));
@@ -60,16 +181,51 @@ TSync::~TSync()
     HTTPQuery->deleteLater();
     FileSystemWatcher->deleteLater();
 
+    FileWriter->Stop(); //дожидаемся сохранения всех полученных файлов
+    //результаты сохранения доставляем сразу - иначе LastDownloadID не учтет последние файлы
+    QCoreApplication::sendPostedEvents(this, QEvent::MetaCall);
+    delete FileWriter;
+    SaveDownloadQueue();
+
+    Ingest->Stop(); //дожидаемся записи в БД всех прочитанных файлов
+    delete Ingest;
+    AckSaveTimer.stop();
+    SaveAcks();
+    Compactor->Stop(); //незаконченный проход продолжится при следующем запуске с сохраненного места
+    QCoreApplication::sendPostedEvents(this, QEvent::MetaCall);
+    delete Compactor;
+    MetricsExporter->WriteSnapshot(); //последние значения перед остановкой
+    delete DownloadQueue;
+    Snapshot->Close();
+    //все поставленные файлы записаны - кеш атрибутов можно сохранить
+    StatCacheTimer.stop();
+    SaveStatCache(true);
     SendLogMsg(MSG_CODE::CODE_OK, "Successfully finished");
-    DB.close();
+    LogWriter->Stop(); //дожидаемся записи всех сообщений
+    delete LogWriter;
+    delete SyncDB;
 }
 
 void TSync::onStart()
 {
-    if (!DB.open()) {
-        qCritical() << "Cannot connect to database. Error: " << DB.lastError().text();
+    if (!SyncDB->Open()) {
+        qCritical() << SyncDB->ErrorString();
         exit(-1);
     };
+    LogWriter->Start();
+    FileWriter->Start();
+
+    //метрики доступны только локально, если явно не указан другой адрес
+    Config->beginGroup("SYSTEM");
+    const quint16 MetricsPort = Config->value("MetricsPort", "0").toUInt();
+    const QHostAddress MetricsAddress(Config->value("MetricsAddress", "127.0.0.1").toString());
+    const QString MetricsFile = Config->value("MetricsFile", "").toString();
+    const int MetricsInterval = Config->value("MetricsInterval", "60000").toInt();
+    Config->endGroup();
+    if ((MetricsPort != 0) && !MetricsExporter->Listen(MetricsAddress, MetricsPort)) {
+        SendLogMsg(MSG_CODE::CODE_ERROR, "Cannot start metrics endpoint. Port: " + QString::number(MetricsPort) + " Error: " + MetricsExporter->ErrorString());
+    }
+    if (!MetricsFile.isEmpty()) MetricsExporter->StartSnapshots(MetricsFile, MetricsInterval);
 
      //считываем количество целей для синхронизации
     Config->beginGroup("SYNCTARGETS");
@@ -88,7 +244,16 @@ void TSync::onStart()
         else { //отслеживаються локальные объекты
             if ((TargetName.right(1) == "/") || (TargetName.right(1) == "\\")) tmp.isChange = TTypeChange::CHANGE_DIR;
             else tmp.isChange = TTypeChange::CHANGE_FILE;
-            if (!FileSystemWatcher->addPath(TargetName)){
+            if (tmp.isChange == TTypeChange::CHANGE_DIR) {
+                tmp.Scanner = new TDirScanner(TargetName, this);
+                tmp.Scanner->Load(StatCacheFileName(TargetName));
+                QObject::connect(tmp.Scanner, SIGNAL(Changed(const QString &)), this, SLOT(onDirectoryChanged(const QString &)));
+            }
+            //если inotify доступен, он сообщает имена изменившихся файлов и QFileSystemWatcher для директории не нужен
+            if ((tmp.Scanner != nullptr) && tmp.Scanner->StartWatching()) {
+                if (DebugMode) qDebug() << "Target is watched by inotify:" << TargetName;
+            }
+            else if (!FileSystemWatcher->addPath(TargetName)){
                 SendLogMsg(MSG_CODE::CODE_INFORMATION, "Tracking target limit reached. Target " + TargetName  + "will be ignored");
             }
         }
@@ -96,6 +261,18 @@ void TSync::onStart()
         tmp.LastID = Config->value("LastID", "0").toULongLong();
         tmp.clearDirAfterSync = Config->value("ClearDirAfterSync", false).toBool();
         tmp.ignoreEmptyFile = Config->value("IgnoreEmptyFile", false).toBool();
+        //файлы категорий с большим приоритетом уходят на сервер раньше, одного приоритета - делят пакет по весу
+        if (tmp.isChange != TTypeChange::LOAD_FROM_SERVER) {
+            Scheduler.AddCategory(tmp.Category, Config->value("Priority", "0").toInt(), Config->value("Weight", "1").toInt(),
+                                  Config->value("MaxRate", "0").toLongLong());
+        }
+        //разность хранится в БД в двоичном виде, поэтому нужен столбец ENCODING и BinaryBody
+        tmp.Delta = Config->value("Delta", false).toBool() && (tmp.isChange == TTypeChange::CHANGE_FILE);
+        if (tmp.Delta && !BinaryBody) {
+            SendLogMsg(MSG_CODE::CODE_INFORMATION, "Delta mode requires BinaryBody. Target " + TargetName + " will be sent in full");
+            tmp.Delta = false;
+        }
+        DeltaEnabled = DeltaEnabled || tmp.Delta;
         Targets.insert(TargetName, tmp);
         CategoryToTarget.insert(tmp.Category, TargetName);
         Config->endGroup();
@@ -104,57 +281,277 @@ void TSync::onStart()
         }
     }
 
+    //очередь скачивания с прошлого запуска - сервер пришлет только файлы, которых в ней нет
+    //очередь относится к серверу и набору запрашиваемых категорий: при их изменении список получаем заново
+    QStringList LoadCategories;
+    for (const auto &Item : Targets) {
+        if (Item.isChange == TTypeChange::LOAD_FROM_SERVER) LoadCategories.push_back(Item.Category);
+    }
+    LoadCategories.sort();
+    LoadCategories.removeDuplicates();
+    DownloadQueueKey += "|" + LoadCategories.join(",");
+    if (DownloadQueue->Load(DownloadQueueFile, DownloadQueueKey, HTTPServerInfo.LastDownloadID) && DebugMode) {
+        qDebug() << "Download queue loaded. Files:" << DownloadQueue->Size();
+    }
+
+    //дочищаем тела файлов, подтвержденных перед сбоем
+    AcksChanged = (ClearedFileID != HTTPServerInfo.LastFileID);
+    SaveAcks();
     GetOldFileName(); //загружаем имена файлов которые уже изменялись
+    //неподтвержденные файлы считаем по БД один раз: туда же попадают файлы, записанные до запуска. Дальше счетчик ведется по событиям
+    if (!SyncDB->CountFiles(HTTPServerInfo.LastFileID, PendingFiles)) qDebug() << SyncDB->ErrorString();
+    PendingFiles -= qMin<quint64>(PendingFiles, AckedIDs.size());
+    InitBacklog();
+    //загрузку новых файлов запускаем, когда известны хеши уже записанных тел
+    Ingest->AddKnownHashes(KnownHashes);
+    KnownHashes.clear();
+    Ingest->Start();
+    Compactor->SetAckedID(ClearedFileID);
+    Compactor->Start();
 
     SendLogMsg(MSG_CODE::CODE_OK, "Successfully started");
 
     UpdateTimer.start(); //запускаем таймер обновления данных
+    if (EvictTimer.interval() > 0) EvictTimer.start();
+    if (StatCacheTimer.interval() > 0) StatCacheTimer.start();
 
     onStartGetData();
 }
 
 void TSync::SendLogMsg(uint16_t Category, const QString &Msg)
 {
-    //Str.replace(QRegularExpression("'"), "''");
     if (DebugMode) {
         qDebug() << Msg;
     }
-    QSqlQuery QueryLog(DB);
-    DB.transaction();
-    QString QueryText = "INSERT INTO LOG (CATEGORY, SENDER, MSG) VALUES ( "
-                        + QString::number(Category) + ", "
-                        "\'Sync\', "
-                        "\'" + Msg +"\'"
-                        ")";
-
-    if (!QueryLog.exec(QueryText)) {
-        qDebug() << "FAIL Cannot execute query. Error: " << QueryLog.lastError().text() << " Query: "<< QueryLog.lastQuery();
-        DB.rollback();
-        return;
+    //сообщение записывается в LOG асинхронно, вместе с другими сообщениями
+    LogWriter->Add(Category, Msg);
+}
+
+void TSync::SendRequests(bool Force)
+{
+    //заполняем окно одновременно выполняющихся запросов, пока есть что отправлять
+    //после ошибок окно сужается, а во время паузы запросы не отправляются вовсе
+    const int Window = qMin(HTTPServerInfo.MaxRequests, Backoff->Allowed());
+    int Failures = 0; //неудачная отправка не останавливает заполнение окна, но и не повторяется бесконечно
+    while ((Requests.size() < Window) && (Failures < Window)) {
+        //общий предел скорости исчерпан - отправка продолжится, когда он восстановится
+        qint64 Wait = Scheduler.GlobalDelay();
+        if (Wait > 0) {
+            ShapingForce = ShapingForce || (Force && Requests.isEmpty());
+        }
+        else {
+            const TSendResult Result = SendToHTTPServer(Force && Requests.isEmpty(), Wait);
+            if (Result == SEND_OK) continue;
+            if (Result == SEND_FAILED) {
+                ++Failures;
+                continue;
+            }
+        }
+        //отправка продолжится, когда восстановится исчерпанный общий предел или предел категорий файлов
+        if ((Wait > 0) && (!ShapingTimer.isActive() || (ShapingTimer.remainingTime() > Wait))) ShapingTimer.start(Wait);
+        break;
     }
-    if (!DB.commit()) {
-        qDebug() << "FAIL Cannot commit transation. Error: " << DB.lastError().text();
-        DB.rollback();
+}
+
+void TSync::InitBacklog()
+{
+    //файлы выбираются по категориям: и тем, файлы которых остались неподтвержденными, и категориям отслеживаемых целей
+    QStringList Categories;
+    if (!SyncDB->Categories(HTTPServerInfo.LastFileID, Categories)) {
+        qDebug() << SyncDB->ErrorString();
+        exit(-2);
+    }
+    for (const auto &Item : Targets) {
+        if (Item.isChange != TTypeChange::LOAD_FROM_SERVER) Categories.push_back(Item.Category);
+    }
+    for (const auto &Category : Categories) {
+        if (!SendCursors.contains(Category)) SendCursors.insert(Category, {HTTPServerInfo.LastFileID, false});
+    }
+
+    //большой файл, передача которого прервалась при прошлом запуске, продолжается раньше, чем начнется передача другого
+    if (HTTPServerInfo.UploadFileID == 0) return;
+    bool Exists = false;
+    if ((HTTPServerInfo.UploadFileID > HTTPServerInfo.LastFileID) && !AckedIDs.contains(HTTPServerInfo.UploadFileID)) {
+        if (!SyncDB->SelectFiles(HTTPServerInfo.UploadFileID - 1, HTTPServerInfo.UploadFileID)) {
+            qDebug() << SyncDB->ErrorString();
+            exit(-2);
+        }
+        Exists = SyncDB->FilesQuery().next();
+        if (Exists) Upload.File = ReadPacketFile(SyncDB->FilesQuery());
+        SyncDB->FinishFiles();
+    }
+    if (!Exists) {
+        Upload = TUploadInfo();
+        SaveUploadProgress();
         return;
+    }
+    quint64 BodyID = 0;
+    qint64 BodySize = 0;
+    QString Encoding;
+    if (!ResolveBody(Upload.File, BodyID, BodySize, Encoding)) {
+        qDebug() << SyncDB->ErrorString();
+        exit(-2);
+    }
+    Upload.File.BodySize = BodySize;
+    Upload.File.QueuedAt = ScheduleClock.elapsed();
+    Upload.ID = Upload.File.ID;
+    Upload.Size = BodySize;
+    Upload.Offset = qBound<qint64>(0, HTTPServerInfo.UploadOffset, Upload.Size);
+    if (DebugMode) {
+        qDebug() << "Resume the upload of file in chunks. ID:" << Upload.ID << "Offset:" << Upload.Offset << "of" << Upload.Size;
+    }
+}
+
+TSync::TPacketFile TSync::ReadPacketFile(const QSqlQuery &Query)
+{
+    TPacketFile File;
+    File.ID = Query.value("ID").toULongLong();
+    File.Category = Query.value("CATEGORY").toString();
+    File.FileName = Query.value("FILE_NAME").toString();
+    File.CreateDateTime = Query.value("CREATE_DATE_TIME").toDateTime();
+    File.ChangeDateTime = Query.value("CHANGE_DATE_TIME").toDateTime();
+    File.BodySize = Query.value("BODY_SIZE").toLongLong();
+    File.Encoding = SyncDB->HasEncoding() ? Query.value("ENCODING").toString() : QString("base64");
+    File.Hash = ContentHash ? Query.value("HASH").toString() : QString();
+    return File;
+}
+
+bool TSync::Overdue(const TPacketFile &File) const
+{
+    return (MaxScheduleDelay > 0) && (ScheduleClock.elapsed() - File.QueuedAt >= MaxScheduleDelay);
+}
+
+void TSync::FillBacklog()
+{
+    //окно заполняется по категориям: поток объемных файлов одной категории не закрывает планировщику файлы других
+    QHash<QString, qsizetype> Counts;
+    for (const auto &File : Backlog) ++Counts[File.Category];
+    QStringList Categories; //категории, у которых есть место в окне и могут быть новые файлы
+    for (auto it = SendCursors.constBegin(); it != SendCursors.constEnd(); ++it) {
+        if (!it->Exhausted && (Counts.value(it.key()) < ScheduleWindow)) Categories.push_back(it.key());
+    }
+    if (Categories.isEmpty()) return;
+
+    SyncDB->Transaction();
+
+    //выбираем новые файлы каждой категории по порядку
+    QList<TPacketFile> Files;
+    for (const auto &Category : Categories) {
+        TSendCursor &Cursor = SendCursors[Category];
+        if (!SyncDB->SelectCategoryFiles(Category, Cursor.SentID)) {
+            SyncDB->Rollback();
+            qDebug() << SyncDB->ErrorString();
+            exit(-2);
+        }
+        QSqlQuery &Query = SyncDB->CategoryFiles();
+        for (qsizetype Free = ScheduleWindow - Counts.value(Category); Free > 0; ) {
+            if (!Query.next()) {
+                Cursor.Exhausted = true; //до записи новых файлов категорию не выбираем
+                break;
+            }
+            const TPacketFile File = ReadPacketFile(Query);
+            Cursor.SentID = File.ID;
+            //файл уже подтвержден сервером или передается частями
+            if (AckedIDs.contains(File.ID) || (File.ID == Upload.ID)) continue;
+            Files.push_back(File);
+            --Free;
+        }
+        SyncDB->FinishCategoryFiles();
+    }
+
+    //тела ищем после закрытия курсоров: не все драйверы позволяют выполнять запросы при открытом курсоре
+    for (auto &File : Files) {
+        //для выбора файлов в пакет ссылке нужен размер тела, на которое она указывает
+        quint64 BodyID = 0;
+        qint64 BodySize = 0;
+        QString Encoding;
+        if (!ResolveBody(File, BodyID, BodySize, Encoding)) {
+            qDebug() << SyncDB->ErrorString();
+            SyncDB->Rollback();
+            exit(-2);
+        }
+        File.BodySize = BodySize;
+        File.QueuedAt = ScheduleClock.elapsed();
+        Backlog.insert(File.ID, File);
+    }
+
+    if (!SyncDB->Commit()) {
+       qDebug() << SyncDB->ErrorString();
+       exit(-4);
     };
 }
 
-void TSync::SendToHTTPServer()
+bool TSync::ResolveBody(const TPacketFile &File, quint64 &BodyID, qint64 &BodySize, QString &Encoding)
+{
+    BodyID = File.ID;
+    BodySize = File.BodySize;
+    Encoding = File.Encoding;
+    if (Encoding != "ref") return true;
+    //тело хранится в другой записи. Пока оно не очищено, отправляем его оттуда
+    //очищенное тело сервер уже подтвердил - отправляем только ссылку на него
+    if (!SyncDB->FindBody(File.Hash, BodyID, BodySize, Encoding)) return false;
+    if (BodyID == 0) BodySize = 0;
+    return true;
+}
+
+TSync::TSendResult TSync::SendToHTTPServer(bool Force, qint64 &Wait)
 {
-    //форматируем XML документ
-    QString XMLStr;
-    QXmlStreamWriter XMLWriter(&XMLStr);
+    Wait = 0;
+    TRequestInfo RequestInfo;
+    QElapsedTimer BuildTimer;
+    BuildTimer.start();
+
+    //тело запроса собирается из кусков разметки XML и тел файлов, которые читаются из БД уже во время отправки
+    //создается после выбора файлов из БД, чтобы не потерять его при аварийном завершении
+    TRequestBody *RequestBody = nullptr;
+    //в двоичном протоколе тела файлов идут отдельными кадрами после XML документа
+    RequestInfo.Framed = HTTPServerInfo.BinaryProtocol;
+    typedef struct {
+        quint64 ID;     //ID записи с телом
+        qint64 Offset;  //позиция и размер отправляемой части тела
+        qint64 Size;
+    } TBodyFrame;
+    QList<TBodyFrame> BodyFrames; //тела файлов для отправки отдельными кадрами
+    qint64 IncompressibleSize = 0; //размер тел уже сжатых файлов (архивы, изображения)
+
+    //форматируем XML документ сразу в UTF-8
+    QBuffer XMLBuffer;
+    XMLBuffer.open(QIODevice::WriteOnly);
+    QXmlStreamWriter XMLWriter(&XMLBuffer);
     XMLWriter.setAutoFormatting(true);
     XMLWriter.writeStartDocument("1.0");
     XMLWriter.writeStartElement("Root");
     XMLWriter.writeTextElement("AZSCode", HTTPServerInfo.AZSCode);
     XMLWriter.writeTextElement("ClientVersion", QCoreApplication::applicationVersion());
-    XMLWriter.writeTextElement("ProtocolVersion", "0.1");
+    XMLWriter.writeTextElement("ProtocolVersion", RequestInfo.Framed ? "0.2" : "0.1");
+    if (HTTPServerInfo.TransferChunkSize > 0) {
+        //сообщаем серверу, что умеем передавать большие файлы частями
+        XMLWriter.writeTextElement("SupportedProtocolVersion", "0.5");
+    }
+    else if (DeltaEnabled) {
+        //сообщаем серверу, что умеем отправлять изменения файлов разностями
+        XMLWriter.writeTextElement("SupportedProtocolVersion", "0.4");
+    }
+    else if (ContentHash) {
+        //сообщаем серверу, что умеем ссылаться на уже отправленные тела по хешу содержимого
+        XMLWriter.writeTextElement("SupportedProtocolVersion", "0.3");
+    }
+    else if (HTTPServerInfo.BinaryAllowed && !RequestInfo.Framed) {
+        //сообщаем серверу, что умеем работать в двоичном протоколе
+        XMLWriter.writeTextElement("SupportedProtocolVersion", "0.2");
+    }
     if (DebugMode) {
         qDebug() << "Starting the formation of a request to the server. Time:" << Timer.msecsTo(QTime::currentTime()) << "ms";
         qDebug() << "->Last download ID:" << HTTPServerInfo.LastDownloadID;
     }
     XMLWriter.writeTextElement("LastID", QString::number(HTTPServerInfo.LastDownloadID));
+    //время от времени запрашиваем полный список: файлы, которые сервер в нем больше не отдает, удаляются из очереди
+    RequestInfo.FullListing = (ListingRequestID == 0) && (ListRefreshInterval > 0) && (DownloadQueue->Size() > 0) &&
+                              (!ListRefreshTimer.isValid() || ListRefreshTimer.hasExpired(ListRefreshInterval));
+    //файлы до LastListedID уже есть в очереди скачивания, в списке незагруженных их можно не присылать
+    if (!RequestInfo.FullListing && (DownloadQueue->LastID() > HTTPServerInfo.LastDownloadID)) {
+        XMLWriter.writeTextElement("LastListedID", QString::number(DownloadQueue->LastID()));
+    }
     //список категорий запрашиваемых с сервера
     for (const auto &Item : Targets) {
         if (Item.isChange == TTypeChange::LOAD_FROM_SERVER) {
@@ -164,115 +561,588 @@ void TSync::SendToHTTPServer()
         }
     }
 
-    //запрашиваем первый файл из списка доступных
-    if (!FileForDownload.isEmpty()) {
-        if (DebugMode) {
-            qDebug() << "->Request file: " << FileForDownload.first();
-        }
+    //выбираем файлы для скачивания, которые еще не сохранены, не запрошены другими запросами и не сохраняются на диск
+    QSet<quint64> BusyFiles = DownloadingFiles;
+    for (auto it = SavingFiles.constBegin(); it != SavingFiles.constEnd(); ++it) BusyFiles.insert(it.key());
+    RequestInfo.DownloadIDs = DownloadQueue->Pending(HTTPServerInfo.MaxDownloadFiles, BusyFiles);
+
+    //запрашиваем сразу несколько файлов из списка доступных. Сервер отдает столько, сколько влезет в MaxSize
+    if (!RequestInfo.DownloadIDs.isEmpty()) {
         XMLWriter.writeStartElement("FilesForLoad");
-        XMLWriter.writeTextElement("HASH", FileForDownload.first());
+        XMLWriter.writeTextElement("MaxSize", QString::number(HTTPServerInfo.MaxDownloadSize));
+        //большие файлы сервер отдает частями не больше ChunkSize
+        if (HTTPServerInfo.ChunkSupported) XMLWriter.writeTextElement("ChunkSize", QString::number(HTTPServerInfo.TransferChunkSize));
+        for (const auto &ID : RequestInfo.DownloadIDs) {
+            const QString HASH = DownloadQueue->Hash(ID);
+            if (DebugMode) {
+                qDebug() << "->Request file: " << HASH;
+            }
+            //недокачанный файл запрашиваем с места, на котором прервалась передача
+            auto Part = PartialDownloads.constFind(ID);
+            if (HTTPServerInfo.ChunkSupported && (Part != PartialDownloads.constEnd())) {
+                XMLWriter.writeStartElement("HASH");
+                XMLWriter.writeAttribute("Offset", QString::number(Part->Offset));
+                XMLWriter.writeCharacters(HASH);
+                XMLWriter.writeEndElement(); //HASH
+            }
+            else {
+                XMLWriter.writeTextElement("HASH", HASH);
+            }
+        }
         XMLWriter.writeEndElement(); //FilesForLoad
     }
-    //Если доступных для скачивания файлов нет, отправляем первый доступный свой
-    else {
-        QSqlQuery Query(DB);
-        DB.transaction();
 
-        //выбираем 1 файл
-        QString QueryText = "SELECT ID, CATEGORY, FILE_NAME, CREATE_DATE_TIME, CHANGE_DATE_TIME, BODY "
-                            "FROM SYNCFILE "
-                            "WHERE ID = (SELECT MIN(ID) FROM SYNCFILE WHERE ID > " + QString::number(HTTPServerInfo.LastFileID) + " ) ";
-
-        if (!Query.exec(QueryText)) {
-            DB.rollback();
-            qDebug() << "Cannot execute query. Error: " + Query.lastError().text() + " Query: " + QueryText;
+    //в том же запросе отправляем свои файлы: скачивание и отправка не ждут друг друга
+    //описание файла в XML. Само тело не копируем - оно будет прочитано из БД кусками во время отправки
+    auto WriteFile = [&](const TPacketFile &File, bool Chunked, qint64 ChunkOffset, qint64 ChunkSize) {
+        quint64 BodyID = 0;
+        qint64 BodySize = 0;
+        QString Encoding;
+        //тело, на которое ссылается файл, могло быть очищено с момента выбора файла из БД
+        if (!ResolveBody(File, BodyID, BodySize, Encoding)) {
+            qDebug() << SyncDB->ErrorString();
+            delete RequestBody;
             exit(-2);
         }
-
-        //отправляемые на сервер первый неотправленный файл
-        if (Query.next()) {
-            if (DebugMode) {
-                qDebug() << "->Send file: " << Query.value("FILE_NAME").toString() << " to server";
+        if (DebugMode) {
+            qDebug() << "->Send file: " << File.FileName << " to server";
+        }
+        //разность хранится без кодирования, сервер собирает из нее файл по своей прошлой версии
+        const bool Delta = (Encoding == "delta");
+        XMLWriter.writeStartElement("File");
+        //по ID сервер подтверждает части и сообщает о разности, которую не смог применить
+        if (Chunked || Delta) XMLWriter.writeTextElement("ID", QString::number(File.ID));
+        XMLWriter.writeTextElement("Category", File.Category);
+        //выделяем только имя файла
+        QFileInfo tmp(File.FileName);
+        XMLWriter.writeTextElement("FileName", tmp.fileName());
+        XMLWriter.writeTextElement("CreateDateTime", File.CreateDateTime.toString("yyyy-MM-dd hh:mm:ss.zzz"));
+        XMLWriter.writeTextElement("ChangeDateTime", File.ChangeDateTime.toString("yyyy-MM-dd hh:mm:ss.zzz"));
+        if (!File.Hash.isEmpty()) XMLWriter.writeTextElement("Hash", File.Hash);
+        if (!Chunked) ChunkSize = BodySize;
+        const bool BinaryRow = (Encoding == "binary") || Delta;
+        if (BodyID == 0) {
+            XMLWriter.writeTextElement("BodyRef", File.Hash);
+            ChunkSize = 0;
+        }
+        else if (RequestInfo.Framed) {
+            //тело уйдет отдельным кадром как есть. Encoding сообщает серверу, как оно хранится
+            XMLWriter.writeEmptyElement("Body");
+            XMLWriter.writeAttribute("Size", QString::number(ChunkSize));
+            XMLWriter.writeAttribute("Encoding", BinaryRow ? "binary" : "base64");
+            if (Delta) XMLWriter.writeAttribute("Format", "delta");
+            if (Chunked) {
+                XMLWriter.writeAttribute("Offset", QString::number(ChunkOffset));
+                XMLWriter.writeAttribute("TotalSize", QString::number(BodySize));
             }
-            XMLWriter.writeStartElement("FilesFromClient");
-            XMLWriter.writeStartElement("File");
-            XMLWriter.writeTextElement("Category", Query.value("CATEGORY").toString());
-            //выделяем только имя файла
-            QFileInfo tmp(Query.value("FILE_NAME").toString());
-            XMLWriter.writeTextElement("FileName", tmp.fileName());
-            XMLWriter.writeTextElement("CreateDateTime", Query.value("CREATE_DATE_TIME").toDateTime().toString("yyyy-MM-dd hh:mm:ss.zzz"));
-            XMLWriter.writeTextElement("ChangeDateTime", Query.value("CHANGE_DATE_TIME").toDateTime().toString("yyyy-MM-dd hh:mm:ss.zzz"));
-            XMLWriter.writeTextElement("Body", Query.value("BODY").toString());
-            XMLWriter.writeEndElement(); //File
-            XMLWriter.writeEndElement(); //FilesFromClient
-            HTTPServerInfo.DeleteFileID = Query.value("ID").toLongLong();
+            BodyFrames.push_back({BodyID, ChunkOffset, ChunkSize});
         }
         else {
-            if (DebugMode) {
-                qDebug() << "->No files to send to server";
+            //тело встраивается в XML в Base64. Двоичные тела кодируются на лету
+            XMLWriter.writeStartElement("Body");
+            if (Delta) XMLWriter.writeAttribute("Format", "delta");
+            if (Chunked) {
+                //Offset и TotalSize - в байтах тела, как оно хранится в БД
+                XMLWriter.writeAttribute("Encoding", BinaryRow ? "binary" : "base64");
+                XMLWriter.writeAttribute("Offset", QString::number(ChunkOffset));
+                XMLWriter.writeAttribute("TotalSize", QString::number(BodySize));
             }
+            XMLWriter.writeCharacters(""); //закрываем открывающий тег
+            RequestBody->AddData(XMLBuffer.data());
+            XMLBuffer.buffer().clear();
+            XMLBuffer.seek(0);
+            RequestBody->AddBody(BodyID, ChunkSize, BinaryRow, ChunkOffset);
+            XMLWriter.writeEndElement(); //Body
         }
+        XMLWriter.writeEndElement(); //File
+        if (HTTPServerInfo.NoCompressExt.contains(tmp.suffix().toLower())) IncompressibleSize += ChunkSize;
+        return ChunkSize;
+    };
 
-        if (!DB.commit()) {
-           DB.rollback();
-           QString LastError = "Cannot commit transation. Error: " + DB.lastError().text();
-           qDebug() << LastError;
-           exit(-4);
-        };
+    FillBacklog();
+
+    //кандидаты в пакет - по порядку ID. Большой файл передается частями по одному за раз,
+    //поэтому пока идет передача одного, другие большие файлы ждут
+    //подтвержденных не по порядку файлов набралось слишком много - все файлы уходят по порядку ID, пока LastFileID не сдвинется
+    const bool InOrder = AckedIDs.size() >= MaxAckedFiles;
+    QList<TScheduler::TCandidate> Candidates;
+    QList<quint64> CandidateIDs;
+    int BestPriority = std::numeric_limits<int>::min(); //высший приоритет среди категорий, которые можно отправлять
+    bool UrgentFiles = false; //есть файлы, ждущие дольше допустимого
+    for (const auto &File : Backlog) {
+        const bool Chunked = HTTPServerInfo.ChunkSupported && (File.BodySize > HTTPServerInfo.TransferChunkSize);
+        if (Chunked && (Upload.ID != 0)) continue;
+        const bool Urgent = InOrder || Overdue(File);
+        Candidates.push_back({File.Category, Chunked ? HTTPServerInfo.TransferChunkSize : File.BodySize, Urgent});
+        CandidateIDs.push_back(File.ID);
+        if (Scheduler.Allowed(File.Category)) {
+            BestPriority = qMax(BestPriority, Scheduler.Priority(File.Category));
+            UrgentFiles = UrgentFiles || Urgent;
+        }
+    }
+
+    //следующая часть большого файла уходит, если ее категория не уступает по приоритету остальным файлам
+    //и файлы, ждущие дольше допустимого, не ждут ее. Сама передача, затянувшаяся дольше допустимого, идет без очереди
+    const bool UploadUrgent = (Upload.ID != 0) && (InOrder || Overdue(Upload.File));
+    bool Resume = (Upload.ID != 0) && !Upload.InFlight && Scheduler.Allowed(Upload.File.Category) &&
+                  (UploadUrgent || (!UrgentFiles && (Scheduler.Priority(Upload.File.Category) >= BestPriority)));
+    if (Resume) {
+        if (!SyncDB->SelectFiles(Upload.ID - 1, Upload.ID)) {
+            qDebug() << SyncDB->ErrorString();
+            exit(-2);
+        }
+        const bool Exists = SyncDB->FilesQuery().next();
+        SyncDB->FinishFiles();
+        //файла в БД больше нет - передавать нечего, а LastFileID сдвигается только по существующим записям
+        if (!Exists) {
+            Upload = TUploadInfo();
+            SaveUploadProgress();
+            AdvanceLastFileID();
+            Resume = false;
+        }
+    }
+    //часть большого файла ждет восстановления предела скорости своей категории
+    else if ((Upload.ID != 0) && !Upload.InFlight && !Scheduler.Allowed(Upload.File.Category)) {
+        Wait = Scheduler.Delay(Upload.File.Category);
+    }
+
+    if (!Resume) {
+        qint64 CategoryWait = 0;
+        const QList<qsizetype> Picked = Scheduler.Pick(Candidates, HTTPServerInfo.MaxFilesPerPacket, HTTPServerInfo.MaxPacketSize, CategoryWait);
+        for (const auto &Index : Picked) {
+            const quint64 ID = CandidateIDs[Index];
+            //большой файл идет отдельным запросом: выбран первым - начинаем его передачу, иначе отправляем файлы до него
+            if (HTTPServerInfo.ChunkSupported && (Backlog[ID].BodySize > HTTPServerInfo.TransferChunkSize)) {
+                if (RequestInfo.Files.isEmpty()) {
+                    Upload.File = Backlog.take(ID);
+                    Upload.ID = ID;
+                    Upload.Size = Upload.File.BodySize;
+                    Upload.Offset = 0;
+                    SaveUploadProgress();
+                    Resume = true;
+                }
+                break;
+            }
+            RequestInfo.Files.push_back(Backlog.take(ID));
+        }
+        if (Picked.isEmpty() && ((Wait == 0) || ((CategoryWait > 0) && (CategoryWait < Wait)))) Wait = CategoryWait;
+    }
+
+    RequestBody = new TRequestBody(SyncDB, HTTPServerInfo.BodyChunkSize);
+    qint64 PacketSize = 0;
+    if (Resume) {
+        //продолжаем передачу большого файла частями, отдельным запросом
+        const qint64 ChunkSize = qMin(HTTPServerInfo.TransferChunkSize, Upload.Size - Upload.Offset);
+        Upload.InFlight = true;
+        Upload.Acked = false;
+        RequestInfo.ChunkFileID = Upload.ID;
+        RequestInfo.ChunkOffset = Upload.Offset;
+        RequestInfo.ChunkSize = ChunkSize;
+        XMLWriter.writeStartElement("FilesFromClient");
+        PacketSize += WriteFile(Upload.File, true, Upload.Offset, ChunkSize);
+        XMLWriter.writeEndElement(); //FilesFromClient
+        if (DebugMode) {
+            qDebug() << "->File chunk in packet. ID:" << Upload.ID << "Offset:" << Upload.Offset << "Size:" << ChunkSize << "Byte";
+        }
+    }
+    else if (!RequestInfo.Files.isEmpty()) {
+        //упаковываем в один пакет не более MaxFilesPerPacket файлов общим размером не более MaxPacketSize
+        XMLWriter.writeStartElement("FilesFromClient");
+        for (const auto &File : RequestInfo.Files) PacketSize += WriteFile(File, false, 0, 0);
+        XMLWriter.writeEndElement(); //FilesFromClient
+        if (DebugMode) {
+            qDebug() << "->Files in packet:" << RequestInfo.Files.size() << "Size:" << PacketSize << "Byte";
+        }
+    }
+    else {
+        if (DebugMode) {
+            qDebug() << "->No files to send to server";
+        }
+    }
+
+    //обмениваться нечем
+    if (!Force && RequestInfo.DownloadIDs.isEmpty() && RequestInfo.Files.isEmpty() && (RequestInfo.ChunkFileID == 0)) {
+        delete RequestBody;
+        return SEND_NOTHING;
     }
 
     XMLWriter.writeEndElement(); //root
     XMLWriter.writeEndDocument();
-
-   /* QFile f("SendToServer.xml");
-    f.open(QIODevice::WriteOnly);
-    f.write(XMLStr.toUtf8());
-    f.close();*/
+    if (RequestInfo.Framed) {
+        RequestBody->AddFrameHeader(XMLBuffer.data().size());
+        RequestBody->AddData(XMLBuffer.data());
+        for (const auto &Item : BodyFrames) {
+            RequestBody->AddFrameHeader(Item.Size);
+            RequestBody->AddBody(Item.ID, Item.Size, false, Item.Offset);
+        }
+    }
+    else {
+        RequestBody->AddData(XMLBuffer.data());
+    }
 
     //отправляем запрос
     if (DebugMode) {
-        qDebug() << "Sending a request. Size: " << XMLStr.toUtf8().size() << "Byte. Time:" << Timer.msecsTo(QTime::currentTime()) << "ms";
+        qDebug() << "Sending a request. Size: " << RequestBody->Size() << "Byte. Time:" << Timer.msecsTo(QTime::currentTime()) << "ms";
+    }
+    //не сжимаем маленькие запросы и запросы, большую часть которых составляют уже сжатые файлы
+    const qint64 RequestSize = RequestBody->Size();
+    const bool Compress = (RequestSize >= HTTPServerInfo.CompressionMinSize) && (IncompressibleSize * 2 < RequestSize);
+    RequestInfo.Compressed = Compress && HTTPQuery->CompressionAllowed();
+    Metrics.AddTime(TMetrics::XML_BUILD, BuildTimer.nsecsElapsed());
+    RequestInfo.SendTimer.start();
+    const quint64 RequestID = HTTPQuery->Run(RequestBody, RequestInfo.Framed ? BinaryContentType : "application/xml", Compress, RequestSize);
+    if (RequestID == 0) {
+        Metrics.Add(TMetrics::HTTP_ERRORS);
+        //пакет будет отправлен повторно
+        if (RequestInfo.ChunkFileID != 0) FinishChunk(RequestInfo, false);
+        ReturnFiles(RequestInfo.Files);
+        return SEND_FAILED;
+    }
+
+    //ответ разбираем по мере получения
+    RequestInfo.AnswerParser = new TAnswerParser(CategoryToTarget, this);
+    QSet<QString> RequestedHashes;
+    for (const auto &ID : RequestInfo.DownloadIDs) RequestedHashes.insert(DownloadQueue->Hash(ID));
+    RequestInfo.AnswerParser->SetRequested(RequestedHashes);
+    QObject::connect(RequestInfo.AnswerParser, SIGNAL(GetProtocolVersion(const QString &)), this, SLOT(onGetProtocolVersion(const QString &)));
+    QObject::connect(RequestInfo.AnswerParser, SIGNAL(GetUndownloadedFile(quint64, const QString &)), this, SLOT(onGetUndownloadedFile(quint64, const QString &)));
+    QObject::connect(RequestInfo.AnswerParser, SIGNAL(GetFile(const QString &, const QString &, const QString &, const QString &)),
+                     this, SLOT(onGetFile(const QString &, const QString &, const QString &, const QString &)));
+    QObject::connect(RequestInfo.AnswerParser, SIGNAL(GetFileChunk(const QString &, const QString &, const QString &, const QString &, qint64, qint64)),
+                     this, SLOT(onGetFileChunk(const QString &, const QString &, const QString &, const QString &, qint64, qint64)));
+    QObject::connect(RequestInfo.AnswerParser, SIGNAL(GetChunkAck(quint64, qint64)), this, SLOT(onGetChunkAck(quint64, qint64)));
+    QObject::connect(RequestInfo.AnswerParser, SIGNAL(GetDeltaRejected(quint64)), this, SLOT(onGetDeltaRejected(quint64)));
+    QObject::connect(RequestInfo.AnswerParser, SIGNAL(SendLogMsg(uint16_t, const QString &)), this, SLOT(onSendLogMsg(uint16_t, const QString &)));
+
+    Metrics.Add(TMetrics::SENT_BYTES, RequestSize);
+    Scheduler.ConsumeGlobal(RequestSize);
+    //предел скорости и доля категории расходуются только на файлы, которые действительно ушли в запросе
+    for (const auto &File : RequestInfo.Files) Scheduler.Consume(File.Category, File.BodySize);
+    if (RequestInfo.ChunkFileID != 0) Scheduler.Consume(Upload.File.Category, RequestInfo.ChunkSize);
+    for (const auto &ID : RequestInfo.DownloadIDs) DownloadingFiles.insert(ID);
+    if (RequestInfo.FullListing) {
+        ListingRequestID = RequestID;
+        ListedIDs.clear();
+        MaxListedID = 0;
+    }
+    Requests.insert(RequestID, RequestInfo);
+    return SEND_OK;
+}
+
+void TSync::AckFile(quint64 ID)
+{
+    AckedIDs.insert(ID);
+    AdvanceLastFileID();
+}
+
+void TSync::AckFiles(const QList<TPacketFile> &Files)
+{
+    //файлы пакета могут идти с разрывами и из разных категорий - каждый подтверждается по ID, а БД обновляется один раз на пакет
+    for (const auto &File : Files) {
+        AckedIDs.insert(File.ID);
+        FileDelivered(File);
+    }
+    AdvanceLastFileID();
+}
+
+void TSync::FileDelivered(const TPacketFile &File)
+{
+    if (PendingFiles > 0) --PendingFiles;
+    const bool Rejected = RejectedDeltas.remove(File.ID);
+    auto Target = CategoryToTarget.constFind(File.Category);
+    if (Target == CategoryToTarget.constEnd()) return;
+    auto TargetInfo = Targets.constFind(Target.value());
+    if ((TargetInfo == Targets.constEnd()) || !TargetInfo->Delta) return;
+    if (!Rejected) {
+        //эта версия теперь есть на сервере - следующие изменения можно отправлять разностью с ней
+        Ingest->AckVersion(File.FileName, File.ChangeDateTime);
+        return;
+    }
+    //у сервера другая прошлая версия файла - записываем эту версию еще раз, уже целиком
+    SendLogMsg(MSG_CODE::CODE_INFORMATION, "Server rejected the delta of file " + File.FileName + ". The file will be sent in full");
+    Ingest->Resend(Target.value(), File.Category, File.FileName, File.CreateDateTime, File.ChangeDateTime);
+}
+
+void TSync::ReturnFiles(const QList<TPacketFile> &Files)
+{
+    //файлы снова участвуют в выборе планировщика, но их ID и диапазоны подтверждения не меняются
+    for (const auto &File : Files) Backlog.insert(File.ID, File);
+}
+
+void TSync::AdvanceLastFileID()
+{
+    //файлы подтверждаются в любом порядке, а LastFileID сдвигается только по подряд идущим подтвержденным записям SYNCFILE
+    //пропуски ID (удаленные записи) не мешают - перебираются только существующие записи
+    if (!AckedIDs.isEmpty()) {
+        if (!SyncDB->SelectFileIDs(HTTPServerInfo.LastFileID)) {
+            qDebug() << "FAIL" << SyncDB->ErrorString();
+            exit(-2);
+        }
+        QSqlQuery &Query = SyncDB->FileIDs();
+        while (Query.next()) {
+            const quint64 ID = Query.value(0).toULongLong();
+            if (!AckedIDs.remove(ID)) break;
+            HTTPServerInfo.LastFileID = ID;
+        }
+        SyncDB->FinishFileIDs();
+    }
+
+    //подтверждения сохраняются не чаще раза в AckSaveInterval мс - при сбое часть файлов будет отправлена повторно
+    AcksChanged = true;
+    if (!AckSaveTimer.isActive()) AckSaveTimer.start();
+}
+
+void TSync::SaveAcks()
+{
+    if (!AcksChanged) return;
+    AcksChanged = false;
+
+    //остальные подтверждения сохраняем вместе с LastFileID диапазонами подряд идущих ID
+    QList<quint64> IDs(AckedIDs.cbegin(), AckedIDs.cend());
+    std::sort(IDs.begin(), IDs.end());
+    QStringList Acked;
+    for (qsizetype i = 0; i < IDs.size(); ) {
+        qsizetype j = i;
+        while ((j + 1 < IDs.size()) && (IDs[j + 1] == IDs[j] + 1)) ++j;
+        Acked.push_back(j == i ? QString::number(IDs[i]) : QString::number(IDs[i]) + "-" + QString::number(IDs[j]));
+        i = j + 1;
+    }
+    Config->beginGroup("SERVER");
+    Config->setValue("LastFileID", HTTPServerInfo.LastFileID);
+    Config->setValue("ClearedFileID", ClearedFileID);
+    Config->setValue("AckedFiles", Acked.join(","));
+    Config->endGroup();
+    Config->sync();
+
+    //тела очищаем только после сохранения LastFileID, иначе после сбоя на сервер уйдут пустые файлы
+    if (HTTPServerInfo.LastFileID == ClearedFileID) return;
+    SyncDB->Transaction();
+    if (!SyncDB->ClearBodies(ClearedFileID, HTTPServerInfo.LastFileID)) {
+        qDebug() << "FAIL" << SyncDB->ErrorString();
+        SyncDB->Rollback();
+        exit(-2);
+    }
+    if (!SyncDB->Commit()) {
+        qDebug() << "FAIL" << SyncDB->ErrorString();
+        exit(-4);
+    };
+    ClearedFileID = HTTPServerInfo.LastFileID;
+    //тела подтвержденных файлов очищены - их старые версии можно удалять
+    Compactor->SetAckedID(ClearedFileID);
+}
+
+void TSync::onSaveAcks()
+{
+    SaveAcks();
+}
+
+void TSync::ReleaseRequest(TRequestInfo &RequestInfo)
+{
+    if (RequestInfo.AnswerParser != nullptr) {
+        RequestInfo.AnswerParser->deleteLater(); //недополученные временные файлы удаляются вместе с разборщиком
+        RequestInfo.AnswerParser = nullptr;
+    }
+    for (const auto &ID : RequestInfo.DownloadIDs) DownloadingFiles.remove(ID);
+}
+
+void TSync::FinishChunk(const TRequestInfo &RequestInfo, bool Ok)
+{
+    if (Upload.ID != RequestInfo.ChunkFileID) return;
+    Upload.InFlight = false;
+    if (!Ok) {
+        //часть будет отправлена повторно с последней подтвержденной позиции
+        Upload.Acked = false;
+        return;
+    }
+
+    //сервер сообщает, сколько байт файла у него уже есть - продолжаем с этого места
+    //позицию выравниваем на 4 байта, чтобы тело в Base64 можно было продолжить с нее
+    if (Upload.Acked) Upload.Offset = qBound<qint64>(0, Upload.AckedOffset - Upload.AckedOffset % 4, Upload.Size);
+    else Upload.Offset = RequestInfo.ChunkOffset + RequestInfo.ChunkSize;
+    Upload.Acked = false;
+    if (DebugMode) {
+        qDebug() << "->File chunk accepted. ID:" << Upload.ID << "Offset:" << Upload.Offset << "of" << Upload.Size;
+    }
+    if (Upload.Offset < Upload.Size) {
+        SaveUploadProgress();
+        return;
+    }
+
+    //файл передан полностью
+    FileDelivered(Upload.File);
+    const quint64 ID = Upload.ID;
+    Upload = TUploadInfo();
+    SaveUploadProgress();
+    AckFile(ID);
+}
+
+void TSync::SaveUploadProgress()
+{
+    HTTPServerInfo.UploadFileID = Upload.ID;
+    HTTPServerInfo.UploadOffset = Upload.Offset;
+    Config->beginGroup("SERVER");
+    Config->setValue("UploadFileID", HTTPServerInfo.UploadFileID);
+    Config->setValue("UploadOffset", HTTPServerInfo.UploadOffset);
+    Config->endGroup();
+    Config->sync();
+}
+
+void TSync::LoadPartialDownloads()
+{
+    Config->beginGroup("DOWNLOADS");
+    for (const auto &Key : Config->childGroups()) {
+        TPartialDownload Part;
+        Part.FileName = Config->value(Key + "/File", "").toString();
+        Part.Offset = Config->value(Key + "/Offset", "0").toLongLong();
+        //часть, полученная после сохранения позиции, могла записаться не полностью - отрезаем ее
+        QFile File(Part.FileName);
+        if (!Part.FileName.isEmpty() && (File.size() >= Part.Offset) && File.resize(Part.Offset)) {
+            PartialDownloads.insert(Key.toULongLong(), Part);
+            continue;
+        }
+        if (!Part.FileName.isEmpty()) File.remove();
+        Config->remove(Key);
+    }
+    Config->endGroup();
+}
+
+void TSync::SaveDownloadProgress(quint64 ID)
+{
+    Config->beginGroup("DOWNLOADS");
+    auto it = PartialDownloads.constFind(ID);
+    if (it != PartialDownloads.constEnd()) {
+        Config->setValue(QString::number(ID) + "/File", it->FileName);
+        Config->setValue(QString::number(ID) + "/Offset", it->Offset);
+    }
+    else {
+        Config->remove(QString::number(ID));
+    }
+    Config->endGroup();
+    Config->sync();
+}
+
+bool TSync::AppendChunk(const QString &FileName, const QString &ChunkFileName)
+{
+    QFile File(FileName);
+    QFile Chunk(ChunkFileName);
+    if (!File.open(QIODevice::WriteOnly | QIODevice::Append) || !Chunk.open(QIODevice::ReadOnly)) return false;
+    while (!Chunk.atEnd()) {
+        const QByteArray Data = Chunk.read(1048576);
+        if (Data.isEmpty() || (File.write(Data) != Data.size())) return false;
     }
-    HTTPQuery->Run(XMLStr.toUtf8());
+    return File.flush();
 }
 
 void TSync::GetOldFileName()
 {
     //qDebug() << "GetOldFileName. TargetSize:" << Targets.size();
-    QSqlQuery Query(DB);
-    DB.transaction();
+    quint64 MaxID = 0;
+    if (!SyncDB->MaxID(MaxID)) {
+        qDebug() << "FAIL" << SyncDB->ErrorString();
+        exit(-2);
+    }
+
+    //сначала загружаем снимок, из БД читаем только файлы добавленные после него
+    QList<TFileSnapshot::TEntry> Entries;
+    quint64 HighWaterMark = 0;
+    bool SnapshotOk = Snapshot->Load(Entries, HighWaterMark);
+    if (SnapshotOk && (HighWaterMark > MaxID)) {
+        //снимок новее БД - БД была заменена, снимок недействителен
+        SendLogMsg(MSG_CODE::CODE_INFORMATION, "Snapshot of processed files does not match the DB and will be rebuilt. Snapshot ID: " +
+                                               QString::number(HighWaterMark) + " DB ID: " + QString::number(MaxID));
+        SnapshotOk = false;
+    }
+    if (!SnapshotOk) {
+        Entries.clear();
+        HighWaterMark = 0;
+    }
 
-    QStringList CategoryList;
-    for (auto &CategoryItem : CategoryToTarget.keys()) CategoryList.push_back("'" + CategoryItem + "'");
+    SyncDB->Transaction();
 
-    QString QueryText = "SELECT ID, CATEGORY, FILE_NAME, CHANGE_DATE_TIME "
-                        "FROM SYNCFILE "
-                        "WHERE CATEGORY IN (" + CategoryList.join(",") + ") AND (NOT BODY LIKE '%*DELETED%')" ;
+    //файлы из снимка могли быть отмечены в БД как удаленные уже после записи в снимок
+    //тела подтвержденных файлов (до LastFileID) очищены вместе с отметками, поэтому просматриваются только неподтвержденные
+    QSet<QString> DeletedFiles;
+    if (HighWaterMark > HTTPServerInfo.LastFileID) {
+        if (!SyncDB->SelectDeletedFiles(HTTPServerInfo.LastFileID, HighWaterMark)) {
+            qDebug() << "FAIL" << SyncDB->ErrorString();
+            SyncDB->Rollback();
+            exit(-2);
+        }
+        QSqlQuery &DeletedQuery = SyncDB->DeletedFiles();
+        while (DeletedQuery.next()) {
+            DeletedFiles.insert(DeletedQuery.value("CATEGORY").toString() + QChar(0) + DeletedQuery.value("FILE_NAME").toString() + QChar(0) +
+                                QString::number(DeletedQuery.value("CHANGE_DATE_TIME").toDateTime().toMSecsSinceEpoch()));
+        }
+        DeletedQuery.finish();
+    }
 
-    if (!Query.exec(QueryText)) {
-        qDebug() << "FAIL Cannot execute query. Error: " << Query.lastError().text() << " Query: "<< Query.lastQuery();
-        DB.rollback();
-        exit(-2);
+    //новые записи дописываем в снимок
+    if (!Snapshot->Open(!SnapshotOk)) {
+        SendLogMsg(MSG_CODE::CODE_ERROR, "Cannot open snapshot of processed files. The next start will read all files from the DB");
+    }
+
+    for (const auto &Entry : Entries) {
+        if (!DeletedFiles.isEmpty() && DeletedFiles.contains(Entry.Category + QChar(0) + Entry.FileName + QChar(0) + QString::number(Entry.ChangeTime))) {
+            Snapshot->Remove(Entry.Category, Entry.FileName, Entry.ChangeTime);
+            continue;
+        }
+        auto it = CategoryToTarget.constFind(Entry.Category);
+        if (it == CategoryToTarget.constEnd()) continue;
+        Targets[it.value()].OldFiles.Insert(Entry.FileName, Entry.ChangeTime);
+        if (!Entry.Hash.isEmpty()) {
+            FileHashes.insert(Entry.FileName, Entry.Hash);
+            KnownHashes.insert(Entry.Hash);
+        }
+    }
+    if (DebugMode) {
+        qDebug() << "Snapshot of processed files loaded. Files:" << Entries.size() << "Snapshot ID:" << HighWaterMark << "DB ID:" << MaxID;
     }
+    Entries.clear();
+    DeletedFiles.clear();
 
+    //в снимок попадают файлы всех категорий, чтобы он оставался полным при изменении списка целей
+    if (!SyncDB->SelectOldFiles(HighWaterMark)) {
+        qDebug() << "FAIL" << SyncDB->ErrorString();
+        SyncDB->Rollback();
+        exit(-2);
+    }
+    QSqlQuery &Query = SyncDB->OldFiles();
     while (Query.next()) {
-        Targets[CategoryToTarget[Query.value("CATEGORY").toString()]].OldFiles.insert(qMakePair(Query.value("FILE_NAME").toString(),
-            TimeAccuracy(Query.value("CHANGE_DATE_TIME").toDateTime())));
+        TFileSnapshot::TEntry Entry;
+        Entry.Category = Query.value("CATEGORY").toString();
+        Entry.FileName = Query.value("FILE_NAME").toString();
+        Entry.ChangeTime = Query.value("CHANGE_DATE_TIME").toDateTime().toMSecsSinceEpoch();
+        if (ContentHash) {
+            Entry.Hash = QByteArray::fromHex(Query.value("HASH").toString().toLatin1());
+            if (!Entry.Hash.isEmpty()) {
+                FileHashes.insert(Entry.FileName, Entry.Hash);
+                KnownHashes.insert(Entry.Hash);
+            }
+        }
+        Snapshot->Add(Entry);
+        auto it = CategoryToTarget.constFind(Entry.Category);
+        if (it != CategoryToTarget.constEnd()) Targets[it.value()].OldFiles.Insert(Entry.FileName, Entry.ChangeTime);
     }
+    Query.finish();
 
-    if (!DB.commit()) {
-        qDebug() << "FAIL Cannot commit transation. Error: " << DB.lastError().text();
-        DB.rollback();
+    if (!SyncDB->Commit()) {
+        qDebug() << "FAIL" << SyncDB->ErrorString();
         exit(-4);
     };
+    //файлов других программ в SYNCFILE нет, поэтому теперь в снимке есть все файлы до MaxID
+    Snapshot->Checkpoint(MaxID);
 }
 
 void TSync::onStartGetData()
 {
+    ScanTimer.stop(); //изменения будут обработаны в этом цикле
+
     if (DebugMode) {
         qDebug() << "Start of a data exchange cycle. Time: 0 ms";
         Timer = QTime::currentTime();
     }
+    QElapsedTimer ScanClock;
+    ScanClock.start();
     for (const auto& TargetName: Targets.keys()) {
         TTargetInfo& CurrentTargetInfo = Targets[TargetName];
 
@@ -281,65 +1151,66 @@ void TSync::onStartGetData()
         //Изменился файл
         else if (CurrentTargetInfo.isChange == CHANGE_FILE) {
             QFileInfo FileInfo(TargetName); //получаем информацию о файле
-            if (CurrentTargetInfo.OldFiles.find(qMakePair(TargetName, FileInfo.fileTime(QFile::FileModificationTime))) ==
-                CurrentTargetInfo.OldFiles.end()) {
+            if (!CurrentTargetInfo.OldFiles.Contains(TargetName, FileInfo.fileTime(QFile::FileModificationTime).toMSecsSinceEpoch())) {
                 //если файл отличаеться - ставим его в очередь на загрузку
-                AddFileToDB(FileInfo, CurrentTargetInfo.Category);
+                AddFileToDB(TargetName, FileInfo, CurrentTargetInfo.Category);
             }
         }
         //Изменилась директория
 
         else if (CurrentTargetInfo.isChange == CHANGE_DIR) {
-            //получаем список файлов в директории
-            QDir Dir(TargetName);
-
-            if (!Dir.isEmpty()) {
-                Dir.setFilter(QDir::Files | QDir::Hidden | QDir::NoSymLinks);
-                Dir.setSorting(QDir::Time | QDir::Reversed);
-
-                TOldFile CurrentFileOnDir;
-                for (const auto &Item : Dir.entryInfoList()) {
-                     CurrentFileOnDir.insert(qMakePair(Item.absoluteFilePath(), TimeAccuracy(Item.fileTime(QFile::FileModificationTime))));
+            //сканер возвращает только новые и изменившиеся с прошлого сканирования файлы
+            for (const auto &FileInfo : CurrentTargetInfo.Scanner->Scan()) {
+                const qint64 MTime = FileInfo.fileTime(QFileDevice::FileModificationTime).toMSecsSinceEpoch();
+                //файл уже загружен в БД
+                if (CurrentTargetInfo.OldFiles.Contains(FileInfo.absoluteFilePath(), MTime)) continue;
+                qDebug() << "File:" << FileInfo.absoluteFilePath();
+                if (!CurrentTargetInfo.ignoreEmptyFile || (FileInfo.size() != 0)) {
+                    AddFileToDB(TargetName, FileInfo, CurrentTargetInfo.Category);
+                    //добавляем файл в очередь для загрузки
+                    CurrentTargetInfo.OldFiles.Insert(FileInfo.absoluteFilePath(), MTime);
                 }
-
-                //все файлы которые поменялись в директории загружаем в БД
-                TOldFile tmp = CurrentFileOnDir.subtract(CurrentTargetInfo.OldFiles);
-                for (const auto& Item : tmp) {
-                    QFileInfo FileInfo(Item.first); //получаем информацию о файле
-                    qDebug() << "File:" << FileInfo.absoluteFilePath();
-                    if (!CurrentTargetInfo.ignoreEmptyFile || (FileInfo.size() != 0)) {
-                        AddFileToDB(FileInfo, CurrentTargetInfo.Category);
-                        //добавляем файл в очередь для загрузки
-                        CurrentTargetInfo.OldFiles.insert(qMakePair(FileInfo.absoluteFilePath(), TimeAccuracy(FileInfo.fileTime(QFileDevice::FileModificationTime))));
-                    }
-                    else {
-                        SendLogMsg(MSG_CODE::CODE_INFORMATION, "File is empty. Ignored.");
-                    }
+                else {
+                    SendLogMsg(MSG_CODE::CODE_INFORMATION, "File is empty. Ignored.");
                 }
-                //если нужно - удаляем все файлы из директории
-                if (CurrentTargetInfo.clearDirAfterSync) {
-                    qDebug() << "-->Clear directory";
-                    for (const auto fileNameItem: Dir.entryList()) {  //здесь нам нужна именно копия списка, т.к. мы его меняем в процессе цикла
-                        Dir.remove(fileNameItem);
-                    }
-
+            }
+            //если нужно - удаляем все файлы из директории
+            //файлы, которые еще не записаны в БД, будут удалены после записи в onFileAdded
+            if (CurrentTargetInfo.clearDirAfterSync) {
+                qDebug() << "-->Clear directory";
+                QDir Dir(TargetName);
+                Dir.setFilter(QDir::Files | QDir::Hidden | QDir::NoSymLinks);
+                for (const auto fileNameItem: Dir.entryList()) {  //здесь нам нужна именно копия списка, т.к. мы его меняем в процессе цикла
+                    if (IngestingFiles.contains(Dir.absoluteFilePath(fileNameItem))) continue;
+                    if (Dir.remove(fileNameItem)) CurrentTargetInfo.Scanner->Forget(fileNameItem);
                 }
             }
         }
         //сбрасываем флаг изменения
         CurrentTargetInfo.isChange = TTypeChange::NO_CHANGE;
     }
+    Metrics.AddTime(TMetrics::SCAN, ScanClock.nsecsElapsed());
 
-    if (Transfering) {
+    if (Requests.size() >= HTTPServerInfo.MaxRequests) {
         if (DebugMode) {
             qDebug() << "The data transfer process is not yet complete. Skip. Time:" << Timer.msecsTo(QTime::currentTime()) << "ms";
         }
         return;
     }
-    else {
-        Transfering = true;
-        SendToHTTPServer();
+    if (Backoff->Allowed() == 0) {
+        if (DebugMode) {
+            qDebug() << "Waiting before retrying the exchange with the server. Skip. Delay:" << Backoff->Delay() << "ms";
+        }
+        return;
     }
+    SendRequests(true);
+}
+
+void TSync::onShapingTimeout()
+{
+    const bool Force = ShapingForce;
+    ShapingForce = false;
+    SendRequests(Force);
 }
 
 void TSync::onSendLogMsg(uint16_t Category, const QString &Msg)
@@ -347,243 +1218,429 @@ void TSync::onSendLogMsg(uint16_t Category, const QString &Msg)
     SendLogMsg(Category, Msg);
 }
 
-void TSync::onHTTPGetAnswer(const QByteArray &Answer)
+void TSync::onHTTPGetAnswerContentType(quint64 ID, const QString &ContentType)
 {
-  //  qDebug() << Answer;
-    if (DebugMode) {
-        qDebug() << "Get a response from the server. Size:" << Answer.size() << "Byte. Time:" << Timer.msecsTo(QTime::currentTime()) << "ms";
-    }
-
-    QXmlStreamReader XMLReader(Answer);
-
-    while ((!XMLReader.atEnd()) && (!XMLReader.hasError())) {
-        QXmlStreamReader::TokenType Token = XMLReader.readNext();
-        if (Token == QXmlStreamReader::StartDocument) continue;
-        if (Token == QXmlStreamReader::EndDocument) break;
-        if (Token == QXmlStreamReader::StartElement) {
-            if (XMLReader.name().toString()  == "ProtocolVersion") continue; //пока версию протокола не проверяем
-            else if (XMLReader.name().toString()  == "UndownloadedFileList") { //пришел список незагруженных файлов
-                while (XMLReader.readNext() != QXmlStreamReader::EndElement) {
-                    if (XMLReader.name().toString()  == "File") {
-                        quint64 ID = 0;
-                        QString HASH;
-                        while (XMLReader.readNext() != QXmlStreamReader::EndElement) {
-                            if (XMLReader.name().toString()  == "ID") ID = XMLReader.readElementText().toULongLong();
-                            else if (XMLReader.name().toString()  == "HASH") HASH = XMLReader.readElementText();
-                        }
-                        if ((ID != 0) && (HASH != "")) {
-                            if (FileForDownload.find(ID) == FileForDownload.end()) {
-                                FileForDownload.insert(ID, HASH); //добавляем ХЭШ в список
-                                if (DebugMode) {
-                                    qDebug() << "<-Add file to queue for download. ID:" << ID << "HASH:" << HASH;
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-            else if (XMLReader.name().toString()  == "NewFileList") { //Пришел новый файл
-                while (XMLReader.readNext() != QXmlStreamReader::EndElement) {
-                    if (XMLReader.name().toString()  == "File") {
-                        QString FileName;
-                        QString HASH;
-                        QByteArray Body;
-                        QString Category;
-                        while (XMLReader.readNext() != QXmlStreamReader::EndElement) {
-                            if (XMLReader.name().toString()  == "FileName") FileName = XMLReader.readElementText();
-                            else if (XMLReader.name().toString()  == "HASH") HASH = XMLReader.readElementText();
-                            else if (XMLReader.name().toString()  == "Category") Category = XMLReader.readElementText();
-                            else if (XMLReader.name().toString()  == "Body") Body = XMLReader.readElementText().toUtf8();
-                        }
-                        //если существует такая категория и пришел запрашиваемый файл
-                        if ((CategoryToTarget.find(Category) != CategoryToTarget.end()) && (HASH == FileForDownload.first()) && (FileName != "")) {
-                            if (SaveFile(Category, FileName, FindHash(HASH), Body)) {
-                                //Сохранение прошло успешно. отмечаем это у себя
-                                Config->beginGroup("SERVER");
-                                Config->setValue("LastDownloadID", FileForDownload.firstKey());
-                                Config->endGroup();
-                                Config->sync();
-
-                                //удаляем самую первую запись
-                                HTTPServerInfo.LastDownloadID = FileForDownload.firstKey();
-                                FileForDownload.erase(FileForDownload.begin());
-                                //  HTTPServerInfo.LastDownloadID = FindHash(HASH);
-                            }
-                            else {
-                                SendLogMsg(MSG_CODE::CODE_INFORMATION, "Cannot save file. Category: " + Category +
-                                                                                   " File name: " + FileName +
-                                                                                   " HASH:" + HASH +
-                                                                                   " Request HASH: " + FileForDownload.first());
-                            }
-                        }
-                        else {
-                            SendLogMsg(MSG_CODE::CODE_INFORMATION, "Wrong file received. Category: " + Category +
-                                                                               " File name: " + FileName +
-                                                                               " HASH:" + HASH +
-                                                                               " Request HASH: " + FileForDownload.first());
-                        }
-                    }
-                }
-            }
+    if (!Requests.contains(ID)) return;
+    Requests[ID].AnswerParser->SetFramed(ContentType.startsWith(BinaryContentType));
+}
+
+void TSync::onGetProtocolVersion(const QString &Version)
+{
+    //ссылки на уже отправленные тела - с версии 0.3
+    HTTPServerInfo.RefSupported = ContentHash && (QVersionNumber::fromString(Version) >= QVersionNumber(0, 3));
+    //разности - с версии 0.4
+    HTTPServerInfo.DeltaSupported = DeltaEnabled && (QVersionNumber::fromString(Version) >= QVersionNumber(0, 4));
+    //передача частями - с версии 0.5
+    HTTPServerInfo.ChunkSupported = (HTTPServerInfo.TransferChunkSize > 0) && (QVersionNumber::fromString(Version) >= QVersionNumber(0, 5));
+
+    if (!HTTPServerInfo.BinaryAllowed) return;
+    //двоичный протокол используем только если сервер его поддерживает, иначе возвращаемся к XML/Base64
+    const bool Supported = QVersionNumber::fromString(Version) >= QVersionNumber(0, 2);
+    if (Supported != HTTPServerInfo.BinaryProtocol) {
+        HTTPServerInfo.BinaryProtocol = Supported;
+        SendLogMsg(MSG_CODE::CODE_INFORMATION, QString("Server protocol version: ") + Version +
+                                               (Supported ? ". Switching to binary protocol" : ". Switching to XML protocol"));
+    }
+}
+
+void TSync::onHTTPGetAnswerData(quint64 ID, const QByteArray &Data)
+{
+    auto Request = Requests.find(ID);
+    if (Request == Requests.end()) return;
+    Request->AnswerSize += Data.size();
+    Metrics.Add(TMetrics::RECEIVED_BYTES, Data.size());
+    Scheduler.ConsumeGlobal(Data.size());
+    QElapsedTimer ParseTimer;
+    ParseTimer.start();
+    Request->AnswerParser->AddData(Data);
+    Request->ParseTime += ParseTimer.nsecsElapsed();
+}
+
+void TSync::onGetUndownloadedFile(quint64 ID, const QString &HASH)
+{
+    //запоминаем файлы из полного списка - по ним очередь сверяется, когда список получен целиком
+    auto it = Requests.constFind(ListingRequestID);
+    if ((it != Requests.constEnd()) && (sender() == it->AnswerParser)) {
+        ListedIDs.insert(ID);
+        MaxListedID = qMax(MaxListedID, ID);
+    }
+    if (DownloadQueue->Add(ID, HASH)) { //добавляем ХЭШ в список
+        DownloadQueueChanged = true;
+        if (DebugMode) {
+            qDebug() << "<-Add file to queue for download. ID:" << ID << "HASH:" << HASH;
         }
     }
+}
 
-    if (XMLReader.hasError()) { //неудалось распарсить пришедшую XML
-        SendLogMsg(MSG_CODE::CODE_ERROR, "Incorrect answer from server. Parser msg: " + XMLReader.errorString() + " Answer from server:" + Answer.left(200));
+void TSync::onGetFile(const QString &Category, const QString &FileName, const QString &HASH, const QString &TmpFileName)
+{
+    //если существует такая категория и пришел один из запрашиваемых файлов. Порядок файлов в ответе не важен
+    const quint64 ID = DownloadQueue->Find(HASH);
+    if ((CategoryToTarget.find(Category) != CategoryToTarget.end()) && (ID != 0) && (FileName != "")) {
+        //файл пришел целиком - ранее полученные части не нужны
+        if (PartialDownloads.contains(ID)) {
+            QFile::remove(PartialDownloads.take(ID).FileName);
+            SaveDownloadProgress(ID);
+        }
+        SaveFile(Category, FileName, ID, TmpFileName);
+        return;
+    }
+    else {
+        SendLogMsg(MSG_CODE::CODE_INFORMATION, "Wrong file received. Category: " + Category +
+                                                       " File name: " + FileName +
+                                                       " HASH:" + HASH);
+    }
+    QFile::remove(TmpFileName);
+}
+
+void TSync::onGetFileChunk(const QString &Category, const QString &FileName, const QString &HASH, const QString &TmpFileName, qint64 Offset, qint64 TotalSize)
+{
+    const quint64 ID = DownloadQueue->Find(HASH);
+    if ((CategoryToTarget.find(Category) == CategoryToTarget.end()) || (ID == 0) || (FileName == "")) {
+        SendLogMsg(MSG_CODE::CODE_INFORMATION, "Wrong file chunk received. Category: " + Category +
+                                               " File name: " + FileName +
+                                               " HASH:" + HASH);
+        QFile::remove(TmpFileName);
         return;
     }
 
-    //если мы дошли до сюда, то обновляем данные в локальной БД
-    QSqlQuery Query(DB);
-    DB.transaction();
+    const qint64 Size = QFileInfo(TmpFileName).size();
+    auto Part = PartialDownloads.find(ID);
+    if (Offset == 0) {
+        //первая часть - временный файл с ней становится файлом для следующих частей
+        if (Part != PartialDownloads.end()) QFile::remove(Part->FileName);
+        TPartialDownload tmp;
+        tmp.FileName = TmpFileName;
+        tmp.Offset = Size;
+        Part = PartialDownloads.insert(ID, tmp);
+    }
+    else if ((Part == PartialDownloads.end()) || (Part->Offset != Offset)) {
+        //часть не продолжает уже полученные - файл будет запрошен еще раз с сохраненной позиции
+        SendLogMsg(MSG_CODE::CODE_INFORMATION, "Unexpected file chunk received. File name: " + FileName +
+                                               " HASH:" + HASH + " Offset: " + QString::number(Offset));
+        QFile::remove(TmpFileName);
+        return;
+    }
+    else {
+        const bool Ok = AppendChunk(Part->FileName, TmpFileName);
+        QFile::remove(TmpFileName);
+        if (!Ok) {
+            //в файле могла остаться часть куска - при следующем запуске он будет обрезан до сохраненной позиции
+            SendLogMsg(MSG_CODE::CODE_ERROR, "Cannot write file chunk. File name: " + Part->FileName);
+            QFile(Part->FileName).resize(Part->Offset);
+            return;
+        }
+        Part->Offset += Size;
+    }
+    if (DebugMode) {
+        qDebug() << "<-File chunk received. HASH:" << HASH << "Offset:" << Part->Offset << "of" << TotalSize;
+    }
 
-    QString QueryText = "UPDATE SYNCFILE "
-                        "SET Body = '' "
-                        "WHERE ID = " + QString::number(HTTPServerInfo.DeleteFileID);
-    if (!Query.exec(QueryText)) {
-        qDebug() << "FAIL Cannot execute query. Error: " << Query.lastError().text() << " Query: "<< Query.lastQuery();
-        DB.rollback();
-        exit(-2);
+    if (Part->Offset < TotalSize) {
+        SaveDownloadProgress(ID);
+        return;
     }
 
-    if (!DB.commit()) {
-        qDebug() << "FAIL Cannot commit transation. Error: " << DB.lastError().text();
-        DB.rollback();
-        exit(-4);
-    };
+    //получены все части
+    const QString PartFileName = Part->FileName;
+    PartialDownloads.erase(Part);
+    SaveDownloadProgress(ID);
+    SaveFile(Category, FileName, ID, PartFileName);
+}
 
-    if (HTTPServerInfo.LastFileID != HTTPServerInfo.DeleteFileID) {
-        if (DebugMode) {
-            qDebug() << "Not all files were sent to the server. Sending the following request. Time:" << Timer.msecsTo(QTime::currentTime()) << "ms";
-        }
-        HTTPServerInfo.LastFileID = HTTPServerInfo.DeleteFileID;
+void TSync::onGetChunkAck(quint64 ID, qint64 Offset)
+{
+    if (ID != Upload.ID) return;
+    Upload.AckedOffset = Offset;
+    Upload.Acked = true;
+}
 
-        Config->beginGroup("SERVER");
-        Config->setValue("LastFileID", HTTPServerInfo.LastFileID);
-        Config->endGroup();
-        Config->sync();
+void TSync::onGetDeltaRejected(quint64 ID)
+{
+    RejectedDeltas.insert(ID);
+}
+
+void TSync::onHTTPGetAnswerFinished(quint64 ID)
+{
+    if (!Requests.contains(ID)) return;
+    TRequestInfo RequestInfo = Requests.take(ID);
+    Metrics.AddTime(TMetrics::HTTP_RTT, RequestInfo.SendTimer.nsecsElapsed());
 
-        SendToHTTPServer();
+    if (DebugMode) {
+        qDebug() << "Get a response from the server. Size:" << RequestInfo.AnswerSize << "Byte. Time:" << Timer.msecsTo(QTime::currentTime()) << "ms";
     }
 
-    if (!FileForDownload.isEmpty()) {
-        if (DebugMode) {
-            qDebug() << "Not all files have been downloaded from the server. Sending the following request. Time:" << Timer.msecsTo(QTime::currentTime()) << "ms";
-        }
-        SendToHTTPServer();
+    QElapsedTimer ParseTimer;
+    ParseTimer.start();
+    const bool AnswerOk = RequestInfo.AnswerParser->Finish();
+    Metrics.AddTime(TMetrics::PARSE, RequestInfo.ParseTime + ParseTimer.nsecsElapsed());
+    const QString ParserError = RequestInfo.AnswerParser->ErrorString();
+    const QByteArray AnswerHead = RequestInfo.AnswerParser->AnswerHead();
+    ReleaseRequest(RequestInfo);
+    const bool Listing = (ID == ListingRequestID);
+    if (Listing) ListingRequestID = 0;
+
+    if (!AnswerOk) { //неудалось распарсить пришедшую XML
+        Metrics.Add(TMetrics::ANSWER_ERRORS);
+        SendLogMsg(MSG_CODE::CODE_ERROR, "Incorrect answer from server. Parser msg: " + ParserError + " Answer from server:" + AnswerHead);
+        if (RequestInfo.ChunkFileID != 0) FinishChunk(RequestInfo, false);
+        //файлы уйдут повторно - отказ в разности из этого ответа не учитываем
+        for (const auto &File : RequestInfo.Files) RejectedDeltas.remove(File.ID);
+        RejectedDeltas.remove(RequestInfo.ChunkFileID);
+        ReturnFiles(RequestInfo.Files);
+        //сервер мог не распаковать тело - повтор уйдет без сжатия
+        if (RequestInfo.Compressed) HTTPQuery->RejectCompression();
+        Backoff->Failure();
+        return;
     }
+    Backoff->Success();
+    Metrics.Add(TMetrics::EXCHANGES);
+    if (RequestInfo.ChunkFileID != 0) FinishChunk(RequestInfo, true);
 
+    //если мы дошли до сюда, то сервер принял весь пакет
+    AckFiles(RequestInfo.Files);
+    if (Listing) ReconcileDownloadQueue();
 
+    //отправляем следующие запросы, если еще есть чем обмениваться
+    SendRequests(false);
+    if (!Requests.isEmpty()) {
+        if (DebugMode) {
+            qDebug() << "Not all files have been synchronized. Requests in progress:" << Requests.size() << "Time:" << Timer.msecsTo(QTime::currentTime()) << "ms";
+        }
+        return;
+    }
 
+    //обмен завершен - сохраняем очередь скачивания, чтобы после перезапуска не получать список заново
+    SaveDownloadQueue();
     SendLogMsg(TSync::CODE_INFORMATION, "Files has been successfully sync to the server."
                                         " Send: LastFileID: " + QString::number(HTTPServerInfo.LastFileID) +
-                                        " Files waiting to be received: " + QString::number(FileForDownload.size()) +
+                                        " Files waiting to be received: " + QString::number(DownloadQueue->Size()) +
                                         " Time: " + QString::number(Timer.msecsTo(QTime::currentTime())) + "ms");
-
-    Transfering = false;
 }
 
-void TSync::AddFileToDB(const QFileInfo& FileInfo, const QString& Category)
+void TSync::AddFileToDB(const QString &Target, const QFileInfo& FileInfo, const QString& Category)
 {
     if (DebugMode) {
         qDebug() << "->Add file DB: " << FileInfo.absoluteFilePath();
     }
 
-    //Сохраняем файл в БД
-    QByteArray Body;
-
-    QFile File(FileInfo.absoluteFilePath(), this);
-    if (File.open(QIODevice::ReadOnly)) {
-        Body = File.readAll().toBase64(QByteArray::Base64Encoding);
-        File.close();
+    //файл читается и записывается в БД в других потоках, результат придет в onFileAdded/onFileFailed
+    IngestingFiles.insert(FileInfo.absoluteFilePath());
+    //по хешу прошлой версии файл, содержимое которого не изменилось, не будет загружен повторно
+    auto it = Targets.constFind(Target);
+    const bool Delta = (it != Targets.constEnd()) && it->Delta;
+    Ingest->Add(Target, Category, FileInfo.absoluteFilePath(), TimeAccuracy(FileInfo.fileTime(QFileDevice::FileBirthTime)),
+                TimeAccuracy(FileInfo.fileTime(QFileDevice::FileModificationTime)),
+                FileHashes.value(FileInfo.absoluteFilePath()), HTTPServerInfo.RefSupported, Delta, Delta && HTTPServerInfo.DeltaSupported);
+}
 
+void TSync::onFileAdded(const QString &Target, const QString &FileName, const QDateTime &ChangeDateTime, qint64 Size, const QByteArray &Hash)
+{
+    IngestingFiles.remove(FileName);
+    if (!Hash.isEmpty()) FileHashes.insert(FileName, Hash);
+    auto it = Targets.constFind(Target);
+    if (it != Targets.constEnd()) {
+        TFileSnapshot::TEntry Entry;
+        Entry.Category = it->Category;
+        Entry.FileName = FileName;
+        Entry.ChangeTime = ChangeDateTime.toMSecsSinceEpoch();
+        Entry.Size = Size;
+        Entry.Hash = Hash;
+        Snapshot->Add(Entry);
     }
-    else {
-        SendLogMsg(TSync::CODE_ERROR, "Cannot open file for sync. File name: " + FileInfo.absolutePath());
-        return;
+    if ((it != Targets.constEnd()) && it->clearDirAfterSync && QFile::remove(FileName) && (it->Scanner != nullptr)) {
+        it->Scanner->Forget(FileName);
     }
+}
 
-    QSqlQuery QueryAdd(DB);
-    DB.transaction();
-
-    QString QueryText = "INSERT INTO SYNCFILE (CATEGORY, FILE_NAME, CREATE_DATE_TIME, CHANGE_DATE_TIME, BODY) VALUES ( "
-                        "'" + Category + "', "
-                        "'" + FileInfo.absoluteFilePath() + "', "
-                        "'" + FileInfo.fileTime(QFileDevice::FileBirthTime).toString("yyyy-MM-dd hh:mm:ss.zzz") + "', "
-                        "'" + FileInfo.fileTime(QFileDevice::FileModificationTime).toString("yyyy-MM-dd hh:mm:ss.zzz") + "', "
-                        "? )";
-    QueryAdd.prepare(QueryText);
-    QueryAdd.bindValue(0, Body);
-    if (!QueryAdd.exec()) {
-        DB.rollback();
-        qDebug() << "Cannot execute query. Error: " + QueryAdd.lastError().text() + " Query: " + QueryAdd.executedQuery();
-        exit(-2);
+void TSync::onFileFailed(const QString &Target, const QString &FileName, const QDateTime &ChangeDateTime, const QString &Msg)
+{
+    IngestingFiles.remove(FileName);
+    Metrics.Add(TMetrics::READ_ERRORS);
+    SendLogMsg(TSync::CODE_ERROR, Msg);
+    //при следующем сканировании попробуем загрузить файл еще раз
+    auto it = Targets.find(Target);
+    if (it != Targets.end()) {
+        it->OldFiles.Remove(FileName, ChangeDateTime.toMSecsSinceEpoch());
+        if (it->Scanner != nullptr) it->Scanner->Forget(FileName);
     }
-    if (!DB.commit()) {
-        DB.rollback();
-        qDebug() << "Cannot commit transation. Error: " + DB.lastError().text();
-        exit(-4);
-    };
 }
 
-qint64 TSync::FindHash(const QString &HASH)
+void TSync::onBatchWritten(int Count, quint64 LastID)
 {
-    for (const auto& ItemID : FileForDownload.keys()) {
-        if (FileForDownload[ItemID] == HASH) {
-         //   qDebug() << "FindHash" << HASH << "ID" << ItemID;
-            return ItemID;
-        }
+    if (DebugMode) {
+        qDebug() << "->Files added to DB:" << Count << "Last ID:" << LastID << "Time:" << Timer.msecsTo(QTime::currentTime()) << "ms";
     }
-    qDebug() << "Hash not find" << HASH << " return 0";
-    return 0;
+    PendingFiles += Count;
+    //в БД появились новые файлы - категории снова выбираются в Backlog
+    for (auto &Cursor : SendCursors) Cursor.Exhausted = false;
+    //все файлы пачки уже добавлены в снимок через onFileAdded
+    if (LastID > 0) Snapshot->Checkpoint(LastID);
+    //новые файлы сразу отправляем на сервер
+    SendRequests(false);
 }
 
-bool TSync::SaveFile(const QString &Category, const QString &FileName, quint64 ID, const QByteArray &Body)
+void TSync::onEvictOldFiles()
 {
-    if (DebugMode) {
-        qDebug() << "<-File received. HASH:" << FileForDownload[ID];
+    //предыдущая очистка еще не закончена
+    if (!EvictTargets.isEmpty()) return;
+    //записи о файлах, которых уже нет на диске, больше не нужны для сравнения
+    for (auto it = Targets.constBegin(); it != Targets.constEnd(); ++it) {
+        if ((it->isChange != TTypeChange::LOAD_FROM_SERVER) && (it->OldFiles.Size() > 0)) EvictTargets.push_back(it.key());
     }
+    EvictedCount = 0;
+    if (!EvictTargets.isEmpty()) EvictSliceTimer.start();
+}
 
-    //декодируем тело файла
-    QByteArray DecodeBody;
-    auto result = QByteArray::fromBase64Encoding(Body);
-    if (result.decodingStatus == QByteArray::Base64DecodingStatus::Ok) {
-        DecodeBody = result.decoded; // Декодируем файл
+void TSync::onEvictSlice()
+{
+    if (EvictTargets.isEmpty()) {
+        EvictSliceTimer.stop();
+        return;
     }
-    else {
-        SendLogMsg(MSG_CODE::CODE_INFORMATION, "Cannot decode file from Base64. Category: " + Category +
-                                               " File name: " + FileName +
-                                               " HASH:" + FileForDownload[ID]);
-        return false;
-    }
-    //создаем директорию, если ее нет
-    QString FullFileName = CategoryToTarget[Category] + FileName;
-    QDir Dir;
-    Dir.mkpath(QFileInfo(FullFileName).absolutePath());
-    //пишем файл
-    QFile File(FullFileName, this);
-    if (File.open(QIODeviceBase::WriteOnly)) {
-        File.write(DecodeBody);
-        File.close();
-        SendLogMsg(MSG_CODE::CODE_INFORMATION, "The file was saved successfully.  Category:"  + Category +
-                                               " File name: " + FullFileName +
-                                               " HASH:" + FileForDownload[ID] +
-                                               " Size:" + QString::number(DecodeBody.size()));
-        if (FileName.right(4) == ".cmd") RunCMD(FullFileName); //пришел командный файл
-        if (FileName == "Update.zip") RunCMD(QCoreApplication::applicationDirPath() + "/Update.bat");//пришло обновление
+    auto it = Targets.find(EvictTargets.first());
+    bool Done = true;
+    if (it != Targets.end()) {
+        QList<QPair<QString, qint64>> EvictedFiles;
+        EvictedCount += it->OldFiles.Evict(EvictSliceSize, Done, &EvictedFiles);
+        //вытесненные записи не должны вернуться из снимка при следующем запуске
+        for (const auto &File : EvictedFiles) Snapshot->Remove(it->Category, File.first, File.second);
+        if (Done && DebugMode && (EvictedCount > 0)) {
+            qDebug() << "Evicted from processed files:" << EvictedCount << "Target:" << it.key() << "Remaining:" << it->OldFiles.Size();
+        }
     }
-    else {
-        SendLogMsg(MSG_CODE::CODE_INFORMATION, "Cannot write file. Category:"  + Category +
-                                               " File name: " + FullFileName +
-                                               " HASH:" + FileForDownload[ID]);
-        return false;
+    if (!Done) return;
+    EvictTargets.removeFirst();
+    EvictedCount = 0;
+    if (!EvictTargets.isEmpty()) return;
+    EvictSliceTimer.stop();
+    //отметка не меняется - сбрасываем надгробия на диск и при необходимости переписываем снимок
+    Snapshot->Checkpoint(Snapshot->HighWaterMark());
+}
+
+void TSync::onCompacted(qint64 Deleted)
+{
+    if (Deleted > 0) SendLogMsg(MSG_CODE::CODE_INFORMATION, "Outdated file versions deleted from SYNCFILE: " + QString::number(Deleted));
+}
+
+void TSync::onCompactionProgress(quint64 LowWaterMark, quint64 Cursor, int Passes)
+{
+    //сохраняется вместе с остальными настройками, отдельный сброс на диск не нужен - проход можно повторить
+    Config->beginGroup("SYSTEM");
+    Config->setValue("CompactionMark", LowWaterMark);
+    Config->setValue("CompactionCursor", Cursor);
+    Config->setValue("CompactionPasses", Passes);
+    Config->endGroup();
+}
+
+void TSync::onCompactionError(const QString &Msg)
+{
+    //очистка не влияет на обмен - следующий проход будет выполнен по расписанию
+    SendLogMsg(MSG_CODE::CODE_ERROR, Msg);
+}
+
+void TSync::onIngestError(const QString &Msg)
+{
+    qDebug() << Msg;
+    exit(-2);
+}
+
+void TSync::onCollectMetrics()
+{
+    Metrics.Set(TMetrics::PENDING_FILES, PendingFiles);
+    Metrics.Set(TMetrics::DOWNLOAD_QUEUE, DownloadQueue->Size());
+    Metrics.Set(TMetrics::REQUESTS, Requests.size());
+    Metrics.Set(TMetrics::INGESTING_FILES, IngestingFiles.size());
+    Metrics.Set(TMetrics::SAVING_FILES, SavingFiles.size());
+}
+
+void TSync::SaveDownloadQueue()
+{
+    if (!DownloadQueueChanged) return;
+    if (!DownloadQueue->Save(DownloadQueueFile, DownloadQueueKey)) {
+        qDebug() << "Cannot save download queue. File:" << DownloadQueueFile;
+        return;
     }
+    DownloadQueueChanged = false;
+}
 
+void TSync::SaveFile(const QString &Category, const QString &FileName, quint64 ID, const QString &TmpFileName)
+{
+    if (DebugMode) {
+        qDebug() << "<-File received. HASH:" << DownloadQueue->Hash(ID);
+    }
 
-    return true;
+    //тело уже декодировано во временный файл рядом с целевым. Поток записи сбросит его на диск и атомарно заменит им файл
+    SavingFiles.insert(ID, Category);
+    FileWriter->Add(ID, TmpFileName, CategoryToTarget[Category] + FileName);
 }
 
+void TSync::onFileSaved(quint64 ID, const QString &FileName)
+{
+    const QString Category = SavingFiles.take(ID);
+    const qint64 Size = QFileInfo(FileName).size();
+    Metrics.Add(TMetrics::SAVED_FILES);
+    Metrics.Add(TMetrics::SAVED_BYTES, Size);
+    SendLogMsg(MSG_CODE::CODE_INFORMATION, "The file was saved successfully.  Category:"  + Category +
+                                           " File name: " + FileName +
+                                           " HASH:" + DownloadQueue->Hash(ID) +
+                                           " Size:" + QString::number(Size));
+    //файл на диске - отмечаем это у себя. LastDownloadID сдвинется по окончании пачки
+    DownloadQueue->SetDownloaded(ID);
+    DownloadQueueChanged = true;
+    if (FileName.right(4) == ".cmd") RunCMD(FileName); //пришел командный файл
+    if (FileName == CategoryToTarget.value(Category) + "Update.zip") RunCMD(QCoreApplication::applicationDirPath() + "/Update.bat");//пришло обновление
+}
 
+void TSync::onFileSaveFailed(quint64 ID, const QString &FileName, const QString &Msg)
+{
+    //файл остается в очереди и будет запрошен еще раз
+    const QString Category = SavingFiles.take(ID);
+    Metrics.Add(TMetrics::SAVE_ERRORS);
+    SendLogMsg(MSG_CODE::CODE_INFORMATION, "Cannot write file. Category:"  + Category +
+                                           " File name: " + FileName +
+                                           " HASH:" + DownloadQueue->Hash(ID) +
+                                           " Error: " + Msg);
+}
+
+void TSync::onFileBatchSaved()
+{
+    CommitDownloadID();
+}
+
+void TSync::ReconcileDownloadQueue()
+{
+    ListRefreshTimer.start();
+    //сервер присылает список по порядку ID и может его обрезать, поэтому сверяем очередь только до последнего присланного ID
+    //файлы, которые сейчас скачиваются или сохраняются, не трогаем - их судьбу решит ответ сервера
+    if (MaxListedID != 0) {
+        QSet<quint64> BusyFiles = DownloadingFiles;
+        for (auto it = SavingFiles.constBegin(); it != SavingFiles.constEnd(); ++it) BusyFiles.insert(it.key());
+        const qsizetype Removed = DownloadQueue->RemoveUnlisted(ListedIDs, MaxListedID, BusyFiles);
+        if (Removed > 0) {
+            DownloadQueueChanged = true;
+            SendLogMsg(MSG_CODE::CODE_INFORMATION, "Files withdrawn by the server removed from the download queue: " + QString::number(Removed));
+            //снятые файлы больше не задерживают LastDownloadID
+            CommitDownloadID();
+        }
+    }
+    ListedIDs.clear();
+    MaxListedID = 0;
+}
+
+void TSync::CommitDownloadID()
+{
+    //удаляем из очереди все сохраненные файлы идущие подряд с начала очереди
+    //LastDownloadID сдвигается только до последнего непрерывно сохраненного ID
+    const quint64 LastDownloadID = DownloadQueue->TakeDownloaded();
+    if (LastDownloadID == 0) return;
+    HTTPServerInfo.LastDownloadID = LastDownloadID;
+    DownloadQueueChanged = true;
+    Config->beginGroup("SERVER");
+    Config->setValue("LastDownloadID", HTTPServerInfo.LastDownloadID);
+    Config->endGroup();
+    Config->sync();
+}
 
 QDateTime TSync::TimeAccuracy(const QDateTime &DateTime)
 {
@@ -609,21 +1666,81 @@ void TSync::RunCMD(const QString &FileName)
     Process->deleteLater();
 }
 
+void TSync::SaveStatCache(bool All)
+{
+    QDir().mkpath(StatCacheDir);
+    for (auto it = Targets.constBegin(); it != Targets.constEnd(); ++it) {
+        if ((it->Scanner == nullptr) || (!All && !it->Scanner->IsModified())) continue;
+        //файлы, еще не записанные в БД, в кеш не попадают - после сбоя они будут найдены снова
+        if (!it->Scanner->Save(StatCacheFileName(it.key()), IngestingFiles)) {
+            qDebug() << "Cannot save stat cache. Target:" << it.key();
+        }
+    }
+}
+
+void TSync::onSaveStatCache()
+{
+    SaveStatCache(false);
+}
+
+QString TSync::StatCacheFileName(const QString &Target) const
+{
+    return StatCacheDir + "/" + QCryptographicHash::hash(Target.toUtf8(), QCryptographicHash::Md5).toHex() + ".stat";
+}
+
+void TSync::ScheduleScan()
+{
+    if (!EventDriven) return; //изменения обработаются по таймеру UpdateTimer
+
+    //серия изменений откладывает цикл на ScanDelay после последнего из них, но не более чем на MaxScanDelay от первого
+    if (!ScanTimer.isActive()) {
+        FirstChangeTimer.start();
+        ScanTimer.start(ScanDelay);
+    }
+    else {
+        ScanTimer.start(qBound<qint64>(0, MaxScanDelay - FirstChangeTimer.elapsed(), ScanDelay));
+    }
+}
+
 void TSync::onDirectoryChanged(const QString &path)
 {
     qDebug() << "Change path:" << path;
     Targets[path].isChange = CHANGE_DIR; //изменилась директория
+    ScheduleScan();
 }
 
 void TSync::onFileChanged(const QString &path)
 {
    qDebug() << "Change file:" << path;
    Targets[path].isChange = CHANGE_FILE;
+   //если файл был заменен новым, QFileSystemWatcher перестает его отслеживать - добавляем заново
+   if (!FileSystemWatcher->files().contains(path) && QFileInfo::exists(path)) {
+       FileSystemWatcher->addPath(path);
+   }
+   ScheduleScan();
 }
 
-void TSync::onHTTPError()
+void TSync::onHTTPError(quint64 ID)
 {
-    Transfering = false;
+    if (!Requests.contains(ID)) return;
+    TRequestInfo RequestInfo = Requests.take(ID);
+    ReleaseRequest(RequestInfo);
+    //полный список не получен - запросим его в следующем запросе
+    if (ID == ListingRequestID) ListingRequestID = 0;
+    Metrics.Add(TMetrics::HTTP_ERRORS);
+
+    //пакет будет отправлен повторно, а часть файла - с позиции, которую сервер подтвердил последней
+    if (RequestInfo.ChunkFileID != 0) FinishChunk(RequestInfo, false);
+    ReturnFiles(RequestInfo.Files);
+    //сервер мог не принять двоичный запрос - следующий отправляем в XML, версия протокола будет согласована заново
+    if (RequestInfo.Framed) HTTPServerInfo.BinaryProtocol = false;
+    //то же со сжатием: после неудачного сжатого запроса отправляем без сжатия
+    if (RequestInfo.Compressed) HTTPQuery->RejectCompression();
+    //следующая попытка - после паузы, которая растет с каждой ошибкой подряд
+    Backoff->Failure();
+    if (DebugMode) {
+        qDebug() << "Exchange with the server failed. Next attempt in" << Backoff->Delay() << "ms";
+    }
 }
 
 
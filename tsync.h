@@ -3,31 +3,64 @@
 
 #include <QObject>
 #include <QSettings>
-#include <QtSql/QSqlDatabase>
 #include <QTimer>
 #include <QtNetwork/QNetworkAccessManager>
 #include <QMap>
 #include <QQueue>
 #include <QFileSystemWatcher>
+#include <QHash>
 #include <QSet>
+#include <QStringList>
 #include <QPair>
 #include <QFileInfo>
+#include <QElapsedTimer>
 #include "tconsole.h"
 #include "thttpquery.h"
+#include "trequestbody.h"
+#include "tanswerparser.h"
+#include "tbackoff.h"
+#include "tlogwriter.h"
+#include "tsyncdb.h"
+#include "tingestpipeline.h"
+#include "tdirscanner.h"
+#include "tfilesnapshot.h"
+#include "toldfiles.h"
+#include "tdownloadqueue.h"
+#include "tfilewriter.h"
+#include "tmetrics.h"
+#include "tmetricsexporter.h"
+#include "tcompactor.h"
+#include "tscheduler.h"
 
 class TSync : public QObject
 {
     Q_OBJECT
  public:
     typedef enum {CODE_OK, CODE_ERROR, CODE_INFORMATION} MSG_CODE; //коды ошибок
+    static const QString BinaryContentType; //тип содержимого запросов и ответов двоичного протокола
 
  private:
     typedef struct {
         QString Url;
         QString AZSCode;
-        quint64 LastFileID;
+        quint64 LastFileID; //все файлы с ID до LastFileID включительно подтверждены сервером
         quint64 LastDownloadID = 0;
-        quint64 DeleteFileID = 0; //ID файла отправляемого в последнем пакете
+        int MaxRequests = 4; //максимальное количество одновременно выполняющихся запросов
+        quint32 MaxFilesPerPacket = 100; //максимальное количество файлов в одном пакете
+        qint64 MaxPacketSize = 5242880; //максимальный размер тел файлов в одном пакете, байт
+        quint32 MaxDownloadFiles = 100; //максимальное количество файлов запрашиваемых с сервера за один запрос
+        qint64 MaxDownloadSize = 5242880; //максимальный размер ответа сервера с файлами, байт
+        qint64 BodyChunkSize = 65536; //размер куска тела файла считываемого из БД при отправке, байт
+        bool BinaryAllowed = true; //разрешено использовать двоичный протокол, если его поддерживает сервер
+        bool BinaryProtocol = false; //сервер поддерживает двоичный протокол (0.2)
+        qint64 CompressionMinSize = 1024; //запросы меньшего размера не сжимаются
+        QStringList NoCompressExt; //расширения уже сжатых файлов, которые нет смысла сжимать повторно
+        bool RefSupported = false; //сервер принимает ссылку BodyRef на тело, уже отправленное ранее (протокол 0.3)
+        bool DeltaSupported = false; //сервер собирает файл из разности с прошлой версией (протокол 0.4)
+        qint64 TransferChunkSize = 1048576; //файлы больше передаются частями такого размера (протокол 0.5). 0 - целиком
+        bool ChunkSupported = false; //сервер принимает и отдает файлы частями
+        quint64 UploadFileID = 0; //файл, передача которого частями прервалась при прошлом запуске
+        qint64 UploadOffset = 0;  //сколько байт этого файла сервер уже получил
     } THTTPServerInfo;
 
     typedef struct {
@@ -39,20 +72,66 @@ class TSync : public QObject
         QByteArray Body;
     } TFileInfo;
 
-    typedef enum {NO_CHANGE, LOAD_FROM_SERVER, CHANGE_FILE, CHANGE_DIR} TTypeChange;
+    typedef struct {
+        quint64 ID = 0;          //ID файла в SYNCFILE
+        QString Category;
+        QString FileName;
+        QDateTime CreateDateTime;
+        QDateTime ChangeDateTime;
+        qint64 BodySize = 0;     //размер тела в БД. Для ссылки - размер тела, на которое она указывает
+        QString Encoding;
+        QString Hash;
+        qint64 QueuedAt = 0;     //когда файл выбран в Backlog, мс по ScheduleClock
+    } TPacketFile;
+
+    typedef struct {
+        TAnswerParser *AnswerParser = nullptr; //разборщик ответа на запрос
+        qint64 AnswerSize = 0;   //размер полученного ответа
+        bool Framed = false;     //запрос отправлен в двоичном протоколе
+        bool Compressed = false; //тело запроса сжато
+        QList<TPacketFile> Files; //файлы, отправленные в запросе целиком
+        QList<quint64> DownloadIDs; //ID файлов запрошенных у сервера
+        quint64 ChunkFileID = 0; //запрос передает часть файла с этим ID
+        qint64 ChunkOffset = 0;  //позиция и размер этой части в теле файла
+        qint64 ChunkSize = 0;
+        QElapsedTimer SendTimer; //время с отправки запроса
+        qint64 ParseTime = 0;    //время разбора ответа, нс
+        bool FullListing = false; //запрос без LastListedID - сервер присылает полный список незагруженных файлов
+    } TRequestInfo;
+
+    typedef struct {
+        quint64 ID = 0;          //ID файла в SYNCFILE, который передается частями. 0 - передачи нет
+        TPacketFile File;        //сам файл
+        qint64 Size = 0;         //размер тела файла в БД
+        qint64 Offset = 0;       //сколько байт тела сервер уже получил
+        bool InFlight = false;   //очередная часть отправлена, ответ еще не получен
+        bool Acked = false;      //в ответе пришло подтверждение ChunkAck
+        qint64 AckedOffset = 0;  //размер, который подтвердил сервер
+    } TUploadInfo;
 
-    typedef QPair<QString, QDateTime> TFile;
+    typedef struct {
+        QString FileName; //файл с уже полученными частями, рядом с целевым
+        qint64 Offset = 0; //сколько байт получено
+    } TPartialDownload;
 
-    typedef QSet<TFile> TOldFile;
+    typedef struct {
+        quint64 SentID = 0;      //файлы категории до этого ID уже выбраны в Backlog или подтверждены
+        bool Exhausted = false;  //в БД больше нет файлов категории - до записи новых файлов ее не выбираем
+    } TSendCursor;
+
+    typedef enum {NO_CHANGE, LOAD_FROM_SERVER, CHANGE_FILE, CHANGE_DIR} TTypeChange;
+    typedef enum {SEND_OK, SEND_NOTHING, SEND_FAILED} TSendResult; //результат отправки очередного запроса
 
     typedef struct {
      //   quint16 Index;
         QString Category; //категория
         TTypeChange isChange ;
-        TOldFile OldFiles; //множество уже обработанных файлов
+        TOldFiles OldFiles; //множество уже обработанных файлов
+        TDirScanner *Scanner = nullptr; //сканер директории с кешем атрибутов файлов. Только для CHANGE_DIR
         quint64 LastID = 0;
         bool clearDirAfterSync = false;
         bool ignoreEmptyFile = false;
+        bool Delta = false; //отправлять изменения файла разностью с прошлой версией. Только для CHANGE_FILE
     } TTargetInfo;
 
 public:
@@ -61,29 +140,107 @@ public:
 
 private:
     QSettings *Config;
-    QSqlDatabase DB;
-    QTimer UpdateTimer;
+    TSyncDB *SyncDB; //соединение с БД и подготовленные запросы к SYNCFILE
+    TLogWriter *LogWriter; //запись сообщений в LOG в отдельном потоке
+    TIngestPipeline *Ingest; //загрузка новых файлов в SYNCFILE в отдельных потоках
+    TCompactor *Compactor; //удаление устаревших версий подтвержденных файлов в отдельном потоке
+    QSet<QString> IngestingFiles; //файлы поставленные на загрузку в БД, но еще не записанные
+    TFileSnapshot *Snapshot; //снимок OldFiles на диске для быстрого запуска
+    QTimer UpdateTimer; //периодический запуск цикла обмена. В режиме EventDriven - страховка на случай пропущенных событий
+    QTimer ScanTimer;   //отложенный запуск цикла обмена после изменения отслеживаемых целей
+    QTimer EvictTimer;  //периодическая очистка OldFiles от записей о несуществующих файлах
+    QTimer EvictSliceTimer; //очистка идет частями, чтобы не задерживать обработку событий
+    QStringList EvictTargets; //цели, очистка OldFiles которых еще не закончена
+    qsizetype EvictSliceSize = 1000; //сколько записей проверять за один шаг очистки
+    qsizetype EvictedCount = 0; //удалено записей в текущей цели
+    QTimer StatCacheTimer; //периодическое сохранение кеша атрибутов файлов - чтобы не потерять его при сбое
+    QElapsedTimer FirstChangeTimer; //время с первого изменения в текущей серии изменений
+    bool EventDriven = true; //запускать цикл обмена сразу после изменения целей
+    int ScanDelay = 200;     //пауза после последнего изменения перед запуском цикла, мс
+    int MaxScanDelay = 1000; //максимальная задержка цикла от первого изменения в серии, мс
+    QString StatCacheDir; //директория для сохранения кеша атрибутов файлов между запусками
     THTTPQuery *HTTPQuery;
+    TBackoff *Backoff; //паузы между повторными попытками при ошибках обмена
     THTTPServerInfo HTTPServerInfo;
-    bool Transfering = false; //Флаг текущей передачи данных
+    QMap<quint64, TRequestInfo> Requests; //выполняющиеся запросы. Ключ - ID запроса в THTTPQuery
+    QSet<quint64> AckedIDs; //подтвержденные сервером файлы, которые пока нельзя учесть в LastFileID. Сохраняются между запусками
+    int MaxAckedFiles = 10000; //больше подтвержденных не по порядку файлов не копим - файлы уходят по порядку ID
+    quint64 ClearedFileID = 0; //тела файлов очищены до этого ID. Отстает от LastFileID до сохранения подтверждений
+    QTimer AckSaveTimer; //отложенное сохранение подтверждений: одна запись настроек на несколько ответов сервера
+    bool AcksChanged = false; //подтверждения изменились с последнего сохранения
+    QMap<quint64, TPacketFile> Backlog; //выбранные из БД и еще не отправленные файлы, в том числе не дошедшие до сервера. Ключ - ID
+    QMap<QString, TSendCursor> SendCursors; //до какого ID выбраны файлы каждой категории
+    int ScheduleWindow = 10000; //сколько файлов каждой категории держать в Backlog - среди них планировщик выбирает файлы для пакета
+    QElapsedTimer ScheduleClock; //часы для времени ожидания файлов в Backlog
+    int MaxScheduleDelay = 60000; //файлы, ждущие дольше, мс, уходят раньше остальных независимо от приоритета категории
+    TScheduler Scheduler; //выбор файлов по приоритетам и весам категорий, ограничение скорости обмена
+    QTimer ShapingTimer;  //отложенная отправка после восстановления предела скорости
+    bool ShapingForce = false; //отложенный запрос нужно отправить даже без файлов для обмена
+    TUploadInfo Upload; //передача большого файла частями
+    QMap<quint64, TPartialDownload> PartialDownloads; //файлы, полученные с сервера не полностью. Ключ - ID файла на сервере
 
     QMap<QString, QString> CategoryToTarget;
     QMap<QString, TTargetInfo> Targets; //карта целей для отслеживания. Ключ - цель отслеживания
 
     QFileSystemWatcher *FileSystemWatcher;
 
-    QMap<quint64, QString> FileForDownload;
+    TDownloadQueue *DownloadQueue; //файлы для скачивания с сервера по порядку ID с поиском по HASH
+    QString DownloadQueueFile; //файл для сохранения очереди между запусками
+    QString DownloadQueueKey;  //сервер, к которому относится сохраненная очередь
+    bool DownloadQueueChanged = false; //очередь изменилась с последнего сохранения
+    int ListRefreshInterval = 0; //период запроса полного списка незагруженных файлов, мс. 0 - не запрашивать
+    QElapsedTimer ListRefreshTimer; //время с последнего полного списка
+    quint64 ListingRequestID = 0; //запрос полного списка, 0 - такого запроса нет
+    QSet<quint64> ListedIDs; //ID файлов, присланные в полном списке
+    quint64 MaxListedID = 0; //максимальный ID в полном списке
+    QSet<quint64> DownloadingFiles; //ID файлов запрошенных выполняющимися запросами
+    TFileWriter *FileWriter; //сохранение полученных файлов на диск в отдельном потоке
+    QHash<quint64, QString> SavingFiles; //файлы переданные в FileWriter, но еще не сброшенные на диск. Ключ - ID, значение - категория
 
+    bool BinaryBody = false; //новые тела файлов хранятся в БД без кодирования (SYNCFILE.ENCODING = 'binary')
+    bool ContentHash = false; //хранить хеш содержимого файлов (SYNCFILE.HASH) и не дублировать одинаковые тела
+    QHash<QString, QByteArray> FileHashes; //хеш содержимого последней загруженной версии файла. Ключ - полный путь
+    QSet<QByteArray> KnownHashes; //хеши всех тел в SYNCFILE, собранные при запуске
+    bool DeltaEnabled = false; //есть цели, изменения которых отправляются разностями
+    QSet<quint64> RejectedDeltas; //файлы, разности которых сервер не принял. Отправляются повторно целиком
+    TMetrics Metrics; //время этапов цикла обмена, очереди, счетчики байт и ошибок
+    quint64 PendingFiles = 0; //записанные в БД и еще не доставленные на сервер файлы. Считается по БД один раз при запуске
+    TMetricsExporter *MetricsExporter; //HTTP и файл для внешнего мониторинга
     bool DebugMode = false;
     QTime Timer = QTime::currentTime();
 
     void SendLogMsg(uint16_t Category, const QString &Msg);
-    void SendToHTTPServer();
+    //отправляет очередной запрос. Force - отправить даже если нет файлов для обмена
+    //Wait - если файлы не отправлены из-за пределов скорости категорий, через сколько мс повторить
+    TSendResult SendToHTTPServer(bool Force, qint64 &Wait);
+    void SendRequests(bool Force);     //заполняет окно одновременно выполняющихся запросов
+    void InitBacklog(); //категории файлов для отправки и незаконченная передача большого файла с прошлого запуска
+    void FillBacklog(); //добирает в Backlog новые файлы из БД по категориям
+    TPacketFile ReadPacketFile(const QSqlQuery &Query); //описание файла из выборки SelectFiles или SelectCategoryFiles
+    bool Overdue(const TPacketFile &File) const; //файл ждет отправки дольше допустимого
+    bool ResolveBody(const TPacketFile &File, quint64 &BodyID, qint64 &BodySize, QString &Encoding); //BodyID = 0 - отправляется только ссылка
+    void AckFile(quint64 ID); //сервер подтвердил прием файла, переданного частями
+    void AckFiles(const QList<TPacketFile> &Files); //сервер подтвердил прием файлов пакета
+    void FileDelivered(const TPacketFile &File); //сервер получил файл целиком: учитываем версию для разностей
+    void AdvanceLastFileID(); //сдвигает LastFileID по подряд идущим подтвержденным файлам
+    void SaveAcks(); //сохраняет LastFileID и подтверждения, затем очищает тела подтвержденных файлов
+    void ReturnFiles(const QList<TPacketFile> &Files); //файлы не дошли до сервера и будут отправлены повторно
+    void ReleaseRequest(TRequestInfo &RequestInfo); //освобождает ресурсы завершенного запроса
+    void FinishChunk(const TRequestInfo &RequestInfo, bool Ok); //запрос с частью файла завершен
+    void SaveUploadProgress();
+    void LoadPartialDownloads();
+    void SaveDownloadProgress(quint64 ID);
+    bool AppendChunk(const QString &FileName, const QString &ChunkFileName); //дописывает полученную часть файла
     void GetOldFileName();
-    void AddFileToDB(const QFileInfo& FileInfo, const QString& Category);
-    qint64 FindHash(const QString& HASH);
-    bool SaveFile(const QString& Category, const QString& FileName, quint64 ID, const QByteArray& Body);
+    void AddFileToDB(const QString &Target, const QFileInfo& FileInfo, const QString& Category); //ставит файл в очередь на загрузку в БД
+    void SaveDownloadQueue();
+    void ReconcileDownloadQueue(); //удаляет из очереди скачивания файлы, которых нет в полном списке
+    void SaveFile(const QString& Category, const QString& FileName, quint64 ID, const QString& TmpFileName); //результат придет в onFileSaved/onFileSaveFailed
+    void CommitDownloadID(); //сдвигает LastDownloadID по сохраненным на диск файлам
 
+    void ScheduleScan(); //планирует запуск цикла обмена после изменения целей
+    QString StatCacheFileName(const QString &Target) const; //файл кеша атрибутов файлов цели
+    void SaveStatCache(bool All); //All = false - сохраняет только изменившиеся кеши
     QDateTime TimeAccuracy(const QDateTime &DateTime);
     void RunCMD(const QString& FileName);
 
@@ -95,12 +252,36 @@ public slots:
     void onStart();
 
 private slots:
-    void onHTTPGetAnswer(const QByteArray &Answer);
+    void onHTTPGetAnswerContentType(quint64 ID, const QString &ContentType);
+    void onHTTPGetAnswerData(quint64 ID, const QByteArray &Data);
+    void onGetProtocolVersion(const QString &Version);
+    void onHTTPGetAnswerFinished(quint64 ID);
+    void onGetUndownloadedFile(quint64 ID, const QString &HASH);
+    void onGetFile(const QString &Category, const QString &FileName, const QString &HASH, const QString &TmpFileName);
+    void onGetFileChunk(const QString &Category, const QString &FileName, const QString &HASH, const QString &TmpFileName, qint64 Offset, qint64 TotalSize);
+    void onGetChunkAck(quint64 ID, qint64 Offset);
+    void onGetDeltaRejected(quint64 ID);
+    void onFileSaved(quint64 ID, const QString &FileName);
+    void onFileSaveFailed(quint64 ID, const QString &FileName, const QString &Msg);
+    void onFileBatchSaved();
     void onStartGetData();
     void onSendLogMsg(uint16_t Category, const QString &Msg);
     void onDirectoryChanged(const QString &path);
     void onFileChanged(const QString &path);
-    void onHTTPError();
+    void onHTTPError(quint64 ID);
+    void onFileAdded(const QString &Target, const QString &FileName, const QDateTime &ChangeDateTime, qint64 Size, const QByteArray &Hash);
+    void onFileFailed(const QString &Target, const QString &FileName, const QDateTime &ChangeDateTime, const QString &Msg);
+    void onBatchWritten(int Count, quint64 LastID);
+    void onIngestError(const QString &Msg);
+    void onEvictOldFiles();
+    void onEvictSlice();
+    void onSaveStatCache();
+    void onCompacted(qint64 Deleted);
+    void onCompactionProgress(quint64 LowWaterMark, quint64 Cursor, int Passes); //запоминает, откуда продолжить очистку
+    void onCompactionError(const QString &Msg);
+    void onCollectMetrics(); //обновляет текущие значения очередей перед выводом метрик
+    void onShapingTimeout();
+    void onSaveAcks();
 
 };
 
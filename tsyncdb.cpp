@@ -0,0 +1,357 @@
+#include <QDebug>
+#include <QSqlError>
+#include <QVariant>
+#include <limits>
+#include "tsyncdb.h"
+
+TSyncDB::TSyncDB(const QSqlDatabase &DB, bool BinaryBody, bool ContentHash, QObject *parent)
+    : QObject(parent)
+    , DB(DB)
+    , BinaryBody(BinaryBody)
+    , ContentHash(ContentHash)
+{
+}
+
+TSyncDB::~TSyncDB()
+{
+    //подготовленные запросы должны быть освобождены до закрытия соединения
+    SelectFilesQuery = QSqlQuery();
+    CategoryFilesQuery = QSqlQuery();
+    CategoriesQuery = QSqlQuery();
+    FileIDsQuery = QSqlQuery();
+    BodyChunkQuery = QSqlQuery();
+    ClearBodiesQuery = QSqlQuery();
+    OldFilesQuery = QSqlQuery();
+    DeletedFilesQuery = QSqlQuery();
+    AddFileQuery = QSqlQuery();
+    MaxIDQuery = QSqlQuery();
+    FindBodyQuery = QSqlQuery();
+    CountFilesQuery = QSqlQuery();
+    CompactQuery = QSqlQuery();
+    DB.close();
+}
+
+bool TSyncDB::Prepare(QSqlQuery &Query, const QString &QueryText)
+{
+    Query = QSqlQuery(DB);
+    Query.setForwardOnly(true); //записи читаем по одной, не кешируя тела файлов
+    if (!Query.prepare(QueryText)) {
+        LastError = "Cannot prepare query. Error: " + Query.lastError().text() + " Query: " + QueryText;
+        return false;
+    }
+    return true;
+}
+
+bool TSyncDB::Exec(QSqlQuery &Query)
+{
+    if (!Query.exec()) {
+        LastError = "Cannot execute query. Error: " + Query.lastError().text() + " Query: " + Query.lastQuery();
+        return false;
+    }
+    return true;
+}
+
+bool TSyncDB::Tune(QSqlDatabase &DB, QString &Error)
+{
+    if (DB.driverName() != "QSQLITE") return true;
+    //WAL: читатели не блокируют запись, фиксация - дописывание в журнал без сброса основного файла
+    //synchronous = NORMAL в WAL не теряет данные при падении процесса, только последние транзакции при отключении питания
+    QSqlQuery Query(DB);
+    for (const QString &Text : {QString("PRAGMA journal_mode = WAL"), QString("PRAGMA synchronous = NORMAL"),
+                                QString("PRAGMA temp_store = MEMORY")}) {
+        if (!Query.exec(Text)) {
+            Error = "Cannot configure database. Error: " + Query.lastError().text() + " Query: " + Text;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TSyncDB::CreateSchema()
+{
+    //столбцы ENCODING и HASH создаются всегда, чтобы настройки BinaryBody и ContentHash можно было включить позже
+    //AUTOINCREMENT не дает повторно использовать ID удаленных записей - на ID держатся LastFileID и снимок
+    //INCREMENTAL действует только для новой БД: место после удаления старых версий возвращается частями, без VACUUM
+    QSqlQuery Query(DB);
+    for (const QString &Text : {QString("PRAGMA auto_vacuum = INCREMENTAL"),
+                                QString("CREATE TABLE IF NOT EXISTS SYNCFILE (ID INTEGER PRIMARY KEY AUTOINCREMENT, CATEGORY VARCHAR(50), "
+                                        "FILE_NAME VARCHAR(250), CREATE_DATE_TIME TIMESTAMP, CHANGE_DATE_TIME TIMESTAMP, BODY BLOB, "
+                                        "ENCODING VARCHAR(10), HASH VARCHAR(128))"),
+                                QString("CREATE INDEX IF NOT EXISTS SYNCFILE_CATEGORY_ID ON SYNCFILE (CATEGORY, ID)"),
+                                QString("CREATE INDEX IF NOT EXISTS SYNCFILE_HASH ON SYNCFILE (HASH)"),
+                                QString("CREATE INDEX IF NOT EXISTS SYNCFILE_FILE ON SYNCFILE (CATEGORY, FILE_NAME, ID)"),
+                                QString("CREATE TABLE IF NOT EXISTS LOG (ID INTEGER PRIMARY KEY AUTOINCREMENT, "
+                                        "DATE_TIME TIMESTAMP DEFAULT (STRFTIME('%Y-%m-%d %H:%M:%f', 'now', 'localtime')), "
+                                        "CATEGORY INTEGER, SENDER VARCHAR(50), MSG TEXT)")}) {
+        if (!Query.exec(Text)) {
+            LastError = "Cannot create database schema. Error: " + Query.lastError().text() + " Query: " + Text;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TSyncDB::Open()
+{
+    if (!DB.open()) {
+        LastError = "Cannot connect to database. Error: " + DB.lastError().text();
+        return false;
+    }
+    if (Embedded() && (!Tune(DB, LastError) || !CreateSchema())) return false;
+
+    //в SQLite тела хранятся как BLOB, поэтому length и substr считают байты
+    const QString BodySize = Embedded() ? "LENGTH(BODY)" : "OCTET_LENGTH(BODY)";
+    const QString BodyChunk = Embedded() ? "SUBSTR(BODY, ?, ?)" : "SUBSTRING(BODY FROM ? FOR ?)";
+    const QString EncodingColumn = HasEncoding() ? ", ENCODING" : "";
+    const QString HashColumn = ContentHash ? ", HASH" : "";
+    if (ContentHash && !Prepare(FindBodyQuery, "SELECT ID, " + BodySize + " AS BODY_SIZE, ENCODING "
+                                               "FROM SYNCFILE "
+                                               "WHERE HASH = ? AND ENCODING NOT IN ('ref', 'delta') AND " + BodySize + " > 0 "
+                                               "ORDER BY ID")) return false;
+    const QString FileColumns = "ID, CATEGORY, FILE_NAME, CREATE_DATE_TIME, CHANGE_DATE_TIME, " + BodySize + " AS BODY_SIZE" + EncodingColumn + HashColumn;
+    return Prepare(SelectFilesQuery, "SELECT " + FileColumns + " "
+                                     "FROM SYNCFILE "
+                                     "WHERE ID > ? AND ID <= ? "
+                                     "ORDER BY ID") &&
+           Prepare(CategoryFilesQuery, "SELECT " + FileColumns + " "
+                                       "FROM SYNCFILE "
+                                       "WHERE CATEGORY = ? AND ID > ? "
+                                       "ORDER BY ID") &&
+           Prepare(CategoriesQuery, "SELECT DISTINCT CATEGORY FROM SYNCFILE WHERE ID > ?") &&
+           Prepare(FileIDsQuery, "SELECT ID FROM SYNCFILE WHERE ID > ? ORDER BY ID") &&
+           Prepare(BodyChunkQuery, "SELECT " + BodyChunk + " FROM SYNCFILE WHERE ID = ?") &&
+           Prepare(ClearBodiesQuery, "UPDATE SYNCFILE SET BODY = '' WHERE ID > ? AND ID <= ?") &&
+           Prepare(OldFilesQuery, "SELECT ID, CATEGORY, FILE_NAME, CHANGE_DATE_TIME" + HashColumn + " "
+                                  "FROM SYNCFILE "
+                                  "WHERE ID > ? AND (NOT BODY LIKE '%*DELETED%')") &&
+           Prepare(DeletedFilesQuery, "SELECT CATEGORY, FILE_NAME, CHANGE_DATE_TIME "
+                                      "FROM SYNCFILE "
+                                      "WHERE ID > ? AND ID <= ? AND BODY LIKE '%*DELETED%'") &&
+           Prepare(MaxIDQuery, "SELECT MAX(ID) FROM SYNCFILE") &&
+           Prepare(CountFilesQuery, "SELECT COUNT(*) FROM SYNCFILE WHERE ID > ?") &&
+           Prepare(CompactQuery, "DELETE FROM SYNCFILE "
+                                 "WHERE ID > ? AND ID <= ? AND CHANGE_DATE_TIME < ? AND " + BodySize + " = 0 AND "
+                                 "EXISTS (SELECT 1 FROM SYNCFILE N WHERE N.CATEGORY = SYNCFILE.CATEGORY AND N.FILE_NAME = SYNCFILE.FILE_NAME AND N.ID > SYNCFILE.ID)") &&
+           Prepare(AddFileQuery, "INSERT INTO SYNCFILE (CATEGORY, FILE_NAME, CREATE_DATE_TIME, CHANGE_DATE_TIME, BODY" + EncodingColumn + HashColumn + ") "
+                                 "VALUES (?, ?, ?, ?, ?" + QString(HasEncoding() ? ", ?" : "") + QString(ContentHash ? ", ?" : "") + ")");
+}
+
+bool TSyncDB::Transaction()
+{
+    if (!DB.transaction()) {
+        LastError = "Cannot start transation. Error: " + DB.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+bool TSyncDB::Commit()
+{
+    if (!DB.commit()) {
+        LastError = "Cannot commit transation. Error: " + DB.lastError().text();
+        DB.rollback();
+        return false;
+    }
+    return true;
+}
+
+void TSyncDB::Rollback()
+{
+    DB.rollback();
+}
+
+bool TSyncDB::SelectFiles(quint64 FromID, quint64 ToID)
+{
+    //ID в БД - знаковое 64-битное целое
+    const qint64 MaxID = std::numeric_limits<qint64>::max();
+    SelectFilesQuery.bindValue(0, static_cast<qint64>(qMin<quint64>(FromID, MaxID)));
+    SelectFilesQuery.bindValue(1, static_cast<qint64>(qMin<quint64>(ToID, MaxID)));
+    return Exec(SelectFilesQuery);
+}
+
+bool TSyncDB::SelectCategoryFiles(const QString &Category, quint64 FromID)
+{
+    CategoryFilesQuery.bindValue(0, Category);
+    CategoryFilesQuery.bindValue(1, static_cast<qint64>(FromID));
+    return Exec(CategoryFilesQuery);
+}
+
+bool TSyncDB::Categories(quint64 FromID, QStringList &List)
+{
+    List.clear();
+    CategoriesQuery.bindValue(0, static_cast<qint64>(FromID));
+    if (!Exec(CategoriesQuery)) return false;
+    while (CategoriesQuery.next()) List.push_back(CategoriesQuery.value(0).toString());
+    CategoriesQuery.finish();
+    return true;
+}
+
+bool TSyncDB::SelectFileIDs(quint64 FromID)
+{
+    FileIDsQuery.bindValue(0, static_cast<qint64>(FromID));
+    return Exec(FileIDsQuery);
+}
+
+bool TSyncDB::ReadBodyChunk(quint64 ID, qint64 Pos, qint64 Size, QByteArray &Chunk)
+{
+    //позиция в SUBSTRING и SUBSTR начинается с 1
+    BodyChunkQuery.bindValue(0, Pos + 1);
+    BodyChunkQuery.bindValue(1, Size);
+    BodyChunkQuery.bindValue(2, static_cast<qint64>(ID));
+    if (!Exec(BodyChunkQuery)) return false;
+    if (!BodyChunkQuery.next()) {
+        LastError = "File not found in DB. ID: " + QString::number(ID);
+        BodyChunkQuery.finish();
+        return false;
+    }
+    Chunk = BodyChunkQuery.value(0).toByteArray();
+    BodyChunkQuery.finish();
+    return true;
+}
+
+bool TSyncDB::ClearBodies(quint64 FromID, quint64 ToID)
+{
+    ClearBodiesQuery.bindValue(0, static_cast<qint64>(FromID));
+    ClearBodiesQuery.bindValue(1, static_cast<qint64>(ToID));
+    return Exec(ClearBodiesQuery);
+}
+
+bool TSyncDB::SelectOldFiles(quint64 FromID)
+{
+    OldFilesQuery.bindValue(0, static_cast<qint64>(FromID));
+    return Exec(OldFilesQuery);
+}
+
+bool TSyncDB::SelectDeletedFiles(quint64 FromID, quint64 ToID)
+{
+    DeletedFilesQuery.bindValue(0, static_cast<qint64>(FromID));
+    DeletedFilesQuery.bindValue(1, static_cast<qint64>(ToID));
+    return Exec(DeletedFilesQuery);
+}
+
+bool TSyncDB::MaxID(quint64 &ID)
+{
+    if (!Exec(MaxIDQuery)) return false;
+    ID = MaxIDQuery.next() ? MaxIDQuery.value(0).toULongLong() : 0; //для пустой таблицы MAX возвращает NULL
+    MaxIDQuery.finish();
+    return true;
+}
+
+bool TSyncDB::CountFiles(quint64 FromID, quint64 &Count)
+{
+    CountFilesQuery.bindValue(0, static_cast<qint64>(FromID));
+    if (!Exec(CountFilesQuery)) return false;
+    Count = CountFilesQuery.next() ? CountFilesQuery.value(0).toULongLong() : 0;
+    CountFilesQuery.finish();
+    return true;
+}
+
+TSyncDB::TIndexState TSyncDB::FileIndex()
+{
+    if (Embedded()) return INDEX_OK;
+    //каталог проверяем только у Firebird. Через ODBC тип сервера узнаем по системной таблице RDB$DATABASE
+    QSqlQuery Query(DB);
+    const bool Firebird = (DB.driverName() == "QIBASE") ||
+                          ((DB.driverName() == "QODBC") && Query.exec("SELECT 1 FROM RDB$DATABASE") && Query.next());
+    Query.finish();
+    if (!Firebird) {
+        LastError = "Index on SYNCFILE (CATEGORY, FILE_NAME) is not checked for database driver " + DB.driverName();
+        return INDEX_UNKNOWN;
+    }
+
+    const QString CheckText = "SELECT COUNT(*) FROM RDB$INDICES I "
+                              "JOIN RDB$INDEX_SEGMENTS S1 ON S1.RDB$INDEX_NAME = I.RDB$INDEX_NAME AND S1.RDB$FIELD_POSITION = 0 "
+                              "JOIN RDB$INDEX_SEGMENTS S2 ON S2.RDB$INDEX_NAME = I.RDB$INDEX_NAME AND S2.RDB$FIELD_POSITION = 1 "
+                              "WHERE I.RDB$RELATION_NAME = 'SYNCFILE' AND S1.RDB$FIELD_NAME = 'CATEGORY' AND S2.RDB$FIELD_NAME = 'FILE_NAME' "
+                              "AND COALESCE(I.RDB$INDEX_INACTIVE, 0) = 0";
+    if (!Query.exec(CheckText)) {
+        LastError = "Cannot check index on SYNCFILE (CATEGORY, FILE_NAME). Error: " + Query.lastError().text() + " Query: " + CheckText;
+        return INDEX_UNKNOWN;
+    }
+    const bool Exists = Query.next() && (Query.value(0).toLongLong() > 0);
+    Query.finish();
+    if (Exists) return INDEX_OK;
+
+    const QString CreateText = "CREATE INDEX SYNCFILE_FILE ON SYNCFILE (CATEGORY, FILE_NAME, ID)";
+    if (!Query.exec(CreateText)) {
+        LastError = "Cannot create index on SYNCFILE (CATEGORY, FILE_NAME, ID). Error: " + Query.lastError().text() + " Query: " + CreateText;
+        return INDEX_FAILED;
+    }
+    return INDEX_OK;
+}
+
+bool TSyncDB::Compact(quint64 FromID, quint64 ToID, const QDateTime &Before, qint64 &Deleted)
+{
+    CompactQuery.bindValue(0, static_cast<qint64>(FromID));
+    CompactQuery.bindValue(1, static_cast<qint64>(ToID));
+    CompactQuery.bindValue(2, Before);
+    if (!Exec(CompactQuery)) return false;
+    Deleted = qMax(0, CompactQuery.numRowsAffected());
+    return true;
+}
+
+bool TSyncDB::ReclaimSpace(int Pages, bool &Done)
+{
+    //во внешней БД место освобождает сборка мусора сервера
+    Done = true;
+    if (!Embedded()) return true;
+
+    QSqlQuery Query(DB);
+    if (!Query.exec("PRAGMA auto_vacuum") || !Query.next()) {
+        LastError = "Cannot read auto_vacuum mode. Error: " + Query.lastError().text();
+        return false;
+    }
+    //без INCREMENTAL (БД создана раньше) свободные страницы остаются в файле и используются под новые записи
+    const bool Incremental = (Query.value(0).toInt() == 2);
+    qint64 FreePages = 0;
+    if (Incremental) {
+        if (!Query.exec("PRAGMA freelist_count") || !Query.next()) {
+            LastError = "Cannot read free page count. Error: " + Query.lastError().text();
+            return false;
+        }
+        FreePages = Query.value(0).toLongLong();
+    }
+    if (FreePages > 0) {
+        //страницы освобождаются по мере выполнения запроса, поэтому его нужно выполнить до конца
+        if (!Query.exec("PRAGMA incremental_vacuum(" + QString::number(qMax(1, Pages)) + ")")) {
+            LastError = "Cannot reclaim free pages. Error: " + Query.lastError().text();
+            return false;
+        }
+        while (Query.next()) {}
+        Done = (FreePages <= Pages);
+        if (!Done) return true;
+    }
+    //переносим журнал в основной файл и обрезаем его. Если есть читатели, журнал будет обрезан в следующий раз
+    Query.exec("PRAGMA wal_checkpoint(TRUNCATE)");
+    while (Query.next()) {}
+    return true;
+}
+
+bool TSyncDB::AddFile(const QString &Category, const QString &FileName, const QDateTime &CreateDateTime,
+                      const QDateTime &ChangeDateTime, const QByteArray &Body, const QString &Encoding, const QString &Hash)
+{
+    AddFileQuery.bindValue(0, Category);
+    AddFileQuery.bindValue(1, FileName);
+    AddFileQuery.bindValue(2, CreateDateTime);
+    AddFileQuery.bindValue(3, ChangeDateTime);
+    AddFileQuery.bindValue(4, Body);
+    int Index = 5;
+    if (HasEncoding()) AddFileQuery.bindValue(Index++, Encoding.isEmpty() ? QString(BinaryBody ? "binary" : "base64") : Encoding);
+    if (ContentHash) AddFileQuery.bindValue(Index++, Hash);
+    return Exec(AddFileQuery);
+}
+
+bool TSyncDB::FindBody(const QString &Hash, quint64 &ID, qint64 &Size, QString &Encoding)
+{
+    ID = 0;
+    if (!ContentHash) return true;
+    FindBodyQuery.bindValue(0, Hash);
+    if (!Exec(FindBodyQuery)) return false;
+    if (FindBodyQuery.next()) {
+        ID = FindBodyQuery.value("ID").toULongLong();
+        Size = FindBodyQuery.value("BODY_SIZE").toLongLong();
+        Encoding = FindBodyQuery.value("ENCODING").toString();
+    }
+    FindBodyQuery.finish();
+    return true;
+}
@@ -0,0 +1,108 @@
+/* Доступ к таблице SYNCFILE
+ * Владеет соединением MainDB. Все запросы подготавливаются один раз при подключении к БД
+ * и затем переиспользуются, значения передаются только через параметры
+ * С драйвером QSQLITE БД встроенная: файл SQLite в режиме WAL, таблицы SYNCFILE и LOG создаются при подключении.
+ * Запись новых файлов тогда не зависит от внешнего сервера БД, а читатели не блокируют поток записи
+*/
+#ifndef TSYNCDB_H
+#define TSYNCDB_H
+
+#include <QObject>
+#include <QString>
+#include <QDateTime>
+#include <QByteArray>
+#include <QStringList>
+#include <QtSql/QSqlDatabase>
+#include <QtSql/QSqlQuery>
+
+class TSyncDB : public QObject
+{
+    Q_OBJECT
+public:
+    typedef enum {INDEX_OK, INDEX_UNKNOWN, INDEX_FAILED} TIndexState; //результат проверки индекса для очистки
+
+private:
+    QSqlDatabase DB;
+    const bool BinaryBody;  //новые тела хранятся без кодирования
+    const bool ContentHash; //в SYNCFILE есть столбец HASH с хешем содержимого файла
+    QString LastError;
+
+    QSqlQuery SelectFilesQuery; //файлы для отправки на сервер
+    QSqlQuery CategoryFilesQuery; //файлы одной категории для отправки на сервер
+    QSqlQuery CategoriesQuery;  //категории файлов после заданного ID
+    QSqlQuery FileIDsQuery;     //ID файлов после заданного ID
+    QSqlQuery BodyChunkQuery;   //кусок тела файла
+    QSqlQuery ClearBodiesQuery; //очистка тел подтвержденных сервером файлов
+    QSqlQuery OldFilesQuery;    //уже обработанные файлы
+    QSqlQuery DeletedFilesQuery; //файлы, отмеченные в БД как удаленные
+    QSqlQuery AddFileQuery;     //добавление нового файла
+    QSqlQuery MaxIDQuery;       //максимальный ID в SYNCFILE
+    QSqlQuery FindBodyQuery;    //запись с еще не очищенным телом по хешу содержимого
+    QSqlQuery CountFilesQuery;  //количество файлов после заданного ID
+    QSqlQuery CompactQuery;     //удаление устаревших версий подтвержденных файлов
+
+    bool Prepare(QSqlQuery &Query, const QString &QueryText);
+    bool CreateSchema(); //создает таблицы и индексы встроенной БД
+    bool Exec(QSqlQuery &Query);
+
+public:
+    explicit TSyncDB(const QSqlDatabase &DB, bool BinaryBody, bool ContentHash, QObject *parent = nullptr); //DB - еще не открытое соединение
+
+    bool HasEncoding() const { return BinaryBody || ContentHash; } //в SYNCFILE есть столбец ENCODING
+    bool Embedded() const { return DB.driverName() == "QSQLITE"; } //встроенная БД SQLite
+    //настраивает открытое соединение со встроенной БД. Нужно для каждого соединения, в том числе клонированного
+    static bool Tune(QSqlDatabase &DB, QString &Error);
+    ~TSyncDB();
+
+    QSqlDatabase &Connection() { return DB; } //для настройки параметров подключения
+    QString ErrorString() const { return LastError; }
+
+    bool Open(); //подключается к БД и подготавливает все запросы
+
+    bool Transaction();
+    bool Commit();
+    void Rollback();
+
+    //выбирает файлы с ID из диапазона (FromID, ToID] по порядку. Записи читаются через FilesQuery().next()
+    bool SelectFiles(quint64 FromID, quint64 ToID);
+    QSqlQuery &FilesQuery() { return SelectFilesQuery; }
+    void FinishFiles() { SelectFilesQuery.finish(); } //закрывает курсор, чтобы запрос можно было выполнить снова
+    //выбирает файлы категории Category с ID больше FromID по порядку. Записи с теми же полями читаются через CategoryFiles().next()
+    bool SelectCategoryFiles(const QString &Category, quint64 FromID);
+    QSqlQuery &CategoryFiles() { return CategoryFilesQuery; }
+    void FinishCategoryFiles() { CategoryFilesQuery.finish(); }
+    bool Categories(quint64 FromID, QStringList &List); //категории файлов с ID больше FromID
+    //выбирает ID файлов больше FromID по порядку. Записи читаются через FileIDs().next()
+    bool SelectFileIDs(quint64 FromID);
+    QSqlQuery &FileIDs() { return FileIDsQuery; }
+    void FinishFileIDs() { FileIDsQuery.finish(); }
+
+    bool ReadBodyChunk(quint64 ID, qint64 Pos, qint64 Size, QByteArray &Chunk); //Pos - с 0
+    bool ClearBodies(quint64 FromID, quint64 ToID); //очищает тела файлов с ID из диапазона (FromID, ToID]
+
+    //выбирает неудаленные файлы всех категорий с ID больше FromID. Записи читаются через OldFiles().next()
+    bool SelectOldFiles(quint64 FromID = 0);
+    QSqlQuery &OldFiles() { return OldFilesQuery; }
+    //выбирает файлы с ID из диапазона (FromID, ToID], отмеченные как удаленные. Записи читаются через DeletedFiles().next()
+    bool SelectDeletedFiles(quint64 FromID, quint64 ToID);
+    QSqlQuery &DeletedFiles() { return DeletedFilesQuery; }
+
+    //Encoding и Hash записываются, только если соответствующие столбцы есть в SYNCFILE
+    bool AddFile(const QString &Category, const QString &FileName, const QDateTime &CreateDateTime,
+                 const QDateTime &ChangeDateTime, const QByteArray &Body, const QString &Encoding = QString(), const QString &Hash = QString());
+    //ищет запись с телом файла с хешем содержимого Hash, которое еще не очищено. ID = 0 - такой записи нет
+    bool FindBody(const QString &Hash, quint64 &ID, qint64 &Size, QString &Encoding);
+    bool MaxID(quint64 &ID); //максимальный ID в SYNCFILE. 0 - таблица пуста
+    bool CountFiles(quint64 FromID, quint64 &Count); //количество файлов с ID больше FromID
+    //удаляет из диапазона (FromID, ToID] файлы с очищенным телом, измененные до Before, у которых есть более новая версия
+    //последняя версия каждого файла остается - по ней определяется, изменился ли файл
+    bool Compact(quint64 FromID, quint64 ToID, const QDateTime &Before, qint64 &Deleted);
+    //проверяет, что есть индекс по (CATEGORY, FILE_NAME), без которого Compact просматривает всю таблицу на каждую запись,
+    //и создает его, если нет. Во встроенной БД индекс создается вместе со схемой, во внешней Firebird проверка - по каталогу.
+    //INDEX_UNKNOWN - БД другого типа или каталог не прочитан, INDEX_FAILED - индекса нет и создать его не удалось
+    TIndexState FileIndex();
+    //возвращает системе до Pages страниц, освободившихся после удаления. Done - освобождать больше нечего
+    bool ReclaimSpace(int Pages, bool &Done);
+};
+
+#endif // TSYNCDB_H